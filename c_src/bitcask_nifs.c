@@ -23,7 +23,9 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <time.h>
 #include <sys/time.h>
 #include <assert.h>
@@ -35,6 +37,9 @@
 
 #include "khash.h"
 #include "murmurhash.h"
+#include "crc32.h"
+#include "codec.h"
+#include "bloom.h"
 
 #include <stdio.h>
 
@@ -136,9 +141,17 @@ static ErlNifResourceType* bitcask_lock_RESOURCE;
 
 static ErlNifResourceType* bitcask_file_RESOURCE;
 
+static ErlNifResourceType* bitcask_dict_RESOURCE;
+
+static ErlNifResourceType* bitcask_merge_RESOURCE;
+
+static ErlNifResourceType* bitcask_value_RESOURCE;
+
 typedef struct
 {
     int fd;
+    char* map;        // Read-only mapping set up by file_mmap, or NULL
+    size_t map_size;
 } bitcask_file_handle;
 
 typedef struct
@@ -148,6 +161,7 @@ typedef struct
     uint64_t offset;
     uint64_t epoch;
     uint32_t tstamp;
+    uint32_t expiry;   // tstamp the key reads as not found from, 0 if never
     uint16_t key_sz;
     char     key[0];
 } bitcask_keydir_entry;
@@ -177,6 +191,7 @@ struct bitcask_keydir_entry_sib
     uint64_t offset;
     uint64_t epoch;
     uint32_t tstamp;
+    uint32_t expiry;
     struct bitcask_keydir_entry_sib * next;
 };
 typedef struct bitcask_keydir_entry_sib bitcask_keydir_entry_sib;
@@ -195,6 +210,34 @@ typedef struct
 #define GET_ENTRY_LIST_POINTER(p) ((bitcask_keydir_entry_head*)((uint64_t)p&(uint64_t)~1))
 #define MAKE_ENTRY_LIST_POINTER(p) ((bitcask_keydir_entry*)((uint64_t)p|(uint64_t)1))
 
+// Packed alternative to bitcask_keydir_entry, used in the entries hash of
+// keydirs created with the compact layout. Offsets and epochs are narrowed
+// to 48 bits and split so every field stays aligned with no padding.
+// Entries whose values do not fit, or that have an expiry time, are stored
+// as regular entries instead.
+typedef struct
+{
+    uint32_t file_id;
+    uint32_t total_sz;
+    uint32_t tstamp;
+    uint32_t offset_lo;
+    uint32_t epoch_lo;
+    uint16_t offset_hi;
+    uint16_t epoch_hi;
+    uint16_t key_sz;
+    char     key[0];
+} bitcask_keydir_compact_entry;
+
+#define COMPACT_MAX ((uint64_t)0xffffffffffffULL)
+#define COMPACT_ENTRY_SIZE(key_sz) (offsetof(bitcask_keydir_compact_entry, key) + (key_sz))
+#define COMPACT_OFFSET(c) (((uint64_t)(c)->offset_hi << 32) | (c)->offset_lo)
+#define COMPACT_EPOCH(c) (((uint64_t)(c)->epoch_hi << 32) | (c)->epoch_lo)
+
+// Compact entries are tagged on the second bit of the pointer.
+#define IS_COMPACT_ENTRY(p) ((uint64_t)p&2)
+#define GET_COMPACT_ENTRY_POINTER(p) ((bitcask_keydir_compact_entry*)((uint64_t)p&(uint64_t)~2))
+#define MAKE_COMPACT_ENTRY_POINTER(p) ((bitcask_keydir_entry*)((uint64_t)p|(uint64_t)2))
+
 // Holds values fetched from a regular entry or a snapshot from an entry list.
 typedef struct
 {
@@ -203,6 +246,7 @@ typedef struct
     uint64_t epoch;
     uint64_t offset;
     uint32_t tstamp;
+    uint32_t expiry;
     uint16_t is_tombstone;
     uint16_t key_sz;
     char *   key;
@@ -219,6 +263,262 @@ KHASH_MAP_INIT_INT(fstats, bitcask_fstats_entry*);
 typedef khash_t(entries) entries_hash_t;
 typedef khash_t(fstats) fstats_hash_t;
 
+// Number of hash partitions in a keydir. Must be a power of two.
+#ifndef BITCASK_KEYDIR_SHARDS
+#define BITCASK_KEYDIR_SHARDS 16
+#endif
+
+// A shard's Bloom filter is rebuilt without the removed keys once it
+// holds at least this many keys and half of them are gone
+#define BLOOM_REBUILD_MIN_KEYS 1024
+
+// Entries, entry list heads and siblings are carved out of slabs grouped
+// in size classes of ARENA_GRAIN bytes. Freed chunks go to a per class
+// free list and get reused, so overwrite churn does not go through malloc,
+// and dropping a keydir releases whole slabs instead of every entry.
+// Allocations bigger than the largest class are malloc'd individually but
+// still tracked so they can be released in bulk too.
+#define ARENA_GRAIN           8
+#define ARENA_CLASSES         32          // chunks of 8 to 256 bytes
+#define ARENA_MIN_SLAB_CHUNKS 32
+#define ARENA_MAX_SLAB_SIZE   (64 * 1024)
+
+typedef struct bitcask_arena_slab
+{
+    struct bitcask_arena_slab* next;
+    char   data[0];
+} bitcask_arena_slab;
+
+// Header of an allocation too big for the size classes.
+typedef struct bitcask_arena_large
+{
+    struct bitcask_arena_large* prev;
+    struct bitcask_arena_large* next;
+} bitcask_arena_large;
+
+typedef struct
+{
+    void*    free_list;    // freed chunks, linked through their first word
+    char*    bump;         // next never used chunk in the newest slab
+    char*    bump_end;
+    uint32_t slab_chunks;  // chunks in the next slab, grows up to the max
+} bitcask_arena_class;
+
+typedef struct
+{
+    bitcask_arena_class  classes[ARENA_CLASSES];
+    bitcask_arena_slab*  slabs;
+    bitcask_arena_large* large;
+    uint64_t slab_bytes;   // memory held in slabs
+    uint64_t used_bytes;   // slab memory in chunks handed out
+    uint64_t large_bytes;  // memory in large allocations, headers included
+} bitcask_arena;
+
+static void* arena_alloc(bitcask_arena* arena, size_t sz)
+{
+    size_t class_idx = sz == 0 ? 0 : (sz - 1) / ARENA_GRAIN;
+
+    if (class_idx >= ARENA_CLASSES)
+    {
+        bitcask_arena_large* large = malloc(sizeof(bitcask_arena_large) + sz);
+        large->prev = NULL;
+        large->next = arena->large;
+        if (arena->large)
+        {
+            arena->large->prev = large;
+        }
+        arena->large = large;
+        arena->large_bytes += sizeof(bitcask_arena_large) + sz;
+        return large + 1;
+    }
+
+    bitcask_arena_class* size_class = &arena->classes[class_idx];
+    size_t chunk_sz = (class_idx + 1) * ARENA_GRAIN;
+    void* chunk;
+
+    if (size_class->free_list)
+    {
+        chunk = size_class->free_list;
+        size_class->free_list = *(void**)chunk;
+    }
+    else
+    {
+        if (size_class->bump + chunk_sz > size_class->bump_end)
+        {
+            // Start a new slab, leaving the tail of the last one unused
+            if (size_class->slab_chunks == 0)
+            {
+                size_class->slab_chunks = ARENA_MIN_SLAB_CHUNKS;
+            }
+            size_t data_sz = size_class->slab_chunks * chunk_sz;
+            bitcask_arena_slab* slab = malloc(sizeof(bitcask_arena_slab) + data_sz);
+            slab->next = arena->slabs;
+            arena->slabs = slab;
+            arena->slab_bytes += sizeof(bitcask_arena_slab) + data_sz;
+            size_class->bump = slab->data;
+            size_class->bump_end = slab->data + data_sz;
+            if (data_sz * 2 <= ARENA_MAX_SLAB_SIZE)
+            {
+                size_class->slab_chunks *= 2;
+            }
+        }
+        chunk = size_class->bump;
+        size_class->bump += chunk_sz;
+    }
+
+    arena->used_bytes += chunk_sz;
+    return chunk;
+}
+
+static void arena_free(bitcask_arena* arena, void* p, size_t sz)
+{
+    size_t class_idx = sz == 0 ? 0 : (sz - 1) / ARENA_GRAIN;
+
+    if (class_idx >= ARENA_CLASSES)
+    {
+        bitcask_arena_large* large = (bitcask_arena_large*)p - 1;
+        if (large->prev)
+        {
+            large->prev->next = large->next;
+        }
+        else
+        {
+            arena->large = large->next;
+        }
+        if (large->next)
+        {
+            large->next->prev = large->prev;
+        }
+        arena->large_bytes -= sizeof(bitcask_arena_large) + sz;
+        free(large);
+        return;
+    }
+
+    bitcask_arena_class* size_class = &arena->classes[class_idx];
+    *(void**)p = size_class->free_list;
+    size_class->free_list = p;
+    arena->used_bytes -= (class_idx + 1) * ARENA_GRAIN;
+}
+
+// Releases all the memory of the arena at once.
+static void arena_destroy(bitcask_arena* arena)
+{
+    while (arena->slabs)
+    {
+        bitcask_arena_slab* slab = arena->slabs;
+        arena->slabs = slab->next;
+        free(slab);
+    }
+    while (arena->large)
+    {
+        bitcask_arena_large* large = arena->large;
+        arena->large = large->next;
+        free(large);
+    }
+    memset(arena, '\0', sizeof(bitcask_arena));
+}
+
+// Expiry index, a timer wheel of the keys put with an expiry time. Each
+// slot lists the keys expiring in the seconds that map to it, and a sweep
+// walks the slots up to the current time removing the keys still expiring
+// then. A key has at most one node, found through a hash of the keys in
+// the wheel and moved to its new slot when the key is put again with
+// another expiry time. Removing a key leaves its node for the sweep, which
+// drops it once it finds the entry no longer matches.
+#define EXPIRY_WHEEL_SLOTS 4096         // seconds, must be a power of two
+
+typedef struct bitcask_expiry_node
+{
+    struct bitcask_expiry_node* next;
+    struct bitcask_expiry_node** link;  // the pointer to this node in its slot
+    uint32_t expiry;
+    uint16_t key_sz;
+    char     key[0];
+} bitcask_expiry_node;
+
+static khint_t expiry_node_hash(bitcask_expiry_node* node);
+static khint_t expiry_node_equal(bitcask_expiry_node* lhs,
+                                 bitcask_expiry_node* rhs);
+KHASH_INIT(expiry_keys, bitcask_expiry_node*, char, 0, expiry_node_hash, expiry_node_equal);
+
+// Value cache, an optional cache of the values read from the data files,
+// keyed by where they are stored. Values are never rewritten in place, so
+// a (file_id, offset) pair always names the same bytes: overwritten and
+// merged values are just no longer asked for and age out.
+//
+// The cache is split in segments picked from the location hash, each with
+// its own mutex and an even share of the memory. Segments follow W-TinyLFU:
+// new values go to a small LRU window, and a value pushed out of it only
+// makes it into the main SLRU area if a count-min sketch of recent lookups
+// says it is asked for more often than the value it would evict. Values
+// live in resources, so hits hand out binaries sharing them instead of
+// copies, and an evicted value goes away with the last of those.
+#define VCACHE_SEGMENTS        16       // must be a power of two
+#define VCACHE_WINDOW_PCT      1        // of a segment, for new values
+#define VCACHE_PROTECTED_PCT   80       // of the main area
+#define VCACHE_ENTRY_OVERHEAD  64       // bytes charged per value on top of it
+#define VCACHE_MAX_VALUE       (1 << 20) // bigger values are not cached
+#define VCACHE_BYTES_PER_COUNTER 256    // sketch size for a segment
+#define VCACHE_SKETCH_MIN      1024     // counters, must be a power of two
+#define VCACHE_SKETCH_MAX      (1 << 22)
+#define VCACHE_SKETCH_HASHES   4
+#define VCACHE_SKETCH_SAMPLE   5        // lookups between agings, per counter
+
+enum { VCACHE_WINDOW, VCACHE_PROBATION, VCACHE_PROTECTED, VCACHE_QUEUES };
+
+typedef struct bitcask_vcache_entry
+{
+    struct bitcask_vcache_entry* prev;  // more recently used
+    struct bitcask_vcache_entry* next;  // less recently used
+    uint64_t offset;
+    uint32_t file_id;
+    uint32_t queue;
+    uint64_t hash;
+    uint64_t charge;                    // bytes held against the segment
+    void*    value;                     // resource holding the value
+    size_t   value_sz;
+} bitcask_vcache_entry;
+
+static khint_t vcache_entry_hash(bitcask_vcache_entry* entry)
+{
+    return (khint_t)entry->hash;
+}
+
+static int vcache_entry_equal(bitcask_vcache_entry* lhs,
+                              bitcask_vcache_entry* rhs)
+{
+    return lhs->offset == rhs->offset && lhs->file_id == rhs->file_id;
+}
+
+KHASH_INIT(vcache, bitcask_vcache_entry*, char, 0, vcache_entry_hash, vcache_entry_equal);
+
+typedef struct
+{
+    bitcask_vcache_entry* head;         // most recently used
+    bitcask_vcache_entry* tail;         // least recently used
+    uint64_t bytes;
+} bitcask_vcache_queue;
+
+typedef struct
+{
+    khash_t(vcache)* entries;
+    bitcask_vcache_queue queues[VCACHE_QUEUES];
+    uint64_t max_bytes;
+    uint64_t window_max;
+    uint64_t protected_max;
+    uint8_t* sketch;                    // 4 bit counters, one per byte
+    uint32_t sketch_mask;
+    uint32_t sketch_adds;               // since the counters were last halved
+    uint32_t sketch_sample;             // adds between halvings
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    ErlNifMutex* mutex;
+} bitcask_vcache_segment;
+
+// A hash partition of the keydir. Every key lives in exactly one shard,
+// picked from its hash, and each shard has its own tables and lock so
+// operations on unrelated keys do not contend with each other.
 typedef struct
 {
     // The hash where entries are usually stored. It may contain
@@ -228,6 +528,33 @@ typedef struct
     // resizing it, which would break ongoing keyfolder on it.
     // It can only contain regular entries, not entry lists.
     entries_hash_t* pending;
+    uint64_t      sweep_last_generation; // iter_generation of last sibling sweep
+    khiter_t      sweep_itr;             // iterator for sibling sweep
+    uint64_t      entry_bytes;           // memory held by entries in both hashes
+    bitcask_arena arena;                 // allocator for entries of both hashes
+    // Expiry index, NULL until a key with an expiry time is put in a
+    // keydir that keeps one. Nodes come from the arena too.
+    bitcask_expiry_node** expiry_wheel;
+    khash_t(expiry_keys)* expiry_keys;   // the node of each key in the wheel
+    uint32_t      expiry_swept;          // slots swept up to this tstamp
+    // Where a sweep that ran out of budget in the expiry_swept slot goes on
+    // from, NULL to start from the head of the slot
+    bitcask_expiry_node** expiry_resume;
+    uint64_t      expiry_nodes;
+    // Bloom filter of the keys in both hashes, NULL unless the keydir
+    // keeps one. Lookups read it without the lock, see bloom_may_contain.
+    bitcask_bloom* bloom;
+    bitcask_bloom* bloom_spare;          // previous filter, reused if same size
+    bitcask_bloom* bloom_retired;        // outgrown filters, freed with the keydir
+    uint64_t      bloom_gen;             // bumped before the spare is cleared
+    uint64_t      bloom_keys;            // keys added since the last rebuild
+    // Readers (get, itr_next) share it, anything that changes the
+    // tables, including sibling sweeps, holds it exclusively.
+    ErlNifRWLock* lock;
+} bitcask_keydir_shard;
+
+typedef struct
+{
     fstats_hash_t*  fstats;
     uint64_t      epoch;
     uint64_t      key_count;
@@ -238,16 +565,29 @@ typedef struct
     uint64_t      newest_folder;  // Epoch for newest folder
     uint64_t      iter_generation;
     char          iter_mutation;         // Mutation while iterating?
-    uint64_t      sweep_last_generation; // iter_generation of last sibling sweep
-    khiter_t      sweep_itr;             // iterator for sibling sweep
+    unsigned int  pending_shards;        // Shards with a pending hash
     uint64_t      pending_updated;
     uint64_t      pending_start_time;  // UNIX epoch seconds (since 1970)
     uint64_t      pending_start_epoch;
     ErlNifPid*    pending_awaken; // processes to wake once pending merged into entries
     unsigned int  pending_awaken_count;
     unsigned int  pending_awaken_size;
+    // Sampled foreground read latency and merge I/O, which the merge
+    // throttle goes by, see keydir_io_stats
+    uint64_t      read_samples;
+    uint64_t      read_usecs;
+    uint64_t      merge_bytes;
+    uint64_t      merge_throttled_usecs;
+    // Guards everything above: stats, epoch and iteration state.
+    // Always taken after the lock of any shard involved.
     ErlNifMutex*  mutex;
     char          is_ready;
+    char          compact_entries;  // Store new entries in the compact layout
+    char          expiry_index;     // Index keys by expiry time for the sweep
+    char          bloom_filter;     // Filter lookups of absent keys per shard
+    // Value cache segments, NULL unless the keydir caches values
+    bitcask_vcache_segment* vcache;
+    bitcask_keydir_shard shards[BITCASK_KEYDIR_SHARDS];
     char          name[0];
 } bitcask_keydir;
 
@@ -255,8 +595,10 @@ typedef struct
 {
     bitcask_keydir* keydir;
     int             iterating;
+    unsigned int    shard;
     khiter_t        iterator;
     uint64_t        epoch;
+    uint32_t        itr_time;   // entries expiring by then are skipped
 } bitcask_keydir_handle;
 
 typedef struct
@@ -269,11 +611,29 @@ typedef struct
 KHASH_INIT(global_biggest_file_id, char*, uint32_t, 1, kh_str_hash_func, kh_str_hash_equal);
 KHASH_INIT(global_keydirs, char*, bitcask_keydir*, 1, kh_str_hash_func, kh_str_hash_equal);
 
+// A compression dictionary loaded from a file, shared by every handle that
+// opened the same path.
+typedef struct
+{
+    bitcask_dict* dict;
+    uint32_t refcount;      // protected by global_dicts_lock
+    char path[0];
+} bitcask_shared_dict;
+
+typedef struct
+{
+    bitcask_shared_dict* shared;
+} bitcask_dict_handle;
+
+KHASH_INIT(global_dicts, char*, bitcask_shared_dict*, 1, kh_str_hash_func, kh_str_hash_equal);
+
 typedef struct
 {
     khash_t(global_biggest_file_id)* global_biggest_file_id;
     khash_t(global_keydirs)* global_keydirs;
     ErlNifMutex*             global_keydirs_lock;
+    khash_t(global_dicts)*   global_dicts;
+    ErlNifMutex*             global_dicts_lock;
 } bitcask_priv_data;
 
 #define kh_put2(name, h, k, v) {                        \
@@ -289,1799 +649,5303 @@ typedef struct
 // Handle lock helper functions
 #define LOCK(keydir)      { if (keydir->mutex) enif_mutex_lock(keydir->mutex); }
 #define UNLOCK(keydir)    { if (keydir->mutex) enif_mutex_unlock(keydir->mutex); }
+#define LOCK_SHARD(shard)    { if ((shard)->lock) enif_rwlock_rwlock((shard)->lock); }
+#define UNLOCK_SHARD(shard)  { if ((shard)->lock) enif_rwlock_rwunlock((shard)->lock); }
+#define RLOCK_SHARD(shard)   { if ((shard)->lock) enif_rwlock_rlock((shard)->lock); }
+#define RUNLOCK_SHARD(shard) { if ((shard)->lock) enif_rwlock_runlock((shard)->lock); }
+
+// Entry memory comes from the shard's arena and is accounted per shard so
+// keydir_memory_info can report it.
+static void* entry_alloc(bitcask_keydir_shard* shard, size_t sz)
+{
+    shard->entry_bytes += sz;
+    return arena_alloc(&shard->arena, sz);
+}
 
-// Related to tombstones in the pending hash.
-// Notice that tombstones in the entries hash are different.
-#define is_pending_tombstone(e) ((e)->offset == MAX_OFFSET)
-#define set_pending_tombstone(e) {(e)->offset = MAX_OFFSET; }
-
-// Atoms (initialized in on_load)
-static ERL_NIF_TERM ATOM_ALLOCATION_ERROR;
-static ERL_NIF_TERM ATOM_ALREADY_EXISTS;
-static ERL_NIF_TERM ATOM_BITCASK_ENTRY;
-static ERL_NIF_TERM ATOM_ERROR;
-static ERL_NIF_TERM ATOM_FALSE;
-static ERL_NIF_TERM ATOM_FSTAT_ERROR;
-static ERL_NIF_TERM ATOM_FTRUNCATE_ERROR;
-static ERL_NIF_TERM ATOM_GETFL_ERROR;
-static ERL_NIF_TERM ATOM_ILT_CREATE_ERROR; /* Iteration lock thread creation error */
-static ERL_NIF_TERM ATOM_ITERATION_IN_PROCESS;
-static ERL_NIF_TERM ATOM_ITERATION_NOT_PERMITTED;
-static ERL_NIF_TERM ATOM_ITERATION_NOT_STARTED;
-static ERL_NIF_TERM ATOM_LOCK_NOT_WRITABLE;
-static ERL_NIF_TERM ATOM_NOT_FOUND;
-static ERL_NIF_TERM ATOM_NOT_READY;
-static ERL_NIF_TERM ATOM_OK;
-static ERL_NIF_TERM ATOM_OUT_OF_DATE;
-static ERL_NIF_TERM ATOM_PREAD_ERROR;
-static ERL_NIF_TERM ATOM_PWRITE_ERROR;
-static ERL_NIF_TERM ATOM_READY;
-static ERL_NIF_TERM ATOM_SETFL_ERROR;
-static ERL_NIF_TERM ATOM_TRUE;
-static ERL_NIF_TERM ATOM_UNDEFINED;
-static ERL_NIF_TERM ATOM_EOF;
-static ERL_NIF_TERM ATOM_CREATE;
-static ERL_NIF_TERM ATOM_READONLY;
-static ERL_NIF_TERM ATOM_O_SYNC;
-// lseek equivalents for file_position
-static ERL_NIF_TERM ATOM_CUR;
-static ERL_NIF_TERM ATOM_BOF;
-
-// Prototypes
-ERL_NIF_TERM bitcask_nifs_keydir_new0(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_keydir_new1(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_maybe_keydir_new1(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_keydir_mark_ready(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_keydir_get_int(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_keydir_get_epoch(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_keydir_put_int(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_keydir_remove(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_keydir_copy(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_keydir_itr(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_keydir_itr_next(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_keydir_itr_release(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_keydir_info(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_keydir_release(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_keydir_trim_fstats(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-
-ERL_NIF_TERM bitcask_nifs_increment_file_id(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-
-ERL_NIF_TERM bitcask_nifs_create_tmp_file(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-
-ERL_NIF_TERM bitcask_nifs_lock_acquire(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_lock_release(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_lock_readdata(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_lock_writedata(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-
-ERL_NIF_TERM bitcask_nifs_file_open(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_file_close(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_file_sync(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_file_pread(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_file_pwrite(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_file_read(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_file_write(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_file_position(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_file_seekbof(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_file_truncate(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-
-ERL_NIF_TERM bitcask_nifs_update_fstats(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
-ERL_NIF_TERM bitcask_nifs_set_pending_delete(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+static void entry_free(bitcask_keydir_shard* shard, void* p, size_t sz)
+{
+    shard->entry_bytes -= sz;
+    arena_free(&shard->arena, p, sz);
+}
 
-ERL_NIF_TERM errno_atom(ErlNifEnv* env, int error);
-ERL_NIF_TERM errno_error_tuple(ErlNifEnv* env, ERL_NIF_TERM key, int error);
+// Locks every shard in index order and then the keydir itself. Needed by
+// operations that change the iteration state or look at all the entries.
+static void lock_keydir_all(bitcask_keydir* keydir)
+{
+    int i;
+    for (i = 0; i < BITCASK_KEYDIR_SHARDS; i++)
+    {
+        LOCK_SHARD(&keydir->shards[i]);
+    }
+    LOCK(keydir);
+}
 
-static void merge_pending_entries(ErlNifEnv* env, bitcask_keydir* keydir);
-static void lock_release(bitcask_lock_handle* handle);
+static void unlock_keydir_all(bitcask_keydir* keydir)
+{
+    int i;
+    UNLOCK(keydir);
+    for (i = BITCASK_KEYDIR_SHARDS - 1; i >= 0; i--)
+    {
+        UNLOCK_SHARD(&keydir->shards[i]);
+    }
+}
 
-static void bitcask_nifs_keydir_resource_cleanup(ErlNifEnv* env, void* arg);
-static void bitcask_nifs_file_resource_cleanup(ErlNifEnv* env, void* arg);
+// Picks the shard owning a key. khash takes the bucket from the low bits
+// of the same hash, so use the high ones here.
+static bitcask_keydir_shard* keydir_shard_of_hash(bitcask_keydir* keydir,
+                                                  uint64_t h)
+{
+    return &keydir->shards[((h >> 32) ^ (h >> 24)) & (BITCASK_KEYDIR_SHARDS - 1)];
+}
 
-static ErlNifFunc nif_funcs[] =
+static bitcask_keydir_shard* keydir_shard(bitcask_keydir* keydir,
+                                          const void* key, size_t key_sz)
 {
-#ifdef PULSE
-    {"set_pulse_pid", 1, set_pulse_pid},
-#endif
-    {"keydir_new", 0, bitcask_nifs_keydir_new0},
-    {"keydir_new", 1, bitcask_nifs_keydir_new1},
-    {"maybe_keydir_new", 1, bitcask_nifs_maybe_keydir_new1},
-    {"keydir_mark_ready", 1, bitcask_nifs_keydir_mark_ready},
-    {"keydir_put_int", 10, bitcask_nifs_keydir_put_int},
-    {"keydir_get_int", 3, bitcask_nifs_keydir_get_int},
-    {"keydir_get_epoch", 1, bitcask_nifs_keydir_get_epoch},
-    {"keydir_remove", 3, bitcask_nifs_keydir_remove},
-    {"keydir_remove_int", 6, bitcask_nifs_keydir_remove},
-    {"keydir_copy", 1, bitcask_nifs_keydir_copy},
-    {"keydir_itr_int", 4, bitcask_nifs_keydir_itr},
-    {"keydir_itr_next_int", 1, bitcask_nifs_keydir_itr_next},
-    {"keydir_itr_release", 1, bitcask_nifs_keydir_itr_release},
-    {"keydir_info", 1, bitcask_nifs_keydir_info},
-    {"keydir_release", 1, bitcask_nifs_keydir_release},
-    {"keydir_trim_fstats", 2, bitcask_nifs_keydir_trim_fstats},
+    return keydir_shard_of_hash(keydir, MURMUR_HASH(key, key_sz, 42));
+}
+static void init_keydir_shards(bitcask_keydir* keydir, char* mutex_name)
+{
+    int i;
+    for (i = 0; i < BITCASK_KEYDIR_SHARDS; i++)
+    {
+        keydir->shards[i].entries = kh_init(entries);
+        if (mutex_name)
+        {
+            keydir->shards[i].lock = enif_rwlock_create(mutex_name);
+        }
+    }
+}
 
-    {"increment_file_id", 1, bitcask_nifs_increment_file_id},
-    {"increment_file_id", 2, bitcask_nifs_increment_file_id},
 
-    {"lock_acquire_int",   2, bitcask_nifs_lock_acquire},
-    {"lock_release_int",   1, bitcask_nifs_lock_release},
-    {"lock_readdata_int",  1, bitcask_nifs_lock_readdata},
-    {"lock_writedata_int", 2, bitcask_nifs_lock_writedata},
-
-    {"file_open_int",   2, bitcask_nifs_file_open},
-    {"file_close_int",  1, bitcask_nifs_file_close},
-    {"file_sync_int",   1, bitcask_nifs_file_sync},
-    {"file_pread_int",  3, bitcask_nifs_file_pread},
-    {"file_pwrite_int", 3, bitcask_nifs_file_pwrite},
-    {"file_read_int",   2, bitcask_nifs_file_read},
-    {"file_write_int",  2, bitcask_nifs_file_write},
-    {"file_position_int",  2, bitcask_nifs_file_position},
-    {"file_seekbof_int", 1, bitcask_nifs_file_seekbof},
-    {"file_truncate_int", 1, bitcask_nifs_file_truncate},
-    {"update_fstats", 8, bitcask_nifs_update_fstats},
-    {"set_pending_delete", 2, bitcask_nifs_set_pending_delete}
-};
+// Gives each shard an empty Bloom filter if the keydir keeps them. Shards
+// whose filter cannot be allocated just go without.
+static void init_keydir_blooms(bitcask_keydir* keydir)
+{
+    int i;
+    for (i = 0; keydir->bloom_filter && i < BITCASK_KEYDIR_SHARDS; i++)
+    {
+        keydir->shards[i].bloom =
+            bitcask_bloom_new(bitcask_bloom_blocks_for(0));
+    }
+}
 
-ERL_NIF_TERM bitcask_nifs_keydir_new0(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+static uint64_t vcache_hash(uint32_t file_id, uint64_t offset)
 {
-    // First, setup a resource for our handle
-    bitcask_keydir_handle* handle = enif_alloc_resource_compat(env,
-                                                               bitcask_keydir_RESOURCE,
-                                                               sizeof(bitcask_keydir_handle));
-    memset(handle, '\0', sizeof(bitcask_keydir_handle));
+    // splitmix64 finalizer over both halves of the location
+    uint64_t h = offset ^ ((uint64_t)file_id * 0x9e3779b97f4a7c15ULL);
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
 
-    // Now allocate the actual keydir instance. Because it's unnamed/shared, we'll
-    // leave the name and lock portions null'd out
-    bitcask_keydir* keydir = malloc(sizeof(bitcask_keydir));
-    memset(keydir, '\0', sizeof(bitcask_keydir));
-    keydir->entries  = kh_init(entries);
-    keydir->fstats   = kh_init(fstats);
+// Picks the segment of a location. khash takes the bucket from the low
+// bits of the same hash, so use the high ones here.
+static bitcask_vcache_segment* vcache_segment(bitcask_keydir* keydir,
+                                              uint64_t h)
+{
+    return &keydir->vcache[(h >> 60) & (VCACHE_SEGMENTS - 1)];
+}
 
-    // Assign the keydir to our handle and hand it back
-    handle->keydir = keydir;
-    ERL_NIF_TERM result = enif_make_resource(env, handle);
-    enif_release_resource_compat(env, handle);
-    return enif_make_tuple2(env, ATOM_OK, result);
+static uint32_t vcache_sketch_index(bitcask_vcache_segment* segment,
+                                    uint64_t h, int i)
+{
+    uint32_t h1 = (uint32_t)h;
+    uint32_t h2 = (uint32_t)(h >> 32) | 1;
+    return (h1 + i * h2) & segment->sketch_mask;
 }
 
-ERL_NIF_TERM bitcask_nifs_maybe_keydir_new1(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+// Estimated lookups of a location since the counters were last aged.
+static uint8_t vcache_frequency(bitcask_vcache_segment* segment, uint64_t h)
 {
-    char name[4096];
-    if (enif_get_string(env, argv[0], name, sizeof(name), ERL_NIF_LATIN1))
+    uint8_t freq = 15;
+    int i;
+    for (i = 0; i < VCACHE_SKETCH_HASHES; i++)
     {
-        // Get our private stash and check the global hash table for this entry
-        bitcask_priv_data* priv = (bitcask_priv_data*)enif_priv_data(env);
-
-        enif_mutex_lock(priv->global_keydirs_lock);
-        khiter_t itr = kh_get(global_keydirs, priv->global_keydirs, name);
-        khiter_t table_end = kh_end(priv->global_keydirs); /* get end while lock is held! */
-        enif_mutex_unlock(priv->global_keydirs_lock);
-        if (itr != table_end)
-        {
-            return bitcask_nifs_keydir_new1(env, argc, argv);
-        }
-        else
+        uint8_t count = segment->sketch[vcache_sketch_index(segment, h, i)];
+        if (count < freq)
         {
-            return enif_make_tuple2(env, ATOM_ERROR, ATOM_NOT_READY);
+            freq = count;
         }
     }
-    else
-    {
-        return enif_make_badarg(env);
-    }
+    return freq;
 }
 
-ERL_NIF_TERM bitcask_nifs_keydir_new1(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+// Counts a lookup of a location, bumping only its smallest counters, and
+// halves every counter once enough lookups were counted so that the
+// sketch follows the recent ones.
+static void vcache_record(bitcask_vcache_segment* segment, uint64_t h)
 {
-    char name[4096];
-    size_t name_sz;
-    if (enif_get_string(env, argv[0], name, sizeof(name), ERL_NIF_LATIN1))
+    uint8_t freq = vcache_frequency(segment, h);
+    int i;
+    if (freq < 15)
     {
-        name_sz = strlen(name);
-
-        // Get our private stash and check the global hash table for this entry
-        bitcask_priv_data* priv = (bitcask_priv_data*)enif_priv_data(env);
-        enif_mutex_lock(priv->global_keydirs_lock);
-
-        bitcask_keydir* keydir;
-        khiter_t itr = kh_get(global_keydirs, priv->global_keydirs, name);
-        if (itr != kh_end(priv->global_keydirs))
+        for (i = 0; i < VCACHE_SKETCH_HASHES; i++)
         {
-            keydir = kh_val(priv->global_keydirs, itr);
-            // Existing keydir is available. Check the is_ready flag to determine if
-            // the original creator is ready for other processes to use it.
-            if (!keydir->is_ready)
-            {
-                // Notify the caller that while the requested keydir exists, it's not
-                // ready for public usage.
-                enif_mutex_unlock(priv->global_keydirs_lock);
-                return enif_make_tuple2(env, ATOM_ERROR, ATOM_NOT_READY);
-            }
-            else
+            uint8_t* count = &segment->sketch[vcache_sketch_index(segment, h, i)];
+            if (*count == freq)
             {
-                keydir->refcount++;
+                (*count)++;
             }
         }
-        else
+    }
+    if (++segment->sketch_adds >= segment->sketch_sample)
+    {
+        uint32_t j;
+        for (j = 0; j <= segment->sketch_mask; j++)
         {
-            // No such keydir, create a new one and add to the globals list. Make sure
-            // to allocate enough room for the name.
-            keydir = malloc(sizeof(bitcask_keydir) + name_sz + 1);
-            memset(keydir, '\0', sizeof(bitcask_keydir) + name_sz + 1);
-            strncpy(keydir->name, name, name_sz + 1);
-
-            // Initialize hash tables
-            keydir->entries  = kh_init(entries);
-            keydir->fstats   = kh_init(fstats);
-
-            // Be sure to initialize the mutex and set our refcount
-            keydir->mutex = enif_mutex_create(name);
-            keydir->refcount = 1;
-
-            // Finally, register this new keydir in the globals
-            kh_put2(global_keydirs, priv->global_keydirs, keydir->name, keydir);
-
-            khiter_t itr_biggest_file_id = kh_get(global_biggest_file_id, priv->global_biggest_file_id, name);
-            if (itr_biggest_file_id != kh_end(priv->global_biggest_file_id)) {
-                uint32_t old_biggest_file_id = kh_val(priv->global_biggest_file_id, itr_biggest_file_id);
-                keydir->biggest_file_id = old_biggest_file_id;
-            }
+            segment->sketch[j] >>= 1;
         }
+        segment->sketch_adds = 0;
+    }
+}
 
-        enif_mutex_unlock(priv->global_keydirs_lock);
-
-        // Setup a resource for the handle
-        bitcask_keydir_handle* handle = enif_alloc_resource_compat(env,
-                                                                   bitcask_keydir_RESOURCE,
-                                                                   sizeof(bitcask_keydir_handle));
-        memset(handle, '\0', sizeof(bitcask_keydir_handle));
-        handle->keydir = keydir;
-        ERL_NIF_TERM result = enif_make_resource(env, handle);
-        enif_release_resource_compat(env, handle);
-
-        // Return to the caller a tuple with the reference and an atom
-        // indicating if the keydir is ready or not.
-        ERL_NIF_TERM is_ready_atom = keydir->is_ready ? ATOM_READY : ATOM_NOT_READY;
-        return enif_make_tuple2(env, is_ready_atom, result);
+static void vcache_unlink(bitcask_vcache_segment* segment,
+                          bitcask_vcache_entry* entry)
+{
+    bitcask_vcache_queue* queue = &segment->queues[entry->queue];
+    if (entry->prev)
+    {
+        entry->prev->next = entry->next;
     }
     else
     {
-        return enif_make_badarg(env);
+        queue->head = entry->next;
     }
-}
-
-ERL_NIF_TERM bitcask_nifs_keydir_mark_ready(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
-{
-    bitcask_keydir_handle* handle;
-
-    if (enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle))
+    if (entry->next)
     {
-        bitcask_keydir* keydir = handle->keydir;
-        LOCK(keydir);
-        keydir->is_ready = 1;
-        UNLOCK(keydir);
-        return ATOM_OK;
+        entry->next->prev = entry->prev;
     }
     else
     {
-        return enif_make_badarg(env);
+        queue->tail = entry->prev;
     }
+    queue->bytes -= entry->charge;
 }
 
-static void update_fstats(ErlNifEnv* env, bitcask_keydir* keydir,
-                          uint32_t file_id, uint32_t tstamp,
-                          uint64_t expiration_epoch,
-                          int32_t live_increment, int32_t total_increment,
-                          int32_t live_bytes_increment, int32_t total_bytes_increment,
-                          int32_t should_create)
+// Makes the entry the most recently used one of a queue.
+static void vcache_push(bitcask_vcache_segment* segment,
+                        bitcask_vcache_entry* entry, uint32_t queue_idx)
 {
-    bitcask_fstats_entry* entry = 0;
-    khiter_t itr = kh_get(fstats, keydir->fstats, file_id);
-
-    if (itr == kh_end(keydir->fstats))
+    bitcask_vcache_queue* queue = &segment->queues[queue_idx];
+    entry->queue = queue_idx;
+    entry->prev = NULL;
+    entry->next = queue->head;
+    if (queue->head)
     {
-        if (!should_create)
-        {
-            return;
-        }
-
-        // Need to initialize new entry and add to the table
-        entry = malloc(sizeof(bitcask_fstats_entry));
-        memset(entry, '\0', sizeof(bitcask_fstats_entry));
-        entry->expiration_epoch = MAX_EPOCH;
-        entry->file_id = file_id;
-
-        kh_put2(fstats, keydir->fstats, file_id, entry);
+        queue->head->prev = entry;
     }
     else
     {
-        entry = kh_val(keydir->fstats, itr);
+        queue->tail = entry;
     }
+    queue->head = entry;
+    queue->bytes += entry->charge;
+}
 
-    entry->live_keys   += live_increment;
-    entry->total_keys  += total_increment;
-    entry->live_bytes  += live_bytes_increment;
-    entry->total_bytes += total_bytes_increment;
+// Evicts an entry already unlinked from its queue.
+static void vcache_drop(bitcask_vcache_segment* segment,
+                        bitcask_vcache_entry* entry)
+{
+    kh_del(vcache, segment->entries, kh_get(vcache, segment->entries, entry));
+    // Binaries handed out keep their own reference to the value
+    enif_release_resource_compat(NULL, entry->value);
+    free(entry);
+    segment->evictions++;
+}
 
-    if (expiration_epoch < entry->expiration_epoch)
+// Moves an entry pushed out of the window into the main area, if it is
+// asked for more often than the victims it has to evict to fit there.
+static void vcache_admit(bitcask_vcache_segment* segment,
+                         bitcask_vcache_entry* candidate)
+{
+    uint64_t main_max = segment->max_bytes - segment->window_max;
+    uint8_t candidate_freq = vcache_frequency(segment, candidate->hash);
+
+    while (segment->queues[VCACHE_PROBATION].bytes +
+           segment->queues[VCACHE_PROTECTED].bytes + candidate->charge > main_max)
     {
-        entry->expiration_epoch = expiration_epoch;
+        bitcask_vcache_entry* victim = segment->queues[VCACHE_PROBATION].tail;
+        if (victim == NULL)
+        {
+            victim = segment->queues[VCACHE_PROTECTED].tail;
+        }
+        if (candidate_freq > vcache_frequency(segment, victim->hash))
+        {
+            vcache_unlink(segment, victim);
+            vcache_drop(segment, victim);
+        }
+        else
+        {
+            vcache_drop(segment, candidate);
+            return;
+        }
     }
+    vcache_push(segment, candidate, VCACHE_PROBATION);
+}
 
-    if ((tstamp != 0 && tstamp < entry->oldest_tstamp) ||
-        entry->oldest_tstamp == 0)
+// Updates the queues for a hit: window and protected entries become the
+// most recently used of their queue, probation ones get protected,
+// demoting the least recently used protected ones if that grows too big.
+static void vcache_touch(bitcask_vcache_segment* segment,
+                         bitcask_vcache_entry* entry)
+{
+    uint32_t queue_idx = entry->queue;
+    vcache_unlink(segment, entry);
+    if (queue_idx == VCACHE_PROBATION)
     {
-        entry->oldest_tstamp = tstamp;
+        queue_idx = VCACHE_PROTECTED;
     }
-
-    if ((tstamp != 0 && tstamp > entry->newest_tstamp) ||
-        entry->newest_tstamp == 0)
+    vcache_push(segment, entry, queue_idx);
+    while (segment->queues[VCACHE_PROTECTED].bytes > segment->protected_max)
     {
-        entry->newest_tstamp = tstamp;
+        bitcask_vcache_entry* demoted = segment->queues[VCACHE_PROTECTED].tail;
+        vcache_unlink(segment, demoted);
+        vcache_push(segment, demoted, VCACHE_PROBATION);
     }
 }
 
-// NIF wrapper around update_fstats().
-ERL_NIF_TERM bitcask_nifs_update_fstats(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+// Allocates the segments sharing max_bytes, or returns NULL if that fails.
+static bitcask_vcache_segment* vcache_new(uint64_t max_bytes, char* mutex_name)
 {
-    bitcask_keydir_handle* handle;
-    uint32_t file_id, tstamp;
-    int32_t live_increment, total_increment;
-    int32_t live_bytes_increment, total_bytes_increment;
-    int32_t should_create;
+    bitcask_vcache_segment* segments = calloc(VCACHE_SEGMENTS,
+                                              sizeof(bitcask_vcache_segment));
+    uint64_t segment_bytes = max_bytes / VCACHE_SEGMENTS;
+    uint64_t counters = VCACHE_SKETCH_MIN;
+    int i;
 
-    if (argc == 8
-            && enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE,
-                (void**)&handle)
-            && enif_get_uint(env, argv[1], &file_id)
-            && enif_get_uint(env, argv[2], &tstamp)
-            && enif_get_int(env, argv[3], &live_increment)
-            && enif_get_int(env, argv[4], &total_increment)
-            && enif_get_int(env, argv[5], &live_bytes_increment)
-            && enif_get_int(env, argv[6], &total_bytes_increment)
-            && enif_get_int(env, argv[7], &should_create))
+    if (segments == NULL)
     {
-        LOCK(handle->keydir);
-        update_fstats(env, handle->keydir, file_id, tstamp, MAX_EPOCH,
-                live_increment, total_increment,
-                live_bytes_increment, total_bytes_increment,
-                should_create);
-        UNLOCK(handle->keydir);
-        return ATOM_OK;
+        return NULL;
     }
-    else
+    while (counters < VCACHE_SKETCH_MAX &&
+           counters < segment_bytes / VCACHE_BYTES_PER_COUNTER)
     {
-        return enif_make_badarg(env);
+        counters *= 2;
     }
-}
-
-ERL_NIF_TERM bitcask_nifs_set_pending_delete(ErlNifEnv* env, int argc,
-        const ERL_NIF_TERM argv[])
-{
-    bitcask_keydir_handle* handle;
-    uint32_t file_id;
-
-    if (argc == 2
-            && enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE,
-                (void**)&handle)
-            && enif_get_uint(env, argv[1], &file_id))
+    for (i = 0; i < VCACHE_SEGMENTS; i++)
     {
-        LOCK(handle->keydir);
-        update_fstats(env, handle->keydir, file_id, 0, handle->keydir->epoch,
-                0, 0, 0, 0, 0);
-        UNLOCK(handle->keydir);
-        return ATOM_OK;
+        bitcask_vcache_segment* segment = &segments[i];
+        segment->entries = kh_init(vcache);
+        segment->max_bytes = segment_bytes;
+        segment->window_max = segment_bytes * VCACHE_WINDOW_PCT / 100;
+        segment->protected_max = (segment_bytes - segment->window_max) *
+            VCACHE_PROTECTED_PCT / 100;
+        segment->sketch = calloc(counters, 1);
+        segment->sketch_mask = (uint32_t)(counters - 1);
+        segment->sketch_sample = (uint32_t)(counters * VCACHE_SKETCH_SAMPLE);
+        segment->mutex = enif_mutex_create(mutex_name);
+    }
+    for (i = 0; i < VCACHE_SEGMENTS; i++)
+    {
+        if (segments[i].entries == NULL || segments[i].sketch == NULL ||
+            segments[i].mutex == NULL)
+        {
+            break;
+        }
     }
-    else
+    if (i < VCACHE_SEGMENTS)
     {
-        return enif_make_badarg(env);
+        for (i = 0; i < VCACHE_SEGMENTS; i++)
+        {
+            if (segments[i].entries)
+            {
+                kh_destroy(vcache, segments[i].entries);
+            }
+            free(segments[i].sketch);
+            if (segments[i].mutex)
+            {
+                enif_mutex_destroy(segments[i].mutex);
+            }
+        }
+        free(segments);
+        return NULL;
     }
+    return segments;
 }
 
-static khint_t keydir_entry_hash(bitcask_keydir_entry* entry)
+static void vcache_free(bitcask_vcache_segment* segments)
 {
-    khint_t h;
-    if (IS_ENTRY_LIST(entry))
+    int i, q;
+    if (segments == NULL)
     {
-        bitcask_keydir_entry_head* par = GET_ENTRY_LIST_POINTER(entry);
-        h = MURMUR_HASH(par->key, par->key_sz, 42);
+        return;
     }
-    else
+    for (i = 0; i < VCACHE_SEGMENTS; i++)
     {
-        h = MURMUR_HASH(entry->key, entry->key_sz, 42);
+        bitcask_vcache_segment* segment = &segments[i];
+        for (q = 0; q < VCACHE_QUEUES; q++)
+        {
+            while (segment->queues[q].head)
+            {
+                bitcask_vcache_entry* entry = segment->queues[q].head;
+                segment->queues[q].head = entry->next;
+                enif_release_resource_compat(NULL, entry->value);
+                free(entry);
+            }
+        }
+        kh_destroy(vcache, segment->entries);
+        free(segment->sketch);
+        enif_mutex_destroy(segment->mutex);
     }
-    return h;
+    free(segments);
 }
 
-
-static khint_t keydir_entry_equal(bitcask_keydir_entry* lhs,
-                                  bitcask_keydir_entry* rhs)
+// Looks up the value stored at a location. On a hit, returns the value
+// resource with a reference the caller must release.
+static void* vcache_get(bitcask_keydir* keydir, uint32_t file_id,
+                        uint64_t offset, size_t* value_sz)
 {
-    char* lkey;
-    char* rkey;
-    int lsz, rsz;
+    bitcask_vcache_entry lookup;
+    bitcask_vcache_segment* segment;
+    void* value = NULL;
+    khiter_t itr;
 
-    if (IS_ENTRY_LIST(lhs)) {
-        bitcask_keydir_entry_head* h = GET_ENTRY_LIST_POINTER(lhs);
-        lkey = &h->key[0];
-        lsz = h->key_sz;
-    }
-    else
-    {
-        lkey = &lhs->key[0];
-        lsz = lhs->key_sz;
-    }
-    if (IS_ENTRY_LIST(rhs)) {
-        bitcask_keydir_entry_head* h = GET_ENTRY_LIST_POINTER(rhs);
-        rkey = &h->key[0];
-        rsz = h->key_sz;
-    }
-    else
-    {
-        rkey = &rhs->key[0];
-        rsz = rhs->key_sz;
-    }
+    lookup.file_id = file_id;
+    lookup.offset = offset;
+    lookup.hash = vcache_hash(file_id, offset);
+    segment = vcache_segment(keydir, lookup.hash);
 
-    if (lsz != rsz)
+    enif_mutex_lock(segment->mutex);
+    vcache_record(segment, lookup.hash);
+    itr = kh_get(vcache, segment->entries, &lookup);
+    if (itr != kh_end(segment->entries))
     {
-        return 0;
+        bitcask_vcache_entry* entry = kh_key(segment->entries, itr);
+        vcache_touch(segment, entry);
+        value = entry->value;
+        *value_sz = entry->value_sz;
+        // Evicting it once the mutex is released must not free it yet
+        enif_keep_resource(value);
+        segment->hits++;
     }
     else
     {
-        return (memcmp(lkey, rkey, lsz) == 0);
+        segment->misses++;
     }
+    enif_mutex_unlock(segment->mutex);
+    return value;
 }
 
-// Custom hash function to be able to look up entries using a
-// ErlNifBinary without allocating a new entry just for that.
-static khint_t nif_binary_hash(void* void_bin)
-{
-    ErlNifBinary * bin =(ErlNifBinary*)void_bin;
-    return MURMUR_HASH(bin->data, bin->size, 42);
-}
-
-// Custom equals function to be able to look up entries using a
-// ErlNifBinary without allocating a new entry just for that.
-static khint_t nif_binary_entry_equal(bitcask_keydir_entry* lhs,
-        void * void_rhs)
+// Caches a copy of the value stored at a location, unless it is already
+// cached or too big for the cache.
+static void vcache_put(bitcask_keydir* keydir, uint32_t file_id,
+                       uint64_t offset, const void* data, size_t data_sz)
 {
-    char* lkey;
-    int lsz;
-
-    if (IS_ENTRY_LIST(lhs)) {
-        bitcask_keydir_entry_head* h = GET_ENTRY_LIST_POINTER(lhs);
-        lkey = &h->key[0];
-        lsz = h->key_sz;
-    }
-    else
+    uint64_t h = vcache_hash(file_id, offset);
+    bitcask_vcache_segment* segment = vcache_segment(keydir, h);
+    uint64_t charge = data_sz + sizeof(bitcask_vcache_entry) +
+        VCACHE_ENTRY_OVERHEAD;
+    bitcask_vcache_entry* entry;
+    int ret;
+
+    if (data_sz > VCACHE_MAX_VALUE ||
+        charge > segment->max_bytes - segment->window_max)
     {
-        lkey = &lhs->key[0];
-        lsz = lhs->key_sz;
+        return;
     }
 
-    ErlNifBinary * rhs = (ErlNifBinary*)void_rhs;
-
-    if (lsz != rhs->size)
+    // Copy the value before taking the mutex
+    entry = malloc(sizeof(bitcask_vcache_entry));
+    if (entry == NULL)
     {
-        return 0;
+        return;
     }
-    else
+    entry->value = enif_alloc_resource_compat(NULL, bitcask_value_RESOURCE,
+                                              data_sz);
+    memcpy(entry->value, data, data_sz);
+    entry->value_sz = data_sz;
+    entry->file_id = file_id;
+    entry->offset = offset;
+    entry->hash = h;
+    entry->charge = charge;
+
+    enif_mutex_lock(segment->mutex);
+    kh_put(vcache, segment->entries, entry, &ret);
+    if (ret <= 0)
     {
-        return (memcmp(lkey, rhs->data, lsz) == 0);
-    }
+        // Cached by another reader in the meantime, or out of memory
+        enif_mutex_unlock(segment->mutex);
+        enif_release_resource_compat(NULL, entry->value);
+        free(entry);
+        return;
+    }
+    vcache_push(segment, entry, VCACHE_WINDOW);
+    while (segment->queues[VCACHE_WINDOW].bytes > segment->window_max)
+    {
+        bitcask_vcache_entry* candidate = segment->queues[VCACHE_WINDOW].tail;
+        vcache_unlink(segment, candidate);
+        vcache_admit(segment, candidate);
+    }
+    enif_mutex_unlock(segment->mutex);
+}
+// Related to tombstones in the pending hash.
+// Notice that tombstones in the entries hash are different.
+#define is_pending_tombstone(e) ((e)->offset == MAX_OFFSET)
+#define set_pending_tombstone(e) {(e)->offset = MAX_OFFSET; }
+
+// Atoms (initialized in on_load)
+static ERL_NIF_TERM ATOM_ALLOCATION_ERROR;
+static ERL_NIF_TERM ATOM_ALREADY_EXISTS;
+static ERL_NIF_TERM ATOM_ARENA_LARGE_BYTES;
+static ERL_NIF_TERM ATOM_ARENA_SLAB_BYTES;
+static ERL_NIF_TERM ATOM_ARENA_USED_BYTES;
+static ERL_NIF_TERM ATOM_ARENA_UTILIZATION;
+static ERL_NIF_TERM ATOM_BITCASK_ENTRY;
+static ERL_NIF_TERM ATOM_BLOOM_BYTES;
+static ERL_NIF_TERM ATOM_BLOOM_FILTER;
+static ERL_NIF_TERM ATOM_BYTES_PER_KEY;
+static ERL_NIF_TERM ATOM_CACHE_BYTES;
+static ERL_NIF_TERM ATOM_CACHE_ENTRIES;
+static ERL_NIF_TERM ATOM_CACHE_EVICTIONS;
+static ERL_NIF_TERM ATOM_CACHE_HITS;
+static ERL_NIF_TERM ATOM_CACHE_MISSES;
+static ERL_NIF_TERM ATOM_COMPACT;
+static ERL_NIF_TERM ATOM_ENTRY_BYTES;
+static ERL_NIF_TERM ATOM_READ_SAMPLES;
+static ERL_NIF_TERM ATOM_READ_USECS;
+static ERL_NIF_TERM ATOM_MERGE_BYTES;
+static ERL_NIF_TERM ATOM_MERGE_THROTTLED_USECS;
+static ERL_NIF_TERM ATOM_ENTRY_LAYOUT;
+static ERL_NIF_TERM ATOM_EXPIRY_INDEX;
+static ERL_NIF_TERM ATOM_EXPIRY_INDEX_KEYS;
+static ERL_NIF_TERM ATOM_DONE;
+static ERL_NIF_TERM ATOM_ERROR;
+static ERL_NIF_TERM ATOM_FALSE;
+static ERL_NIF_TERM ATOM_FSTAT_ERROR;
+static ERL_NIF_TERM ATOM_FTRUNCATE_ERROR;
+static ERL_NIF_TERM ATOM_GETFL_ERROR;
+static ERL_NIF_TERM ATOM_HASH_BYTES;
+static ERL_NIF_TERM ATOM_ILT_CREATE_ERROR; /* Iteration lock thread creation error */
+static ERL_NIF_TERM ATOM_INVALID_HINTFILE;
+static ERL_NIF_TERM ATOM_ITERATION_IN_PROCESS;
+static ERL_NIF_TERM ATOM_ITERATION_NOT_PERMITTED;
+static ERL_NIF_TERM ATOM_ITERATION_NOT_STARTED;
+static ERL_NIF_TERM ATOM_KEY_COUNT;
+static ERL_NIF_TERM ATOM_LOCK_NOT_WRITABLE;
+static ERL_NIF_TERM ATOM_NOT_EMPTY;
+static ERL_NIF_TERM ATOM_NOT_FOUND;
+static ERL_NIF_TERM ATOM_NOT_LOADED;
+static ERL_NIF_TERM ATOM_NOT_READY;
+static ERL_NIF_TERM ATOM_OK;
+static ERL_NIF_TERM ATOM_OUT_OF_DATE;
+static ERL_NIF_TERM ATOM_PREAD_ERROR;
+static ERL_NIF_TERM ATOM_PWRITE_ERROR;
+static ERL_NIF_TERM ATOM_READY;
+static ERL_NIF_TERM ATOM_SETFL_ERROR;
+static ERL_NIF_TERM ATOM_STANDARD;
+static ERL_NIF_TERM ATOM_TRUE;
+static ERL_NIF_TERM ATOM_TRUNC_HINTFILE;
+static ERL_NIF_TERM ATOM_UNDEFINED;
+static ERL_NIF_TERM ATOM_UNCOMPRESSIBLE;
+static ERL_NIF_TERM ATOM_VALUE_CACHE;
+static ERL_NIF_TERM ATOM_INVALID_DICT;
+static ERL_NIF_TERM ATOM_TRAINING_FAILED;
+static ERL_NIF_TERM ATOM_LZ4;
+static ERL_NIF_TERM ATOM_ZSTD;
+static ERL_NIF_TERM ATOM_EOF;
+static ERL_NIF_TERM ATOM_MORE;
+static ERL_NIF_TERM ATOM_WRAP;
+static ERL_NIF_TERM ATOM_FRESH;
+static ERL_NIF_TERM ATOM_ENTRY;
+static ERL_NIF_TERM ATOM_BAD_ENTRY;
+static ERL_NIF_TERM ATOM_CRC32;
+static ERL_NIF_TERM ATOM_CRC32C;
+static ERL_NIF_TERM ATOM_CREATE;
+static ERL_NIF_TERM ATOM_READONLY;
+static ERL_NIF_TERM ATOM_O_SYNC;
+// lseek equivalents for file_position
+static ERL_NIF_TERM ATOM_CUR;
+static ERL_NIF_TERM ATOM_BOF;
+
+// Prototypes
+ERL_NIF_TERM bitcask_nifs_keydir_new0(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_new1(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_new2(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_maybe_keydir_new1(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_mark_ready(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_get_int(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_get_many_int(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_get_epoch(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_put_int(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_remove(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_remove_file(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_sweep_expired(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_copy(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_itr(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_itr_next(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_itr_release(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_info(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_memory_info(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_io_stats(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_add_read_latency(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_add_merge_io(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_cache_get(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_cache_put(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_release(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_load_hintfile(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_load_hintfiles(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_write_snapshot(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_load_snapshot(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_keydir_trim_fstats(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+
+ERL_NIF_TERM bitcask_nifs_increment_file_id(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+
+ERL_NIF_TERM bitcask_nifs_create_tmp_file(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+
+ERL_NIF_TERM bitcask_nifs_lock_acquire(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_lock_release(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_lock_readdata(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_lock_writedata(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+
+ERL_NIF_TERM bitcask_nifs_file_open(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_file_close(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_file_sync(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_file_datasync(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_file_pread(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_file_mmap(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_file_mmap_pread(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_file_pwrite(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_file_read(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_file_write(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_file_position(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_file_seekbof(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_file_truncate(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+
+ERL_NIF_TERM bitcask_nifs_update_fstats(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_set_pending_delete(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+
+ERL_NIF_TERM bitcask_nifs_crc32c1(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_crc32c2(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_compression_codecs(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_compress(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_decompress(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_zstd_dict_open(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_zstd_train_dict(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_compress_dict(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_decompress_dict(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+
+ERL_NIF_TERM bitcask_nifs_merge_copy_open(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_merge_copy_close(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+ERL_NIF_TERM bitcask_nifs_merge_copy(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+
+ERL_NIF_TERM errno_atom(ErlNifEnv* env, int error);
+ERL_NIF_TERM errno_error_tuple(ErlNifEnv* env, ERL_NIF_TERM key, int error);
+
+static void merge_pending_entries(ErlNifEnv* env, bitcask_keydir* keydir);
+static void lock_release(bitcask_lock_handle* handle);
+
+static void bitcask_nifs_keydir_resource_cleanup(ErlNifEnv* env, void* arg);
+static void bitcask_nifs_file_resource_cleanup(ErlNifEnv* env, void* arg);
+static void bitcask_nifs_dict_resource_cleanup(ErlNifEnv* env, void* arg);
+static void bitcask_nifs_merge_resource_cleanup(ErlNifEnv* env, void* arg);
+
+static ErlNifFunc nif_funcs[] =
+{
+#ifdef PULSE
+    {"set_pulse_pid", 1, set_pulse_pid},
+#endif
+    {"keydir_new", 0, bitcask_nifs_keydir_new0},
+    {"keydir_new", 1, bitcask_nifs_keydir_new1},
+    {"keydir_new", 2, bitcask_nifs_keydir_new2},
+    {"maybe_keydir_new", 1, bitcask_nifs_maybe_keydir_new1},
+    {"keydir_mark_ready", 1, bitcask_nifs_keydir_mark_ready},
+    {"keydir_put_int", 11, bitcask_nifs_keydir_put_int},
+    {"keydir_get_int", 4, bitcask_nifs_keydir_get_int},
+    {"keydir_get_many_int", 4, bitcask_nifs_keydir_get_many_int},
+    {"keydir_get_epoch", 1, bitcask_nifs_keydir_get_epoch},
+    {"keydir_remove", 3, bitcask_nifs_keydir_remove},
+    {"keydir_remove_int", 6, bitcask_nifs_keydir_remove},
+    ERL_NIF_FUNC_COMPAT("keydir_remove_file_int", 3, bitcask_nifs_keydir_remove_file, ERL_NIF_DIRTY_CPU_COMPAT),
+    {"keydir_sweep_expired", 3, bitcask_nifs_keydir_sweep_expired},
+    ERL_NIF_FUNC_COMPAT("keydir_copy", 1, bitcask_nifs_keydir_copy, ERL_NIF_DIRTY_CPU_COMPAT),
+    {"keydir_itr_int", 4, bitcask_nifs_keydir_itr},
+    {"keydir_itr_next_int", 1, bitcask_nifs_keydir_itr_next},
+    ERL_NIF_FUNC_COMPAT("keydir_itr_release", 1, bitcask_nifs_keydir_itr_release, ERL_NIF_DIRTY_CPU_COMPAT),
+    {"keydir_info", 1, bitcask_nifs_keydir_info},
+    {"keydir_memory_info", 1, bitcask_nifs_keydir_memory_info},
+    {"keydir_io_stats", 1, bitcask_nifs_keydir_io_stats},
+    {"keydir_add_read_latency", 2, bitcask_nifs_keydir_add_read_latency},
+    {"keydir_add_merge_io", 3, bitcask_nifs_keydir_add_merge_io},
+    {"keydir_cache_get", 3, bitcask_nifs_keydir_cache_get},
+    {"keydir_cache_put", 4, bitcask_nifs_keydir_cache_put},
+    ERL_NIF_FUNC_COMPAT("keydir_release", 1, bitcask_nifs_keydir_release, ERL_NIF_DIRTY_CPU_COMPAT),
+    ERL_NIF_FUNC_COMPAT("keydir_load_hintfile_int", 5, bitcask_nifs_keydir_load_hintfile, ERL_NIF_DIRTY_IO_COMPAT),
+    ERL_NIF_FUNC_COMPAT("keydir_load_hintfiles", 3, bitcask_nifs_keydir_load_hintfiles, ERL_NIF_DIRTY_IO_COMPAT),
+    ERL_NIF_FUNC_COMPAT("keydir_write_snapshot", 3, bitcask_nifs_keydir_write_snapshot, ERL_NIF_DIRTY_IO_COMPAT),
+    ERL_NIF_FUNC_COMPAT("keydir_load_snapshot", 3, bitcask_nifs_keydir_load_snapshot, ERL_NIF_DIRTY_IO_COMPAT),
+    {"keydir_trim_fstats", 2, bitcask_nifs_keydir_trim_fstats},
+
+    {"increment_file_id", 1, bitcask_nifs_increment_file_id},
+    {"increment_file_id", 2, bitcask_nifs_increment_file_id},
+
+    ERL_NIF_FUNC_COMPAT("lock_acquire_int", 2, bitcask_nifs_lock_acquire, ERL_NIF_DIRTY_IO_COMPAT),
+    ERL_NIF_FUNC_COMPAT("lock_release_int", 1, bitcask_nifs_lock_release, ERL_NIF_DIRTY_IO_COMPAT),
+    ERL_NIF_FUNC_COMPAT("lock_readdata_int", 1, bitcask_nifs_lock_readdata, ERL_NIF_DIRTY_IO_COMPAT),
+    ERL_NIF_FUNC_COMPAT("lock_writedata_int", 2, bitcask_nifs_lock_writedata, ERL_NIF_DIRTY_IO_COMPAT),
+
+    ERL_NIF_FUNC_COMPAT("file_open_int", 2, bitcask_nifs_file_open, ERL_NIF_DIRTY_IO_COMPAT),
+    ERL_NIF_FUNC_COMPAT("file_close_int", 1, bitcask_nifs_file_close, ERL_NIF_DIRTY_IO_COMPAT),
+    ERL_NIF_FUNC_COMPAT("file_sync_int", 1, bitcask_nifs_file_sync, ERL_NIF_DIRTY_IO_COMPAT),
+    ERL_NIF_FUNC_COMPAT("file_datasync_int", 1, bitcask_nifs_file_datasync, ERL_NIF_DIRTY_IO_COMPAT),
+    ERL_NIF_FUNC_COMPAT("file_pread_int", 3, bitcask_nifs_file_pread, ERL_NIF_DIRTY_IO_COMPAT),
+    ERL_NIF_FUNC_COMPAT("file_mmap_int", 1, bitcask_nifs_file_mmap, ERL_NIF_DIRTY_IO_COMPAT),
+    ERL_NIF_FUNC_COMPAT("file_mmap_pread_int", 3, bitcask_nifs_file_mmap_pread, ERL_NIF_DIRTY_IO_COMPAT),
+    ERL_NIF_FUNC_COMPAT("file_pwrite_int", 3, bitcask_nifs_file_pwrite, ERL_NIF_DIRTY_IO_COMPAT),
+    ERL_NIF_FUNC_COMPAT("file_read_int", 2, bitcask_nifs_file_read, ERL_NIF_DIRTY_IO_COMPAT),
+    ERL_NIF_FUNC_COMPAT("file_write_int", 2, bitcask_nifs_file_write, ERL_NIF_DIRTY_IO_COMPAT),
+    ERL_NIF_FUNC_COMPAT("file_position_int", 2, bitcask_nifs_file_position, ERL_NIF_DIRTY_IO_COMPAT),
+    ERL_NIF_FUNC_COMPAT("file_seekbof_int", 1, bitcask_nifs_file_seekbof, ERL_NIF_DIRTY_IO_COMPAT),
+    ERL_NIF_FUNC_COMPAT("file_truncate_int", 1, bitcask_nifs_file_truncate, ERL_NIF_DIRTY_IO_COMPAT),
+    {"update_fstats", 8, bitcask_nifs_update_fstats},
+    {"set_pending_delete", 2, bitcask_nifs_set_pending_delete},
+    {"crc32c", 1, bitcask_nifs_crc32c1},
+    {"crc32c", 2, bitcask_nifs_crc32c2},
+    {"compression_codecs", 0, bitcask_nifs_compression_codecs},
+    {"compress_int", 2, bitcask_nifs_compress},
+    {"decompress_int", 2, bitcask_nifs_decompress},
+    ERL_NIF_FUNC_COMPAT("compress_dirty_int", 2, bitcask_nifs_compress, ERL_NIF_DIRTY_CPU_COMPAT),
+    ERL_NIF_FUNC_COMPAT("decompress_dirty_int", 2, bitcask_nifs_decompress, ERL_NIF_DIRTY_CPU_COMPAT),
+    {"compress_dict_int", 2, bitcask_nifs_compress_dict},
+    {"decompress_dict_int", 2, bitcask_nifs_decompress_dict},
+    ERL_NIF_FUNC_COMPAT("compress_dict_dirty_int", 2, bitcask_nifs_compress_dict, ERL_NIF_DIRTY_CPU_COMPAT),
+    ERL_NIF_FUNC_COMPAT("decompress_dict_dirty_int", 2, bitcask_nifs_decompress_dict, ERL_NIF_DIRTY_CPU_COMPAT),
+    ERL_NIF_FUNC_COMPAT("zstd_dict_open_int", 1, bitcask_nifs_zstd_dict_open, ERL_NIF_DIRTY_IO_COMPAT),
+    ERL_NIF_FUNC_COMPAT("zstd_train_dict_int", 3, bitcask_nifs_zstd_train_dict, ERL_NIF_DIRTY_CPU_COMPAT),
+    ERL_NIF_FUNC_COMPAT("merge_copy_open", 1, bitcask_nifs_merge_copy_open, ERL_NIF_DIRTY_IO_COMPAT),
+    ERL_NIF_FUNC_COMPAT("merge_copy_close", 1, bitcask_nifs_merge_copy_close, ERL_NIF_DIRTY_IO_COMPAT),
+    ERL_NIF_FUNC_COMPAT("merge_copy_int", 8, bitcask_nifs_merge_copy, ERL_NIF_DIRTY_IO_COMPAT)
+};
+
+ERL_NIF_TERM bitcask_nifs_keydir_new0(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    // First, setup a resource for our handle
+    bitcask_keydir_handle* handle = enif_alloc_resource_compat(env,
+                                                               bitcask_keydir_RESOURCE,
+                                                               sizeof(bitcask_keydir_handle));
+    memset(handle, '\0', sizeof(bitcask_keydir_handle));
+
+    // Now allocate the actual keydir instance. Because it's unnamed/shared, we'll
+    // leave the name and lock portions null'd out
+    bitcask_keydir* keydir = malloc(sizeof(bitcask_keydir));
+    memset(keydir, '\0', sizeof(bitcask_keydir));
+    init_keydir_shards(keydir, NULL);
+    keydir->fstats   = kh_init(fstats);
+
+    // Assign the keydir to our handle and hand it back
+    handle->keydir = keydir;
+    ERL_NIF_TERM result = enif_make_resource(env, handle);
+    enif_release_resource_compat(env, handle);
+    return enif_make_tuple2(env, ATOM_OK, result);
+}
+
+ERL_NIF_TERM bitcask_nifs_maybe_keydir_new1(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    char name[4096];
+    if (enif_get_string(env, argv[0], name, sizeof(name), ERL_NIF_LATIN1))
+    {
+        // Get our private stash and check the global hash table for this entry
+        bitcask_priv_data* priv = (bitcask_priv_data*)enif_priv_data(env);
+
+        enif_mutex_lock(priv->global_keydirs_lock);
+        khiter_t itr = kh_get(global_keydirs, priv->global_keydirs, name);
+        khiter_t table_end = kh_end(priv->global_keydirs); /* get end while lock is held! */
+        enif_mutex_unlock(priv->global_keydirs_lock);
+        if (itr != table_end)
+        {
+            return bitcask_nifs_keydir_new1(env, argc, argv);
+        }
+        else
+        {
+            return enif_make_tuple2(env, ATOM_ERROR, ATOM_NOT_READY);
+        }
+    }
+    else
+    {
+        return enif_make_badarg(env);
+    }
+}
+
+// Opens the named keydir, creating it if needed. Options only apply to
+// newly created keydirs.
+static ERL_NIF_TERM keydir_new_named(ErlNifEnv* env, ERL_NIF_TERM name_term,
+                                     char compact_entries, char expiry_index,
+                                     char bloom_filter,
+                                     uint64_t value_cache_bytes)
+{
+    char name[4096];
+    size_t name_sz;
+    if (enif_get_string(env, name_term, name, sizeof(name), ERL_NIF_LATIN1))
+    {
+        name_sz = strlen(name);
+
+        // Get our private stash and check the global hash table for this entry
+        bitcask_priv_data* priv = (bitcask_priv_data*)enif_priv_data(env);
+        enif_mutex_lock(priv->global_keydirs_lock);
+
+        bitcask_keydir* keydir;
+        khiter_t itr = kh_get(global_keydirs, priv->global_keydirs, name);
+        if (itr != kh_end(priv->global_keydirs))
+        {
+            keydir = kh_val(priv->global_keydirs, itr);
+            // Existing keydir is available. Check the is_ready flag to determine if
+            // the original creator is ready for other processes to use it.
+            if (!keydir->is_ready)
+            {
+                // Notify the caller that while the requested keydir exists, it's not
+                // ready for public usage.
+                enif_mutex_unlock(priv->global_keydirs_lock);
+                return enif_make_tuple2(env, ATOM_ERROR, ATOM_NOT_READY);
+            }
+            else
+            {
+                keydir->refcount++;
+            }
+        }
+        else
+        {
+            // No such keydir, create a new one and add to the globals list. Make sure
+            // to allocate enough room for the name.
+            keydir = malloc(sizeof(bitcask_keydir) + name_sz + 1);
+            memset(keydir, '\0', sizeof(bitcask_keydir) + name_sz + 1);
+            strncpy(keydir->name, name, name_sz + 1);
+
+            // Initialize hash tables and shard locks
+            init_keydir_shards(keydir, name);
+            keydir->fstats   = kh_init(fstats);
+            keydir->compact_entries = compact_entries;
+            keydir->expiry_index = expiry_index;
+            keydir->bloom_filter = bloom_filter;
+            init_keydir_blooms(keydir);
+            // Goes without a value cache if it cannot be allocated
+            if (value_cache_bytes > 0)
+            {
+                keydir->vcache = vcache_new(value_cache_bytes, name);
+            }
+
+            // Be sure to initialize the mutex and set our refcount
+            keydir->mutex = enif_mutex_create(name);
+            keydir->refcount = 1;
+
+            // Finally, register this new keydir in the globals
+            kh_put2(global_keydirs, priv->global_keydirs, keydir->name, keydir);
+
+            khiter_t itr_biggest_file_id = kh_get(global_biggest_file_id, priv->global_biggest_file_id, name);
+            if (itr_biggest_file_id != kh_end(priv->global_biggest_file_id)) {
+                uint32_t old_biggest_file_id = kh_val(priv->global_biggest_file_id, itr_biggest_file_id);
+                keydir->biggest_file_id = old_biggest_file_id;
+            }
+        }
+
+        enif_mutex_unlock(priv->global_keydirs_lock);
+
+        // Setup a resource for the handle
+        bitcask_keydir_handle* handle = enif_alloc_resource_compat(env,
+                                                                   bitcask_keydir_RESOURCE,
+                                                                   sizeof(bitcask_keydir_handle));
+        memset(handle, '\0', sizeof(bitcask_keydir_handle));
+        handle->keydir = keydir;
+        ERL_NIF_TERM result = enif_make_resource(env, handle);
+        enif_release_resource_compat(env, handle);
+
+        // Return to the caller a tuple with the reference and an atom
+        // indicating if the keydir is ready or not.
+        ERL_NIF_TERM is_ready_atom = keydir->is_ready ? ATOM_READY : ATOM_NOT_READY;
+        return enif_make_tuple2(env, is_ready_atom, result);
+    }
+    else
+    {
+        return enif_make_badarg(env);
+    }
+}
+
+ERL_NIF_TERM bitcask_nifs_keydir_new1(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    return keydir_new_named(env, argv[0], 0, 0, 0, 0);
+}
+
+ERL_NIF_TERM bitcask_nifs_keydir_new2(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    char compact_entries = 0;
+    char expiry_index = 0;
+    char bloom_filter = 0;
+    ErlNifUInt64 value_cache_bytes = 0;
+    ERL_NIF_TERM head, tail, list = argv[1];
+    const ERL_NIF_TERM* option;
+    int arity;
+
+    while (enif_get_list_cell(env, list, &head, &tail))
+    {
+        if (enif_get_tuple(env, head, &arity, &option) && arity == 2 &&
+            option[0] == ATOM_ENTRY_LAYOUT)
+        {
+            if (option[1] == ATOM_COMPACT)
+            {
+                compact_entries = 1;
+            }
+            else if (option[1] == ATOM_STANDARD)
+            {
+                compact_entries = 0;
+            }
+            else
+            {
+                return enif_make_badarg(env);
+            }
+        }
+        else if (enif_get_tuple(env, head, &arity, &option) && arity == 2 &&
+                 option[0] == ATOM_EXPIRY_INDEX)
+        {
+            if (option[1] == ATOM_TRUE)
+            {
+                expiry_index = 1;
+            }
+            else if (option[1] == ATOM_FALSE)
+            {
+                expiry_index = 0;
+            }
+            else
+            {
+                return enif_make_badarg(env);
+            }
+        }
+        else if (enif_get_tuple(env, head, &arity, &option) && arity == 2 &&
+                 option[0] == ATOM_BLOOM_FILTER)
+        {
+            if (option[1] == ATOM_TRUE)
+            {
+                bloom_filter = 1;
+            }
+            else if (option[1] == ATOM_FALSE)
+            {
+                bloom_filter = 0;
+            }
+            else
+            {
+                return enif_make_badarg(env);
+            }
+        }
+        else if (enif_get_tuple(env, head, &arity, &option) && arity == 2 &&
+                 option[0] == ATOM_VALUE_CACHE)
+        {
+            if (!enif_get_uint64(env, option[1], &value_cache_bytes))
+            {
+                return enif_make_badarg(env);
+            }
+        }
+        list = tail;
+    }
+
+    return keydir_new_named(env, argv[0], compact_entries, expiry_index,
+                            bloom_filter, value_cache_bytes);
+}
+
+ERL_NIF_TERM bitcask_nifs_keydir_mark_ready(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    bitcask_keydir_handle* handle;
+
+    if (enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle))
+    {
+        bitcask_keydir* keydir = handle->keydir;
+        LOCK(keydir);
+        keydir->is_ready = 1;
+        UNLOCK(keydir);
+        return ATOM_OK;
+    }
+    else
+    {
+        return enif_make_badarg(env);
+    }
+}
+
+static void update_fstats_hash(fstats_hash_t* fstats,
+                               uint32_t file_id, uint32_t tstamp,
+                               uint64_t expiration_epoch,
+                               int32_t live_increment, int32_t total_increment,
+                               int32_t live_bytes_increment, int32_t total_bytes_increment,
+                               int32_t should_create)
+{
+    bitcask_fstats_entry* entry = 0;
+    khiter_t itr = kh_get(fstats, fstats, file_id);
+
+    if (itr == kh_end(fstats))
+    {
+        if (!should_create)
+        {
+            return;
+        }
+
+        // Need to initialize new entry and add to the table
+        entry = malloc(sizeof(bitcask_fstats_entry));
+        memset(entry, '\0', sizeof(bitcask_fstats_entry));
+        entry->expiration_epoch = MAX_EPOCH;
+        entry->file_id = file_id;
+
+        kh_put2(fstats, fstats, file_id, entry);
+    }
+    else
+    {
+        entry = kh_val(fstats, itr);
+    }
+
+    entry->live_keys   += live_increment;
+    entry->total_keys  += total_increment;
+    entry->live_bytes  += live_bytes_increment;
+    entry->total_bytes += total_bytes_increment;
+
+    if (expiration_epoch < entry->expiration_epoch)
+    {
+        entry->expiration_epoch = expiration_epoch;
+    }
+
+    if ((tstamp != 0 && tstamp < entry->oldest_tstamp) ||
+        entry->oldest_tstamp == 0)
+    {
+        entry->oldest_tstamp = tstamp;
+    }
+
+    if ((tstamp != 0 && tstamp > entry->newest_tstamp) ||
+        entry->newest_tstamp == 0)
+    {
+        entry->newest_tstamp = tstamp;
+    }
+}
+
+static void update_fstats(ErlNifEnv* env, bitcask_keydir* keydir,
+                          uint32_t file_id, uint32_t tstamp,
+                          uint64_t expiration_epoch,
+                          int32_t live_increment, int32_t total_increment,
+                          int32_t live_bytes_increment, int32_t total_bytes_increment,
+                          int32_t should_create)
+{
+    update_fstats_hash(keydir->fstats, file_id, tstamp, expiration_epoch,
+                       live_increment, total_increment,
+                       live_bytes_increment, total_bytes_increment,
+                       should_create);
+}
+
+// NIF wrapper around update_fstats().
+ERL_NIF_TERM bitcask_nifs_update_fstats(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    bitcask_keydir_handle* handle;
+    uint32_t file_id, tstamp;
+    int32_t live_increment, total_increment;
+    int32_t live_bytes_increment, total_bytes_increment;
+    int32_t should_create;
+
+    if (argc == 8
+            && enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE,
+                (void**)&handle)
+            && enif_get_uint(env, argv[1], &file_id)
+            && enif_get_uint(env, argv[2], &tstamp)
+            && enif_get_int(env, argv[3], &live_increment)
+            && enif_get_int(env, argv[4], &total_increment)
+            && enif_get_int(env, argv[5], &live_bytes_increment)
+            && enif_get_int(env, argv[6], &total_bytes_increment)
+            && enif_get_int(env, argv[7], &should_create))
+    {
+        LOCK(handle->keydir);
+        update_fstats(env, handle->keydir, file_id, tstamp, MAX_EPOCH,
+                live_increment, total_increment,
+                live_bytes_increment, total_bytes_increment,
+                should_create);
+        UNLOCK(handle->keydir);
+        return ATOM_OK;
+    }
+    else
+    {
+        return enif_make_badarg(env);
+    }
+}
+
+ERL_NIF_TERM bitcask_nifs_set_pending_delete(ErlNifEnv* env, int argc,
+        const ERL_NIF_TERM argv[])
+{
+    bitcask_keydir_handle* handle;
+    uint32_t file_id;
+
+    if (argc == 2
+            && enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE,
+                (void**)&handle)
+            && enif_get_uint(env, argv[1], &file_id))
+    {
+        LOCK(handle->keydir);
+        update_fstats(env, handle->keydir, file_id, 0, handle->keydir->epoch,
+                0, 0, 0, 0, 0);
+        UNLOCK(handle->keydir);
+        return ATOM_OK;
+    }
+    else
+    {
+        return enif_make_badarg(env);
+    }
+}
+
+// Finds the key of a regular, compact or list entry.
+static inline void entry_key(bitcask_keydir_entry* entry, char** key, int* key_sz)
+{
+    if (IS_ENTRY_LIST(entry))
+    {
+        bitcask_keydir_entry_head* h = GET_ENTRY_LIST_POINTER(entry);
+        *key = &h->key[0];
+        *key_sz = h->key_sz;
+    }
+    else if (IS_COMPACT_ENTRY(entry))
+    {
+        bitcask_keydir_compact_entry* c = GET_COMPACT_ENTRY_POINTER(entry);
+        *key = &c->key[0];
+        *key_sz = c->key_sz;
+    }
+    else
+    {
+        *key = &entry->key[0];
+        *key_sz = entry->key_sz;
+    }
+}
+
+static khint_t keydir_entry_hash(bitcask_keydir_entry* entry)
+{
+    char* key;
+    int key_sz;
+
+    entry_key(entry, &key, &key_sz);
+    return MURMUR_HASH(key, key_sz, 42);
+}
+
+
+static khint_t keydir_entry_equal(bitcask_keydir_entry* lhs,
+                                  bitcask_keydir_entry* rhs)
+{
+    char* lkey;
+    char* rkey;
+    int lsz, rsz;
+
+    entry_key(lhs, &lkey, &lsz);
+    entry_key(rhs, &rkey, &rsz);
+
+    if (lsz != rsz)
+    {
+        return 0;
+    }
+    else
+    {
+        return (memcmp(lkey, rkey, lsz) == 0);
+    }
+}
+
+// Custom hash function to be able to look up entries using a
+// ErlNifBinary without allocating a new entry just for that.
+static khint_t nif_binary_hash(void* void_bin)
+{
+    ErlNifBinary * bin =(ErlNifBinary*)void_bin;
+    return MURMUR_HASH(bin->data, bin->size, 42);
+}
+
+// Custom equals function to be able to look up entries using a
+// ErlNifBinary without allocating a new entry just for that.
+static khint_t nif_binary_entry_equal(bitcask_keydir_entry* lhs,
+        void * void_rhs)
+{
+    char* lkey;
+    int lsz;
+
+    entry_key(lhs, &lkey, &lsz);
+
+    ErlNifBinary * rhs = (ErlNifBinary*)void_rhs;
+
+    if (lsz != rhs->size)
+    {
+        return 0;
+    }
+    else
+    {
+        return (memcmp(lkey, rhs->data, lsz) == 0);
+    }
+}
+
+static khiter_t get_entries_hash(entries_hash_t *hash, ErlNifBinary* key,
+                                 khiter_t* itr_ptr, bitcask_keydir_entry** entry_ptr)
+{
+    khiter_t itr = kh_get_custom(entries, hash, key, nif_binary_hash,
+            nif_binary_entry_equal);
+
+    if (itr != kh_end(hash))
+    {
+        if (itr_ptr != NULL)
+        {
+            *itr_ptr = itr;
+        }
+        if (entry_ptr != NULL)
+        {
+            *entry_ptr = kh_key(hash, itr);
+        }
+        return 1;
+    }
+    else
+    {
+        return 0;
+    }
+}
+
+static khint_t expiry_node_hash(bitcask_expiry_node* node)
+{
+    return MURMUR_HASH(node->key, node->key_sz, 42);
+}
+
+static khint_t expiry_node_equal(bitcask_expiry_node* lhs,
+                                 bitcask_expiry_node* rhs)
+{
+    return lhs->key_sz == rhs->key_sz &&
+        memcmp(lhs->key, rhs->key, lhs->key_sz) == 0;
+}
+
+// Looks up the expiry index node of a key by an ErlNifBinary, as
+// nif_binary_entry_equal does for entries.
+static khint_t nif_binary_expiry_node_equal(bitcask_expiry_node* lhs,
+                                            void* void_rhs)
+{
+    ErlNifBinary * rhs = (ErlNifBinary*)void_rhs;
+    return lhs->key_sz == rhs->size &&
+        memcmp(lhs->key, rhs->data, rhs->size) == 0;
+}
+
+static inline int is_sib_tombstone(bitcask_keydir_entry_sib *s)
+{
+    if (s->file_id == MAX_TIME &&
+        s->total_sz == MAX_SIZE &&
+        s->offset == MAX_OFFSET)
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+// Extracts the entry values from a regular entry or from the
+// closest snapshot in time in an entry list.
+static int proxy_kd_entry_at_epoch(bitcask_keydir_entry* old,
+                                   uint64_t epoch, bitcask_keydir_entry_proxy * ret)
+{
+    if (IS_COMPACT_ENTRY(old))
+    {
+        bitcask_keydir_compact_entry* c = GET_COMPACT_ENTRY_POINTER(old);
+        uint64_t c_epoch = COMPACT_EPOCH(c);
+        if (epoch < c_epoch)
+            return 0;
+
+        ret->file_id = c->file_id;
+        ret->total_sz = c->total_sz;
+        ret->offset = COMPACT_OFFSET(c);
+        ret->tstamp = c->tstamp;
+        ret->expiry = 0;
+        ret->epoch = c_epoch;
+        ret->key_sz = c->key_sz;
+        ret->key = c->key;
+        ret->is_tombstone = 0;
+
+        return 1;
+    }
+
+    if (!IS_ENTRY_LIST(old))
+    {
+        if (epoch < old->epoch)
+            return 0;
+
+        ret->file_id = old->file_id;
+        ret->total_sz = old->total_sz;
+        ret->offset = old->offset;
+        ret->tstamp = old->tstamp;
+        ret->expiry = old->expiry;
+        ret->epoch = old->epoch;
+        ret->key_sz = old->key_sz;
+        ret->key = old->key;
+        ret->is_tombstone = is_pending_tombstone(old);
+
+        return 1;
+    }
+
+    bitcask_keydir_entry_head* head = GET_ENTRY_LIST_POINTER(old);
+
+    //grab the newest sib
+    bitcask_keydir_entry_sib* s = head->sibs;
+
+    while (s != NULL)
+    {
+        if (epoch >= s->epoch)
+        {
+            break;
+        }
+        s = s->next;
+    }
+
+    if (s == NULL)
+    {
+        return 0;
+    }
+
+    ret->file_id = s->file_id;
+    ret->total_sz = s->total_sz;
+    ret->offset = s->offset;
+    ret->tstamp = s->tstamp;
+    ret->expiry = s->expiry;
+    ret->is_tombstone = is_sib_tombstone(s);
+    ret->epoch = s->epoch;
+
+    ret->key_sz = head->key_sz;
+    ret->key = head->key;
+
+    return 1;
+}
+
+// Extracts entry values from a regular entry or the latest snapshot
+// from an entry list.
+static inline int proxy_kd_entry(bitcask_keydir_entry* old,
+                                 bitcask_keydir_entry_proxy * proxy)
+{
+    return proxy_kd_entry_at_epoch(old, MAX_EPOCH, proxy);
+}
+
+// All info about a lookup with find_keydir_entry.
+typedef struct
+{
+    // Entry found in the pending hash. If set, entries_entry will be NULL.
+    bitcask_keydir_entry * pending_entry;
+    // Entry found in the entries hash. If set, pending_entry is NULL
+    bitcask_keydir_entry * entries_entry;
+    // Copy of the values of the found entry, if any, whether it's
+    // a regular entry or list.
+    bitcask_keydir_entry_proxy proxy;
+    // Hash (entries or pending) where the entry was found.
+    entries_hash_t * hash;
+    khiter_t itr;
+    // True if found, even if it is a tombstone
+    char found;
+} find_result;
+
+// Find an entry in the pending hash when the shard is frozen, or in the
+// entries hash otherwise.
+static void find_keydir_entry(bitcask_keydir_shard* shard, ErlNifBinary* key,
+                              uint64_t epoch, find_result * ret)
+{
+    // Search pending. If keydir handle used is in iterating mode
+    // we want to see a past snapshot instead.
+    if (shard->pending != NULL)
+    {
+        if (get_entries_hash(shard->pending, key,
+                             &ret->itr, &ret->pending_entry)
+            && (epoch >= ret->pending_entry->epoch))
+        {
+            DEBUG("Found in pending %llu > %llu", epoch, ret->pending_entry->epoch);
+            ret->hash = shard->pending;
+            ret->entries_entry = NULL;
+            ret->found = 1;
+            proxy_kd_entry(ret->pending_entry, &ret->proxy);
+            return;
+        }
+    }
+
+    // Definitely not in the pending entries
+    ret->pending_entry = NULL;
+
+    // If a snapshot for that time is found in regular entries
+    if (get_entries_hash(shard->entries, key, &ret->itr, &ret->entries_entry)
+        && proxy_kd_entry_at_epoch(ret->entries_entry, epoch, &ret->proxy))
+    {
+        ret->hash = shard->entries;
+        ret->found = 1;
+        return;
+    }
+
+    ret->entries_entry = NULL;
+    ret->hash = NULL;
+    ret->found = 0;
+    return;
+}
+
+static void update_kd_entry_list(bitcask_keydir_shard *shard,
+                                 bitcask_keydir_entry *old,
+                                 bitcask_keydir_entry_proxy *new,
+                                 int iterating_p) {
+    bitcask_keydir_entry_head* h = GET_ENTRY_LIST_POINTER(old);
+    bitcask_keydir_entry_sib* new_sib;
+
+    if (! iterating_p)
+    {
+        new_sib = h->sibs;
+
+        new_sib->file_id = new->file_id;
+        new_sib->total_sz = new->total_sz;
+        new_sib->offset = new->offset;
+        new_sib->epoch = new->epoch;
+        new_sib->tstamp = new->tstamp;
+        new_sib->expiry = new->expiry;
+    }
+    else // otherwise make a new sib
+    {
+        new_sib = entry_alloc(shard, sizeof(bitcask_keydir_entry_sib));
+
+        new_sib->file_id = new->file_id;
+        new_sib->total_sz = new->total_sz;
+        new_sib->offset = new->offset;
+        new_sib->epoch = new->epoch;
+        new_sib->tstamp = new->tstamp;
+        new_sib->expiry = new->expiry;
+        new_sib->next = h->sibs;
+
+        h->sibs = new_sib;
+    }
+}
+
+static bitcask_keydir_entry* new_kd_entry_list(bitcask_keydir_shard *shard,
+                                               bitcask_keydir_entry *old,
+                                               bitcask_keydir_entry_proxy *new)
+{
+    bitcask_keydir_entry_head* ret;
+    bitcask_keydir_entry_sib *old_sib, *new_sib;
+    bitcask_keydir_entry_proxy old_proxy;
+
+    proxy_kd_entry(old, &old_proxy);
+    ret = entry_alloc(shard, sizeof(bitcask_keydir_entry_head) + old_proxy.key_sz);
+    old_sib = entry_alloc(shard, sizeof(bitcask_keydir_entry_sib));
+    new_sib = entry_alloc(shard, sizeof(bitcask_keydir_entry_sib));
+
+    //fill in list head, use old since new could be a tombstone
+    memcpy(ret->key, old_proxy.key, old_proxy.key_sz);
+    ret->key_sz = old_proxy.key_sz;
+    ret->sibs = new_sib;
+
+    //make new sib
+    new_sib->file_id = new->file_id;
+    new_sib->total_sz = new->total_sz;
+    new_sib->offset = new->offset;
+    new_sib->epoch = new->epoch;
+    new_sib->tstamp = new->tstamp;
+    new_sib->expiry = new->expiry;
+    new_sib->next = old_sib;
+
+    //make new sib
+    old_sib->file_id = old_proxy.file_id;
+    old_sib->total_sz = old_proxy.total_sz;
+    old_sib->offset = old_proxy.offset;
+    old_sib->epoch = old_proxy.epoch;
+    old_sib->tstamp = old_proxy.tstamp;
+    old_sib->expiry = old_proxy.expiry;
+    old_sib->next = NULL;
+
+    return MAKE_ENTRY_LIST_POINTER(ret);
+}
+
+#ifdef BITCASK_DEBUG
+void print_entry_list(bitcask_keydir_entry *e)
+{
+    bitcask_keydir_entry_head* h = GET_ENTRY_LIST_POINTER(e);
+    char buf[4096];
+    assert(h->key_sz+1 < 4096);
+    memcpy(&buf, h->key, h->key_sz);
+    buf[h->key_sz] = '\0';
+
+    fprintf(stderr, "entry list %p key: %s keylen %d\r\n",
+            h, buf, h->key_sz);
+
+    int sib_count = 0;
+
+    bitcask_keydir_entry_sib
+        *s = h->sibs;
+    while (s != NULL) {
+        fprintf(stderr, "sib %d \r\n\t%u\t\t%u\r\n\t%llu\t\t%u\tepoch=%u\r\n\r\n",
+                sib_count, s->file_id, s->total_sz, (unsigned long long)s->offset, s->tstamp, s->epoch);
+        sib_count++;
+        s = s->next;
+        if( s == NULL )
+            break;
+    }
+}
+
+void print_entry(bitcask_keydir_entry *e)
+{
+    if (IS_ENTRY_LIST(e))
+    {
+        print_entry_list(e);
+        return;
+    }
+    if (IS_COMPACT_ENTRY(e))
+    {
+        bitcask_keydir_compact_entry* c = GET_COMPACT_ENTRY_POINTER(e);
+        fprintf(stderr, "compact entry %p key: %d keylen %d\r\n",
+                c, (int)c->key[3], c->key_sz);
+        fprintf(stderr, "\r\n\t%u\t\t%u\r\n\t%llu\t\t%u\tepoch=%llu\r\n\r\n",
+                c->file_id, c->total_sz, (unsigned long long)COMPACT_OFFSET(c),
+                c->tstamp, (unsigned long long)COMPACT_EPOCH(c));
+        return;
+    }
+
+    fprintf(stderr, "entry %p key: %d keylen %d\r\n",
+            e, (int)e->key[3], e->key_sz);
+
+    fprintf(stderr, "\r\n\t%u\t\t%u\r\n\t%llu\t\t%u\tepoch=%u\r\n\r\n",
+            e->file_id, e->total_sz, (unsigned long long)e->offset, e->tstamp, e->epoch);
+}
+
+void print_keydir(bitcask_keydir* keydir)
+{
+    khiter_t itr;
+    int i;
+    bitcask_keydir_entry* current_entry;
+    fprintf(stderr, "printing keydir: %s size %llu\r\n\r\n", keydir->name,
+            (unsigned long long)keydir->key_count);
+    // should likely dump some useful stuff here, but don't need it
+    // right now
+    for (i = 0; i < BITCASK_KEYDIR_SHARDS; i++)
+    {
+        bitcask_keydir_shard* shard = &keydir->shards[i];
+        fprintf(stderr, "shard %d entries:\r\n", i);
+        for (itr = kh_begin(shard->entries);
+             itr != kh_end(shard->entries);
+             ++itr)
+        {
+
+            if (kh_exist(shard->entries, itr))
+            {
+                current_entry = kh_key(shard->entries, itr);
+                print_entry(current_entry);
+            }
+        }
+        fprintf(stderr, "\r\nshard %d pending:\r\n", i);
+        if (shard->pending == NULL)
+        {
+            fprintf(stderr, "NULL\r\n");
+        }
+        else
+        {
+            for (itr = kh_begin(shard->pending);
+                 itr != kh_end(shard->pending);
+                 ++itr)
+            {
+
+                if (kh_exist(shard->pending, itr))
+                {
+                    current_entry = kh_key(shard->pending, itr);
+                    print_entry(current_entry);
+                }
+            }
+        }
+    }
+}
+#endif
+
+static void free_entry_list(bitcask_keydir_shard* shard, bitcask_keydir_entry* e)
+{
+    bitcask_keydir_entry_head* h = GET_ENTRY_LIST_POINTER(e);
+
+    bitcask_keydir_entry_sib
+        *temp = NULL,
+        *s = h->sibs;
+    while (s != NULL) {
+        temp = s;
+        s = s->next;
+
+        entry_free(shard, temp, sizeof(bitcask_keydir_entry_sib));
+    }
+
+    entry_free(shard, h, sizeof(bitcask_keydir_entry_head) + h->key_sz);
+}
+
+static void free_entry(bitcask_keydir_shard* shard, bitcask_keydir_entry *e)
+{
+    if (IS_ENTRY_LIST(e))
+    {
+        free_entry_list(shard, e);
+    }
+    else if (IS_COMPACT_ENTRY(e))
+    {
+        bitcask_keydir_compact_entry* c = GET_COMPACT_ENTRY_POINTER(e);
+        entry_free(shard, c, COMPACT_ENTRY_SIZE(c->key_sz));
+    }
+    else
+    {
+        entry_free(shard, e, sizeof(bitcask_keydir_entry) + e->key_sz);
+    }
+}
+
+static int compact_entry_fits(bitcask_keydir_entry_proxy* entry)
+{
+    return entry->offset < COMPACT_MAX && entry->epoch < COMPACT_MAX &&
+        entry->expiry == 0;
+}
+
+static void set_compact_entry(bitcask_keydir_compact_entry* c,
+                              bitcask_keydir_entry_proxy* entry)
+{
+    c->file_id = entry->file_id;
+    c->total_sz = entry->total_sz;
+    c->tstamp = entry->tstamp;
+    c->offset_lo = (uint32_t)entry->offset;
+    c->offset_hi = (uint16_t)(entry->offset >> 32);
+    c->epoch_lo = (uint32_t)entry->epoch;
+    c->epoch_hi = (uint16_t)(entry->epoch >> 32);
+}
+
+// Allocates a single value entry with the key and values of the proxy,
+// in the compact layout if requested and the values fit.
+static bitcask_keydir_entry* new_entry(bitcask_keydir_shard* shard,
+                                       bitcask_keydir_entry_proxy* entry,
+                                       int compact)
+{
+    if (compact && compact_entry_fits(entry))
+    {
+        bitcask_keydir_compact_entry* c =
+            entry_alloc(shard, COMPACT_ENTRY_SIZE(entry->key_sz));
+        set_compact_entry(c, entry);
+        c->key_sz = entry->key_sz;
+        memcpy(c->key, entry->key, entry->key_sz);
+        return MAKE_COMPACT_ENTRY_POINTER(c);
+    }
+
+    bitcask_keydir_entry* new_entry = entry_alloc(shard, sizeof(bitcask_keydir_entry) +
+                                                  entry->key_sz);
+    new_entry->file_id = entry->file_id;
+    new_entry->total_sz = entry->total_sz;
+    new_entry->offset = entry->offset;
+    new_entry->epoch = entry->epoch;
+    new_entry->tstamp = entry->tstamp;
+    new_entry->expiry = entry->expiry;
+    new_entry->key_sz = entry->key_sz;
+    memcpy(new_entry->key, entry->key, entry->key_sz);
+    return new_entry;
+}
+
+// Rebuilds a shard's Bloom filter after it outgrew its size or lost too
+// many keys, holding the shard lock. Lookups go on with the old filter
+// until the new one has every key of both hashes. The new filter is sized
+// for twice as many keys and never shrinks, so filters only stop being
+// used, and get retired, as they outgrow.
+static void bloom_rebuild(bitcask_keydir_shard* shard)
+{
+    entries_hash_t* hashes[] = { shard->entries, shard->pending };
+    uint64_t keys = kh_size(shard->entries) +
+        (shard->pending ? kh_size(shard->pending) : 0);
+    uint32_t nblocks = bitcask_bloom_blocks_for(keys * 2);
+    bitcask_bloom* bloom = shard->bloom_spare;
+    bitcask_bloom* old = shard->bloom;
+    khiter_t itr;
+    int i;
+
+    if (nblocks < old->nblocks)
+    {
+        nblocks = old->nblocks;
+    }
+    if (bloom != NULL && bloom->nblocks == nblocks)
+    {
+        // Lookups still using it from before the last rebuild see the
+        // generation change and take the lock instead
+        shard->bloom_spare = NULL;
+        __atomic_store_n(&shard->bloom_gen, shard->bloom_gen + 1,
+                         __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        bitcask_bloom_clear(bloom);
+    }
+    else
+    {
+        bloom = bitcask_bloom_new(nblocks);
+        if (bloom == NULL)
+        {
+            // The old filter still has every key, just more false positives
+            return;
+        }
+    }
+
+    for (i = 0; i < 2; i++)
+    {
+        entries_hash_t* hash = hashes[i];
+        for (itr = kh_begin(hash); hash != NULL && itr != kh_end(hash); itr++)
+        {
+            if (kh_exist(hash, itr))
+            {
+                char* key;
+                int key_sz;
+                entry_key(kh_key(hash, itr), &key, &key_sz);
+                bitcask_bloom_add(bloom, MURMUR_HASH(key, key_sz, 42));
+            }
+        }
+    }
+    __atomic_store_n(&shard->bloom, bloom, __ATOMIC_RELEASE);
+    shard->bloom_keys = keys;
+
+    if (old->nblocks != nblocks)
+    {
+        old->next = shard->bloom_retired;
+        shard->bloom_retired = old;
+    }
+    else
+    {
+        if (shard->bloom_spare != NULL)
+        {
+            shard->bloom_spare->next = shard->bloom_retired;
+            shard->bloom_retired = shard->bloom_spare;
+        }
+        shard->bloom_spare = old;
+    }
+}
+
+// Adds a key new to the shard to its Bloom filter, growing the filter once
+// it holds more keys than it was sized for.
+static void bloom_add_key(bitcask_keydir_shard* shard, const char* key,
+                          size_t key_sz)
+{
+    if (shard->bloom == NULL)
+    {
+        return;
+    }
+    bitcask_bloom_add(shard->bloom, MURMUR_HASH(key, key_sz, 42));
+    if (++shard->bloom_keys > bitcask_bloom_capacity(shard->bloom))
+    {
+        bloom_rebuild(shard);
+    }
+}
+
+// Removed keys stay in the filter until it is rebuilt, which is worth it
+// once at least half of the keys it holds are gone.
+static void perhaps_rebuild_bloom(bitcask_keydir_shard* shard)
+{
+    uint64_t keys;
+
+    if (shard->bloom == NULL || shard->bloom_keys < BLOOM_REBUILD_MIN_KEYS)
+    {
+        return;
+    }
+    keys = kh_size(shard->entries) +
+        (shard->pending ? kh_size(shard->pending) : 0);
+    if (keys * 2 <= shard->bloom_keys)
+    {
+        bloom_rebuild(shard);
+    }
+}
+
+// False if the key with hash h is definitely not in the shard, true if it
+// may be. Takes no lock: a rebuild only publishes a filter once it has
+// every key, and clearing the spare for reuse first bumps the generation,
+// so a lookup that raced with it answers maybe.
+static int bloom_may_contain(bitcask_keydir_shard* shard, uint64_t h)
+{
+    uint64_t gen = __atomic_load_n(&shard->bloom_gen, __ATOMIC_ACQUIRE);
+    bitcask_bloom* bloom = __atomic_load_n(&shard->bloom, __ATOMIC_ACQUIRE);
+    int may = bloom == NULL || bitcask_bloom_may_contain(bloom, h);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return may || __atomic_load_n(&shard->bloom_gen, __ATOMIC_RELAXED) != gen;
+}
+
+// Allocate, populate and add entry to the keydir hash based on the key and entry structure
+// never need to add an entry list, can update to it later.
+static bitcask_keydir_entry* add_entry(bitcask_keydir* keydir,
+                                       bitcask_keydir_shard* shard,
+                                       entries_hash_t* hash,
+                                       bitcask_keydir_entry_proxy * entry)
+{
+    // Pending entries are short lived and updated in place as tombstones,
+    // so they always use the regular layout.
+    bitcask_keydir_entry* added =
+        new_entry(shard, entry,
+                  keydir->compact_entries && hash == shard->entries);
+    kh_put_set(entries, hash, added);
+    bloom_add_key(shard, entry->key, entry->key_sz);
+
+    return added;
+}
+
+
+static void update_regular_entry(bitcask_keydir_entry* cur_entry,
+        bitcask_keydir_entry_proxy* upd_entry)
+{
+    cur_entry->file_id = upd_entry->file_id;
+    cur_entry->total_sz = upd_entry->total_sz;
+    cur_entry->epoch = upd_entry->epoch;
+    cur_entry->offset = upd_entry->offset;
+    cur_entry->tstamp = upd_entry->tstamp;
+    cur_entry->expiry = upd_entry->expiry;
+}
+
+// Updates an entry from the entries hash, not from pending.
+// Use update_regular_entry on pending hash entries instead.
+// While iterating, regular entries will become entry lists,
+// otherwise the result is a regular, single value entry.
+static void update_entry(bitcask_keydir* keydir,
+                         bitcask_keydir_shard* shard,
+                         bitcask_keydir_entry* cur_entry,
+                         bitcask_keydir_entry_proxy* upd_entry)
+{
+    int is_entry_list = IS_ENTRY_LIST(cur_entry);
+    int iterating = keydir->keyfolders > 0;
+
+    if (iterating)
+    {
+        if (is_entry_list)
+        {
+            // Add to list of values during iteration
+            update_kd_entry_list(shard, cur_entry, upd_entry, iterating);
+        }
+        else
+        {
+            // Convert regular entry to list during iteration
+            khiter_t itr = kh_get(entries, shard->entries, cur_entry);
+            kh_key(shard->entries, itr) =
+                new_kd_entry_list(shard, cur_entry, upd_entry);
+            free_entry(shard, cur_entry);
+        }
+    }
+    else // not iterating, so end up with regular entries only.
+    {
+        if (is_entry_list)
+        {
+            // Convert list to regular entry
+            khiter_t itr = kh_get(entries, shard->entries, cur_entry);
+            bitcask_keydir_entry_head* h = GET_ENTRY_LIST_POINTER(cur_entry);
+            bitcask_keydir_entry_proxy values = *upd_entry;
+
+            values.key = h->key;
+            values.key_sz = h->key_sz;
+            kh_key(shard->entries, itr) =
+                new_entry(shard, &values, keydir->compact_entries);
+
+            free_entry_list(shard, cur_entry);
+        }
+        else if (IS_COMPACT_ENTRY(cur_entry))
+        {
+            bitcask_keydir_compact_entry* c = GET_COMPACT_ENTRY_POINTER(cur_entry);
+            if (compact_entry_fits(upd_entry))
+            {
+                set_compact_entry(c, upd_entry);
+            }
+            else
+            {
+                // Outgrew the compact layout, switch to a regular entry
+                khiter_t itr = kh_get(entries, shard->entries, cur_entry);
+                bitcask_keydir_entry_proxy values = *upd_entry;
+
+                values.key = c->key;
+                values.key_sz = c->key_sz;
+                kh_key(shard->entries, itr) = new_entry(shard, &values, 0);
+                free_entry(shard, cur_entry);
+            }
+        }
+        else // regular entry, no iteration
+        {
+            update_regular_entry(cur_entry, upd_entry);
+        }
+    }
+}
+
+// Remove entry from the entries hash of a shard and free its memory.
+static void remove_entry(bitcask_keydir_shard* shard, khiter_t itr)
+{
+    bitcask_keydir_entry * entry = kh_key(shard->entries, itr);
+    kh_del(entries, shard->entries, itr);
+    free_entry(shard, entry);
+}
+
+// Collapses the entry lists left behind by finished iterations, and
+// rebuilds the Bloom filter once it is mostly removed keys. Shards are
+// swept independently, each under its own write lock. Only called from
+// the mutating operations so readers never pay for a sweep.
+static void perhaps_sweep_siblings(bitcask_keydir* keydir,
+                                   bitcask_keydir_shard* shard)
+{
+    int i;
+    bitcask_keydir_entry* current_entry;
+    bitcask_keydir_entry_proxy proxy;
+    struct timeval target, now;
+    suseconds_t max_usec = 600;
+
+    assert(keydir != NULL);
+
+    perhaps_rebuild_bloom(shard);
+
+    /* fprintf(stderr, "keydir iter_mutation %d sweep_last_generation %d iter_generation %d\r\n", keydir->iter_mutation,shard->sweep_last_generation,keydir->iter_generation); */
+    if (keydir->keyfolders > 0 ||
+        keydir->iter_mutation == 0 ||
+        shard->sweep_last_generation == keydir->iter_generation)
+    {
+        return;
+    }
+
+#ifdef  PULSE
+    i = 10;
+#else   /* PULSE */
+    i = 100*1000;
+#endif
+
+    gettimeofday(&target, NULL);
+    target.tv_usec += max_usec;
+    if (target.tv_usec > 1000000)
+    {
+        target.tv_sec++;
+        target.tv_usec = target.tv_usec % 1000000;
+    }
+    while (i--)
+    {
+        if ((i % 500) == 0)
+        {
+            gettimeofday(&now, NULL);
+            if (now.tv_sec > target.tv_usec &&
+                now.tv_usec > target.tv_usec)
+            {
+                break;
+            }
+        }
+        if (shard->sweep_itr >= kh_end(shard->entries))
+        {
+            shard->sweep_itr = kh_begin(shard->entries);
+            shard->sweep_last_generation = keydir->iter_generation;
+            return;
+        }
+        if (kh_exist(shard->entries, shard->sweep_itr))
+        {
+            current_entry = kh_key(shard->entries, shard->sweep_itr);
+            if (IS_ENTRY_LIST(current_entry))
+            {
+                if (proxy_kd_entry(current_entry, &proxy))
+                {
+                    if (proxy.is_tombstone)
+                    {
+                        remove_entry(shard, shard->sweep_itr);
+                    }
+                    else
+                    {
+                        update_entry(keydir, shard, current_entry, &proxy);
+                    }
+                }
+            }
+        }
+        shard->sweep_itr++;
+    }
+}
+
+// Adds a tombstone to an existing entries hash entry. Regular entries are
+// converted to lists first. Only to be called during iterations.
+// Entries are simply removed when there are no iterations.
+static void set_entry_tombstone(bitcask_keydir* keydir,
+                                bitcask_keydir_shard* shard, khiter_t itr,
+                                uint32_t remove_time,
+                                uint64_t remove_epoch)
+{
+    bitcask_keydir_entry_proxy tombstone;
+    tombstone.tstamp = remove_time;
+    tombstone.expiry = 0;
+    tombstone.epoch = remove_epoch;
+    tombstone.offset = MAX_OFFSET;
+    tombstone.total_sz = MAX_SIZE;
+    tombstone.file_id = MAX_FILE_ID;
+    tombstone.key_sz = 0;
+
+    bitcask_keydir_entry * entry= kh_key(shard->entries, itr);
+    if (!IS_ENTRY_LIST(entry))
+    {
+        // update into an entry list
+        bitcask_keydir_entry* new_entry_list;
+        new_entry_list = new_kd_entry_list(shard, entry, &tombstone);
+        kh_key(shard->entries, itr) = new_entry_list;
+        free_entry(shard, entry);
+    }
+    else
+    {
+        //need to update the entry list with a tombstone
+        update_kd_entry_list(shard, entry, &tombstone, keydir->keyfolders > 0);
+    }
+}
+
+// Inserts an expiry index node in a slot list at link.
+static void expiry_node_link(bitcask_expiry_node* node,
+                             bitcask_expiry_node** link)
+{
+    node->next = *link;
+    if (node->next != NULL)
+    {
+        node->next->link = &node->next;
+    }
+    node->link = link;
+    *link = node;
+}
+
+// Takes an expiry index node out of its slot list. A sweep due to resume
+// right after it goes on from where it was instead.
+static void expiry_node_unlink(bitcask_keydir_shard* shard,
+                               bitcask_expiry_node* node)
+{
+    if (shard->expiry_resume == &node->next)
+    {
+        shard->expiry_resume = node->link;
+    }
+    *node->link = node->next;
+    if (node->next != NULL)
+    {
+        node->next->link = node->link;
+    }
+}
+
+// Drops an expiry index node that is out of its slot list.
+static void expiry_node_free(bitcask_keydir_shard* shard,
+                             bitcask_expiry_node* node)
+{
+    kh_del(expiry_keys, shard->expiry_keys,
+           kh_get(expiry_keys, shard->expiry_keys, node));
+    entry_free(shard, node, sizeof(bitcask_expiry_node) + node->key_sz);
+    shard->expiry_nodes--;
+}
+
+// Indexes the key of an entry just put by its expiry time, if the keydir
+// keeps an expiry index, moving the node the key already has if its
+// expiry time changed, or dropping it if the entry has none. Keys already
+// due go in the slot the next sweep starts from, after where it stopped.
+static void expiry_index_add(bitcask_keydir* keydir,
+                             bitcask_keydir_shard* shard,
+                             bitcask_keydir_entry_proxy* entry)
+{
+    if (!keydir->expiry_index ||
+        (entry->expiry == 0 && shard->expiry_wheel == NULL))
+    {
+        return;
+    }
+    if (shard->expiry_wheel == NULL)
+    {
+        shard->expiry_wheel = calloc(EXPIRY_WHEEL_SLOTS,
+                                     sizeof(bitcask_expiry_node*));
+        shard->expiry_keys = kh_init(expiry_keys);
+        if (shard->expiry_wheel == NULL || shard->expiry_keys == NULL)
+        {
+            free(shard->expiry_wheel);
+            shard->expiry_wheel = NULL;
+            if (shard->expiry_keys != NULL)
+            {
+                kh_destroy(expiry_keys, shard->expiry_keys);
+                shard->expiry_keys = NULL;
+            }
+            return;
+        }
+    }
+
+    ErlNifBinary key;
+    key.data = (unsigned char*)entry->key;
+    key.size = entry->key_sz;
+    khiter_t itr = kh_get_custom(expiry_keys, shard->expiry_keys, &key,
+                                 nif_binary_hash, nif_binary_expiry_node_equal);
+    bitcask_expiry_node* node = NULL;
+    if (itr != kh_end(shard->expiry_keys))
+    {
+        node = kh_key(shard->expiry_keys, itr);
+        if (node->expiry == entry->expiry)
+        {
+            return;
+        }
+        expiry_node_unlink(shard, node);
+        if (entry->expiry == 0)
+        {
+            expiry_node_free(shard, node);
+            return;
+        }
+    }
+    else if (entry->expiry == 0)
+    {
+        return;
+    }
+    else
+    {
+        node = entry_alloc(shard, sizeof(bitcask_expiry_node) + entry->key_sz);
+        node->key_sz = entry->key_sz;
+        memcpy(node->key, entry->key, entry->key_sz);
+        kh_put_set(expiry_keys, shard->expiry_keys, node);
+        shard->expiry_nodes++;
+    }
+    node->expiry = entry->expiry;
+
+    uint32_t at = entry->expiry > shard->expiry_swept ?
+        entry->expiry : shard->expiry_swept;
+    bitcask_expiry_node** slot =
+        &shard->expiry_wheel[at & (EXPIRY_WHEEL_SLOTS - 1)];
+    if (shard->expiry_resume != NULL &&
+        slot == &shard->expiry_wheel[shard->expiry_swept & (EXPIRY_WHEEL_SLOTS - 1)])
+    {
+        slot = shard->expiry_resume;
+    }
+    expiry_node_link(node, slot);
+}
+
+// Adds or updates an entry in the pending hash if the shard is frozen
+// or in the entries hash otherwise.
+static void put_entry(bitcask_keydir * keydir, bitcask_keydir_shard * shard,
+                      find_result * r, bitcask_keydir_entry_proxy * entry)
+{
+    // found in pending (shard is frozen), update that one
+    if (r->pending_entry)
+    {
+        update_regular_entry(r->pending_entry, entry);
+    }
+    // iterating (frozen) and not found in pending, add to pending
+    else if (shard->pending)
+    {
+        add_entry(keydir, shard, shard->pending, entry);
+        keydir->pending_updated++;
+    }
+    // found in entries, update that one
+    else if (r->entries_entry)
+    {
+        update_entry(keydir, shard, r->entries_entry, entry);
+    }
+    // Not found and not frozen, add to entries
+    else
+    {
+        add_entry(keydir, shard, shard->entries, entry);
+    }
+
+    if (entry->file_id > keydir->biggest_file_id)
+    {
+        keydir->biggest_file_id = entry->file_id;
+    }
+
+    expiry_index_add(keydir, shard, entry);
+}
+
+// Shared by keydir_put_int and the native hint file loader.
+static ERL_NIF_TERM do_keydir_put(ErlNifEnv* env, bitcask_keydir* keydir,
+                                  ErlNifBinary* key,
+                                  bitcask_keydir_entry_proxy* entry,
+                                  uint32_t nowsec, uint32_t newest_put,
+                                  uint32_t old_file_id, uint64_t old_offset)
+{
+    bitcask_keydir_shard* shard = keydir_shard(keydir, key->data, key->size);
+    entry->key = (char*)key->data;
+    entry->key_sz = key->size;
+
+    LOCK_SHARD(shard);
+    DEBUG2("LINE %d put\r\n", __LINE__);
+
+    DEBUG_BIN(dbgKey, key->data, key->size);
+    DEBUG("+++ Put key = %s file_id=%d offset=%d total_sz=%d tstamp=%u old_file_id=%d\r\n",
+            dbgKey,
+          (int) entry->file_id, (int) entry->offset,
+          (int)entry->total_sz, (unsigned) entry->tstamp, (int)old_file_id);
+    DEBUG_KEYDIR(keydir);
+
+    perhaps_sweep_siblings(keydir, shard);
+
+    find_result f;
+    find_keydir_entry(shard, key, MAX_EPOCH, &f);
+
+    // If conditional put and not found, bail early
+    if ((!f.found || f.proxy.is_tombstone)
+            && old_file_id != 0)
+    {
+        DEBUG2("LINE %d put -> already_exists\r\n", __LINE__);
+        UNLOCK_SHARD(shard);
+        return ATOM_ALREADY_EXISTS;
+    }
+
+    LOCK(keydir);
+
+    keydir->epoch += 1; //don't worry about backing this out if we bail
+    entry->epoch = keydir->epoch;
+
+    // If put would resize and iterating, start pending hash
+    if (kh_put_will_resize(entries, shard->entries) &&
+        keydir->keyfolders != 0 &&
+        (shard->pending == NULL))
+    {
+        shard->pending = kh_init(entries);
+        if (keydir->pending_shards++ == 0)
+        {
+            keydir->pending_start_epoch = keydir->epoch;
+            keydir->pending_start_time = nowsec;
+        }
+    }
+
+    if (!f.found || f.proxy.is_tombstone)
+    {
+        if ((newest_put &&
+             (entry->file_id < keydir->biggest_file_id)) ||
+            old_file_id != 0) {
+            /*
+             * Really, it doesn't exist.  But the atom 'already_exists'
+             * is also a signal that a merge has incremented the
+             * keydir->biggest_file_id and that we need to retry this
+             * operation after Erlang-land has re-written the key & val
+             * to a new location in the same-or-bigger file id.
+             */
+            DEBUG2("LINE %d put -> already_exists\r\n", __LINE__);
+            UNLOCK(keydir);
+            UNLOCK_SHARD(shard);
+            return ATOM_ALREADY_EXISTS;
+        }
+
+        keydir->key_count++;
+        keydir->key_bytes += key->size;
+        if (keydir->keyfolders > 0)
+        {
+            keydir->iter_mutation = 1;
+        }
+
+        // Increment live and total stats.
+        update_fstats(env, keydir, entry->file_id, entry->tstamp, MAX_EPOCH,
+                      1, 1, entry->total_sz, entry->total_sz, 1);
+
+        put_entry(keydir, shard, &f, entry);
+
+        DEBUG("+++ Put new\r\n");
+        DEBUG_KEYDIR(keydir);
+
+        DEBUG2("LINE %d put -> ok (!found || !tombstone)\r\n", __LINE__);
+        UNLOCK(keydir);
+        UNLOCK_SHARD(shard);
+        return ATOM_OK;
+    }
+
+    // Putting only if replacing this file/offset entry, fail otherwise.
+    // This is an important part of our optimistic concurrency mechanisms
+    // to resolve races between writers (main and merge currently).
+    if (old_file_id != 0 &&
+            // This line is tricky: We are trying to detect a merge putting
+            // a value that replaces another value that same merge just put
+            // (so same output file).  Because when it does that, it has
+            // replaced a previous value with smaller file/offset.  It then
+            // found yet another value that is also current and should
+            // be written to the merge file, but since it has smaller file/ofs
+            // than the newly merged value (in a new merge file), it is
+            // ignored. This happens with values from the same second,
+            // since the out of date logic in merge uses timestamps.
+        (newest_put || entry->file_id != f.proxy.file_id) &&
+        !(old_file_id == f.proxy.file_id &&
+          old_offset == f.proxy.offset))
+    {
+        DEBUG("++ Conditional not match\r\n");
+        DEBUG2("LINE %d put -> already_exists/cond bad match\r\n", __LINE__);
+        UNLOCK(keydir);
+        UNLOCK_SHARD(shard);
+        return ATOM_ALREADY_EXISTS;
+    }
+
+    // Avoid updating with stale data. Allow if:
+    // - If real put to current write file, not a stale one
+    // - If internal put (from merge, etc) with newer timestamp
+    // - If internal put with a higher file id or higher offset
+    if ((newest_put &&
+         (entry->file_id >= keydir->biggest_file_id)) ||
+        (! newest_put &&
+         (f.proxy.tstamp < entry->tstamp)) ||
+        (! newest_put &&
+         ((f.proxy.file_id < entry->file_id) ||
+          (((f.proxy.file_id == entry->file_id) &&
+            (f.proxy.offset < entry->offset))))))
+    {
+        if (keydir->keyfolders > 0)
+        {
+            keydir->iter_mutation = 1;
+        }
+        // Remove the stats for the old entry and add the new
+        if (f.proxy.file_id != entry->file_id) // different files
+        {
+            update_fstats(env, keydir, f.proxy.file_id, 0, MAX_EPOCH,
+                          -1, 0,
+                          -f.proxy.total_sz, 0, 0);
+            update_fstats(env, keydir, entry->file_id, entry->tstamp,
+                          MAX_EPOCH, 1, 1,
+                          entry->total_sz, entry->total_sz, 1);
+        }
+        else // file_id is same, change live/total in one entry
+        {
+            update_fstats(env, keydir, entry->file_id, entry->tstamp,
+                          MAX_EPOCH, 0, 1,
+                          entry->total_sz - f.proxy.total_sz,
+                          entry->total_sz, 1);
+        }
+
+        put_entry(keydir, shard, &f, entry);
+        DEBUG2("LINE %d put -> ok\r\n", __LINE__);
+        UNLOCK(keydir);
+        UNLOCK_SHARD(shard);
+        DEBUG("Finished put\r\n");
+        DEBUG_KEYDIR(keydir);
+        return ATOM_OK;
+    }
+    else
+    {
+        // If not live yet, live stats are not updated, but total stats are
+        if (!keydir->is_ready)
+        {
+            update_fstats(env, keydir, entry->file_id, entry->tstamp,
+                          MAX_EPOCH, 0, 1, 0, entry->total_sz, 1);
+        }
+        DEBUG2("LINE %d put -> already_exists end\r\n", __LINE__);
+        UNLOCK(keydir);
+        UNLOCK_SHARD(shard);
+        DEBUG("No update\r\n");
+        return ATOM_ALREADY_EXISTS;
+    }
+}
+
+ERL_NIF_TERM bitcask_nifs_keydir_put_int(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    bitcask_keydir_handle* handle;
+    bitcask_keydir_entry_proxy entry;
+    ErlNifBinary key;
+    uint32_t nowsec;
+    uint32_t newest_put;
+    uint32_t old_file_id;
+    uint64_t old_offset;
+
+    if (enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle) &&
+        enif_inspect_binary(env, argv[1], &key) &&
+        enif_get_uint(env, argv[2], &(entry.file_id)) &&
+        enif_get_uint(env, argv[3], &(entry.total_sz)) &&
+        enif_get_uint64_bin(env, argv[4], &(entry.offset)) &&
+        enif_get_uint(env, argv[5], &(entry.tstamp)) &&
+        enif_get_uint(env, argv[6], &(nowsec)) &&
+        enif_get_uint(env, argv[7], &(newest_put)) &&
+        enif_get_uint(env, argv[8], &(old_file_id)) &&
+        enif_get_uint64_bin(env, argv[9], &(old_offset)) &&
+        enif_get_uint(env, argv[10], &(entry.expiry)))
+    {
+        return do_keydir_put(env, handle->keydir, &key, &entry, nowsec,
+                             newest_put, old_file_id, old_offset);
+    }
+    else
+    {
+        return enif_make_badarg(env);
+    }
+}
+
+/* int erts_printf(const char *, ...); */
+
+// True for entries past their own expiry time at now. A now of 0 skips the
+// check, for callers that need to see the entry regardless.
+static inline int is_expired(bitcask_keydir_entry_proxy* proxy, uint32_t now)
+{
+    return now != 0 && proxy->expiry != 0 && proxy->expiry <= now;
+}
+
+static ERL_NIF_TERM make_entry_term(ErlNifEnv* env, ERL_NIF_TERM key,
+                                    bitcask_keydir_entry_proxy* proxy)
+{
+    return enif_make_tuple6(env,
+                            ATOM_BITCASK_ENTRY,
+                            key,
+                            enif_make_uint(env, proxy->file_id),
+                            enif_make_uint(env, proxy->total_sz),
+                            enif_make_uint64_bin(env, proxy->offset),
+                            enif_make_uint(env, proxy->tstamp));
+}
+
+ERL_NIF_TERM bitcask_nifs_keydir_get_int(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    bitcask_keydir_handle* handle;
+    ErlNifBinary key;
+    uint64 epoch; //intentionally odd type to get around warnings
+    uint32_t now;
+
+    if (enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle) &&
+        enif_inspect_binary(env, argv[1], &key) &&
+        enif_get_uint64(env, argv[2], &epoch) &&
+        enif_get_uint(env, argv[3], &now))
+    {
+        bitcask_keydir* keydir = handle->keydir;
+        uint64_t h = MURMUR_HASH(key.data, key.size, 42);
+        bitcask_keydir_shard* shard = keydir_shard_of_hash(keydir, h);
+        if (!bloom_may_contain(shard, h))
+        {
+            return ATOM_NOT_FOUND;
+        }
+        RLOCK_SHARD(shard);
+
+        DEBUG_BIN(dbgKey, key.data, key.size);
+        DEBUG("+++ Get %s time = %lu\r\n", dbgKey, epoch);
+
+        find_result f;
+        find_keydir_entry(shard, &key, epoch, &f);
+
+        if (f.found && !f.proxy.is_tombstone && !is_expired(&f.proxy, now))
+        {
+            ERL_NIF_TERM result = make_entry_term(env, argv[1], &f.proxy);
+            DEBUG(" ... returned value file id=%u size=%u ofs=%u tstamp=%u tomb=%u\r\n",
+                  f.proxy.file_id, f.proxy.total_sz, f.proxy.offset, f.proxy.tstamp,
+                  (unsigned)f.proxy.is_tombstone);
+            DEBUG_ENTRY(f.entries_entry ? f.entries_entry : f.pending_entry);
+            RUNLOCK_SHARD(shard);
+            return result;
+        }
+        else
+        {
+            DEBUG(" ... not_found\r\n");
+            RUNLOCK_SHARD(shard);
+            return ATOM_NOT_FOUND;
+        }
+    }
+    else
+    {
+        return enif_make_badarg(env);
+    }
+}
+
+// Looks up a list of keys, returning a list of entries (or not_found) in
+// the same order. Keys are visited shard by shard so each shard's read
+// lock is taken at most once per call, however many keys it owns.
+ERL_NIF_TERM bitcask_nifs_keydir_get_many_int(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    bitcask_keydir_handle* handle;
+    unsigned count;
+    uint64 epoch; //intentionally odd type to get around warnings
+    uint32_t now;
+
+    if (!(enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle) &&
+          enif_get_list_length(env, argv[1], &count) &&
+          enif_get_uint64(env, argv[2], &epoch) &&
+          enif_get_uint(env, argv[3], &now)))
+    {
+        return enif_make_badarg(env);
+    }
+
+    if (count == 0)
+    {
+        return enif_make_list(env, 0);
+    }
+
+    bitcask_keydir* keydir = handle->keydir;
+    ERL_NIF_TERM* key_terms = malloc(count * sizeof(ERL_NIF_TERM));
+    ErlNifBinary* keys = malloc(count * sizeof(ErlNifBinary));
+    bitcask_keydir_shard** shards = malloc(count * sizeof(bitcask_keydir_shard*));
+    ERL_NIF_TERM* results = malloc(count * sizeof(ERL_NIF_TERM));
+    int used_shards[BITCASK_KEYDIR_SHARDS] = {0};
+
+    ERL_NIF_TERM head, tail, list = argv[1];
+    unsigned i = 0;
+    while (enif_get_list_cell(env, list, &head, &tail))
+    {
+        if (!enif_inspect_binary(env, head, &keys[i]))
+        {
+            free(key_terms);
+            free(keys);
+            free(shards);
+            free(results);
+            return enif_make_badarg(env);
+        }
+        key_terms[i] = head;
+        uint64_t h = MURMUR_HASH(keys[i].data, keys[i].size, 42);
+        shards[i] = keydir_shard_of_hash(keydir, h);
+        if (bloom_may_contain(shards[i], h))
+        {
+            used_shards[shards[i] - keydir->shards] = 1;
+        }
+        else
+        {
+            // Filtered out, no shard lock needed
+            shards[i] = NULL;
+            results[i] = ATOM_NOT_FOUND;
+        }
+        list = tail;
+        i++;
+    }
+
+    int s;
+    for (s = 0; s < BITCASK_KEYDIR_SHARDS; s++)
+    {
+        if (!used_shards[s])
+        {
+            continue;
+        }
+
+        bitcask_keydir_shard* shard = &keydir->shards[s];
+        RLOCK_SHARD(shard);
+        for (i = 0; i < count; i++)
+        {
+            if (shards[i] != shard)
+            {
+                continue;
+            }
+
+            find_result f;
+            find_keydir_entry(shard, &keys[i], epoch, &f);
+            if (f.found && !f.proxy.is_tombstone && !is_expired(&f.proxy, now))
+            {
+                results[i] = make_entry_term(env, key_terms[i], &f.proxy);
+            }
+            else
+            {
+                results[i] = ATOM_NOT_FOUND;
+            }
+        }
+        RUNLOCK_SHARD(shard);
+    }
+
+    ERL_NIF_TERM result = enif_make_list_from_array(env, results, count);
+    free(key_terms);
+    free(keys);
+    free(shards);
+    free(results);
+    return result;
+}
+
+ERL_NIF_TERM bitcask_nifs_keydir_get_epoch(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    bitcask_keydir_handle* handle;
+
+    if (enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle))
+    {
+        LOCK(handle->keydir);
+        uint64 epoch = handle->keydir->epoch;
+        UNLOCK(handle->keydir);
+        return enif_make_uint64(env, epoch);
+    }
+    else
+    {
+        return enif_make_badarg(env);
+    }
+}
+
+// The part of do_keydir_remove done under the lock of the key's shard,
+// which the caller holds.
+static ERL_NIF_TERM remove_locked(ErlNifEnv* env, bitcask_keydir* keydir,
+                                  bitcask_keydir_shard* shard,
+                                  ErlNifBinary* key, int is_conditional,
+                                  uint32_t tstamp, uint32_t file_id,
+                                  uint64_t offset, uint32_t remove_time)
+{
+    LOCK(keydir);
+
+    keydir->epoch += 1; // never back out, even if we don't mutate
+
+    DEBUG("+++ Remove %s\r\n", is_conditional ? "conditional" : "");
+    DEBUG_KEYDIR(keydir);
+
+    find_result fr;
+    find_keydir_entry(shard, key, keydir->epoch, &fr);
+
+    if (fr.found && !fr.proxy.is_tombstone)
+    {
+        // If a conditional remove, bail if not a match.
+        if (is_conditional &&
+            (fr.proxy.tstamp != tstamp ||
+             fr.proxy.file_id != file_id ||
+             fr.proxy.offset != offset))
+        {
+            UNLOCK(keydir);
+            DEBUG("+++Conditional no match\r\n");
+            return ATOM_ALREADY_EXISTS;
+        }
+
+        // Remove the key from the keydir stats
+        keydir->key_count--;
+        keydir->key_bytes -= fr.proxy.key_sz;
+        if (keydir->keyfolders > 0)
+        {
+            keydir->iter_mutation = 1;
+        }
+
+        // Remove from file stats
+        update_fstats(env, keydir, fr.proxy.file_id, fr.proxy.tstamp,
+                      MAX_EPOCH, -1, 0, -fr.proxy.total_sz, 0, 0);
+
+        // If found an entry in the pending hash, convert it to a tombstone
+        if (fr.pending_entry)
+        {
+            DEBUG2("LINE %d pending put\r\n", __LINE__);
+            set_pending_tombstone(fr.pending_entry);
+            fr.pending_entry->tstamp = remove_time;
+            fr.pending_entry->expiry = 0;
+            fr.pending_entry->epoch = keydir->epoch;
+        }
+        // If frozen, add tombstone to pending hash (iteration must have
+        // started between put/remove call in bitcask:delete.
+        else if (shard->pending)
+        {
+            DEBUG2("LINE %d pending put\r\n", __LINE__);
+            bitcask_keydir_entry* pending_entry =
+                add_entry(keydir, shard, shard->pending, &fr.proxy);
+            set_pending_tombstone(pending_entry);
+            pending_entry->tstamp = remove_time;
+            pending_entry->expiry = 0;
+            pending_entry->epoch = keydir->epoch;
+        }
+        // If not iterating, just remove.
+        else if(keydir->keyfolders == 0)
+        {
+            remove_entry(shard, fr.itr);
+        }
+        // else found in entries while iterating
+        else
+        {
+            set_entry_tombstone(keydir, shard, fr.itr, remove_time,
+                                keydir->epoch);
+        }
+        DEBUG("Removed\r\n");
+        DEBUG_KEYDIR(keydir);
+
+        UNLOCK(keydir);
+        return ATOM_OK;;
+    }
+    else // not found
+    {
+        DEBUG("Not found - not removed\r\n");
+        UNLOCK(keydir);
+        return ATOM_OK;;
+    }
+}
+
+// Unconditional when is_conditional is 0, in which case tstamp, file_id
+// and offset are ignored.
+static ERL_NIF_TERM do_keydir_remove(ErlNifEnv* env, bitcask_keydir* keydir,
+                                     ErlNifBinary* key, int is_conditional,
+                                     uint32_t tstamp, uint32_t file_id,
+                                     uint64_t offset, uint32_t remove_time)
+{
+    bitcask_keydir_shard* shard = keydir_shard(keydir, key->data, key->size);
+    LOCK_SHARD(shard);
+
+    perhaps_sweep_siblings(keydir, shard);
+
+    ERL_NIF_TERM result = remove_locked(env, keydir, shard, key,
+                                        is_conditional, tstamp, file_id,
+                                        offset, remove_time);
+    UNLOCK_SHARD(shard);
+    return result;
+}
+
+ERL_NIF_TERM bitcask_nifs_keydir_remove(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    bitcask_keydir_handle* handle;
+    ErlNifBinary key;
+    uint32_t tstamp;
+    uint32_t file_id;
+    uint64_t offset;
+    uint32_t remove_time;
+    // If this call has 6 arguments, this is a conditional removal. We
+    // only want to actually remove the entry if the tstamp, fileid and
+    // offset matches the one provided. A sort of poor-man's CAS.
+    int is_conditional = argc == 6;
+    int common_args_ok =
+        enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle) &&
+        enif_inspect_binary(env, argv[1], &key);
+    int other_args_ok =
+        is_conditional ?
+        (enif_get_uint(env, argv[2], (unsigned int*)&tstamp) &&
+         enif_get_uint(env, argv[3], (unsigned int*)&file_id) &&
+         enif_get_uint64_bin(env, argv[4], (uint64_t*)&offset) &&
+         enif_get_uint(env, argv[5], &remove_time))
+        :
+        ( enif_get_uint(env, argv[2], &remove_time));
+
+    if (common_args_ok && other_args_ok)
+    {
+        return do_keydir_remove(env, handle->keydir, &key, is_conditional,
+                                tstamp, file_id, offset, remove_time);
+    } // if args OK
+
+    return enif_make_badarg(env);
+}
+
+// A keydir entry pointing into the file keydir_remove_file drops
+typedef struct
+{
+    uint32_t tstamp;
+    uint64_t offset;
+    size_t   key_at;    // in the key buffer
+    uint16_t key_sz;
+} file_entry;
+
+// Adds the live entries of hash pointing into file_id to entries, and
+// their keys to keys. Returns 0 when out of memory.
+static int collect_file_entries(entries_hash_t* hash, uint32_t file_id,
+                                file_entry** entries, size_t* count,
+                                size_t* cap, char** keys, size_t* keys_sz,
+                                size_t* keys_cap)
+{
+    khiter_t itr;
+    for (itr = kh_begin(hash); itr != kh_end(hash); ++itr)
+    {
+        bitcask_keydir_entry_proxy proxy;
+        if (!kh_exist(hash, itr) ||
+            !proxy_kd_entry(kh_key(hash, itr), &proxy) ||
+            proxy.is_tombstone || proxy.file_id != file_id)
+        {
+            continue;
+        }
+        if (*count == *cap)
+        {
+            size_t cap2 = *cap ? *cap * 2 : 1024;
+            file_entry* entries2 = realloc(*entries, cap2 * sizeof(file_entry));
+            if (entries2 == NULL)
+            {
+                return 0;
+            }
+            *entries = entries2;
+            *cap = cap2;
+        }
+        if (*keys_sz + proxy.key_sz > *keys_cap)
+        {
+            size_t keys_cap2 = *keys_cap ? *keys_cap * 2 : 65536;
+            while (keys_cap2 < *keys_sz + proxy.key_sz)
+            {
+                keys_cap2 *= 2;
+            }
+            char* keys2 = realloc(*keys, keys_cap2);
+            if (keys2 == NULL)
+            {
+                return 0;
+            }
+            *keys = keys2;
+            *keys_cap = keys_cap2;
+        }
+        file_entry* e = &(*entries)[(*count)++];
+        e->tstamp = proxy.tstamp;
+        e->offset = proxy.offset;
+        e->key_at = *keys_sz;
+        e->key_sz = proxy.key_sz;
+        memcpy(*keys + *keys_sz, proxy.key, proxy.key_sz);
+        *keys_sz += proxy.key_sz;
+    }
+    return 1;
+}
+
+// Removes every live entry pointing into a file from the keydir, the
+// same as a conditional keydir_remove for each of them, without reading
+// the file. The entries are picked one shard at a time and then removed
+// through do_keydir_remove, so one a put moved on meanwhile stays.
+ERL_NIF_TERM bitcask_nifs_keydir_remove_file(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    bitcask_keydir_handle* handle;
+    uint32_t file_id;
+    uint32_t remove_time;
+
+    if (!(enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle) &&
+          enif_get_uint(env, argv[1], &file_id) &&
+          enif_get_uint(env, argv[2], &remove_time)))
+    {
+        return enif_make_badarg(env);
+    }
+
+    bitcask_keydir* keydir = handle->keydir;
+    file_entry* entries = NULL;
+    char* keys = NULL;
+    size_t cap = 0, keys_cap = 0;
+    int i;
+    for (i = 0; i < BITCASK_KEYDIR_SHARDS; i++)
+    {
+        bitcask_keydir_shard* shard = &keydir->shards[i];
+        size_t count = 0, keys_sz = 0, j;
+
+        RLOCK_SHARD(shard);
+        int ok = collect_file_entries(shard->entries, file_id, &entries,
+                                      &count, &cap, &keys, &keys_sz, &keys_cap) &&
+            (shard->pending == NULL ||
+             collect_file_entries(shard->pending, file_id, &entries, &count,
+                                  &cap, &keys, &keys_sz, &keys_cap));
+        RUNLOCK_SHARD(shard);
+        if (!ok)
+        {
+            free(entries);
+            free(keys);
+            return enif_make_tuple2(env, ATOM_ERROR, ATOM_ALLOCATION_ERROR);
+        }
+
+        for (j = 0; j < count; j++)
+        {
+            ErlNifBinary key;
+            key.data = (unsigned char*)keys + entries[j].key_at;
+            key.size = entries[j].key_sz;
+            // The entry of a key in both hashes was picked twice, the
+            // second remove finds it gone
+            do_keydir_remove(env, keydir, &key, 1, entries[j].tstamp, file_id,
+                             entries[j].offset, remove_time);
+        }
+    }
+
+    free(entries);
+    free(keys);
+    return ATOM_OK;
+}
+
+// Walks the expiry_swept slot of the expiry wheel of a shard, whose lock
+// the caller holds, removing the keys past their expiry time at now that
+// still have it. Nodes due in a later turn of the wheel stay. Stops once
+// visited, to which the nodes walked are added, gets to budget, leaving
+// expiry_resume where the next call goes on from. Returns the number of
+// keys removed and sets *done if the walk got to the end of the slot.
+static uint64_t sweep_expiry_slot(ErlNifEnv* env, bitcask_keydir* keydir,
+                                  bitcask_keydir_shard* shard, uint32_t now,
+                                  uint64_t* visited, uint64_t budget,
+                                  int* done)
+{
+    bitcask_expiry_node** link = shard->expiry_resume != NULL ?
+        shard->expiry_resume :
+        &shard->expiry_wheel[shard->expiry_swept & (EXPIRY_WHEEL_SLOTS - 1)];
+    uint64_t removed = 0;
+    while (*link != NULL && *visited < budget)
+    {
+        bitcask_expiry_node* node = *link;
+        (*visited)++;
+        if (node->expiry > now)
+        {
+            link = &node->next;
+            continue;
+        }
+        expiry_node_unlink(shard, node);
+
+        ErlNifBinary key;
+        key.data = (unsigned char*)node->key;
+        key.size = node->key_sz;
+        find_result f;
+        find_keydir_entry(shard, &key, MAX_EPOCH, &f);
+        // Entries put since with another expiry time, or none, stay
+        if (f.found && !f.proxy.is_tombstone &&
+            f.proxy.expiry == node->expiry &&
+            remove_locked(env, keydir, shard, &key, 1, f.proxy.tstamp,
+                          f.proxy.file_id, f.proxy.offset, now) == ATOM_OK)
+        {
+            removed++;
+        }
+        expiry_node_free(shard, node);
+    }
+    *done = *link == NULL;
+    shard->expiry_resume = *done ? NULL : link;
+    return removed;
+}
+
+// Removes the keys past their expiry time at now from a keydir with an
+// expiry index, as keydir_remove would, so the key count and file stats
+// follow. Each shard walks its wheel from where the last sweep stopped,
+// down to the node within a slot, and gives up after max_nodes /
+// BITCASK_KEYDIR_SHARDS index nodes, so a call holds each shard lock for
+// a bounded time. Returns {more, Removed} if some shard did not get to now,
+// {done, Removed} otherwise.
+ERL_NIF_TERM bitcask_nifs_keydir_sweep_expired(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    bitcask_keydir_handle* handle;
+    uint32_t now;
+    uint32_t max_nodes;
+
+    if (!(enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle) &&
+          handle->keydir != NULL &&
+          enif_get_uint(env, argv[1], &now) &&
+          enif_get_uint(env, argv[2], &max_nodes)))
+    {
+        return enif_make_badarg(env);
+    }
+
+    bitcask_keydir* keydir = handle->keydir;
+    uint64_t budget = max_nodes / BITCASK_KEYDIR_SHARDS;
+    uint64_t removed = 0;
+    int more = 0;
+    int i;
+
+    if (budget == 0)
+    {
+        budget = 1;
+    }
+    for (i = 0; keydir->expiry_index && i < BITCASK_KEYDIR_SHARDS; i++)
+    {
+        bitcask_keydir_shard* shard = &keydir->shards[i];
+        LOCK_SHARD(shard);
+        if (shard->expiry_wheel == NULL)
+        {
+            UNLOCK_SHARD(shard);
+            continue;
+        }
+
+        perhaps_sweep_siblings(keydir, shard);
+
+        // Slots to walk, one full turn of the wheel if it was never swept
+        // or the clock moved by more than that either way
+        uint32_t t = shard->expiry_swept;
+        uint32_t n;
+        if (t == 0 || t > now + 1 || now + 1 - t > EXPIRY_WHEEL_SLOTS)
+        {
+            t = now + 1 - EXPIRY_WHEEL_SLOTS;
+            n = EXPIRY_WHEEL_SLOTS;
+            shard->expiry_resume = NULL;
+        }
+        else
+        {
+            n = now + 1 - t;
+        }
+
+        uint64_t visited = 0;
+        int done = 1;
+        for (; n > 0 && visited < budget; n--, t++)
+        {
+            shard->expiry_swept = t;
+            removed += sweep_expiry_slot(env, keydir, shard, now,
+                                         &visited, budget, &done);
+            if (!done)
+            {
+                break;
+            }
+        }
+        if (done)
+        {
+            shard->expiry_swept = t;
+        }
+        more |= n > 0;
+        UNLOCK_SHARD(shard);
+    }
+
+    return enif_make_tuple2(env, more ? ATOM_MORE : ATOM_DONE,
+                            enif_make_uint64(env, removed));
+}
+
+bitcask_keydir_entry * clone_entry(bitcask_keydir_shard * shard,
+                                   bitcask_keydir_entry * curr)
+{
+    if (IS_ENTRY_LIST(curr))
+    {
+        bitcask_keydir_entry_head * curr_head = GET_ENTRY_LIST_POINTER(curr);
+        size_t head_sz = sizeof(bitcask_keydir_entry_head) + curr_head->key_sz;
+        bitcask_keydir_entry_head * new_head = entry_alloc(shard, head_sz);
+        memcpy(new_head, curr_head, head_sz);
+        bitcask_keydir_entry_sib ** sib_ptr = &new_head->sibs;
+        bitcask_keydir_entry_sib * next_sib = curr_head->sibs;
+        while (next_sib)
+        {
+            bitcask_keydir_entry_sib * sib =
+                entry_alloc(shard, sizeof(bitcask_keydir_entry_sib));
+            memcpy(sib, next_sib, sizeof(bitcask_keydir_entry_sib));
+            *sib_ptr = sib;
+            sib_ptr = &sib->next;
+            next_sib = next_sib->next;
+        }
+        *sib_ptr = NULL;
+        return MAKE_ENTRY_LIST_POINTER(new_head);
+    }
+    else if (IS_COMPACT_ENTRY(curr))
+    {
+        bitcask_keydir_compact_entry * curr_c = GET_COMPACT_ENTRY_POINTER(curr);
+        size_t new_sz = COMPACT_ENTRY_SIZE(curr_c->key_sz);
+        bitcask_keydir_compact_entry * new = entry_alloc(shard, new_sz);
+        memcpy(new, curr_c, new_sz);
+        return MAKE_COMPACT_ENTRY_POINTER(new);
+    }
+    else
+    {
+        size_t new_sz = sizeof(bitcask_keydir_entry) + curr->key_sz;
+        bitcask_keydir_entry* new = entry_alloc(shard, new_sz);
+        memcpy(new, curr, new_sz);
+        return new;
+    }
+}
+
+ERL_NIF_TERM bitcask_nifs_keydir_copy(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    bitcask_keydir_handle* handle;
+
+    if (enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle))
+    {
+        bitcask_keydir* keydir = handle->keydir;
+        lock_keydir_all(keydir);
+
+        bitcask_keydir_handle* new_handle = enif_alloc_resource_compat(env,
+                                                                       bitcask_keydir_RESOURCE,
+                                                                       sizeof(bitcask_keydir_handle));
+        memset(new_handle, '\0', sizeof(bitcask_keydir_handle));
+
+        // Now allocate the actual keydir instance. Because it's unnamed/shared, we'll
+        // leave the name and lock portions null'd out
+        bitcask_keydir* new_keydir = malloc(sizeof(bitcask_keydir));
+        new_handle->keydir = new_keydir;
+        memset(new_keydir, '\0', sizeof(bitcask_keydir));
+        init_keydir_shards(new_keydir, NULL);
+        new_keydir->fstats   = kh_init(fstats);
+        new_keydir->compact_entries = keydir->compact_entries;
+
+        // Deep copy each item from the existing handle. Keys hash the
+        // same in both keydirs, so each shard is copied to its peer.
+        khiter_t itr;
+        int i;
+        for (i = 0; i < BITCASK_KEYDIR_SHARDS; i++)
+        {
+            bitcask_keydir_shard* shard = &keydir->shards[i];
+            bitcask_keydir_shard* new_shard = &new_keydir->shards[i];
+
+            for (itr = kh_begin(shard->entries); itr != kh_end(shard->entries); ++itr)
+            {
+                // Allocate our entry to be inserted into the new table and copy the record
+                // over.
+                if (kh_exist(shard->entries, itr))
+                {
+                    bitcask_keydir_entry* curr = kh_key(shard->entries, itr);
+                    bitcask_keydir_entry* new = clone_entry(new_shard, curr);
+                    kh_put_set(entries, new_shard->entries, new);
+                }
+            }
+            if (shard->pending != NULL)
+            {
+                DEBUG2("LINE %d pending copy\r\n", __LINE__);
+                new_shard->pending = kh_init(entries);
+                for (itr = kh_begin(shard->pending); itr != kh_end(shard->pending); ++itr)
+                {
+                    // Allocate our entry to be inserted into the new table and copy the record
+                    // over.
+                    if (kh_exist(shard->pending, itr))
+                    {
+                        bitcask_keydir_entry* curr = kh_key(shard->pending, itr);
+                        bitcask_keydir_entry* new = clone_entry(new_shard, curr);
+                        kh_put_set(entries, new_shard->pending, new);
+                    }
+                }
+            }
+        }
+
+        // Deep copy fstats info
+        for (itr = kh_begin(keydir->fstats); itr != kh_end(keydir->fstats); ++itr)
+        {
+            if (kh_exist(keydir->fstats, itr))
+            {
+                bitcask_fstats_entry* curr_f = kh_val(keydir->fstats, itr);
+                bitcask_fstats_entry* new_f = malloc(sizeof(bitcask_fstats_entry));
+                memcpy(new_f, curr_f, sizeof(bitcask_fstats_entry));
+                kh_put2(fstats, new_keydir->fstats, new_f->file_id, new_f);
+            }
+        }
+
+        unlock_keydir_all(keydir);
+
+        ERL_NIF_TERM result = enif_make_resource(env, new_handle);
+        enif_release_resource_compat(env, new_handle);
+        return enif_make_tuple2(env, ATOM_OK, result);
+    }
+    else
+    {
+        return enif_make_badarg(env);
+    }
+}
+
+// Helper for bitcask_nifs_keydir_itr to decide if it is valid to iterate over entries.
+// Check the number of updates since pending was created is less than the maximum
+// and that the current view is not too old.
+// Call with ts set to zero to force a wait on any pending keydir.
+// Set maxage or maxputs negative to ignore them.  Set both negative to force
+// using the keydir - useful when a process has waited once and needs to run
+// next time.
+static int can_itr_keydir(bitcask_keydir* keydir, uint32_t ts, int maxage, int maxputs)
+{
+    if (keydir->pending_shards == 0 || // not frozen or caller wants to reuse
+        (maxage < 0 && maxputs < 0)) // the exiting freeze
+    {
+        DEBUG2("LINE %d can_itr\r\n", __LINE__);
+        return 1;
+    }
+    else if (ts == 0 || ts < keydir->pending_start_time)
+    {             // if clock skew (or forced wait), force key folding to wait
+        DEBUG2("LINE %d can_itr\r\n", __LINE__);
+        return 0; // which will fix keydir->pending_start
+    }
+
+    {
+        DEBUG2("LINE %d can_itr\r\n", __LINE__);
+        uint64_t age = ts - keydir->pending_start_time;
+        return ((maxage < 0 || age <= maxage) &&
+                (maxputs < 0 || keydir->pending_updated <= maxputs));
+    }
+}
+
+ERL_NIF_TERM bitcask_nifs_keydir_itr(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    bitcask_keydir_handle* handle;
+
+    if (enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle))
+    {
+        uint32_t ts;
+        int maxage;
+        int maxputs;
+
+        lock_keydir_all(handle->keydir);
+        DEBUG("+++ itr\r\n");
+        bitcask_keydir* keydir = handle->keydir;
+
+        // If a iterator thread is already active for this keydir, bail
+        if (handle->iterating)
+        {
+            unlock_keydir_all(handle->keydir);
+            return enif_make_tuple2(env, ATOM_ERROR, ATOM_ITERATION_IN_PROCESS);
+        }
+
+        if (!(enif_get_uint(env, argv[1], &ts) &&
+              enif_get_int(env, argv[2], (int*)&maxage) &&
+              enif_get_int(env, argv[3], (int*)&maxputs)))
+        {
+            unlock_keydir_all(handle->keydir);
+            return enif_make_badarg(env);
+        }
+
+        if (can_itr_keydir(keydir, ts, maxage, maxputs))
+        {
+            keydir->epoch += 1;
+
+            handle->iterating = 1;
+            handle->epoch = keydir->epoch;
+            handle->itr_time = ts;
+            keydir->newest_folder = keydir->epoch;
+            keydir->keyfolders++;
+            handle->shard = 0;
+            handle->iterator = kh_begin(keydir->shards[0].entries);
+            DEBUG2("LINE %d itr started, keydir->pending_shards = %u\r\n", __LINE__, keydir->pending_shards);
+            unlock_keydir_all(handle->keydir);
+            return ATOM_OK;
+        }
+        else
+        {
+            // Grow the pending_awaken array if necessary
+            if (keydir->pending_awaken_count == keydir->pending_awaken_size)
+            {   // Grow 16-at-a-time, expect a single alloc
+                keydir->pending_awaken_size += 16;
+                size_t size = keydir->pending_awaken_size * sizeof(keydir->pending_awaken[0]);
+                if (keydir->pending_awaken == NULL)
+                {
+                    keydir->pending_awaken = malloc(size);
+                }
+                else
+                {
+                    keydir->pending_awaken = realloc(keydir->pending_awaken, size);
+                }
+            }
+            enif_self(env, &keydir->pending_awaken[keydir->pending_awaken_count]);
+            keydir->pending_awaken_count++;
+            DEBUG2("LINE %d itr\r\n", __LINE__);
+            unlock_keydir_all(handle->keydir);
+            return ATOM_OUT_OF_DATE;
+        }
+    }
+    else
+    {
+        return enif_make_badarg(env);
+    }
+}
+
+ERL_NIF_TERM bitcask_nifs_keydir_itr_next(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    bitcask_keydir_handle* handle;
+
+    if (enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle))
+    {
+        DEBUG("+++ itr next\r\n");
+        bitcask_keydir* keydir = handle->keydir;
+
+        if (handle->iterating != 1)
+        {
+            DEBUG("Itr not started\r\n");
+            // Iteration not started!
+            return enif_make_tuple2(env, ATOM_ERROR, ATOM_ITERATION_NOT_STARTED);
+        }
+
+        // Walk the shards in order, only holding the lock of the one
+        // being scanned.
+        while (handle->shard < BITCASK_KEYDIR_SHARDS)
+        {
+            bitcask_keydir_shard* shard = &keydir->shards[handle->shard];
+            RLOCK_SHARD(shard);
+
+            while (handle->iterator != kh_end(shard->entries))
+            {
+                if (kh_exist(shard->entries, handle->iterator))
+                {
+                    DEBUG2("LINE %d itr_next\r\n", __LINE__);
+                    bitcask_keydir_entry* entry = kh_key(shard->entries, handle->iterator);
+                    ErlNifBinary key;
+                    bitcask_keydir_entry_proxy proxy;
+
+                    if (!proxy_kd_entry_at_epoch(entry, handle->epoch, &proxy)
+                        || proxy.is_tombstone
+                        || is_expired(&proxy, handle->itr_time))
+                    {
+                        DEBUG("No value for itr_next");
+                        // No value in the snapshot for the iteration time
+                        (handle->iterator)++;
+                        continue;
+                    }
+                    DEBUG_BIN(dbgKey, proxy.key, proxy.key_sz);
+                    DEBUG("itr_next key=%s", dbgKey);
+
+                    // Alloc the binary and make sure it succeeded
+                    if (!enif_alloc_binary_compat(env, proxy.key_sz, &key))
+                    {
+                        RUNLOCK_SHARD(shard);
+                        return ATOM_ALLOCATION_ERROR;
+                    }
+
+                    // Copy the data from our key to the new allocated binary
+                    // TODO: If we maintained a ErlNifBinary in the original entry, could we
+                    // get away with not doing a copy here?
+                    memcpy(key.data, proxy.key, proxy.key_sz);
+                    ERL_NIF_TERM curr = enif_make_tuple6(env,
+                                                         ATOM_BITCASK_ENTRY,
+                                                         enif_make_binary(env, &key),
+                                                         enif_make_uint(env, proxy.file_id),
+                                                         enif_make_uint(env, proxy.total_sz),
+                                                         enif_make_uint64_bin(env, proxy.offset),
+                                                         enif_make_uint(env, proxy.tstamp));
+
+                    // Update the iterator to the next entry
+                    (handle->iterator)++;
+                    RUNLOCK_SHARD(shard);
+                    DEBUG("Found entry\r\n");
+                    DEBUG_ENTRY(entry);
+                    return curr;
+                }
+                else
+                {
+                    // No item in this slot; increment the iterator and keep looping
+                    (handle->iterator)++;
+                }
+            }
+
+            RUNLOCK_SHARD(shard);
+            // The iterator is at the end of this shard, move on to the next
+            handle->shard++;
+            handle->iterator = kh_begin(shard->entries);
+        }
+
+        // The iterator is at the end of the last shard
+        return ATOM_NOT_FOUND;
+    }
+    else
+    {
+        return enif_make_badarg(env);
+    }
+}
+
+void itr_release_internal(ErlNifEnv* env, bitcask_keydir_handle* handle)
+{
+    handle->iterating = 0;
+    handle->keydir->keyfolders--;
+    handle->epoch = MAX_EPOCH;
+
+    // If last iterator closing, unfreeze keydir and merge pending entries.
+    if (handle->keydir->keyfolders == 0 && handle->keydir->pending_shards != 0)
+    {
+        DEBUG2("LINE %d itr_release\r\n", __LINE__);
+        merge_pending_entries(env, handle->keydir);
+        handle->keydir->iter_generation++;
+    }
+}
+
+ERL_NIF_TERM bitcask_nifs_keydir_itr_release(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    bitcask_keydir_handle* handle;
+
+    if (enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle))
+    {
+        lock_keydir_all(handle->keydir);
+        if (handle->iterating != 1)
+        {
+            // Iteration not started!
+            unlock_keydir_all(handle->keydir);
+            return enif_make_tuple2(env, ATOM_ERROR, ATOM_ITERATION_NOT_STARTED);
+        }
+
+        itr_release_internal(env, handle);
+
+        unlock_keydir_all(handle->keydir);
+        return ATOM_OK;
+    }
+    else
+    {
+        return enif_make_badarg(env);
+    }
 }
 
-static khiter_t get_entries_hash(entries_hash_t *hash, ErlNifBinary* key,
-                                 khiter_t* itr_ptr, bitcask_keydir_entry** entry_ptr)
+ERL_NIF_TERM bitcask_nifs_keydir_info(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
-    khiter_t itr = kh_get_custom(entries, hash, key, nif_binary_hash,
-            nif_binary_entry_equal);
+    bitcask_keydir_handle* handle;
 
-    if (itr != kh_end(hash))
+    if (enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle))
     {
-        if (itr_ptr != NULL)
+        bitcask_keydir* keydir = handle->keydir;
+
+        if (keydir == NULL)
         {
-            *itr_ptr = itr;
+            return enif_make_badarg(env);
         }
-        if (entry_ptr != NULL)
+        LOCK(keydir);
+
+        // Dump fstats info into a list of [{file_id, live_keys, total_keys,
+        //                                   live_bytes, total_bytes,
+        //                                   oldest_tstamp, newest_tstamp,
+        //                                   expiration_epoch}]
+        ERL_NIF_TERM fstats_list = enif_make_list(env, 0);
+        khiter_t itr;
+        bitcask_fstats_entry* curr_f;
+        for (itr = kh_begin(keydir->fstats); itr != kh_end(keydir->fstats); ++itr)
         {
-            *entry_ptr = kh_key(hash, itr);
+            if (kh_exist(keydir->fstats, itr))
+            {
+                curr_f = kh_val(keydir->fstats, itr);
+                ERL_NIF_TERM fstat =
+                    enif_make_tuple8(env,
+                                     enif_make_uint(env, curr_f->file_id),
+                                     enif_make_ulong(env, curr_f->live_keys),
+                                     enif_make_ulong(env, curr_f->total_keys),
+                                     enif_make_ulong(env, curr_f->live_bytes),
+                                     enif_make_ulong(env, curr_f->total_bytes),
+                                     enif_make_uint(env, curr_f->oldest_tstamp),
+                                     enif_make_uint(env, curr_f->newest_tstamp),
+                                     enif_make_uint64(env, (ErlNifUInt64)curr_f->expiration_epoch));
+                fstats_list = enif_make_list_cell(env, fstat, fstats_list);
+            }
         }
-        return 1;
+
+        ERL_NIF_TERM iter_info =
+            enif_make_tuple4(env,
+                             enif_make_uint64(env, keydir->iter_generation),
+                             enif_make_ulong(env, keydir->keyfolders),
+                             keydir->pending_shards == 0 ? ATOM_FALSE : ATOM_TRUE,
+                             keydir->pending_shards == 0 ? ATOM_UNDEFINED :
+                             enif_make_uint64(env, keydir->pending_start_epoch));
+
+        ERL_NIF_TERM result = enif_make_tuple5(env,
+                                               enif_make_uint64(env, keydir->key_count),
+                                               enif_make_uint64(env, keydir->key_bytes),
+                                               fstats_list,
+                                               iter_info,
+                                               enif_make_uint64(env, keydir->epoch));
+        UNLOCK(keydir);
+        return result;
     }
     else
     {
-        return 0;
+        return enif_make_badarg(env);
     }
 }
 
-static inline int is_sib_tombstone(bitcask_keydir_entry_sib *s)
+// Bytes used by the bucket arrays of an entries hash.
+static uint64_t entries_hash_bytes(entries_hash_t* hash)
 {
-    if (s->file_id == MAX_TIME &&
-        s->total_sz == MAX_SIZE &&
-        s->offset == MAX_OFFSET)
+    if (hash == NULL || kh_n_buckets(hash) == 0)
     {
-        return 1;
+        return 0;
     }
-
-    return 0;
+    return kh_n_buckets(hash) * sizeof(bitcask_keydir_entry*) +
+        ((kh_n_buckets(hash) >> 4) + 1) * sizeof(khint32_t);
 }
 
-// Extracts the entry values from a regular entry or from the
-// closest snapshot in time in an entry list.
-static int proxy_kd_entry_at_epoch(bitcask_keydir_entry* old,
-                                   uint64_t epoch, bitcask_keydir_entry_proxy * ret)
+// Memory held by a shard's Bloom filters, including the spare and the
+// outgrown ones.
+static uint64_t shard_bloom_bytes(bitcask_keydir_shard* shard)
 {
-    if (!IS_ENTRY_LIST(old))
-    {
-        if (epoch < old->epoch)
-            return 0;
-
-        ret->file_id = old->file_id;
-        ret->total_sz = old->total_sz;
-        ret->offset = old->offset;
-        ret->tstamp = old->tstamp;
-        ret->epoch = old->epoch;
-        ret->key_sz = old->key_sz;
-        ret->key = old->key;
-        ret->is_tombstone = is_pending_tombstone(old);
+    uint64_t bytes = 0;
+    bitcask_bloom* bloom;
 
-        return 1;
+    if (shard->bloom != NULL)
+    {
+        bytes += bitcask_bloom_bytes(shard->bloom);
     }
-
-    bitcask_keydir_entry_head* head = GET_ENTRY_LIST_POINTER(old);
-
-    //grab the newest sib
-    bitcask_keydir_entry_sib* s = head->sibs;
-
-    while (s != NULL)
+    if (shard->bloom_spare != NULL)
     {
-        if (epoch >= s->epoch)
-        {
-            break;
-        }
-        s = s->next;
+        bytes += bitcask_bloom_bytes(shard->bloom_spare);
     }
-
-    if (s == NULL)
+    for (bloom = shard->bloom_retired; bloom != NULL; bloom = bloom->next)
     {
-        return 0;
+        bytes += bitcask_bloom_bytes(bloom);
     }
+    return bytes;
+}
 
-    ret->file_id = s->file_id;
-    ret->total_sz = s->total_sz;
-    ret->offset = s->offset;
-    ret->tstamp = s->tstamp;
-    ret->is_tombstone = is_sib_tombstone(s);
-    ret->epoch = s->epoch;
+ERL_NIF_TERM bitcask_nifs_keydir_memory_info(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    bitcask_keydir_handle* handle;
 
-    ret->key_sz = head->key_sz;
-    ret->key = head->key;
+    if (enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle))
+    {
+        bitcask_keydir* keydir = handle->keydir;
+        uint64_t entry_bytes = 0, hash_bytes = 0, key_count;
+        uint64_t slab_bytes = 0, used_bytes = 0, large_bytes = 0;
+        uint64_t expiry_nodes = 0, bloom_bytes = 0;
+        int i;
 
-    return 1;
-}
+        if (keydir == NULL)
+        {
+            return enif_make_badarg(env);
+        }
 
-// Extracts entry values from a regular entry or the latest snapshot
-// from an entry list.
-static inline int proxy_kd_entry(bitcask_keydir_entry* old,
-                                 bitcask_keydir_entry_proxy * proxy)
-{
-    return proxy_kd_entry_at_epoch(old, MAX_EPOCH, proxy);
+        for (i = 0; i < BITCASK_KEYDIR_SHARDS; i++)
+        {
+            bitcask_keydir_shard* shard = &keydir->shards[i];
+            RLOCK_SHARD(shard);
+            entry_bytes += shard->entry_bytes;
+            slab_bytes += shard->arena.slab_bytes;
+            used_bytes += shard->arena.used_bytes;
+            large_bytes += shard->arena.large_bytes;
+            expiry_nodes += shard->expiry_nodes;
+            bloom_bytes += shard_bloom_bytes(shard);
+            hash_bytes += entries_hash_bytes(shard->entries) +
+                entries_hash_bytes(shard->pending);
+            RUNLOCK_SHARD(shard);
+        }
+
+        LOCK(keydir);
+        key_count = keydir->key_count;
+        UNLOCK(keydir);
+
+        // Counts everything the arenas hold, including free chunks.
+        double bytes_per_key = key_count == 0 ? 0.0 :
+            (double)(slab_bytes + large_bytes + hash_bytes) / key_count;
+        double utilization = slab_bytes == 0 ? 0.0 :
+            (double)used_bytes / slab_bytes;
+        ERL_NIF_TERM items[] = {
+            enif_make_tuple2(env, ATOM_ENTRY_LAYOUT,
+                             keydir->compact_entries ? ATOM_COMPACT : ATOM_STANDARD),
+            enif_make_tuple2(env, ATOM_KEY_COUNT, enif_make_uint64(env, key_count)),
+            enif_make_tuple2(env, ATOM_ENTRY_BYTES, enif_make_uint64(env, entry_bytes)),
+            enif_make_tuple2(env, ATOM_HASH_BYTES, enif_make_uint64(env, hash_bytes)),
+            enif_make_tuple2(env, ATOM_BYTES_PER_KEY, enif_make_double(env, bytes_per_key)),
+            enif_make_tuple2(env, ATOM_ARENA_SLAB_BYTES, enif_make_uint64(env, slab_bytes)),
+            enif_make_tuple2(env, ATOM_ARENA_USED_BYTES, enif_make_uint64(env, used_bytes)),
+            enif_make_tuple2(env, ATOM_ARENA_LARGE_BYTES, enif_make_uint64(env, large_bytes)),
+            enif_make_tuple2(env, ATOM_ARENA_UTILIZATION, enif_make_double(env, utilization)),
+            enif_make_tuple2(env, ATOM_EXPIRY_INDEX_KEYS, enif_make_uint64(env, expiry_nodes)),
+            enif_make_tuple2(env, ATOM_BLOOM_BYTES, enif_make_uint64(env, bloom_bytes))
+        };
+        return enif_make_list_from_array(env, items, sizeof(items) / sizeof(items[0]));
+    }
+    else
+    {
+        return enif_make_badarg(env);
+    }
 }
 
-// All info about a lookup with find_keydir_entry.
-typedef struct
+ERL_NIF_TERM bitcask_nifs_keydir_io_stats(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
-    // Entry found in the pending hash. If set, entries_entry will be NULL.
-    bitcask_keydir_entry * pending_entry;
-    // Entry found in the entries hash. If set, pending_entry is NULL
-    bitcask_keydir_entry * entries_entry;
-    // Copy of the values of the found entry, if any, whether it's
-    // a regular entry or list.
-    bitcask_keydir_entry_proxy proxy;
-    // Hash (entries or pending) where the entry was found.
-    entries_hash_t * hash;
-    khiter_t itr;
-    // True if found, even if it is a tombstone
-    char found;
-} find_result;
+    bitcask_keydir_handle* handle;
 
-// Find an entry in the pending hash when they keydir is frozen, or in the
-// entries hash otherwise.
-static void find_keydir_entry(bitcask_keydir* keydir, ErlNifBinary* key,
-                              uint64_t epoch, find_result * ret)
-{
-    // Search pending. If keydir handle used is in iterating mode
-    // we want to see a past snapshot instead.
-    if (keydir->pending != NULL)
+    if (enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle) &&
+        handle->keydir != NULL)
     {
-        if (get_entries_hash(keydir->pending, key,
-                             &ret->itr, &ret->pending_entry)
-            && (epoch >= ret->pending_entry->epoch))
+        bitcask_keydir* keydir = handle->keydir;
+        uint64_t cache_hits = 0, cache_misses = 0, cache_evictions = 0;
+        uint64_t cache_entries = 0, cache_bytes = 0;
+        int i, q;
+
+        for (i = 0; keydir->vcache != NULL && i < VCACHE_SEGMENTS; i++)
         {
-            DEBUG("Found in pending %llu > %llu", epoch, ret->pending_entry->epoch);
-            ret->hash = keydir->pending;
-            ret->entries_entry = NULL;
-            ret->found = 1;
-            proxy_kd_entry(ret->pending_entry, &ret->proxy);
-            return;
+            bitcask_vcache_segment* segment = &keydir->vcache[i];
+            enif_mutex_lock(segment->mutex);
+            cache_hits += segment->hits;
+            cache_misses += segment->misses;
+            cache_evictions += segment->evictions;
+            cache_entries += kh_size(segment->entries);
+            for (q = 0; q < VCACHE_QUEUES; q++)
+            {
+                cache_bytes += segment->queues[q].bytes;
+            }
+            enif_mutex_unlock(segment->mutex);
         }
+
+        LOCK(keydir);
+        ERL_NIF_TERM items[] = {
+            enif_make_tuple2(env, ATOM_READ_SAMPLES,
+                             enif_make_uint64(env, keydir->read_samples)),
+            enif_make_tuple2(env, ATOM_READ_USECS,
+                             enif_make_uint64(env, keydir->read_usecs)),
+            enif_make_tuple2(env, ATOM_MERGE_BYTES,
+                             enif_make_uint64(env, keydir->merge_bytes)),
+            enif_make_tuple2(env, ATOM_MERGE_THROTTLED_USECS,
+                             enif_make_uint64(env, keydir->merge_throttled_usecs)),
+            enif_make_tuple2(env, ATOM_CACHE_HITS,
+                             enif_make_uint64(env, cache_hits)),
+            enif_make_tuple2(env, ATOM_CACHE_MISSES,
+                             enif_make_uint64(env, cache_misses)),
+            enif_make_tuple2(env, ATOM_CACHE_EVICTIONS,
+                             enif_make_uint64(env, cache_evictions)),
+            enif_make_tuple2(env, ATOM_CACHE_ENTRIES,
+                             enif_make_uint64(env, cache_entries)),
+            enif_make_tuple2(env, ATOM_CACHE_BYTES,
+                             enif_make_uint64(env, cache_bytes))
+        };
+        UNLOCK(keydir);
+        return enif_make_list_from_array(env, items, sizeof(items) / sizeof(items[0]));
     }
+    else
+    {
+        return enif_make_badarg(env);
+    }
+}
 
-    // Definitely not in the pending entries
-    ret->pending_entry = NULL;
+ERL_NIF_TERM bitcask_nifs_keydir_add_read_latency(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    bitcask_keydir_handle* handle;
+    ErlNifUInt64 usecs;
 
-    // If a snapshot for that time is found in regular entries
-    if (get_entries_hash(keydir->entries, key, &ret->itr, &ret->entries_entry)
-        && proxy_kd_entry_at_epoch(ret->entries_entry, epoch, &ret->proxy))
+    if (enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle) &&
+        handle->keydir != NULL &&
+        enif_get_uint64(env, argv[1], &usecs))
     {
-        ret->hash = keydir->entries;
-        ret->found = 1;
-        return;
-    }
+        bitcask_keydir* keydir = handle->keydir;
 
-    ret->entries_entry = NULL;
-    ret->hash = NULL;
-    ret->found = 0;
-    return;
+        LOCK(keydir);
+        keydir->read_samples++;
+        keydir->read_usecs += usecs;
+        UNLOCK(keydir);
+        return ATOM_OK;
+    }
+    else
+    {
+        return enif_make_badarg(env);
+    }
 }
 
-static void update_kd_entry_list(bitcask_keydir_entry *old,
-                                 bitcask_keydir_entry_proxy *new,
-                                 int iterating_p) {
-    bitcask_keydir_entry_head* h = GET_ENTRY_LIST_POINTER(old);
-    bitcask_keydir_entry_sib* new_sib;
+ERL_NIF_TERM bitcask_nifs_keydir_add_merge_io(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    bitcask_keydir_handle* handle;
+    ErlNifUInt64 bytes, throttled_usecs;
 
-    if (! iterating_p)
+    if (enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle) &&
+        handle->keydir != NULL &&
+        enif_get_uint64(env, argv[1], &bytes) &&
+        enif_get_uint64(env, argv[2], &throttled_usecs))
     {
-        new_sib = h->sibs;
+        bitcask_keydir* keydir = handle->keydir;
 
-        new_sib->file_id = new->file_id;
-        new_sib->total_sz = new->total_sz;
-        new_sib->offset = new->offset;
-        new_sib->epoch = new->epoch;
-        new_sib->tstamp = new->tstamp;
+        LOCK(keydir);
+        keydir->merge_bytes += bytes;
+        keydir->merge_throttled_usecs += throttled_usecs;
+        UNLOCK(keydir);
+        return ATOM_OK;
     }
-    else // otherwise make a new sib
+    else
     {
-        new_sib = malloc(sizeof(bitcask_keydir_entry_sib));
+        return enif_make_badarg(env);
+    }
+}
 
-        new_sib->file_id = new->file_id;
-        new_sib->total_sz = new->total_sz;
-        new_sib->offset = new->offset;
-        new_sib->epoch = new->epoch;
-        new_sib->tstamp = new->tstamp;
-        new_sib->next = h->sibs;
+ERL_NIF_TERM bitcask_nifs_keydir_cache_get(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    bitcask_keydir_handle* handle;
+    uint32_t file_id;
+    ErlNifUInt64 offset;
 
-        h->sibs = new_sib;
+    if (enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle) &&
+        handle->keydir != NULL &&
+        enif_get_uint(env, argv[1], &file_id) &&
+        enif_get_uint64(env, argv[2], &offset))
+    {
+        bitcask_keydir* keydir = handle->keydir;
+        size_t value_sz;
+        void* value;
+
+        if (keydir->vcache == NULL ||
+            (value = vcache_get(keydir, file_id, offset, &value_sz)) == NULL)
+        {
+            return ATOM_NOT_FOUND;
+        }
+        ERL_NIF_TERM bin = enif_make_resource_binary(env, value, value, value_sz);
+        enif_release_resource_compat(env, value);
+        return enif_make_tuple2(env, ATOM_OK, bin);
+    }
+    else
+    {
+        return enif_make_badarg(env);
     }
 }
 
-static bitcask_keydir_entry* new_kd_entry_list(bitcask_keydir_entry *old,
-                                               bitcask_keydir_entry_proxy *new)
+ERL_NIF_TERM bitcask_nifs_keydir_cache_put(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
-    bitcask_keydir_entry_head* ret;
-    bitcask_keydir_entry_sib *old_sib, *new_sib;
-    ret = malloc(sizeof(bitcask_keydir_entry_head) + old->key_sz);
-    old_sib = malloc(sizeof(bitcask_keydir_entry_sib));
-    new_sib = malloc(sizeof(bitcask_keydir_entry_sib));
-
-    //fill in list head, use old since new could be a tombstone
-    memcpy(ret->key, old->key, old->key_sz);
-    ret->key_sz = old->key_sz;
-    ret->sibs = new_sib;
-
-    //make new sib
-    new_sib->file_id = new->file_id;
-    new_sib->total_sz = new->total_sz;
-    new_sib->offset = new->offset;
-    new_sib->epoch = new->epoch;
-    new_sib->tstamp = new->tstamp;
-    new_sib->next = old_sib;
+    bitcask_keydir_handle* handle;
+    uint32_t file_id;
+    ErlNifUInt64 offset;
+    ErlNifBinary value;
 
-    //make new sib
-    old_sib->file_id = old->file_id;
-    old_sib->total_sz = old->total_sz;
-    old_sib->offset = old->offset;
-    old_sib->epoch = old->epoch;
-    old_sib->tstamp = old->tstamp;
-    old_sib->next = NULL;
+    if (enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle) &&
+        handle->keydir != NULL &&
+        enif_get_uint(env, argv[1], &file_id) &&
+        enif_get_uint64(env, argv[2], &offset) &&
+        enif_inspect_binary(env, argv[3], &value))
+    {
+        bitcask_keydir* keydir = handle->keydir;
 
-    return MAKE_ENTRY_LIST_POINTER(ret);
+        if (keydir->vcache != NULL)
+        {
+            vcache_put(keydir, file_id, offset, value.data, value.size);
+        }
+        return ATOM_OK;
+    }
+    else
+    {
+        return enif_make_badarg(env);
+    }
 }
 
-#ifdef BITCASK_DEBUG
-void print_entry_list(bitcask_keydir_entry *e)
-{
-    bitcask_keydir_entry_head* h = GET_ENTRY_LIST_POINTER(e);
-    char buf[4096];
-    assert(h->key_sz+1 < 4096);
-    memcpy(&buf, h->key, h->key_sz);
-    buf[h->key_sz] = '\0';
+// Hint file records: Tstamp:32 KeySz:16 TotalSz:32 Tomb:1 Expires:1
+// Offset:62 Key, all big endian, followed by Expiry:32 when the Expires
+// bit is set. The last record carries the CRC of everything before it in
+// the TotalSz field, with a zero key size and all of the Expires and
+// Offset bits set. Its tstamp tells the checksum: 0 for CRC-32, 1 for the
+// CRC-32C of hint files that go with CRC-32C data files. See
+// bitcask_fileops:hintfile_entry/6.
+#define HINT_RECORD_SZ 18
+#define HINT_EXPIRY_SZ 4
+#define HINT_MAX_OFFSET 0x3fffffffffffffffULL
+#define HINT_CRC32_TSTAMP 0
+#define HINT_CRC32C_TSTAMP 1
 
-    fprintf(stderr, "entry list %p key: %s keylen %d\r\n",
-            h, buf, h->key_sz);
+typedef struct
+{
+    uint32_t tstamp;
+    uint16_t key_sz;
+    uint32_t total_sz;
+    uint32_t is_tombstone;
+    uint32_t has_expiry;
+    uint64_t offset;
+} hint_record;
 
-    int sib_count = 0;
+// Bytes taken by a record, key and expiry time included
+static inline size_t hint_record_len(const hint_record* r)
+{
+    return HINT_RECORD_SZ + r->key_sz + (r->has_expiry ? HINT_EXPIRY_SZ : 0);
+}
 
-    bitcask_keydir_entry_sib
-        *s = h->sibs;
-    while (s != NULL) {
-        fprintf(stderr, "sib %d \r\n\t%u\t\t%u\r\n\t%llu\t\t%u\tepoch=%u\r\n\r\n",
-                sib_count, s->file_id, s->total_sz, (unsigned long long)s->offset, s->tstamp, s->epoch);
-        sib_count++;
-        s = s->next;
-        if( s == NULL )
-            break;
+// The expiry time of the record at p, 0 when it has none
+static uint32_t hint_record_expiry(const unsigned char* p, const hint_record* r)
+{
+    if (!r->has_expiry)
+    {
+        return 0;
     }
+    p += HINT_RECORD_SZ + r->key_sz;
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+        ((uint32_t)p[2] << 8) | p[3];
 }
 
-void print_entry(bitcask_keydir_entry *e)
+static void decode_hint_record(const unsigned char* p, hint_record* r)
 {
-    if (IS_ENTRY_LIST(e))
+    uint64_t tomb_offset = 0;
+    int i;
+    r->tstamp = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+        ((uint32_t)p[2] << 8) | p[3];
+    r->key_sz = (uint16_t)((p[4] << 8) | p[5]);
+    r->total_sz = ((uint32_t)p[6] << 24) | ((uint32_t)p[7] << 16) |
+        ((uint32_t)p[8] << 8) | p[9];
+    for (i = 10; i < HINT_RECORD_SZ; i++)
     {
-        print_entry_list(e);
-        return;
+        tomb_offset = (tomb_offset << 8) | p[i];
     }
-
-    fprintf(stderr, "entry %p key: %d keylen %d\r\n",
-            e, (int)e->key[3], e->key_sz);
-
-    fprintf(stderr, "\r\n\t%u\t\t%u\r\n\t%llu\t\t%u\tepoch=%u\r\n\r\n",
-            e->file_id, e->total_sz, (unsigned long long)e->offset, e->tstamp, e->epoch);
+    r->is_tombstone = (uint32_t)(tomb_offset >> 63);
+    r->has_expiry = (uint32_t)(tomb_offset >> 62) & 1;
+    r->offset = tomb_offset & HINT_MAX_OFFSET;
 }
 
-void print_keydir(bitcask_keydir* keydir)
+// Checks the trailing CRC record and that the records before it parse
+// cleanly, mirroring has_valid_hintfile/1 in bitcask_fileops.
+static int validate_hintfile(const unsigned char* data, size_t size)
 {
-    khiter_t itr;
-    bitcask_keydir_entry* current_entry;
-    fprintf(stderr, "printing keydir: %s size %d\r\n\r\n", keydir->name,
-            kh_size(keydir->entries));
-    // should likely dump some useful stuff here, but don't need it
-    // right now
-    fprintf(stderr, "entries:\r\n");
-    for (itr = kh_begin(keydir->entries);
-         itr != kh_end(keydir->entries);
-         ++itr)
+    hint_record r;
+    size_t pos = 0;
+    size_t body_sz;
+
+    if (size < HINT_RECORD_SZ)
     {
+        return 0;
+    }
+    body_sz = size - HINT_RECORD_SZ;
 
-        if (kh_exist(keydir->entries, itr))
+    decode_hint_record(data + body_sz, &r);
+    if (r.key_sz != 0 || !r.has_expiry || r.offset != HINT_MAX_OFFSET)
+    {
+        return 0;
+    }
+    if (r.tstamp == HINT_CRC32_TSTAMP)
+    {
+        if (r.total_sz != bitcask_crc32(0, data, body_sz))
         {
-            current_entry = kh_key(keydir->entries, itr);
-            print_entry(current_entry);
+            return 0;
         }
     }
-    fprintf(stderr, "\r\npending:\r\n");
-    if (keydir->pending == NULL)
+    else if (r.tstamp != HINT_CRC32C_TSTAMP ||
+             r.total_sz != bitcask_crc32c(0, data, body_sz))
     {
-        fprintf(stderr, "NULL\r\n");
+        return 0;
     }
-    else
+
+    while (pos < body_sz)
     {
-        for (itr = kh_begin(keydir->pending);
-             itr != kh_end(keydir->pending);
-             ++itr)
+        if (body_sz - pos < HINT_RECORD_SZ)
         {
-
-            if (kh_exist(keydir->pending, itr))
-            {
-                current_entry = kh_key(keydir->pending, itr);
-                print_entry(current_entry);
-            }
+            return 0;
+        }
+        decode_hint_record(data + pos, &r);
+        if (body_sz - pos < hint_record_len(&r))
+        {
+            return 0;
         }
+        pos += hint_record_len(&r);
     }
+    return 1;
 }
-#endif
 
-static void free_entry_list(bitcask_keydir_entry* e)
+// Maps a hint file read only and checks it. Returns 0 with the mapping in
+// *data and *size, an errno value, or -1 when the file is not a valid
+// hint file.
+static int map_hintfile(const char* filename, unsigned char** data,
+                        size_t* size)
 {
-    bitcask_keydir_entry_head* h = GET_ENTRY_LIST_POINTER(e);
-
-    bitcask_keydir_entry_sib
-        *temp = NULL,
-        *s = h->sibs;
-    while (s != NULL) {
-        temp = s;
-        s = s->next;
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+    {
+        return errno;
+    }
 
-        free(temp);
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        int error = errno;
+        close(fd);
+        return error;
     }
 
-    free(h);
-}
+    *size = (size_t)st.st_size;
+    if (*size < HINT_RECORD_SZ)
+    {
+        close(fd);
+        return -1;
+    }
 
-static void free_entry(bitcask_keydir_entry *e)
-{
-    if (IS_ENTRY_LIST(e))
+    *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (*data == MAP_FAILED)
     {
-        free_entry_list(e);
+        return errno;
     }
-    else
+#ifdef MADV_SEQUENTIAL
+    madvise(*data, *size, MADV_SEQUENTIAL);
+#endif
+
+    if (!validate_hintfile(*data, *size))
     {
-        free(e);
+        munmap(*data, *size);
+        return -1;
     }
+    return 0;
 }
 
-// Allocate, populate and add entry to the keydir hash based on the key and entry structure
-// never need to add an entry list, can update to it later.
-static bitcask_keydir_entry* add_entry(bitcask_keydir* keydir,
-                                       entries_hash_t* hash,
-                                       bitcask_keydir_entry_proxy * entry)
+static ERL_NIF_TERM map_hintfile_error(ErlNifEnv* env, int error)
 {
-    bitcask_keydir_entry* new_entry = malloc(sizeof(bitcask_keydir_entry) +
-                                             entry->key_sz);
-    new_entry->file_id = entry->file_id;
-    new_entry->total_sz = entry->total_sz;
-    new_entry->offset = entry->offset;
-    new_entry->epoch = entry->epoch;
-    new_entry->tstamp = entry->tstamp;
-    new_entry->key_sz = entry->key_sz;
-    memcpy(new_entry->key, entry->key, entry->key_sz);
-    kh_put_set(entries, hash, new_entry);
-
-    return new_entry;
+    if (error == -1)
+    {
+        return enif_make_tuple2(env, ATOM_ERROR, ATOM_INVALID_HINTFILE);
+    }
+    return enif_make_tuple2(env, ATOM_ERROR, errno_atom(env, error));
 }
 
-
-static void update_regular_entry(bitcask_keydir_entry* cur_entry,
-        bitcask_keydir_entry_proxy* upd_entry)
+// Loads a whole hint file into the keydir without going back to Erlang
+// for every key. Records are applied exactly as bitcask:scan_key_files/5
+// applies them: keydir_put with newest_put = 0 for values and an
+// unconditional keydir_remove for tombstones.
+//
+// Returns ok, {trunc_hintfile, Offset, TotalSz} if a record points past
+// the end of the data file (records up to there are kept, as the Erlang
+// fold does), {error, invalid_hintfile} if the CRC or record framing is
+// wrong (nothing is loaded), or {error, Errno}.
+ERL_NIF_TERM bitcask_nifs_keydir_load_hintfile(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
-    cur_entry->file_id = upd_entry->file_id;
-    cur_entry->total_sz = upd_entry->total_sz;
-    cur_entry->epoch = upd_entry->epoch;
-    cur_entry->offset = upd_entry->offset;
-    cur_entry->tstamp = upd_entry->tstamp;
-}
+    bitcask_keydir_handle* handle;
+    char filename[4096];
+    uint32_t file_id;
+    ErlNifUInt64 data_size;
+    uint32_t nowsec;
 
-// Updates an entry from the entries hash, not from pending.
-// Use update_regular_entry on pending hash entries instead.
-// While iterating, regular entries will become entry lists,
-// otherwise the result is a regular, single value entry.
-static void update_entry(bitcask_keydir* keydir,
-                         bitcask_keydir_entry* cur_entry,
-                         bitcask_keydir_entry_proxy* upd_entry)
-{
-    int is_entry_list = IS_ENTRY_LIST(cur_entry);
-    int iterating = keydir->keyfolders > 0;
+    if (!(enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle) &&
+          enif_get_string(env, argv[1], filename, sizeof(filename), ERL_NIF_LATIN1) > 0 &&
+          enif_get_uint(env, argv[2], &file_id) &&
+          enif_get_uint64(env, argv[3], &data_size) &&
+          enif_get_uint(env, argv[4], &nowsec)))
+    {
+        return enif_make_badarg(env);
+    }
 
-    if (iterating)
+    unsigned char* data;
+    size_t size;
+    int error = map_hintfile(filename, &data, &size);
+    if (error != 0)
     {
-        if (is_entry_list)
+        return map_hintfile_error(env, error);
+    }
+
+    bitcask_keydir* keydir = handle->keydir;
+    ERL_NIF_TERM result = ATOM_OK;
+    size_t body_sz = size - HINT_RECORD_SZ;
+    size_t pos = 0;
+    while (pos < body_sz)
+    {
+        hint_record r;
+        ErlNifBinary key;
+
+        decode_hint_record(data + pos, &r);
+        key.data = data + pos + HINT_RECORD_SZ;
+        key.size = r.key_sz;
+        uint32_t expiry = hint_record_expiry(data + pos, &r);
+        pos += hint_record_len(&r);
+
+        if (r.offset + r.total_sz > data_size + 1)
         {
-            // Add to list of values during iteration
-            update_kd_entry_list(cur_entry, upd_entry, iterating);
+            result = enif_make_tuple3(env, ATOM_TRUNC_HINTFILE,
+                                      enif_make_uint64(env, r.offset),
+                                      enif_make_uint(env, r.total_sz));
+            break;
+        }
+
+        if (r.is_tombstone)
+        {
+            do_keydir_remove(env, keydir, &key, 0, 0, 0, 0, nowsec);
         }
         else
         {
-            // Convert regular entry to list during iteration
-            khiter_t itr = kh_get(entries, keydir->entries, cur_entry);
-            kh_key(keydir->entries, itr) =
-                new_kd_entry_list(cur_entry, upd_entry);
-            free(cur_entry);
+            bitcask_keydir_entry_proxy entry;
+            entry.file_id = file_id;
+            entry.total_sz = r.total_sz;
+            entry.offset = r.offset;
+            entry.tstamp = r.tstamp;
+            entry.expiry = expiry;
+            do_keydir_put(env, keydir, &key, &entry, nowsec, 0, 0, 0);
         }
     }
-    else // not iterating, so end up with regular entries only.
+
+    munmap(data, size);
+    return result;
+}
+
+// Parallel load of a run of hint files, see keydir_load_hintfiles/3.
+//
+// Phase one maps, checks and decodes the files, several at a time, and
+// groups the records of each file by the keydir shard owning their key.
+// Phase two gives every thread a fixed set of shards and replays, shard by
+// shard, the records of all the files in file order, so each key still
+// sees its puts and tombstones in the order the serial loader would apply
+// them. Threads only take their own shard locks; the keydir wide counters
+// and file stats are kept per thread and added in once everything is done.
+typedef struct
+{
+    char*          filename;
+    uint32_t       file_id;
+    uint64_t       data_size;
+    unsigned char* data;
+    size_t         size;
+    int            error;           // as returned by map_hintfile
+    int            truncated;
+    uint64_t       trunc_offset;
+    uint32_t       trunc_total_sz;
+    size_t*        rec_pos;         // record offsets, grouped by shard
+    size_t         shard_start[BITCASK_KEYDIR_SHARDS + 1];
+} hint_load_file;
+
+typedef struct
+{
+    bitcask_keydir* keydir;
+    hint_load_file* files;
+    unsigned int    nfiles;
+    unsigned int    nthreads;
+    ErlNifMutex*    mutex;          // guards next_file
+    unsigned int    next_file;
+    uint64_t        epoch;
+} hint_load_ctx;
+
+typedef struct
+{
+    hint_load_ctx*  ctx;
+    unsigned int    index;
+    ErlNifTid       tid;
+    int             started;
+    int64_t         key_count;
+    int64_t         key_bytes;
+    uint32_t        biggest_file_id;
+    fstats_hash_t*  fstats;
+} hint_load_worker;
+
+static void parse_hint_load_file(bitcask_keydir* keydir, hint_load_file* file)
+{
+    file->error = map_hintfile(file->filename, &file->data, &file->size);
+    if (file->error != 0)
     {
-        if (is_entry_list)
-        {
-            // Convert list to regular entry
-            khiter_t itr = kh_get(entries, keydir->entries, cur_entry);
-            bitcask_keydir_entry_head* h = GET_ENTRY_LIST_POINTER(cur_entry);
+        file->data = NULL;
+        return;
+    }
 
-            bitcask_keydir_entry* new_entry =
-                malloc(sizeof(bitcask_keydir_entry) +
-                       h->key_sz);
-            new_entry->file_id = upd_entry->file_id;
-            new_entry->total_sz = upd_entry->total_sz;
-            new_entry->offset = upd_entry->offset;
-            new_entry->epoch = upd_entry->epoch;
-            new_entry->tstamp = upd_entry->tstamp;
-            new_entry->key_sz = h->key_sz;
-            memcpy(new_entry->key, h->key, h->key_sz);
-            kh_key(keydir->entries, itr) = new_entry;
+    size_t body_sz = file->size - HINT_RECORD_SZ;
+    size_t max_recs = body_sz / HINT_RECORD_SZ;
+    size_t* pos_buf = enif_alloc(sizeof(size_t) * (max_recs + 1));
+    unsigned char* shard_buf = enif_alloc(max_recs + 1);
+    size_t counts[BITCASK_KEYDIR_SHARDS] = {0};
+    size_t nrecs = 0;
+    size_t pos = 0;
+    int s;
 
-            free_entry_list(cur_entry);
-        }
-        else // regular entry, no iteration
+    while (pos < body_sz)
+    {
+        hint_record r;
+        decode_hint_record(file->data + pos, &r);
+
+        if (r.offset + r.total_sz > file->data_size + 1)
         {
-            update_regular_entry(cur_entry, upd_entry);
+            file->truncated = 1;
+            file->trunc_offset = r.offset;
+            file->trunc_total_sz = r.total_sz;
+            break;
         }
+
+        bitcask_keydir_shard* shard =
+            keydir_shard(keydir, file->data + pos + HINT_RECORD_SZ, r.key_sz);
+        pos_buf[nrecs] = pos;
+        shard_buf[nrecs] = (unsigned char)(shard - keydir->shards);
+        counts[shard_buf[nrecs]]++;
+        nrecs++;
+        pos += hint_record_len(&r);
+    }
+
+    // Counting sort by shard, keeping file order within a shard
+    file->shard_start[0] = 0;
+    for (s = 0; s < BITCASK_KEYDIR_SHARDS; s++)
+    {
+        file->shard_start[s + 1] = file->shard_start[s] + counts[s];
+        counts[s] = file->shard_start[s];
+    }
+    file->rec_pos = enif_alloc(sizeof(size_t) * (nrecs + 1));
+    for (pos = 0; pos < nrecs; pos++)
+    {
+        file->rec_pos[counts[shard_buf[pos]]++] = pos_buf[pos];
     }
+
+    enif_free(pos_buf);
+    enif_free(shard_buf);
 }
 
-// Remove entry from either hash and free its memory.
-static void remove_entry(bitcask_keydir* keydir, khiter_t itr)
+static void* hint_parse_worker(void* arg)
 {
-    bitcask_keydir_entry * entry = kh_key(keydir->entries, itr);
-    kh_del(entries, keydir->entries, itr);
-    free_entry(entry);
+    hint_load_worker* w = (hint_load_worker*)arg;
+    hint_load_ctx* ctx = w->ctx;
+
+    for (;;)
+    {
+        enif_mutex_lock(ctx->mutex);
+        unsigned int i = ctx->next_file++;
+        enif_mutex_unlock(ctx->mutex);
+
+        if (i >= ctx->nfiles)
+        {
+            return NULL;
+        }
+        parse_hint_load_file(ctx->keydir, &ctx->files[i]);
+    }
 }
 
-static void perhaps_sweep_siblings(bitcask_keydir* keydir)
+// Same outcome as do_keydir_put with newest_put = 0 followed by
+// do_keydir_remove for tombstones, for a keydir nobody is iterating.
+static void apply_hint_record(hint_load_worker* w, bitcask_keydir_shard* shard,
+                              hint_load_file* file, size_t pos)
 {
-    int i;
-    bitcask_keydir_entry* current_entry;
-    bitcask_keydir_entry_proxy proxy;
-    struct timeval target, now;
-    suseconds_t max_usec = 600;
+    bitcask_keydir* keydir = w->ctx->keydir;
+    hint_record r;
+    ErlNifBinary key;
+    find_result f;
 
-    assert(keydir != NULL);
+    decode_hint_record(file->data + pos, &r);
+    key.data = file->data + pos + HINT_RECORD_SZ;
+    key.size = r.key_sz;
 
-    /* fprintf(stderr, "keydir iter_mutation %d sweep_last_generation %d iter_generation %d\r\n", keydir->iter_mutation,keydir->sweep_last_generation,keydir->iter_generation); */
-    if (keydir->keyfolders > 0 ||
-        keydir->iter_mutation == 0 ||
-        keydir->sweep_last_generation == keydir->iter_generation)
+    find_keydir_entry(shard, &key, MAX_EPOCH, &f);
+
+    if (r.is_tombstone)
     {
+        if (f.found && !f.proxy.is_tombstone)
+        {
+            w->key_count--;
+            w->key_bytes -= f.proxy.key_sz;
+            update_fstats_hash(w->fstats, f.proxy.file_id, f.proxy.tstamp,
+                               MAX_EPOCH, -1, 0, -f.proxy.total_sz, 0, 1);
+            remove_entry(shard, f.itr);
+        }
         return;
     }
 
-#ifdef  PULSE
-    i = 10;
-#else   /* PULSE */
-    i = 100*1000;
-#endif
+    bitcask_keydir_entry_proxy entry;
+    entry.key = (char*)key.data;
+    entry.key_sz = key.size;
+    entry.file_id = file->file_id;
+    entry.total_sz = r.total_sz;
+    entry.offset = r.offset;
+    entry.tstamp = r.tstamp;
+    entry.expiry = hint_record_expiry(file->data + pos, &r);
+    entry.epoch = w->ctx->epoch;
+
+    if (!f.found || f.proxy.is_tombstone)
+    {
+        w->key_count++;
+        w->key_bytes += key.size;
+        update_fstats_hash(w->fstats, entry.file_id, entry.tstamp, MAX_EPOCH,
+                           1, 1, entry.total_sz, entry.total_sz, 1);
+    }
+    else if ((f.proxy.tstamp < entry.tstamp) ||
+             (f.proxy.file_id < entry.file_id) ||
+             ((f.proxy.file_id == entry.file_id) &&
+              (f.proxy.offset < entry.offset)))
+    {
+        if (f.proxy.file_id != entry.file_id)
+        {
+            update_fstats_hash(w->fstats, f.proxy.file_id, 0, MAX_EPOCH,
+                               -1, 0, -f.proxy.total_sz, 0, 1);
+            update_fstats_hash(w->fstats, entry.file_id, entry.tstamp,
+                               MAX_EPOCH, 1, 1,
+                               entry.total_sz, entry.total_sz, 1);
+        }
+        else
+        {
+            update_fstats_hash(w->fstats, entry.file_id, entry.tstamp,
+                               MAX_EPOCH, 0, 1,
+                               entry.total_sz - f.proxy.total_sz,
+                               entry.total_sz, 1);
+        }
+    }
+    else
+    {
+        if (!keydir->is_ready)
+        {
+            update_fstats_hash(w->fstats, entry.file_id, entry.tstamp,
+                               MAX_EPOCH, 0, 1, 0, entry.total_sz, 1);
+        }
+        return;
+    }
+
+    if (f.entries_entry)
+    {
+        update_entry(keydir, shard, f.entries_entry, &entry);
+    }
+    else
+    {
+        add_entry(keydir, shard, shard->entries, &entry);
+    }
+    expiry_index_add(keydir, shard, &entry);
 
-    gettimeofday(&target, NULL);
-    target.tv_usec += max_usec;
-    if (target.tv_usec > 1000000)
+    if (entry.file_id > w->biggest_file_id)
     {
-        target.tv_sec++;
-        target.tv_usec = target.tv_usec % 1000000;
+        w->biggest_file_id = entry.file_id;
     }
-    while (i--)
+}
+
+static void* hint_apply_worker(void* arg)
+{
+    hint_load_worker* w = (hint_load_worker*)arg;
+    hint_load_ctx* ctx = w->ctx;
+    unsigned int s, i;
+    size_t j;
+
+    for (s = w->index; s < BITCASK_KEYDIR_SHARDS; s += ctx->nthreads)
     {
-        if ((i % 500) == 0)
-        {
-            gettimeofday(&now, NULL);
-            if (now.tv_sec > target.tv_usec &&
-                now.tv_usec > target.tv_usec)
-            {
-                break;
-            }
-        }
-        if (keydir->sweep_itr >= kh_end(keydir->entries))
-        {
-            keydir->sweep_itr = kh_begin(keydir->entries);
-            keydir->sweep_last_generation = keydir->iter_generation;
-            return;
-        }
-        if (kh_exist(keydir->entries, keydir->sweep_itr))
+        bitcask_keydir_shard* shard = &ctx->keydir->shards[s];
+        LOCK_SHARD(shard);
+        perhaps_sweep_siblings(ctx->keydir, shard);
+        for (i = 0; i < ctx->nfiles; i++)
         {
-            current_entry = kh_key(keydir->entries, keydir->sweep_itr);
-            if (IS_ENTRY_LIST(current_entry))
+            hint_load_file* file = &ctx->files[i];
+            for (j = file->shard_start[s]; j < file->shard_start[s + 1]; j++)
             {
-                if (proxy_kd_entry(current_entry, &proxy))
-                {
-                    if (proxy.is_tombstone)
-                    {
-                        remove_entry(keydir, keydir->sweep_itr);
-                    }
-                    else
-                    {
-                        update_entry(keydir, current_entry, &proxy);
-                    }
-                }
+                apply_hint_record(w, shard, file, file->rec_pos[j]);
             }
         }
-        keydir->sweep_itr++;
+        UNLOCK_SHARD(shard);
     }
+    return NULL;
 }
 
-// Adds a tombstone to an existing entries hash entry. Regular entries are
-// converted to lists first. Only to be called during iterations.
-// Entries are simply removed when there are no iterations.
-static void set_entry_tombstone(bitcask_keydir* keydir, khiter_t itr,
-                                uint32_t remove_time,
-                                uint64_t remove_epoch)
+// Runs fun on nthreads workers, falling back to the calling thread for any
+// worker that could not be started.
+static void run_hint_load_workers(hint_load_worker* workers,
+                                  unsigned int nthreads,
+                                  void* (*fun)(void*))
 {
-    bitcask_keydir_entry_proxy tombstone;
-    tombstone.tstamp = remove_time;
-    tombstone.epoch = remove_epoch;
-    tombstone.offset = MAX_OFFSET;
-    tombstone.total_sz = MAX_SIZE;
-    tombstone.file_id = MAX_FILE_ID;
-    tombstone.key_sz = 0;
-
-    bitcask_keydir_entry * entry= kh_key(keydir->entries, itr);
-    if (!IS_ENTRY_LIST(entry))
+    unsigned int i;
+    for (i = 1; i < nthreads; i++)
     {
-        // update into an entry list
-        bitcask_keydir_entry* new_entry_list;
-        new_entry_list = new_kd_entry_list(entry, &tombstone);
-        kh_key(keydir->entries, itr) = new_entry_list;
-        free(entry);
+        workers[i].started =
+            enif_thread_create("bitcask_hint_load", &workers[i].tid,
+                               fun, &workers[i], NULL) == 0;
     }
-    else
+    fun(&workers[0]);
+    for (i = 1; i < nthreads; i++)
     {
-        //need to update the entry list with a tombstone
-        update_kd_entry_list(entry, &tombstone, keydir->keyfolders > 0);
+        if (workers[i].started)
+        {
+            enif_thread_join(workers[i].tid, NULL);
+        }
+        else
+        {
+            fun(&workers[i]);
+        }
     }
 }
 
-// Adds or updates an entry in the pending hash if they keydir is frozen
-// or in the entries hash otherwise.
-static void put_entry(bitcask_keydir * keydir, find_result * r,
-                      bitcask_keydir_entry_proxy * entry)
+// Adds the stats gathered by a worker into the keydir's. Counts are
+// deltas; the tstamps follow the same rules as update_fstats.
+static void merge_fstats(fstats_hash_t* into, bitcask_fstats_entry* from)
 {
-    // found in pending (keydir is frozen), update that one
-    if (r->pending_entry)
+    bitcask_fstats_entry* entry;
+    khiter_t itr = kh_get(fstats, into, from->file_id);
+
+    if (itr == kh_end(into))
     {
-        update_regular_entry(r->pending_entry, entry);
+        entry = malloc(sizeof(bitcask_fstats_entry));
+        memcpy(entry, from, sizeof(bitcask_fstats_entry));
+        kh_put2(fstats, into, from->file_id, entry);
+        return;
     }
-    // iterating (frozen) and not found in pending, add to pending
-    else if (keydir->pending)
+
+    entry = kh_val(into, itr);
+    entry->live_keys   += from->live_keys;
+    entry->total_keys  += from->total_keys;
+    entry->live_bytes  += from->live_bytes;
+    entry->total_bytes += from->total_bytes;
+
+    if (from->expiration_epoch < entry->expiration_epoch)
     {
-        add_entry(keydir, keydir->pending, entry);
-        keydir->pending_updated++;
+        entry->expiration_epoch = from->expiration_epoch;
     }
-    // found in entries, update that one
-    else if (r->entries_entry)
+
+    if ((from->oldest_tstamp != 0 &&
+         from->oldest_tstamp < entry->oldest_tstamp) ||
+        entry->oldest_tstamp == 0)
     {
-        update_entry(keydir, r->entries_entry, entry);
+        entry->oldest_tstamp = from->oldest_tstamp;
     }
-    // Not found and not frozen, add to entries
-    else
+
+    if ((from->newest_tstamp != 0 &&
+         from->newest_tstamp > entry->newest_tstamp) ||
+        entry->newest_tstamp == 0)
     {
-        add_entry(keydir, keydir->entries, entry);
+        entry->newest_tstamp = from->newest_tstamp;
     }
+}
 
-    if (entry->file_id > keydir->biggest_file_id)
+static int get_hint_load_file(ErlNifEnv* env, ERL_NIF_TERM term,
+                              hint_load_file* file)
+{
+    const ERL_NIF_TERM* items;
+    int arity;
+    unsigned int len;
+    ErlNifUInt64 data_size;
+
+    if (!(enif_get_tuple(env, term, &arity, &items) && arity == 3 &&
+          enif_get_list_length(env, items[0], &len) &&
+          enif_get_uint(env, items[1], &file->file_id) &&
+          enif_get_uint64(env, items[2], &data_size)))
     {
-        keydir->biggest_file_id = entry->file_id;
+        return 0;
     }
+
+    file->data_size = data_size;
+    file->filename = enif_alloc(len + 1);
+    return enif_get_string(env, items[0], file->filename, len + 1,
+                           ERL_NIF_LATIN1) > 0;
 }
 
-ERL_NIF_TERM bitcask_nifs_keydir_put_int(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+// Loads the hint files in the list, applying them in list order, using up
+// to Threads threads. Expects a keydir nobody is iterating and returns
+// {error, iteration_in_process} otherwise.
+//
+// Returns a list with one element per file: ok, {trunc_hintfile, Offset,
+// TotalSz} or {error, Reason} as keydir_load_hintfile_int does. Loading
+// stops at the first file returning an error, and the files after it come
+// back as not_loaded.
+ERL_NIF_TERM bitcask_nifs_keydir_load_hintfiles(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
     bitcask_keydir_handle* handle;
-    bitcask_keydir_entry_proxy entry;
-    ErlNifBinary key;
-    uint32_t nowsec;
-    uint32_t newest_put;
-    uint32_t old_file_id;
-    uint64_t old_offset;
+    unsigned int nfiles;
+    unsigned int nthreads;
 
-    if (enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle) &&
-        enif_inspect_binary(env, argv[1], &key) &&
-        enif_get_uint(env, argv[2], &(entry.file_id)) &&
-        enif_get_uint(env, argv[3], &(entry.total_sz)) &&
-        enif_get_uint64_bin(env, argv[4], &(entry.offset)) &&
-        enif_get_uint(env, argv[5], &(entry.tstamp)) &&
-        enif_get_uint(env, argv[6], &(nowsec)) &&
-        enif_get_uint(env, argv[7], &(newest_put)) &&
-        enif_get_uint(env, argv[8], &(old_file_id)) &&
-        enif_get_uint64_bin(env, argv[9], &(old_offset)))
+    if (!(enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle) &&
+          enif_get_list_length(env, argv[1], &nfiles) &&
+          enif_get_uint(env, argv[2], &nthreads)))
     {
-        bitcask_keydir* keydir = handle->keydir;
-        entry.key = (char*)key.data;
-        entry.key_sz = key.size;
-
-        LOCK(keydir);
-        DEBUG2("LINE %d put\r\n", __LINE__);
-
-        DEBUG_BIN(dbgKey, key.data, key.size);
-        DEBUG("+++ Put key = %s file_id=%d offset=%d total_sz=%d tstamp=%u old_file_id=%d\r\n",
-                dbgKey,
-              (int) entry.file_id, (int) entry.offset,
-              (int)entry.total_sz, (unsigned) entry.tstamp, (int)old_file_id);
-        DEBUG_KEYDIR(keydir);
+        return enif_make_badarg(env);
+    }
 
-        perhaps_sweep_siblings(handle->keydir);
+    bitcask_keydir* keydir = handle->keydir;
+    hint_load_file* files = enif_alloc(sizeof(hint_load_file) * (nfiles + 1));
+    memset(files, '\0', sizeof(hint_load_file) * (nfiles + 1));
 
-        find_result f;
-        find_keydir_entry(keydir, &key, MAX_EPOCH, &f);
+    ERL_NIF_TERM list = argv[1];
+    ERL_NIF_TERM head;
+    ERL_NIF_TERM result;
+    unsigned int i, cut;
 
-        // If conditional put and not found, bail early
-        if ((!f.found || f.proxy.is_tombstone)
-                && old_file_id != 0)
+    for (i = 0; enif_get_list_cell(env, list, &head, &list); i++)
+    {
+        if (!get_hint_load_file(env, head, &files[i]))
         {
-            DEBUG2("LINE %d put -> already_exists\r\n", __LINE__);
-            UNLOCK(keydir);
-            return ATOM_ALREADY_EXISTS;
+            result = enif_make_badarg(env);
+            goto cleanup;
         }
+    }
 
-        keydir->epoch += 1; //don't worry about backing this out if we bail
-        entry.epoch = keydir->epoch;
-
-        // If put would resize and iterating, start pending hash
-        if (kh_put_will_resize(entries, keydir->entries) &&
-            keydir->keyfolders != 0 &&
-            (keydir->pending == NULL))
-        {
-            keydir->pending = kh_init(entries);
-            keydir->pending_start_epoch = keydir->epoch;
-            keydir->pending_start_time = nowsec;
-        }
+    LOCK(keydir);
+    int iterating = keydir->keyfolders != 0 || keydir->pending_shards != 0;
+    uint64_t epoch = keydir->epoch + 1;
+    UNLOCK(keydir);
 
-        if (!f.found || f.proxy.is_tombstone)
-        {
-            if ((newest_put &&
-                 (entry.file_id < keydir->biggest_file_id)) ||
-                old_file_id != 0) {
-                /*
-                 * Really, it doesn't exist.  But the atom 'already_exists'
-                 * is also a signal that a merge has incremented the
-                 * keydir->biggest_file_id and that we need to retry this
-                 * operation after Erlang-land has re-written the key & val
-                 * to a new location in the same-or-bigger file id.
-                 */
-                DEBUG2("LINE %d put -> already_exists\r\n", __LINE__);
-                UNLOCK(keydir);
-                return ATOM_ALREADY_EXISTS;
-            }
+    if (iterating)
+    {
+        result = enif_make_tuple2(env, ATOM_ERROR, ATOM_ITERATION_IN_PROCESS);
+        goto cleanup;
+    }
 
-            keydir->key_count++;
-            keydir->key_bytes += key.size;
-            if (keydir->keyfolders > 0)
-            {
-                keydir->iter_mutation = 1;
-            }
+    if (nthreads < 1)
+    {
+        nthreads = 1;
+    }
+    else if (nthreads > BITCASK_KEYDIR_SHARDS)
+    {
+        nthreads = BITCASK_KEYDIR_SHARDS;
+    }
+
+    hint_load_ctx ctx;
+    hint_load_worker workers[BITCASK_KEYDIR_SHARDS];
+    memset(&ctx, '\0', sizeof(ctx));
+    memset(workers, '\0', sizeof(workers));
+    ctx.keydir = keydir;
+    ctx.files = files;
+    ctx.nfiles = nfiles;
+    ctx.nthreads = nthreads < nfiles ? nthreads : (nfiles ? nfiles : 1);
+    ctx.mutex = enif_mutex_create("bitcask_hint_load");
+    ctx.epoch = epoch;
+    for (i = 0; i < nthreads; i++)
+    {
+        workers[i].ctx = &ctx;
+        workers[i].index = i;
+        workers[i].fstats = kh_init(fstats);
+    }
 
-            // Increment live and total stats.
-            update_fstats(env, keydir, entry.file_id, entry.tstamp, MAX_EPOCH,
-                          1, 1, entry.total_sz, entry.total_sz, 1);
+    run_hint_load_workers(workers, ctx.nthreads, hint_parse_worker);
 
-            put_entry(keydir, &f, &entry);
+    for (cut = 0; cut < nfiles && files[cut].error == 0; cut++)
+    {
+    }
 
-            DEBUG("+++ Put new\r\n");
-            DEBUG_KEYDIR(keydir);
+    ctx.nfiles = cut;
+    ctx.nthreads = nthreads;
+    run_hint_load_workers(workers, nthreads, hint_apply_worker);
 
-            DEBUG2("LINE %d put -> ok (!found || !tombstone)\r\n", __LINE__);
-            UNLOCK(keydir);
-            return ATOM_OK;
-        }
+    LOCK(keydir);
+    keydir->epoch = epoch;
+    for (i = 0; i < nthreads; i++)
+    {
+        khiter_t itr;
+        fstats_hash_t* fstats = workers[i].fstats;
 
-        // Putting only if replacing this file/offset entry, fail otherwise.
-        // This is an important part of our optimistic concurrency mechanisms
-        // to resolve races between writers (main and merge currently).
-        if (old_file_id != 0 &&
-                // This line is tricky: We are trying to detect a merge putting
-                // a value that replaces another value that same merge just put
-                // (so same output file).  Because when it does that, it has
-                // replaced a previous value with smaller file/offset.  It then
-                // found yet another value that is also current and should
-                // be written to the merge file, but since it has smaller file/ofs
-                // than the newly merged value (in a new merge file), it is
-                // ignored. This happens with values from the same second,
-                // since the out of date logic in merge uses timestamps.
-            (newest_put || entry.file_id != f.proxy.file_id) &&
-            !(old_file_id == f.proxy.file_id &&
-              old_offset == f.proxy.offset))
-        {
-            DEBUG("++ Conditional not match\r\n");
-            DEBUG2("LINE %d put -> already_exists/cond bad match\r\n", __LINE__);
-            UNLOCK(keydir);
-            return ATOM_ALREADY_EXISTS;
+        keydir->key_count += (uint64_t)workers[i].key_count;
+        keydir->key_bytes += (uint64_t)workers[i].key_bytes;
+        if (workers[i].biggest_file_id > keydir->biggest_file_id)
+        {
+            keydir->biggest_file_id = workers[i].biggest_file_id;
         }
 
-        // Avoid updating with stale data. Allow if:
-        // - If real put to current write file, not a stale one
-        // - If internal put (from merge, etc) with newer timestamp
-        // - If internal put with a higher file id or higher offset
-        if ((newest_put &&
-             (entry.file_id >= keydir->biggest_file_id)) ||
-            (! newest_put &&
-             (f.proxy.tstamp < entry.tstamp)) ||
-            (! newest_put &&
-             ((f.proxy.file_id < entry.file_id) ||
-              (((f.proxy.file_id == entry.file_id) &&
-                (f.proxy.offset < entry.offset))))))
+        for (itr = kh_begin(fstats); itr != kh_end(fstats); ++itr)
         {
-            if (keydir->keyfolders > 0)
+            if (kh_exist(fstats, itr))
             {
-                keydir->iter_mutation = 1;
-            }
-            // Remove the stats for the old entry and add the new
-            if (f.proxy.file_id != entry.file_id) // different files
-            {
-                update_fstats(env, keydir, f.proxy.file_id, 0, MAX_EPOCH,
-                              -1, 0,
-                              -f.proxy.total_sz, 0, 0);
-                update_fstats(env, keydir, entry.file_id, entry.tstamp,
-                              MAX_EPOCH, 1, 1,
-                              entry.total_sz, entry.total_sz, 1);
-            }
-            else // file_id is same, change live/total in one entry
-            {
-                update_fstats(env, keydir, entry.file_id, entry.tstamp,
-                              MAX_EPOCH, 0, 1,
-                              entry.total_sz - f.proxy.total_sz,
-                              entry.total_sz, 1);
+                bitcask_fstats_entry* curr_f = kh_val(fstats, itr);
+                merge_fstats(keydir->fstats, curr_f);
+                free(curr_f);
             }
+        }
+        kh_destroy(fstats, fstats);
+    }
+    UNLOCK(keydir);
+    enif_mutex_destroy(ctx.mutex);
 
-            put_entry(keydir, &f, &entry);
-            DEBUG2("LINE %d put -> ok\r\n", __LINE__);
-            UNLOCK(keydir);
-            DEBUG("Finished put\r\n");
-            DEBUG_KEYDIR(keydir);
-            return ATOM_OK;
+    result = enif_make_list(env, 0);
+    for (i = nfiles; i-- > 0; )
+    {
+        ERL_NIF_TERM status;
+        if (i > cut)
+        {
+            status = ATOM_NOT_LOADED;
+        }
+        else if (i == cut)
+        {
+            status = map_hintfile_error(env, files[i].error);
+        }
+        else if (files[i].truncated)
+        {
+            status = enif_make_tuple3(env, ATOM_TRUNC_HINTFILE,
+                                      enif_make_uint64(env, files[i].trunc_offset),
+                                      enif_make_uint(env, files[i].trunc_total_sz));
         }
         else
         {
-            // If not live yet, live stats are not updated, but total stats are
-            if (!keydir->is_ready)
-            {
-                update_fstats(env, keydir, entry.file_id, entry.tstamp,
-                              MAX_EPOCH, 0, 1, 0, entry.total_sz, 1);
-            }
-            DEBUG2("LINE %d put -> already_exists end\r\n", __LINE__);
-            UNLOCK(keydir);
-            DEBUG("No update\r\n");
-            return ATOM_ALREADY_EXISTS;
+            status = ATOM_OK;
         }
+        result = enif_make_list_cell(env, status, result);
     }
-    else
+
+cleanup:
+    for (i = 0; i < nfiles; i++)
     {
-        return enif_make_badarg(env);
+        if (files[i].data)
+        {
+            munmap(files[i].data, files[i].size);
+        }
+        if (files[i].rec_pos)
+        {
+            enif_free(files[i].rec_pos);
+        }
+        if (files[i].filename)
+        {
+            enif_free(files[i].filename);
+        }
     }
+    enif_free(files);
+    return result;
 }
 
-/* int erts_printf(const char *, ...); */
+// Keydir snapshot files, written by keydir_write_snapshot/3 and read back
+// by keydir_load_snapshot/3. All integers are big endian:
+//
+//   "BCKS" Version:32 NumFiles:32 NumFstats:32
+//   NumFiles x (FileId:32 DataSize:64 HintSize:64) data files covered
+//   NumFstats x (FileId:32 LiveKeys:64 LiveBytes:64 TotalKeys:64
+//                TotalBytes:64 OldestTstamp:32 NewestTstamp:32
+//                ExpirationEpoch:64)
+//   N x (KeySz:16 TotalSz:32 FileId:32 Tstamp:32 Offset:64 Expiry:32 Key)
+//   N:64 CRC:32                                    CRC of all before it
+//
+// Version 1 snapshots, from before keys had an expiry time, are out of
+// date and the keydir is loaded from the hint files instead.
+#define SNAPSHOT_MAGIC "BCKS"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_HEADER_SZ 16
+#define SNAPSHOT_FILE_SZ 20
+#define SNAPSHOT_FSTATS_SZ 60
+#define SNAPSHOT_ENTRY_SZ 26
+#define SNAPSHOT_TRAILER_SZ 12
+#define SNAPSHOT_BUF_SZ (1024 * 1024)
 
-ERL_NIF_TERM bitcask_nifs_keydir_get_int(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+typedef struct
 {
-    bitcask_keydir_handle* handle;
-    ErlNifBinary key;
-    uint64 epoch; //intentionally odd type to get around warnings
-
-    if (enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle) &&
-        enif_inspect_binary(env, argv[1], &key) &&
-        enif_get_uint64(env, argv[2], &epoch))
+    int            fd;
+    unsigned char* buf;
+    size_t         len;
+    uint32_t       crc;
+    int            error;
+} snapshot_writer;
+
+static void snapshot_flush(snapshot_writer* w)
+{
+    size_t done = 0;
+    while (w->error == 0 && done < w->len)
     {
-        bitcask_keydir* keydir = handle->keydir;
-        LOCK(keydir);
-
-        DEBUG_BIN(dbgKey, key.data, key.size);
-        DEBUG("+++ Get %s time = %lu\r\n", dbgKey, epoch);
-
-        perhaps_sweep_siblings(handle->keydir);
-
-        find_result f;
-        find_keydir_entry(keydir, &key, epoch, &f);
-
-        if (f.found && !f.proxy.is_tombstone)
+        ssize_t n = write(w->fd, w->buf + done, w->len - done);
+        if (n < 0)
         {
-            ERL_NIF_TERM result;
-            result = enif_make_tuple6(env,
-                                      ATOM_BITCASK_ENTRY,
-                                      argv[1], /* Key */
-                                      enif_make_uint(env, f.proxy.file_id),
-                                      enif_make_uint(env, f.proxy.total_sz),
-                                      enif_make_uint64_bin(env, f.proxy.offset),
-                                      enif_make_uint(env, f.proxy.tstamp));
-            DEBUG(" ... returned value file id=%u size=%u ofs=%u tstamp=%u tomb=%u\r\n",
-                  f.proxy.file_id, f.proxy.total_sz, f.proxy.offset, f.proxy.tstamp,
-                  (unsigned)f.proxy.is_tombstone);
-            DEBUG_ENTRY(f.entries_entry ? f.entries_entry : f.pending_entry);
-            UNLOCK(keydir);
-            return result;
+            if (errno != EINTR)
+            {
+                w->error = errno;
+            }
         }
         else
         {
-            DEBUG(" ... not_found\r\n");
-            UNLOCK(keydir);
-            return ATOM_NOT_FOUND;
+            done += n;
         }
     }
-    else
-    {
-        return enif_make_badarg(env);
-    }
+    w->len = 0;
 }
 
-ERL_NIF_TERM bitcask_nifs_keydir_get_epoch(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+static void snapshot_put(snapshot_writer* w, const void* data, size_t sz)
 {
-    bitcask_keydir_handle* handle;
-
-    if (enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle))
+    w->crc = bitcask_crc32(w->crc, data, sz);
+    while (sz > 0)
     {
-        LOCK(handle->keydir);
-        uint64 epoch = handle->keydir->epoch;
-        UNLOCK(handle->keydir);
-        return enif_make_uint64(env, epoch);
+        size_t n = SNAPSHOT_BUF_SZ - w->len;
+        if (n > sz)
+        {
+            n = sz;
+        }
+        memcpy(w->buf + w->len, data, n);
+        w->len += n;
+        data = (const unsigned char*)data + n;
+        sz -= n;
+        if (w->len == SNAPSHOT_BUF_SZ)
+        {
+            snapshot_flush(w);
+        }
     }
-    else
+}
+
+static unsigned char* put_be(unsigned char* p, uint64_t v, int sz)
+{
+    int i;
+    for (i = sz - 1; i >= 0; i--)
     {
-        return enif_make_badarg(env);
+        p[i] = (unsigned char)v;
+        v >>= 8;
     }
+    return p + sz;
 }
 
-ERL_NIF_TERM bitcask_nifs_keydir_remove(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+static uint64_t get_be(const unsigned char* p, int sz)
 {
-    bitcask_keydir_handle* handle;
-    ErlNifBinary key;
-    uint32_t tstamp;
-    uint32_t file_id;
-    uint64_t offset;
-    uint32_t remove_time;
-    // If this call has 6 arguments, this is a conditional removal. We
-    // only want to actually remove the entry if the tstamp, fileid and
-    // offset matches the one provided. A sort of poor-man's CAS.
-    int is_conditional = argc == 6;
-    int common_args_ok =
-        enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle) &&
-        enif_inspect_binary(env, argv[1], &key);
-    int other_args_ok =
-        is_conditional ?
-        (enif_get_uint(env, argv[2], (unsigned int*)&tstamp) &&
-         enif_get_uint(env, argv[3], (unsigned int*)&file_id) &&
-         enif_get_uint64_bin(env, argv[4], (uint64_t*)&offset) &&
-         enif_get_uint(env, argv[5], &remove_time))
-        :
-        ( enif_get_uint(env, argv[2], &remove_time));
-
-    if (common_args_ok && other_args_ok)
-    {
-        bitcask_keydir* keydir = handle->keydir;
-        LOCK(keydir);
+    uint64_t v = 0;
+    int i;
+    for (i = 0; i < sz; i++)
+    {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
 
-        keydir->epoch += 1; // never back out, even if we don't mutate
+// A data file and the size of its hint file, 0 when there is none.
+typedef struct
+{
+    uint32_t file_id;
+    uint64_t size;
+    uint64_t hint_size;
+} snapshot_file;
 
-        DEBUG("+++ Remove %s\r\n", is_conditional ? "conditional" : "");
-        DEBUG_KEYDIR(keydir);
+static int snapshot_file_cmp(const void* a, const void* b)
+{
+    uint32_t x = ((const snapshot_file*)a)->file_id;
+    uint32_t y = ((const snapshot_file*)b)->file_id;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
 
-        perhaps_sweep_siblings(handle->keydir);
+static snapshot_file* find_snapshot_file(snapshot_file* files, unsigned int n,
+                                         uint32_t file_id)
+{
+    snapshot_file key;
+    key.file_id = file_id;
+    return bsearch(&key, files, n, sizeof(snapshot_file), snapshot_file_cmp);
+}
 
-        find_result fr;
-        find_keydir_entry(keydir, &key, keydir->epoch, &fr);
+// Reads a [{FileId, DataSize, HintSize}] list into a new array sorted by
+// file id.
+static snapshot_file* get_snapshot_files(ErlNifEnv* env, ERL_NIF_TERM list,
+                                         unsigned int* count)
+{
+    ERL_NIF_TERM head;
+    unsigned int i;
+    snapshot_file* files;
 
-        if (fr.found && !fr.proxy.is_tombstone)
+    if (!enif_get_list_length(env, list, count))
+    {
+        return NULL;
+    }
+    files = enif_alloc(sizeof(snapshot_file) * (*count + 1));
+    for (i = 0; enif_get_list_cell(env, list, &head, &list); i++)
+    {
+        const ERL_NIF_TERM* items;
+        int arity;
+        ErlNifUInt64 size, hint_size;
+        if (!(enif_get_tuple(env, head, &arity, &items) && arity == 3 &&
+              enif_get_uint(env, items[0], &files[i].file_id) &&
+              enif_get_uint64(env, items[1], &size) &&
+              enif_get_uint64(env, items[2], &hint_size)))
         {
-            // If a conditional remove, bail if not a match.
-            if (is_conditional &&
-                (fr.proxy.tstamp != tstamp ||
-                 fr.proxy.file_id != file_id ||
-                 fr.proxy.offset != offset))
-            {
-                UNLOCK(keydir);
-                DEBUG("+++Conditional no match\r\n");
-                return ATOM_ALREADY_EXISTS;
-            }
+            enif_free(files);
+            return NULL;
+        }
+        files[i].size = size;
+        files[i].hint_size = hint_size;
+    }
+    qsort(files, *count, sizeof(snapshot_file), snapshot_file_cmp);
+    return files;
+}
 
-            // Remove the key from the keydir stats
-            keydir->key_count--;
-            keydir->key_bytes -= fr.proxy.key_sz;
-            if (keydir->keyfolders > 0)
-            {
-                keydir->iter_mutation = 1;
-            }
+static void write_snapshot_contents(snapshot_writer* w, bitcask_keydir* keydir,
+                                    snapshot_file* files, unsigned int nfiles)
+{
+    unsigned char rec[SNAPSHOT_FSTATS_SZ];
+    unsigned char* p;
+    uint64_t nkeys = 0;
+    unsigned int i;
+    khiter_t itr;
 
-            // Remove from file stats
-            update_fstats(env, keydir, fr.proxy.file_id, fr.proxy.tstamp,
-                          MAX_EPOCH, -1, 0, -fr.proxy.total_sz, 0, 0);
+    LOCK(keydir);
+    p = rec;
+    memcpy(p, SNAPSHOT_MAGIC, 4);
+    p = put_be(p + 4, SNAPSHOT_VERSION, 4);
+    p = put_be(p, nfiles, 4);
+    p = put_be(p, kh_size(keydir->fstats), 4);
+    snapshot_put(w, rec, SNAPSHOT_HEADER_SZ);
 
-            // If found an entry in the pending hash, convert it to a tombstone
-            if (fr.pending_entry)
-            {
-                DEBUG2("LINE %d pending put\r\n", __LINE__);
-                set_pending_tombstone(fr.pending_entry);
-                fr.pending_entry->tstamp = remove_time;
-                fr.pending_entry->epoch = keydir->epoch;
-            }
-            // If frozen, add tombstone to pending hash (iteration must have
-            // started between put/remove call in bitcask:delete.
-            else if (keydir->pending)
-            {
-                DEBUG2("LINE %d pending put\r\n", __LINE__);
-                bitcask_keydir_entry* pending_entry =
-                    add_entry(keydir, keydir->pending, &fr.proxy);
-                set_pending_tombstone(pending_entry);
-                pending_entry->tstamp = remove_time;
-                pending_entry->epoch = keydir->epoch;
-            }
-            // If not iterating, just remove.
-            else if(keydir->keyfolders == 0)
+    for (i = 0; i < nfiles; i++)
+    {
+        p = put_be(rec, files[i].file_id, 4);
+        p = put_be(p, files[i].size, 8);
+        p = put_be(p, files[i].hint_size, 8);
+        snapshot_put(w, rec, SNAPSHOT_FILE_SZ);
+    }
+
+    for (itr = kh_begin(keydir->fstats); itr != kh_end(keydir->fstats); ++itr)
+    {
+        if (kh_exist(keydir->fstats, itr))
+        {
+            bitcask_fstats_entry* curr_f = kh_val(keydir->fstats, itr);
+            p = put_be(rec, curr_f->file_id, 4);
+            p = put_be(p, curr_f->live_keys, 8);
+            p = put_be(p, curr_f->live_bytes, 8);
+            p = put_be(p, curr_f->total_keys, 8);
+            p = put_be(p, curr_f->total_bytes, 8);
+            p = put_be(p, curr_f->oldest_tstamp, 4);
+            p = put_be(p, curr_f->newest_tstamp, 4);
+            p = put_be(p, curr_f->expiration_epoch, 8);
+            snapshot_put(w, rec, SNAPSHOT_FSTATS_SZ);
+        }
+    }
+    UNLOCK(keydir);
+
+    for (i = 0; i < BITCASK_KEYDIR_SHARDS && w->error == 0; i++)
+    {
+        bitcask_keydir_shard* shard = &keydir->shards[i];
+        RLOCK_SHARD(shard);
+        for (itr = kh_begin(shard->entries); itr != kh_end(shard->entries); ++itr)
+        {
+            bitcask_keydir_entry_proxy proxy;
+            if (!kh_exist(shard->entries, itr) ||
+                !proxy_kd_entry(kh_key(shard->entries, itr), &proxy) ||
+                proxy.is_tombstone)
             {
-                remove_entry(keydir, fr.itr);
+                continue;
             }
-            // else found in entries while iterating
-            else
+            if (!find_snapshot_file(files, nfiles, proxy.file_id))
             {
-                set_entry_tombstone(keydir, fr.itr, remove_time, keydir->epoch);
+                // Points to a file the caller did not list, give up
+                w->error = -1;
+                break;
             }
-            DEBUG("Removed\r\n");
-            DEBUG_KEYDIR(keydir);
-
-            UNLOCK(keydir);
-            return ATOM_OK;;
+            p = put_be(rec, proxy.key_sz, 2);
+            p = put_be(p, proxy.total_sz, 4);
+            p = put_be(p, proxy.file_id, 4);
+            p = put_be(p, proxy.tstamp, 4);
+            p = put_be(p, proxy.offset, 8);
+            p = put_be(p, proxy.expiry, 4);
+            snapshot_put(w, rec, SNAPSHOT_ENTRY_SZ);
+            snapshot_put(w, proxy.key, proxy.key_sz);
+            nkeys++;
         }
-        else // not found
-        {
-            DEBUG("Not found - not removed\r\n");
-            UNLOCK(keydir);
-            return ATOM_OK;;
-        }
-    } // if args OK
+        RUNLOCK_SHARD(shard);
+    }
 
-    return enif_make_badarg(env);
+    p = put_be(rec, nkeys, 8);
+    snapshot_put(w, rec, 8);
+    put_be(rec, w->crc, 4);
+    snapshot_put(w, rec, 4);
+    snapshot_flush(w);
 }
 
-bitcask_keydir_entry * clone_entry(bitcask_keydir_entry * curr)
+// Writes the live entries and file stats of the keydir to Filename,
+// through a temporary file renamed into place once synced. Files lists
+// every data file the entries may point to, with its size and the size
+// of its hint file. Entries pointing elsewhere make the call fail with
+// {error, out_of_date}; a keydir being iterated makes it fail with
+// {error, iteration_in_process}.
+ERL_NIF_TERM bitcask_nifs_keydir_write_snapshot(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
-    if (IS_ENTRY_LIST(curr))
+    bitcask_keydir_handle* handle;
+    char filename[4096];
+    char tmp_filename[4096 + 4];
+    snapshot_file* files;
+    unsigned int nfiles;
+
+    if (!(enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle) &&
+          enif_get_string(env, argv[1], filename, sizeof(filename), ERL_NIF_LATIN1) > 0 &&
+          (files = get_snapshot_files(env, argv[2], &nfiles)) != NULL))
     {
-        bitcask_keydir_entry_head * curr_head = GET_ENTRY_LIST_POINTER(curr);
-        size_t head_sz = sizeof(bitcask_keydir_entry_head) + curr->key_sz;
-        bitcask_keydir_entry_head * new_head = malloc(head_sz);
-        memcpy(new_head, curr_head, head_sz);
-        bitcask_keydir_entry_sib ** sib_ptr = &new_head->sibs;
-        bitcask_keydir_entry_sib * next_sib = curr_head->sibs;
-        while (next_sib)
-        {
-            bitcask_keydir_entry_sib * sib =
-                malloc(sizeof(bitcask_keydir_entry_sib));
-            memcpy(sib, next_sib, sizeof(bitcask_keydir_entry_sib));
-            *sib_ptr = sib;
-            sib_ptr = &sib->next;
-            next_sib = next_sib->next;
-        }
-        *sib_ptr = NULL;
-        return MAKE_ENTRY_LIST_POINTER(new_head);
+        return enif_make_badarg(env);
     }
-    else
+
+    bitcask_keydir* keydir = handle->keydir;
+    LOCK(keydir);
+    int iterating = keydir->keyfolders != 0 || keydir->pending_shards != 0;
+    UNLOCK(keydir);
+    if (iterating)
     {
-        size_t new_sz = sizeof(bitcask_keydir_entry) + curr->key_sz;
-        bitcask_keydir_entry* new = malloc(new_sz);
-        memcpy(new, curr, new_sz);
-        return curr;
+        enif_free(files);
+        return enif_make_tuple2(env, ATOM_ERROR, ATOM_ITERATION_IN_PROCESS);
     }
-}
 
-ERL_NIF_TERM bitcask_nifs_keydir_copy(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
-{
-    bitcask_keydir_handle* handle;
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", filename);
+    snapshot_writer w;
+    memset(&w, '\0', sizeof(w));
+    w.fd = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, S_IREAD | S_IWRITE);
+    if (w.fd == -1)
+    {
+        enif_free(files);
+        return enif_make_tuple2(env, ATOM_ERROR, errno_atom(env, errno));
+    }
 
-    if (enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle))
+    w.buf = enif_alloc(SNAPSHOT_BUF_SZ);
+    write_snapshot_contents(&w, keydir, files, nfiles);
+    enif_free(w.buf);
+    enif_free(files);
+
+    if (w.error == 0 && fsync(w.fd) == -1)
     {
-        bitcask_keydir* keydir = handle->keydir;
-        LOCK(keydir);
+        w.error = errno;
+    }
+    close(w.fd);
+    if (w.error == 0 && rename(tmp_filename, filename) == -1)
+    {
+        w.error = errno;
+    }
 
-        bitcask_keydir_handle* new_handle = enif_alloc_resource_compat(env,
-                                                                       bitcask_keydir_RESOURCE,
-                                                                       sizeof(bitcask_keydir_handle));
-        memset(handle, '\0', sizeof(bitcask_keydir_handle));
+    if (w.error != 0)
+    {
+        unlink(tmp_filename);
+        return enif_make_tuple2(env, ATOM_ERROR,
+                                w.error == -1 ? ATOM_OUT_OF_DATE :
+                                errno_atom(env, w.error));
+    }
+    return ATOM_OK;
+}
 
-        // Now allocate the actual keydir instance. Because it's unnamed/shared, we'll
-        // leave the name and lock portions null'd out
-        bitcask_keydir* new_keydir = malloc(sizeof(bitcask_keydir));
-        new_handle->keydir = new_keydir;
-        memset(new_keydir, '\0', sizeof(bitcask_keydir));
-        new_keydir->entries  = kh_init(entries);
-        new_keydir->fstats   = kh_init(fstats);
+// Checks the snapshot is intact and still describes the data files in
+// Files: each file it covers must be there with the same data and hint
+// file sizes, and the other files must all be newer. Returns the number of entries, or -1.
+static int64_t check_snapshot(const unsigned char* data, size_t size,
+                              snapshot_file* files, unsigned int nfiles)
+{
+    const unsigned char* p = data;
+    const unsigned char* end;
+    uint32_t snap_nfiles, snap_nfstats, max_file_id = 0;
+    uint64_t nkeys, i;
+    unsigned int j, covered = 0;
+
+    if (size < SNAPSHOT_HEADER_SZ + SNAPSHOT_TRAILER_SZ ||
+        memcmp(p, SNAPSHOT_MAGIC, 4) != 0 ||
+        get_be(p + 4, 4) != SNAPSHOT_VERSION ||
+        get_be(data + size - 4, 4) != bitcask_crc32(0, data, size - 4))
+    {
+        return -1;
+    }
+    snap_nfiles = (uint32_t)get_be(p + 8, 4);
+    snap_nfstats = (uint32_t)get_be(p + 12, 4);
+    nkeys = get_be(data + size - SNAPSHOT_TRAILER_SZ, 8);
+    end = data + size - SNAPSHOT_TRAILER_SZ;
+    p += SNAPSHOT_HEADER_SZ;
 
-        // Deep copy each item from the existing handle
-        khiter_t itr;
-        for (itr = kh_begin(keydir->entries); itr != kh_end(keydir->entries); ++itr)
+    if ((uint64_t)(end - p) < (uint64_t)snap_nfiles * SNAPSHOT_FILE_SZ +
+        (uint64_t)snap_nfstats * SNAPSHOT_FSTATS_SZ)
+    {
+        return -1;
+    }
+    for (j = 0; j < snap_nfiles; j++, p += SNAPSHOT_FILE_SZ)
+    {
+        uint32_t file_id = (uint32_t)get_be(p, 4);
+        snapshot_file* f = find_snapshot_file(files, nfiles, file_id);
+        if (f == NULL || f->size != get_be(p + 4, 8) ||
+            f->hint_size != get_be(p + 12, 8))
         {
-            // Allocate our entry to be inserted into the new table and copy the record
-            // over.
-            if (kh_exist(keydir->entries, itr))
-            {
-                bitcask_keydir_entry* curr = kh_key(keydir->entries, itr);
-                bitcask_keydir_entry* new = clone_entry(curr);
-                kh_put_set(entries, new_keydir->entries, new);
-            }
+            return -1;
         }
-        if (keydir->pending != NULL)
+        if (file_id > max_file_id)
         {
-            DEBUG2("LINE %d pending copy\r\n", __LINE__);
-            for (itr = kh_begin(keydir->pending); itr != kh_end(keydir->pending); ++itr)
-            {
-                // Allocate our entry to be inserted into the new table and copy the record
-                // over.
-                if (kh_exist(keydir->pending, itr))
-                {
-                    bitcask_keydir_entry* curr = kh_key(keydir->pending, itr);
-                    bitcask_keydir_entry* new = clone_entry(curr);
-                    kh_put_set(entries, new_keydir->pending, new);
-                }
-            }
+            max_file_id = file_id;
+        }
+        covered++;
+    }
+    // Files are sorted, so everything not covered must come after them
+    for (j = 0; j < nfiles; j++)
+    {
+        if (files[j].file_id <= max_file_id)
+        {
+            covered--;
         }
+    }
+    if (covered != 0)
+    {
+        return -1;
+    }
 
-        // Deep copy fstats info
-        for (itr = kh_begin(keydir->fstats); itr != kh_end(keydir->fstats); ++itr)
+    p += (size_t)snap_nfstats * SNAPSHOT_FSTATS_SZ;
+    for (i = 0; i < nkeys; i++)
+    {
+        if (end - p < SNAPSHOT_ENTRY_SZ ||
+            (size_t)(end - p) < SNAPSHOT_ENTRY_SZ + get_be(p, 2))
         {
-            if (kh_exist(keydir->fstats, itr))
-            {
-                bitcask_fstats_entry* curr_f = kh_val(keydir->fstats, itr);
-                bitcask_fstats_entry* new_f = malloc(sizeof(bitcask_fstats_entry));
-                memcpy(new_f, curr_f, sizeof(bitcask_fstats_entry));
-                kh_put2(fstats, new_keydir->fstats, new_f->file_id, new_f);
-            }
+            return -1;
         }
+        p += SNAPSHOT_ENTRY_SZ + get_be(p, 2);
+    }
+    return p == end ? (int64_t)nkeys : -1;
+}
 
-        UNLOCK(keydir);
+// Fills an empty keydir from the snapshot in Filename, provided it still
+// matches the data files in Files (see check_snapshot). Returns
+// {ok, CoveredFileIds}, whose entries and stats are now in the keydir;
+// the other files still need to be loaded, oldest first. Returns
+// {error, out_of_date}, {error, not_empty} or {error, Errno} otherwise.
+ERL_NIF_TERM bitcask_nifs_keydir_load_snapshot(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    bitcask_keydir_handle* handle;
+    char filename[4096];
+    snapshot_file* files;
+    unsigned int nfiles;
 
-        ERL_NIF_TERM result = enif_make_resource(env, new_handle);
-        enif_release_resource_compat(env, new_handle);
-        return enif_make_tuple2(env, ATOM_OK, result);
-    }
-    else
+    if (!(enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle) &&
+          enif_get_string(env, argv[1], filename, sizeof(filename), ERL_NIF_LATIN1) > 0 &&
+          (files = get_snapshot_files(env, argv[2], &nfiles)) != NULL))
     {
         return enif_make_badarg(env);
     }
-}
 
-// Helper for bitcask_nifs_keydir_itr to decide if it is valid to iterate over entries.
-// Check the number of updates since pending was created is less than the maximum
-// and that the current view is not too old.
-// Call with ts set to zero to force a wait on any pending keydir.
-// Set maxage or maxputs negative to ignore them.  Set both negative to force
-// using the keydir - useful when a process has waited once and needs to run
-// next time.
-static int can_itr_keydir(bitcask_keydir* keydir, uint32_t ts, int maxage, int maxputs)
-{
-    if (keydir->pending == NULL ||   // not frozen or caller wants to reuse
-        (maxage < 0 && maxputs < 0)) // the exiting freeze
+    bitcask_keydir* keydir = handle->keydir;
+    LOCK(keydir);
+    int not_empty = keydir->key_count != 0 || kh_size(keydir->fstats) != 0;
+    uint64_t epoch = keydir->epoch + 1;
+    UNLOCK(keydir);
+    if (not_empty)
     {
-        DEBUG2("LINE %d can_itr\r\n", __LINE__);
-        return 1;
+        enif_free(files);
+        return enif_make_tuple2(env, ATOM_ERROR, ATOM_NOT_EMPTY);
     }
-    else if (ts == 0 || ts < keydir->pending_start_time)
-    {             // if clock skew (or forced wait), force key folding to wait
-        DEBUG2("LINE %d can_itr\r\n", __LINE__);
-        return 0; // which will fix keydir->pending_start
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+    {
+        enif_free(files);
+        return enif_make_tuple2(env, ATOM_ERROR, errno_atom(env, errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        int error = errno;
+        close(fd);
+        enif_free(files);
+        return enif_make_tuple2(env, ATOM_ERROR, errno_atom(env, error));
+    }
+    size_t size = (size_t)st.st_size;
+    if (size < SNAPSHOT_HEADER_SZ + SNAPSHOT_TRAILER_SZ)
+    {
+        close(fd);
+        enif_free(files);
+        return enif_make_tuple2(env, ATOM_ERROR, ATOM_OUT_OF_DATE);
     }
+    unsigned char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        enif_free(files);
+        return enif_make_tuple2(env, ATOM_ERROR, errno_atom(env, errno));
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(data, size, MADV_SEQUENTIAL);
+#endif
 
+    int64_t nkeys = check_snapshot(data, size, files, nfiles);
+    enif_free(files);
+    if (nkeys < 0)
     {
-        DEBUG2("LINE %d can_itr\r\n", __LINE__);
-        uint64_t age = ts - keydir->pending_start_time;
-        return ((maxage < 0 || age <= maxage) &&
-                (maxputs < 0 || keydir->pending_updated <= maxputs));
+        munmap(data, size);
+        return enif_make_tuple2(env, ATOM_ERROR, ATOM_OUT_OF_DATE);
+    }
+
+    const unsigned char* p = data + SNAPSHOT_HEADER_SZ;
+    uint32_t snap_nfiles = (uint32_t)get_be(data + 8, 4);
+    uint32_t snap_nfstats = (uint32_t)get_be(data + 12, 4);
+    uint32_t biggest_file_id = 0;
+    uint64_t key_bytes = 0;
+    ERL_NIF_TERM covered = enif_make_list(env, 0);
+    uint32_t j;
+    int64_t i;
+
+    for (j = 0; j < snap_nfiles; j++, p += SNAPSHOT_FILE_SZ)
+    {
+        uint32_t file_id = (uint32_t)get_be(p, 4);
+        covered = enif_make_list_cell(env, enif_make_uint(env, file_id), covered);
+        if (file_id > biggest_file_id)
+        {
+            biggest_file_id = file_id;
+        }
+    }
+
+    LOCK(keydir);
+    for (j = 0; j < snap_nfstats; j++, p += SNAPSHOT_FSTATS_SZ)
+    {
+        bitcask_fstats_entry* entry = malloc(sizeof(bitcask_fstats_entry));
+        memset(entry, '\0', sizeof(bitcask_fstats_entry));
+        entry->file_id = (uint32_t)get_be(p, 4);
+        entry->live_keys = get_be(p + 4, 8);
+        entry->live_bytes = get_be(p + 12, 8);
+        entry->total_keys = get_be(p + 20, 8);
+        entry->total_bytes = get_be(p + 28, 8);
+        entry->oldest_tstamp = (uint32_t)get_be(p + 36, 4);
+        entry->newest_tstamp = (uint32_t)get_be(p + 40, 4);
+        entry->expiration_epoch = get_be(p + 44, 8);
+        kh_put2(fstats, keydir->fstats, entry->file_id, entry);
+    }
+    UNLOCK(keydir);
+
+    for (i = 0; i < nkeys; i++)
+    {
+        bitcask_keydir_entry_proxy entry;
+        entry.key_sz = (uint16_t)get_be(p, 2);
+        entry.total_sz = (uint32_t)get_be(p + 2, 4);
+        entry.file_id = (uint32_t)get_be(p + 6, 4);
+        entry.tstamp = (uint32_t)get_be(p + 10, 4);
+        entry.offset = get_be(p + 14, 8);
+        entry.expiry = (uint32_t)get_be(p + 22, 4);
+        entry.key = (char*)p + SNAPSHOT_ENTRY_SZ;
+        entry.epoch = epoch;
+        p += SNAPSHOT_ENTRY_SZ + entry.key_sz;
+
+        bitcask_keydir_shard* shard = keydir_shard(keydir, entry.key, entry.key_sz);
+        LOCK_SHARD(shard);
+        add_entry(keydir, shard, shard->entries, &entry);
+        expiry_index_add(keydir, shard, &entry);
+        UNLOCK_SHARD(shard);
+        key_bytes += entry.key_sz;
+    }
+    munmap(data, size);
+
+    LOCK(keydir);
+    keydir->epoch = epoch;
+    keydir->key_count += nkeys;
+    keydir->key_bytes += key_bytes;
+    if (biggest_file_id > keydir->biggest_file_id)
+    {
+        keydir->biggest_file_id = biggest_file_id;
     }
+    UNLOCK(keydir);
+
+    return enif_make_tuple2(env, ATOM_OK, covered);
 }
 
-ERL_NIF_TERM bitcask_nifs_keydir_itr(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+// Merge copy, see bitcask_nifs:merge_copy/7.
+//
+// A merge cursor scans one input data file and copies the records the live
+// keydir still points at, byte for byte, to the merge output file. The
+// copies are written out before the keydir is moved over to them, with the
+// conditional put bitcask:inner_merge_write/7 makes, so a reader never gets
+// a location that is not on disk yet. Only files whose records can be used
+// as they are come through here: one record per entry, no codec in the
+// value size field and the same checksum as the output file. Records still
+// have their CRC checked, so a damaged one is left to the Erlang fold and
+// its skipping rules instead of being copied. Tombstones and expired
+// records need the policy in bitcask:merge_single_entry/7, so they are
+// handed back to Erlang one at a time, in file order.
+#define MERGE_HEADER_SZ     14          // Crc:32 Tstamp:32 KeySz:16 ValueSz:32
+#define MERGE_BUF_SZ        (1024 * 1024)
+#define MERGE_TOMBSTONE     "bitcask_tombstone"
+#define MERGE_TOMBSTONE_SZ  (sizeof(MERGE_TOMBSTONE) - 1)
+
+typedef struct
 {
-    bitcask_keydir_handle* handle;
+    int            in_fd;
+    int            out_fd;
+    uint32_t       out_file_id;
+    unsigned char* rbuf;        // Bytes of the input file from rbuf_pos on
+    size_t         rbuf_cap;
+    size_t         rbuf_len;
+    uint64_t       rbuf_pos;
+} bitcask_merge_handle;
 
-    if (enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle))
-    {
-        uint32_t ts;
-        int maxage;
-        int maxputs;
+typedef struct
+{
+    unsigned char* data;
+    size_t         len;
+    size_t         cap;
+} merge_buf;
 
-        LOCK(handle->keydir);
-        DEBUG("+++ itr\r\n");
-        bitcask_keydir* keydir = handle->keydir;
+// A record copied to the write buffer, waiting for its keydir update
+typedef struct
+{
+    size_t   rec;               // Position in the write buffer
+    uint32_t tstamp;
+    uint16_t key_sz;
+    uint32_t total_sz;
+    uint64_t old_offset;
+    uint64_t offset;            // In the output file
+} merge_put;
 
-        // If a iterator thread is already active for this keydir, bail
-        if (handle->iterating)
+static unsigned char* merge_buf_reserve(merge_buf* buf, size_t sz)
+{
+    if (buf->len + sz > buf->cap)
+    {
+        size_t cap = buf->cap ? buf->cap : 4096;
+        while (cap < buf->len + sz)
         {
-            UNLOCK(handle->keydir);
-            return enif_make_tuple2(env, ATOM_ERROR, ATOM_ITERATION_IN_PROCESS);
+            cap *= 2;
         }
+        buf->data = enif_realloc(buf->data, cap);
+        buf->cap = cap;
+    }
+    return buf->data + buf->len;
+}
 
-        if (!(enif_get_uint(env, argv[1], &ts) &&
-              enif_get_int(env, argv[2], (int*)&maxage) &&
-              enif_get_int(env, argv[3], (int*)&maxputs)))
+// Makes the read buffer hold the need bytes at pos, reading a whole buffer
+// at a time. Returns how many bytes from pos are buffered, which is less
+// than need at the end of the file, or -1 with errno set.
+static ssize_t merge_fill(bitcask_merge_handle* h, uint64_t pos, size_t need)
+{
+    if (pos >= h->rbuf_pos && pos + need <= h->rbuf_pos + h->rbuf_len)
+    {
+        return (ssize_t)(h->rbuf_pos + h->rbuf_len - pos);
+    }
+
+    size_t want = need > MERGE_BUF_SZ ? need : MERGE_BUF_SZ;
+    if (want > h->rbuf_cap)
+    {
+        h->rbuf = enif_realloc(h->rbuf, want);
+        h->rbuf_cap = want;
+    }
+    h->rbuf_pos = pos;
+    h->rbuf_len = 0;
+    while (h->rbuf_len < want)
+    {
+        ssize_t n = pread(h->in_fd, h->rbuf + h->rbuf_len, want - h->rbuf_len,
+                          (off_t)(pos + h->rbuf_len));
+        if (n == -1 && errno == EINTR)
         {
-            UNLOCK(handle->keydir);
-            return enif_make_badarg(env);
+            continue;
         }
-
-        if (can_itr_keydir(keydir, ts, maxage, maxputs))
+        if (n == -1)
         {
-            keydir->epoch += 1;
-
-            handle->iterating = 1;
-            handle->epoch = keydir->epoch;
-            keydir->newest_folder = keydir->epoch;
-            keydir->keyfolders++;
-            handle->iterator = kh_begin(keydir->entries);
-            DEBUG2("LINE %d itr started, keydir->pending = 0x%lx\r\n", __LINE__, keydir->pending);
-            UNLOCK(handle->keydir);
-            return ATOM_OK;
+            h->rbuf_len = 0;
+            return -1;
         }
-        else
+        if (n == 0)
         {
-            // Grow the pending_awaken array if necessary
-            if (keydir->pending_awaken_count == keydir->pending_awaken_size)
-            {   // Grow 16-at-a-time, expect a single alloc
-                keydir->pending_awaken_size += 16;
-                size_t size = keydir->pending_awaken_size * sizeof(keydir->pending_awaken[0]);
-                if (keydir->pending_awaken == NULL)
-                {
-                    keydir->pending_awaken = malloc(size);
-                }
-                else
-                {
-                    keydir->pending_awaken = realloc(keydir->pending_awaken, size);
-                }
-            }
-            enif_self(env, &keydir->pending_awaken[keydir->pending_awaken_count]);
-            keydir->pending_awaken_count++;
-            DEBUG2("LINE %d itr\r\n", __LINE__);
-            UNLOCK(handle->keydir);
-            return ATOM_OUT_OF_DATE;
+            break;
         }
+        h->rbuf_len += (size_t)n;
     }
-    else
+    return (ssize_t)h->rbuf_len;
+}
+
+static int merge_pwrite(int fd, const unsigned char* data, size_t sz,
+                        uint64_t offset)
+{
+    while (sz > 0)
     {
-        return enif_make_badarg(env);
+        ssize_t n = pwrite(fd, data, sz, (off_t)offset);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1)
+        {
+            return errno;
+        }
+        data += n;
+        sz -= (size_t)n;
+        offset += (uint64_t)n;
     }
+    return 0;
 }
 
-ERL_NIF_TERM bitcask_nifs_keydir_itr_next(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+// Finds the current entry for a key, tombstones being as good as missing
+static int merge_lookup(bitcask_keydir* keydir, ErlNifBinary* key,
+                        bitcask_keydir_entry_proxy* entry)
 {
-    bitcask_keydir_handle* handle;
+    bitcask_keydir_shard* shard = keydir_shard(keydir, key->data, key->size);
+    find_result f;
 
-    if (enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle))
+    RLOCK_SHARD(shard);
+    find_keydir_entry(shard, key, MAX_EPOCH, &f);
+    RUNLOCK_SHARD(shard);
+    if (f.found && !f.proxy.is_tombstone)
     {
-        DEBUG("+++ itr next\r\n");
-        bitcask_keydir* keydir = handle->keydir;
-
-        if (handle->iterating != 1)
-        {
-            DEBUG("Itr not started\r\n");
-            // Iteration not started!
-            return enif_make_tuple2(env, ATOM_ERROR, ATOM_ITERATION_NOT_STARTED);
-        }
+        *entry = f.proxy;
+        return 1;
+    }
+    return 0;
+}
 
-        LOCK(keydir);
+// True when entry makes the record at file_id/offset out of date, as
+// bitcask:out_of_date/8 decides: a newer tstamp, or the same tstamp at a
+// later file or offset.
+static int merge_newer(bitcask_keydir_entry_proxy* entry, uint32_t tstamp,
+                       uint32_t file_id, uint64_t offset)
+{
+    if (entry->tstamp != tstamp)
+    {
+        return entry->tstamp > tstamp;
+    }
+    return entry->file_id > file_id ||
+        (entry->file_id == file_id && entry->offset > offset);
+}
 
-        while (handle->iterator != kh_end(keydir->entries))
-        {
-            if (kh_exist(keydir->entries, handle->iterator))
-            {
-                DEBUG2("LINE %d itr_next\r\n", __LINE__);
-                bitcask_keydir_entry* entry = kh_key(keydir->entries, handle->iterator);
-                ErlNifBinary key;
-                bitcask_keydir_entry_proxy proxy;
+static void merge_hint_record(merge_buf* hints, const unsigned char* key,
+                              uint16_t key_sz, uint32_t tstamp,
+                              uint32_t total_sz, uint64_t offset)
+{
+    unsigned char* p = merge_buf_reserve(hints, HINT_RECORD_SZ + key_sz);
+    p = put_be(p, tstamp, 4);
+    p = put_be(p, key_sz, 2);
+    p = put_be(p, total_sz, 4);
+    p = put_be(p, offset & HINT_MAX_OFFSET, 8);
+    memcpy(p, key, key_sz);
+    hints->len += HINT_RECORD_SZ + key_sz;
+}
 
-                if (!proxy_kd_entry_at_epoch(entry, handle->epoch, &proxy)
-                    || proxy.is_tombstone)
-                {
-                    DEBUG("No value for itr_next");
-                    // No value in the snapshot for the iteration time
-                    (handle->iterator)++;
-                    continue;
-                }
-                DEBUG_BIN(dbgKey, proxy.key, proxy.key_sz);
-                DEBUG("itr_next key=%s", dbgKey);
+// Writes out the copied records, then points the live keydir at the ones
+// it still has at their old location. The others stay in the output file
+// as dead bytes, and in its file stats as such.
+static int merge_flush(ErlNifEnv* env, bitcask_merge_handle* h,
+                       bitcask_keydir* live, uint32_t in_file_id,
+                       merge_buf* wbuf, uint64_t* wbuf_offset,
+                       merge_put* puts, size_t nputs, merge_buf* hints,
+                       uint32_t nowsec)
+{
+    size_t i;
+    int error;
 
-                // Alloc the binary and make sure it succeeded
-                if (!enif_alloc_binary_compat(env, proxy.key_sz, &key))
-                {
-                    UNLOCK(keydir);
-                    return ATOM_ALLOCATION_ERROR;
-                }
+    if (wbuf->len == 0)
+    {
+        return 0;
+    }
+    error = merge_pwrite(h->out_fd, wbuf->data, wbuf->len, *wbuf_offset);
+    if (error != 0)
+    {
+        return error;
+    }
 
-                // Copy the data from our key to the new allocated binary
-                // TODO: If we maintained a ErlNifBinary in the original entry, could we
-                // get away with not doing a copy here?
-                memcpy(key.data, proxy.key, proxy.key_sz);
-                ERL_NIF_TERM curr = enif_make_tuple6(env,
-                                                     ATOM_BITCASK_ENTRY,
-                                                     enif_make_binary(env, &key),
-                                                     enif_make_uint(env, proxy.file_id),
-                                                     enif_make_uint(env, proxy.total_sz),
-                                                     enif_make_uint64_bin(env, proxy.offset),
-                                                     enif_make_uint(env, proxy.tstamp));
-
-                // Update the iterator to the next entry
-                (handle->iterator)++;
-                UNLOCK(keydir);
-                DEBUG("Found entry\r\n");
-                DEBUG_ENTRY(entry);
-                return curr;
-            }
-            else
-            {
-                // No item in this slot; increment the iterator and keep looping
-                (handle->iterator)++;
-            }
+    for (i = 0; i < nputs; i++)
+    {
+        bitcask_keydir_entry_proxy entry;
+        ErlNifBinary key;
+
+        key.data = wbuf->data + puts[i].rec + MERGE_HEADER_SZ;
+        key.size = puts[i].key_sz;
+        entry.file_id = h->out_file_id;
+        entry.total_sz = puts[i].total_sz;
+        entry.offset = puts[i].offset;
+        entry.tstamp = puts[i].tstamp;
+        entry.expiry = 0; // files without codecs hold no expiry times
+        if (do_keydir_put(env, live, &key, &entry, nowsec, 0, in_file_id,
+                          puts[i].old_offset) == ATOM_OK)
+        {
+            merge_hint_record(hints, key.data, puts[i].key_sz,
+                              puts[i].tstamp, puts[i].total_sz,
+                              puts[i].offset);
         }
+        else
+        {
+            LOCK(live);
+            update_fstats(env, live, h->out_file_id, puts[i].tstamp,
+                          MAX_EPOCH, 0, 0, 0, puts[i].total_sz, 1);
+            UNLOCK(live);
+        }
+    }
+    *wbuf_offset += wbuf->len;
+    wbuf->len = 0;
+    return 0;
+}
 
-        UNLOCK(keydir);
-        // The iterator is at the end of the table
-        return ATOM_NOT_FOUND;
+static int merge_open_output(bitcask_merge_handle* h, const char* filename,
+                             uint32_t file_id)
+{
+    if (h->out_fd > -1 && h->out_file_id == file_id)
+    {
+        return 0;
     }
-    else
+    if (h->out_fd > -1)
     {
-        return enif_make_badarg(env);
+        close(h->out_fd);
+    }
+    h->out_fd = open(filename, O_WRONLY);
+    if (h->out_fd == -1)
+    {
+        return errno;
     }
+    h->out_file_id = file_id;
+    return 0;
 }
 
-void itr_release_internal(ErlNifEnv* env, bitcask_keydir_handle* handle)
+ERL_NIF_TERM bitcask_nifs_merge_copy_open(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
-    handle->iterating = 0;
-    handle->keydir->keyfolders--;
-    handle->epoch = MAX_EPOCH;
+    char filename[4096];
 
-    // If last iterator closing, unfreeze keydir and merge pending entries.
-    if (handle->keydir->keyfolders == 0 && handle->keydir->pending != NULL)
+    if (!enif_get_string(env, argv[0], filename, sizeof(filename), ERL_NIF_LATIN1))
     {
-        DEBUG2("LINE %d itr_release\r\n", __LINE__);
-        merge_pending_entries(env, handle->keydir);
-        handle->keydir->iter_generation++;
+        return enif_make_badarg(env);
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+    {
+        return enif_make_tuple2(env, ATOM_ERROR, errno_atom(env, errno));
     }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    bitcask_merge_handle* handle = enif_alloc_resource_compat(env,
+                                                              bitcask_merge_RESOURCE,
+                                                              sizeof(bitcask_merge_handle));
+    memset(handle, '\0', sizeof(bitcask_merge_handle));
+    handle->in_fd = fd;
+    handle->out_fd = -1;
+
+    ERL_NIF_TERM result = enif_make_resource(env, handle);
+    enif_release_resource_compat(env, handle);
+    return enif_make_tuple2(env, ATOM_OK, result);
 }
 
-ERL_NIF_TERM bitcask_nifs_keydir_itr_release(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+static void merge_copy_release(bitcask_merge_handle* handle)
 {
-    bitcask_keydir_handle* handle;
-
-    if (enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle))
+    if (handle->in_fd > -1)
     {
-        LOCK(handle->keydir);
-        if (handle->iterating != 1)
-        {
-            // Iteration not started!
-            UNLOCK(handle->keydir);
-            return enif_make_tuple2(env, ATOM_ERROR, ATOM_ITERATION_NOT_STARTED);
-        }
+        close(handle->in_fd);
+        handle->in_fd = -1;
+    }
+    if (handle->out_fd > -1)
+    {
+        close(handle->out_fd);
+        handle->out_fd = -1;
+    }
+    if (handle->rbuf != NULL)
+    {
+        enif_free(handle->rbuf);
+        handle->rbuf = NULL;
+        handle->rbuf_cap = handle->rbuf_len = 0;
+    }
+}
 
-        itr_release_internal(env, handle);
+ERL_NIF_TERM bitcask_nifs_merge_copy_close(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    bitcask_merge_handle* handle;
 
-        UNLOCK(handle->keydir);
-        return ATOM_OK;
-    }
-    else
+    if (!enif_get_resource(env, argv[0], bitcask_merge_RESOURCE, (void**)&handle))
     {
         return enif_make_badarg(env);
     }
+    merge_copy_release(handle);
+    return ATOM_OK;
 }
 
-ERL_NIF_TERM bitcask_nifs_keydir_info(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+// merge_copy_int(Cursor, LiveKeyDir, DelKeyDir,
+//                {InFileId, InOffset, Checksum},
+//                fresh | {OutFile, OutFileId, OutOffset, OutStart, MaxSize},
+//                ExpiryTime, Budget, NowSec)
+//
+// Copies from InOffset until the end of the file, or until Budget bytes of
+// it have been looked at, and returns {Status, InOffset, OutOffset, Hints}
+// where Hints are the hint records of the copies the keydir now points at.
+// Status is one of
+//   eof | more
+//   wrap          the next copy does not fit in the output file, or there
+//                 is none yet. InOffset is the record to start again from.
+//   {entry, Key, Value, Tstamp, Offset, TotalSz}
+//                 a record for bitcask:merge_single_entry/7. InOffset is
+//                 the record after it.
+//   bad_entry     the record at InOffset fails its CRC
+//   {error, Errno}
+ERL_NIF_TERM bitcask_nifs_merge_copy(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
-    bitcask_keydir_handle* handle;
+    bitcask_merge_handle* handle;
+    bitcask_keydir_handle* live_handle;
+    bitcask_keydir_handle* del_handle;
+    const ERL_NIF_TERM* in;
+    const ERL_NIF_TERM* out;
+    int in_arity, out_arity = 0;
+    uint32_t in_file_id, out_file_id = 0, expiry_time, nowsec;
+    ErlNifUInt64 pos, out_offset = 0, out_start = 0, max_size = 0, budget;
+    char out_filename[4096];
+
+    if (!(enif_get_resource(env, argv[0], bitcask_merge_RESOURCE, (void**)&handle) &&
+          enif_get_resource(env, argv[1], bitcask_keydir_RESOURCE, (void**)&live_handle) &&
+          enif_get_resource(env, argv[2], bitcask_keydir_RESOURCE, (void**)&del_handle) &&
+          enif_get_tuple(env, argv[3], &in_arity, &in) && in_arity == 3 &&
+          enif_get_uint(env, in[0], &in_file_id) &&
+          enif_get_uint64(env, in[1], &pos) &&
+          (in[2] == ATOM_CRC32 || in[2] == ATOM_CRC32C) &&
+          (argv[4] == ATOM_FRESH ||
+           (enif_get_tuple(env, argv[4], &out_arity, &out) && out_arity == 5 &&
+            enif_get_string(env, out[0], out_filename, sizeof(out_filename),
+                            ERL_NIF_LATIN1) > 0 &&
+            enif_get_uint(env, out[1], &out_file_id) &&
+            enif_get_uint64(env, out[2], &out_offset) &&
+            enif_get_uint64(env, out[3], &out_start) &&
+            enif_get_uint64(env, out[4], &max_size) &&
+            out_file_id > in_file_id)) &&
+          enif_get_uint(env, argv[5], &expiry_time) &&
+          enif_get_uint64(env, argv[6], &budget) &&
+          enif_get_uint(env, argv[7], &nowsec) &&
+          handle->in_fd > -1))
+    {
+        return enif_make_badarg(env);
+    }
 
-    if (enif_get_resource(env, argv[0], bitcask_keydir_RESOURCE, (void**)&handle))
+    if (out_arity != 0)
     {
-        bitcask_keydir* keydir = handle->keydir;
+        int error = merge_open_output(handle, out_filename, out_file_id);
+        if (error != 0)
+        {
+            ERL_NIF_TERM no_hints;
+            enif_make_new_binary(env, 0, &no_hints);
+            return enif_make_tuple4(env,
+                                    enif_make_tuple2(env, ATOM_ERROR,
+                                                     errno_atom(env, error)),
+                                    in[1], out[2], no_hints);
+        }
+    }
 
-        if (keydir == NULL)
+    bitcask_keydir* live = live_handle->keydir;
+    bitcask_keydir* del = del_handle->keydir;
+    int crc32c = in[2] == ATOM_CRC32C;
+    uint64_t end = pos + budget;
+    uint64_t wbuf_offset = out_offset;
+    merge_buf wbuf = {NULL, 0, 0};
+    merge_buf hints = {NULL, 0, 0};
+    merge_put* puts = NULL;
+    size_t nputs = 0, puts_cap = 0;
+    ERL_NIF_TERM status = ATOM_EOF;
+    int error = 0;
+
+    while (pos < end)
+    {
+        ssize_t avail = merge_fill(handle, pos, MERGE_HEADER_SZ);
+        if (avail == -1)
         {
-            return enif_make_badarg(env);
+            error = errno;
+            break;
+        }
+        if (avail < MERGE_HEADER_SZ)
+        {
+            // A partly written record at the end is ignored, as the
+            // Erlang fold ignores it
+            status = ATOM_EOF;
+            break;
         }
-        LOCK(keydir);
 
-        // Dump fstats info into a list of [{file_id, live_keys, total_keys,
-        //                                   live_bytes, total_bytes,
-        //                                   oldest_tstamp, newest_tstamp,
-        //                                   expiration_epoch}]
-        ERL_NIF_TERM fstats_list = enif_make_list(env, 0);
-        khiter_t itr;
-        bitcask_fstats_entry* curr_f;
-        for (itr = kh_begin(keydir->fstats); itr != kh_end(keydir->fstats); ++itr)
+        unsigned char* p = handle->rbuf + (pos - handle->rbuf_pos);
+        uint32_t crc = (uint32_t)get_be(p, 4);
+        uint32_t tstamp = (uint32_t)get_be(p + 4, 4);
+        uint16_t key_sz = (uint16_t)get_be(p + 8, 2);
+        uint32_t value_sz = (uint32_t)get_be(p + 10, 4);
+        uint64_t total_sz = MERGE_HEADER_SZ + (uint64_t)key_sz + value_sz;
+
+        avail = merge_fill(handle, pos, (size_t)total_sz);
+        if (avail == -1)
         {
-            if (kh_exist(keydir->fstats, itr))
+            error = errno;
+            break;
+        }
+        if ((uint64_t)avail < total_sz)
+        {
+            status = ATOM_EOF;
+            break;
+        }
+        p = handle->rbuf + (pos - handle->rbuf_pos);
+        if (crc != (crc32c ? bitcask_crc32c(0, p + 4, (size_t)total_sz - 4)
+                           : bitcask_crc32(0, p + 4, (size_t)total_sz - 4)))
+        {
+            status = ATOM_BAD_ENTRY;
+            break;
+        }
+
+        ErlNifBinary key;
+        unsigned char* value = p + MERGE_HEADER_SZ + key_sz;
+        key.data = p + MERGE_HEADER_SZ;
+        key.size = key_sz;
+
+        if (tstamp < expiry_time ||
+            (value_sz >= MERGE_TOMBSTONE_SZ &&
+             memcmp(value, MERGE_TOMBSTONE, MERGE_TOMBSTONE_SZ) == 0))
+        {
+            ERL_NIF_TERM key_term, value_term;
+            memcpy(enif_make_new_binary(env, key_sz, &key_term), key.data,
+                   key_sz);
+            memcpy(enif_make_new_binary(env, value_sz, &value_term), value,
+                   value_sz);
+            status = enif_make_tuple6(env, ATOM_ENTRY, key_term, value_term,
+                                      enif_make_uint(env, tstamp),
+                                      enif_make_uint64(env, pos),
+                                      enif_make_uint64(env, total_sz));
+            pos += total_sz;
+            break;
+        }
+
+        // Out of date against the live keydir, then against the keys this
+        // merge has seen deleted, as bitcask:out_of_date/8 checks them
+        bitcask_keydir_entry_proxy live_entry, del_entry;
+        int live_found = merge_lookup(live, &key, &live_entry);
+        if (live_found && merge_newer(&live_entry, tstamp, in_file_id, pos))
+        {
+            pos += total_sz;
+            continue;
+        }
+        int del_found = merge_lookup(del, &key, &del_entry);
+        if ((del_found && merge_newer(&del_entry, tstamp, in_file_id, pos)) ||
+            (!live_found && !del_found))
+        {
+            pos += total_sz;
+            continue;
+        }
+
+        // A current value. Copy it unless the put that follows would fail
+        // because the keydir has moved on to another location.
+        int copy = live_found && live_entry.file_id == in_file_id &&
+            live_entry.offset == pos;
+        uint64_t out_pos = wbuf_offset + wbuf.len;
+        if (copy &&
+            (out_arity == 0 ||
+             (out_pos > out_start && out_pos + total_sz > max_size)))
+        {
+            status = ATOM_WRAP;
+            break;
+        }
+        if (del_found)
+        {
+            do_keydir_remove(env, del, &key, 0, 0, 0, 0, nowsec);
+        }
+        if (copy)
+        {
+            if (wbuf.len > 0 && wbuf.len + total_sz > MERGE_BUF_SZ)
             {
-                curr_f = kh_val(keydir->fstats, itr);
-                ERL_NIF_TERM fstat =
-                    enif_make_tuple8(env,
-                                     enif_make_uint(env, curr_f->file_id),
-                                     enif_make_ulong(env, curr_f->live_keys),
-                                     enif_make_ulong(env, curr_f->total_keys),
-                                     enif_make_ulong(env, curr_f->live_bytes),
-                                     enif_make_ulong(env, curr_f->total_bytes),
-                                     enif_make_uint(env, curr_f->oldest_tstamp),
-                                     enif_make_uint(env, curr_f->newest_tstamp),
-                                     enif_make_uint64(env, (ErlNifUInt64)curr_f->expiration_epoch));
-                fstats_list = enif_make_list_cell(env, fstat, fstats_list);
+                error = merge_flush(env, handle, live, in_file_id, &wbuf,
+                                    &wbuf_offset, puts, nputs, &hints, nowsec);
+                if (error != 0)
+                {
+                    break;
+                }
+                nputs = 0;
+            }
+            if (nputs == puts_cap)
+            {
+                puts_cap = puts_cap ? puts_cap * 2 : 1024;
+                puts = enif_realloc(puts, sizeof(merge_put) * puts_cap);
             }
+            puts[nputs].rec = wbuf.len;
+            puts[nputs].tstamp = tstamp;
+            puts[nputs].key_sz = key_sz;
+            puts[nputs].total_sz = (uint32_t)total_sz;
+            puts[nputs].old_offset = pos;
+            puts[nputs].offset = out_pos;
+            nputs++;
+            memcpy(merge_buf_reserve(&wbuf, (size_t)total_sz), p,
+                   (size_t)total_sz);
+            wbuf.len += (size_t)total_sz;
         }
+        pos += total_sz;
+    }
 
-        ERL_NIF_TERM iter_info =
-            enif_make_tuple4(env,
-                             enif_make_uint64(env, keydir->iter_generation),
-                             enif_make_ulong(env, keydir->keyfolders),
-                             keydir->pending == NULL ? ATOM_FALSE : ATOM_TRUE,
-                             keydir->pending == NULL ? ATOM_UNDEFINED :
-                             enif_make_uint64(env, keydir->pending_start_epoch));
+    if (pos >= end && error == 0 && status == ATOM_EOF)
+    {
+        status = ATOM_MORE;
+    }
+    if (error == 0)
+    {
+        error = merge_flush(env, handle, live, in_file_id, &wbuf, &wbuf_offset,
+                            puts, nputs, &hints, nowsec);
+    }
 
-        ERL_NIF_TERM result = enif_make_tuple5(env,
-                                               enif_make_uint64(env, keydir->key_count),
-                                               enif_make_uint64(env, keydir->key_bytes),
-                                               fstats_list,
-                                               iter_info,
-                                               enif_make_uint64(env, keydir->epoch));
-        UNLOCK(keydir);
-        return result;
+    // What was written before an error stays written, and is reported
+    // with it, as the keydir may point at it already
+    if (error != 0)
+    {
+        status = enif_make_tuple2(env, ATOM_ERROR, errno_atom(env, error));
     }
-    else
+    ERL_NIF_TERM hints_term;
+    unsigned char* hints_data = enif_make_new_binary(env, hints.len,
+                                                     &hints_term);
+    if (hints.len > 0)
     {
-        return enif_make_badarg(env);
+        memcpy(hints_data, hints.data, hints.len);
     }
+    ERL_NIF_TERM result = enif_make_tuple4(env, status,
+                                           enif_make_uint64(env, pos),
+                                           enif_make_uint64(env, wbuf_offset),
+                                           hints_term);
+
+    enif_free(wbuf.data);
+    enif_free(hints.data);
+    enif_free(puts);
+    return result;
 }
 
 ERL_NIF_TERM bitcask_nifs_keydir_release(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
@@ -2408,6 +6272,33 @@ ERL_NIF_TERM bitcask_nifs_file_sync(ErlNifEnv* env, int argc, const ERL_NIF_TERM
     }
 }
 
+// Like file_sync, but skips flushing metadata that isn't needed to read
+// the data back (e.g. mtime) where the platform allows it.
+ERL_NIF_TERM bitcask_nifs_file_datasync(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    bitcask_file_handle* handle;
+    if (enif_get_resource(env, argv[0], bitcask_file_RESOURCE, (void**)&handle))
+    {
+#if defined(__linux__) || defined(__sun)
+        int rc = fdatasync(handle->fd);
+#else
+        int rc = fsync(handle->fd);
+#endif
+        if (rc != -1)
+        {
+            return ATOM_OK;
+        }
+        else
+        {
+            return enif_make_tuple2(env, ATOM_ERROR, errno_atom(env, errno));
+        }
+    }
+    else
+    {
+        return enif_make_badarg(env);
+    }
+}
+
 ERL_NIF_TERM bitcask_nifs_file_pread(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
 {
     bitcask_file_handle* handle;
@@ -2440,23 +6331,103 @@ ERL_NIF_TERM bitcask_nifs_file_pread(ErlNifEnv* env, int argc, const ERL_NIF_TER
             }
             else
             {
-                /* Realloc failed; cleanup and bail */
-                enif_release_binary(&bin);
-                return enif_make_tuple2(env, ATOM_ERROR, ATOM_ALLOCATION_ERROR);
+                /* Realloc failed; cleanup and bail */
+                enif_release_binary(&bin);
+                return enif_make_tuple2(env, ATOM_ERROR, ATOM_ALLOCATION_ERROR);
+            }
+        }
+        else if (bytes_read == 0)
+        {
+            /* EOF */
+            enif_release_binary(&bin);
+            return ATOM_EOF;
+        }
+        else
+        {
+            /* Read failed altogether */
+            enif_release_binary(&bin);
+            return enif_make_tuple2(env, ATOM_ERROR, errno_atom(env, errno));
+        }
+    }
+    else
+    {
+        return enif_make_badarg(env);
+    }
+}
+
+// Map a whole file read-only. The handle has no descriptor: it only
+// serves file_mmap_pread, and the mapping lives until the handle and every
+// binary made from it are garbage collected.
+ERL_NIF_TERM bitcask_nifs_file_mmap(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    char filename[4096];
+    if (enif_get_string(env, argv[0], filename, sizeof(filename), ERL_NIF_LATIN1))
+    {
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0)
+        {
+            return enif_make_tuple2(env, ATOM_ERROR, errno_atom(env, errno));
+        }
+
+        struct stat st;
+        char* map = NULL;
+        if (fstat(fd, &st) < 0)
+        {
+            int err = errno;
+            close(fd);
+            return enif_make_tuple2(env, ATOM_ERROR, errno_atom(env, err));
+        }
+        if (st.st_size > 0)
+        {
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (map == MAP_FAILED)
+            {
+                int err = errno;
+                close(fd);
+                return enif_make_tuple2(env, ATOM_ERROR, errno_atom(env, err));
             }
+            // Lookups hit single entries; readahead would only waste cache
+            madvise(map, st.st_size, MADV_RANDOM);
         }
-        else if (bytes_read == 0)
+        close(fd);
+
+        bitcask_file_handle* handle = enif_alloc_resource_compat(env,
+                                                                 bitcask_file_RESOURCE,
+                                                                 sizeof(bitcask_file_handle));
+        memset(handle, '\0', sizeof(bitcask_file_handle));
+        handle->fd = -1;
+        handle->map = map;
+        handle->map_size = map ? st.st_size : 0;
+
+        ERL_NIF_TERM result = enif_make_resource(env, handle);
+        enif_release_resource_compat(env, handle);
+        return enif_make_tuple2(env, ATOM_OK, result);
+    }
+    else
+    {
+        return enif_make_badarg(env);
+    }
+}
+
+// Returns {ok, Bin} with Bin pointing straight into the mapping, or eof if
+// the range is not entirely mapped (the file grew after it was mapped, or
+// is shorter than asked for); callers then fall back to file_pread.
+ERL_NIF_TERM bitcask_nifs_file_mmap_pread(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    bitcask_file_handle* handle;
+    unsigned long offset;
+    unsigned long count;
+    if (enif_get_resource(env, argv[0], bitcask_file_RESOURCE, (void**)&handle) &&
+        enif_get_ulong(env, argv[1], &offset) && /* Offset */
+        enif_get_ulong(env, argv[2], &count))    /* Count */
+    {
+        if (offset > handle->map_size || count > handle->map_size - offset)
         {
-            /* EOF */
-            enif_release_binary(&bin);
             return ATOM_EOF;
         }
-        else
-        {
-            /* Read failed altogether */
-            enif_release_binary(&bin);
-            return enif_make_tuple2(env, ATOM_ERROR, errno_atom(env, errno));
-        }
+        ERL_NIF_TERM bin = enif_make_resource_binary(env, handle,
+                                                     handle->map + offset, count);
+        return enif_make_tuple2(env, ATOM_OK, bin);
     }
     else
     {
@@ -2706,6 +6677,358 @@ ERL_NIF_TERM bitcask_nifs_file_truncate(ErlNifEnv* env, int argc, const ERL_NIF_
     }
 }
 
+// Feeds an iolist to the CRC without flattening it, so the value of an
+// entry being written is not copied just to checksum it.
+static int crc32c_iolist(ErlNifEnv* env, ERL_NIF_TERM term, uint32_t* crc)
+{
+    ErlNifBinary bin;
+    ERL_NIF_TERM head;
+    int byte;
+
+    while (enif_get_list_cell(env, term, &head, &term))
+    {
+        if (enif_get_int(env, head, &byte) && byte >= 0 && byte < 256)
+        {
+            unsigned char c = (unsigned char)byte;
+            *crc = bitcask_crc32c(*crc, &c, 1);
+        }
+        else if (!crc32c_iolist(env, head, crc))
+        {
+            return 0;
+        }
+    }
+    if (enif_is_empty_list(env, term))
+    {
+        return 1;
+    }
+    if (enif_inspect_binary(env, term, &bin))
+    {
+        *crc = bitcask_crc32c(*crc, bin.data, bin.size);
+        return 1;
+    }
+    return 0;
+}
+
+// Same interface as erlang:crc32/1,2
+ERL_NIF_TERM bitcask_nifs_crc32c1(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    uint32_t crc = 0;
+    if (crc32c_iolist(env, argv[0], &crc))
+    {
+        return enif_make_uint(env, crc);
+    }
+    else
+    {
+        return enif_make_badarg(env);
+    }
+}
+
+ERL_NIF_TERM bitcask_nifs_crc32c2(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    unsigned int prev;
+    uint32_t crc;
+    if (enif_get_uint(env, argv[0], &prev) &&
+        (crc = prev, crc32c_iolist(env, argv[1], &crc)))
+    {
+        return enif_make_uint(env, crc);
+    }
+    else
+    {
+        return enif_make_badarg(env);
+    }
+}
+
+static int get_codec(ERL_NIF_TERM term, int* codec)
+{
+    if (term == ATOM_LZ4)
+    {
+        *codec = BITCASK_CODEC_LZ4;
+        return 1;
+    }
+    if (term == ATOM_ZSTD)
+    {
+        *codec = BITCASK_CODEC_ZSTD;
+        return 1;
+    }
+    return 0;
+}
+
+ERL_NIF_TERM bitcask_nifs_compression_codecs(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    ERL_NIF_TERM codecs = enif_make_list(env, 0);
+    if (bitcask_codec_available(BITCASK_CODEC_ZSTD))
+    {
+        codecs = enif_make_list_cell(env, ATOM_ZSTD, codecs);
+    }
+    if (bitcask_codec_available(BITCASK_CODEC_LZ4))
+    {
+        codecs = enif_make_list_cell(env, ATOM_LZ4, codecs);
+    }
+    return codecs;
+}
+
+// Registered twice: values from 64 KB up are sent to a dirty scheduler by
+// bitcask_nifs:compress/2.
+ERL_NIF_TERM bitcask_nifs_compress(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    int codec;
+    ErlNifBinary value, out;
+    size_t bound, n;
+
+    if (!get_codec(argv[0], &codec) ||
+        !enif_inspect_binary(env, argv[1], &value))
+    {
+        return enif_make_badarg(env);
+    }
+
+    // Storing the value as it is always works, so give up on any failure
+    bound = bitcask_compress_bound(codec, value.size);
+    if (bound == 0 || !enif_alloc_binary_compat(env, bound, &out))
+    {
+        return ATOM_UNCOMPRESSIBLE;
+    }
+
+    n = bitcask_compress(codec, value.data, value.size, out.data);
+    if (n == 0 || n >= value.size)
+    {
+        enif_release_binary(&out);
+        return ATOM_UNCOMPRESSIBLE;
+    }
+    enif_realloc_binary(&out, n);
+    return enif_make_tuple2(env, ATOM_OK, enif_make_binary(env, &out));
+}
+
+ERL_NIF_TERM bitcask_nifs_decompress(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    int codec;
+    ErlNifBinary stored, out;
+    size_t size;
+
+    if (!get_codec(argv[0], &codec) ||
+        !enif_inspect_binary(env, argv[1], &stored))
+    {
+        return enif_make_badarg(env);
+    }
+
+    size = bitcask_decompressed_size(codec, stored.data, stored.size);
+    if (size == (size_t)-1 || !enif_alloc_binary_compat(env, size, &out))
+    {
+        return ATOM_ERROR;
+    }
+    if (bitcask_decompress(codec, stored.data, stored.size, out.data, size) != 0)
+    {
+        enif_release_binary(&out);
+        return ATOM_ERROR;
+    }
+    return enif_make_tuple2(env, ATOM_OK, enif_make_binary(env, &out));
+}
+
+// Reads a whole dictionary file; returns 0 or an errno value
+static int read_dict_file(const char* path, ErlNifBinary* data)
+{
+    struct stat sinfo;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        return errno;
+    }
+    if (fstat(fd, &sinfo) != 0)
+    {
+        int error = errno;
+        close(fd);
+        return error;
+    }
+    if (!enif_alloc_binary(sinfo.st_size, data))
+    {
+        close(fd);
+        return ENOMEM;
+    }
+    if (pread(fd, data->data, data->size, 0) != (ssize_t)data->size)
+    {
+        enif_release_binary(data);
+        close(fd);
+        return EIO;
+    }
+    close(fd);
+    return 0;
+}
+
+// Opens the dictionary stored at a path. Dictionary files are never
+// rewritten, so all handles for a path share one loaded copy.
+ERL_NIF_TERM bitcask_nifs_zstd_dict_open(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    char path[4096];
+    bitcask_priv_data* priv = (bitcask_priv_data*)enif_priv_data(env);
+    bitcask_shared_dict* shared = NULL;
+    khiter_t itr;
+
+    if (!enif_get_string(env, argv[0], path, sizeof(path), ERL_NIF_LATIN1))
+    {
+        return enif_make_badarg(env);
+    }
+
+    enif_mutex_lock(priv->global_dicts_lock);
+    itr = kh_get(global_dicts, priv->global_dicts, path);
+    if (itr != kh_end(priv->global_dicts))
+    {
+        shared = kh_val(priv->global_dicts, itr);
+        shared->refcount++;
+    }
+    enif_mutex_unlock(priv->global_dicts_lock);
+
+    if (shared == NULL)
+    {
+        ErlNifBinary data;
+        int error = read_dict_file(path, &data);
+        if (error != 0)
+        {
+            return enif_make_tuple2(env, ATOM_ERROR, errno_atom(env, error));
+        }
+        bitcask_dict* dict = bitcask_dict_new(data.data, data.size);
+        enif_release_binary(&data);
+        if (dict == NULL)
+        {
+            return enif_make_tuple2(env, ATOM_ERROR, ATOM_INVALID_DICT);
+        }
+
+        // Someone else may have loaded it meanwhile; keep theirs
+        enif_mutex_lock(priv->global_dicts_lock);
+        itr = kh_get(global_dicts, priv->global_dicts, path);
+        if (itr != kh_end(priv->global_dicts))
+        {
+            shared = kh_val(priv->global_dicts, itr);
+            shared->refcount++;
+        }
+        else
+        {
+            shared = malloc(sizeof(bitcask_shared_dict) + strlen(path) + 1);
+            strcpy(shared->path, path);
+            shared->dict = dict;
+            shared->refcount = 1;
+            dict = NULL;
+            kh_put2(global_dicts, priv->global_dicts, shared->path, shared);
+        }
+        enif_mutex_unlock(priv->global_dicts_lock);
+        if (dict != NULL)
+        {
+            bitcask_dict_free(dict);
+        }
+    }
+
+    bitcask_dict_handle* handle = enif_alloc_resource_compat(env, bitcask_dict_RESOURCE,
+                                                             sizeof(bitcask_dict_handle));
+    handle->shared = shared;
+    ERL_NIF_TERM result = enif_make_resource(env, handle);
+    enif_release_resource_compat(env, handle);
+    return enif_make_tuple2(env, ATOM_OK, result);
+}
+
+// Trains a dictionary from a list of sample values. Runs on a dirty
+// scheduler: training on a few MB of samples takes seconds.
+ERL_NIF_TERM bitcask_nifs_zstd_train_dict(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    unsigned n, capacity, id, i;
+    size_t total = 0, pos = 0, len;
+    ERL_NIF_TERM list, head;
+    ErlNifBinary bin, dict;
+
+    if (!enif_get_list_length(env, argv[0], &n) ||
+        !enif_get_uint(env, argv[1], &capacity) ||
+        !enif_get_uint(env, argv[2], &id) || id == 0)
+    {
+        return enif_make_badarg(env);
+    }
+    for (list = argv[0]; enif_get_list_cell(env, list, &head, &list); )
+    {
+        if (!enif_inspect_binary(env, head, &bin))
+        {
+            return enif_make_badarg(env);
+        }
+        total += bin.size;
+    }
+
+    size_t* sizes = malloc((n + 1) * sizeof(size_t));
+    unsigned char* samples = malloc(total + 1);
+    if (sizes == NULL || samples == NULL ||
+        !enif_alloc_binary_compat(env, capacity, &dict))
+    {
+        free(sizes);
+        free(samples);
+        return enif_make_tuple2(env, ATOM_ERROR, ATOM_ALLOCATION_ERROR);
+    }
+    for (i = 0, list = argv[0]; enif_get_list_cell(env, list, &head, &list); i++)
+    {
+        enif_inspect_binary(env, head, &bin);
+        memcpy(samples + pos, bin.data, bin.size);
+        sizes[i] = bin.size;
+        pos += bin.size;
+    }
+
+    len = bitcask_train_dict(dict.data, dict.size, samples, sizes, n, id);
+    free(sizes);
+    free(samples);
+    if (len == 0)
+    {
+        enif_release_binary(&dict);
+        return enif_make_tuple2(env, ATOM_ERROR, ATOM_TRAINING_FAILED);
+    }
+    enif_realloc_binary(&dict, len);
+    return enif_make_tuple2(env, ATOM_OK, enif_make_binary(env, &dict));
+}
+
+ERL_NIF_TERM bitcask_nifs_compress_dict(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    bitcask_dict_handle* handle;
+    ErlNifBinary value, out;
+    size_t n;
+
+    if (!enif_get_resource(env, argv[0], bitcask_dict_RESOURCE, (void**)&handle) ||
+        !enif_inspect_binary(env, argv[1], &value))
+    {
+        return enif_make_badarg(env);
+    }
+
+    if (!enif_alloc_binary_compat(env, bitcask_compress_bound(BITCASK_CODEC_ZSTD,
+                                                              value.size), &out))
+    {
+        return ATOM_UNCOMPRESSIBLE;
+    }
+    n = bitcask_compress_dict(handle->shared->dict, value.data, value.size, out.data);
+    if (n == 0 || n >= value.size)
+    {
+        enif_release_binary(&out);
+        return ATOM_UNCOMPRESSIBLE;
+    }
+    enif_realloc_binary(&out, n);
+    return enif_make_tuple2(env, ATOM_OK, enif_make_binary(env, &out));
+}
+
+ERL_NIF_TERM bitcask_nifs_decompress_dict(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    bitcask_dict_handle* handle;
+    ErlNifBinary stored, out;
+    size_t size;
+
+    if (!enif_get_resource(env, argv[0], bitcask_dict_RESOURCE, (void**)&handle) ||
+        !enif_inspect_binary(env, argv[1], &stored))
+    {
+        return enif_make_badarg(env);
+    }
+
+    size = bitcask_decompressed_size(BITCASK_CODEC_ZSTD, stored.data, stored.size);
+    if (size == (size_t)-1 || !enif_alloc_binary_compat(env, size, &out))
+    {
+        return ATOM_ERROR;
+    }
+    if (bitcask_decompress_dict(handle->shared->dict, stored.data, stored.size,
+                                out.data, size) != 0)
+    {
+        enif_release_binary(&out);
+        return ATOM_ERROR;
+    }
+    return enif_make_tuple2(env, ATOM_OK, enif_make_binary(env, &out));
+}
+
 ERL_NIF_TERM errno_atom(ErlNifEnv* env, int error)
 {
     return enif_make_atom(env, erl_errno_id(error));
@@ -2743,20 +7066,41 @@ static void msg_pending_awaken(ErlNifEnv* env, bitcask_keydir* keydir,
     enif_free_env(msg_env);
 }
 
-// Merge pending hash into entries hash and awaken any pids that want to
-// start iterating once we are merged.  keydir must be locked before calling.
-static void merge_pending_entries(ErlNifEnv* env, bitcask_keydir* keydir)
+// Merge the pending hash of a shard into its entries hash.
+// Pending entries always use the regular layout. Converts them when
+// they move to the entries hash of a compact keydir.
+static bitcask_keydir_entry* maybe_compact_entry(bitcask_keydir* keydir,
+                                                 bitcask_keydir_shard* shard,
+                                                 bitcask_keydir_entry* entry)
 {
-    DEBUG("Merge pending entries. Keydir before merging\r\n");
-    DEBUG_KEYDIR(keydir);
+    bitcask_keydir_entry_proxy proxy;
+
+    if (!keydir->compact_entries || IS_COMPACT_ENTRY(entry))
+    {
+        return entry;
+    }
+
+    proxy_kd_entry(entry, &proxy);
+    if (!compact_entry_fits(&proxy))
+    {
+        return entry;
+    }
+
+    bitcask_keydir_entry* compact = new_entry(shard, &proxy, 1);
+    free_entry(shard, entry);
+    return compact;
+}
 
+static void merge_pending_shard(bitcask_keydir* keydir,
+                                bitcask_keydir_shard* shard)
+{
     khiter_t pend_itr;
-    for (pend_itr = kh_begin(keydir->pending); pend_itr != kh_end(keydir->pending); ++pend_itr)
+    for (pend_itr = kh_begin(shard->pending); pend_itr != kh_end(shard->pending); ++pend_itr)
     {
-        if (kh_exist(keydir->pending, pend_itr))
+        if (kh_exist(shard->pending, pend_itr))
         {
-            bitcask_keydir_entry* pending_entry = kh_key(keydir->pending, pend_itr);
-            khiter_t ent_itr = kh_get(entries, keydir->entries, pending_entry);
+            bitcask_keydir_entry* pending_entry = kh_key(shard->pending, pend_itr);
+            khiter_t ent_itr = kh_get(entries, shard->entries, pending_entry);
 
             DEBUG("Pending Entry: key=%s key_sz=%d file_id=%d tstamp=%u offset=%u size=%d\r\n",
                     pending_entry->key, pending_entry->key_sz,
@@ -2765,7 +7109,7 @@ static void merge_pending_entries(ErlNifEnv* env, bitcask_keydir* keydir)
                     (unsigned int) pending_entry->offset,
                     pending_entry->total_sz);
 
-            if (ent_itr == kh_end(keydir->entries))
+            if (ent_itr == kh_end(shard->entries))
             {
                 /* entries: empty, pending:tombstone */
                 if (is_pending_tombstone(pending_entry))
@@ -2773,18 +7117,19 @@ static void merge_pending_entries(ErlNifEnv* env, bitcask_keydir* keydir)
                     /* nop - stats were not updated when tombstone written for
                     ** empty entry
                     */
-                    free(pending_entry);
+                    free_entry(shard, pending_entry);
                 }
                 /* entries: empty, pending:value */
                 else
                 {
                     // Move to entries, do not free
-                    kh_put_set(entries, keydir->entries, pending_entry);
+                    kh_put_set(entries, shard->entries,
+                               maybe_compact_entry(keydir, shard, pending_entry));
                 }
             }
             else
             {
-                bitcask_keydir_entry* entries_entry = kh_key(keydir->entries, ent_itr);
+                bitcask_keydir_entry* entries_entry = kh_key(shard->entries, ent_itr);
                 DEBUG("Entries Entry: key=%s key_sz=%d file_id=%d statmp=%u offset=%u size=%d\r\n",
                         entries_entry->key, entries_entry->key_sz,
                         entries_entry->file_id,
@@ -2795,26 +7140,48 @@ static void merge_pending_entries(ErlNifEnv* env, bitcask_keydir* keydir)
                 /* entries: present, pending:tombstone */
                 if (is_pending_tombstone(pending_entry))
                 {
-                    remove_entry(keydir, ent_itr);
-                    free(pending_entry);
+                    remove_entry(shard, ent_itr);
+                    free_entry(shard, pending_entry);
                 }
                 /* entries: present, pending:value */
                 else
                 {
-                    free_entry(entries_entry);
-                    kh_key(keydir->entries, ent_itr) = pending_entry;
+                    free_entry(shard, entries_entry);
+                    kh_key(shard->entries, ent_itr) =
+                        maybe_compact_entry(keydir, shard, pending_entry);
                 }
             }
         }
     }
 
+    kh_destroy(entries, shard->pending);
+    shard->pending = NULL;
+}
+
+// Merge pending hashes into entries hashes and awaken any pids that want to
+// start iterating once we are merged.  All shards and the keydir must be
+// locked before calling.
+static void merge_pending_entries(ErlNifEnv* env, bitcask_keydir* keydir)
+{
+    int i;
+
+    DEBUG("Merge pending entries. Keydir before merging\r\n");
+    DEBUG_KEYDIR(keydir);
+
+    for (i = 0; i < BITCASK_KEYDIR_SHARDS; i++)
+    {
+        if (keydir->shards[i].pending != NULL)
+        {
+            merge_pending_shard(keydir, &keydir->shards[i]);
+        }
+    }
+
     // Wake up all sleeping pids
     msg_pending_awaken(env, keydir, ATOM_READY);
 
     // Free all resources for keydir folding
-    kh_destroy(entries, keydir->pending);
-    DEBUG2("LINE %d keydir->pending = NULL\r\n", __LINE__);
-    keydir->pending = NULL;
+    DEBUG2("LINE %d keydir->pending_shards = 0\r\n", __LINE__);
+    keydir->pending_shards = 0;
 
     keydir->pending_updated = 0;
     keydir->pending_start_time = 0;
@@ -2853,21 +7220,37 @@ static void lock_release(bitcask_lock_handle* handle)
 
 static void free_keydir(bitcask_keydir* keydir)
 {
-    // Delete all the entries in the hash table, which also has the effect of
-    // freeing up all resources associated with the table.
     khiter_t itr;
-    bitcask_keydir_entry* current_entry;
-    for (itr = kh_begin(keydir->entries); itr != kh_end(keydir->entries); ++itr)
+    int i;
+    for (i = 0; i < BITCASK_KEYDIR_SHARDS; i++)
     {
-        if (kh_exist(keydir->entries, itr))
+        bitcask_keydir_shard* shard = &keydir->shards[i];
+        // All entries live in the arena, no need to visit them
+        kh_destroy(entries, shard->entries);
+        if (shard->pending != NULL)
+        {
+            kh_destroy(entries, shard->pending);
+        }
+        arena_destroy(&shard->arena);
+        free(shard->expiry_wheel);
+        if (shard->expiry_keys != NULL)
+        {
+            kh_destroy(expiry_keys, shard->expiry_keys);
+        }
+        bitcask_bloom_free(shard->bloom);
+        bitcask_bloom_free(shard->bloom_spare);
+        while (shard->bloom_retired != NULL)
+        {
+            bitcask_bloom* next = shard->bloom_retired->next;
+            bitcask_bloom_free(shard->bloom_retired);
+            shard->bloom_retired = next;
+        }
+        if (shard->lock)
         {
-            current_entry = kh_key(keydir->entries, itr);
-            free_entry(current_entry);
+            enif_rwlock_destroy(shard->lock);
         }
     }
 
-    kh_destroy(entries, keydir->entries);
-
     bitcask_fstats_entry* curr_f;
 
     for (itr = kh_begin(keydir->fstats); itr != kh_end(keydir->fstats); ++itr)
@@ -2880,6 +7263,7 @@ static void free_keydir(bitcask_keydir* keydir)
     }
 
     kh_destroy(fstats, keydir->fstats);
+    vcache_free(keydir->vcache);
     free(keydir);
 }
 
@@ -2901,11 +7285,11 @@ static void bitcask_nifs_keydir_resource_cleanup(ErlNifEnv* env, void* arg)
     {
         if (handle->iterating)
         {
-            LOCK(handle->keydir);
+            lock_keydir_all(handle->keydir);
 
             itr_release_internal(env, handle);
 
-            UNLOCK(handle->keydir);
+            unlock_keydir_all(handle->keydir);
         }
 
         handle->keydir = 0;
@@ -2969,6 +7353,31 @@ static void bitcask_nifs_lock_resource_cleanup(ErlNifEnv* env, void* arg)
     lock_release(handle);
 }
 
+static void bitcask_nifs_dict_resource_cleanup(ErlNifEnv* env, void* arg)
+{
+    bitcask_dict_handle* handle = (bitcask_dict_handle*)arg;
+    bitcask_shared_dict* shared = handle->shared;
+    bitcask_priv_data* priv = (bitcask_priv_data*)enif_priv_data(env);
+
+    enif_mutex_lock(priv->global_dicts_lock);
+    if (--shared->refcount == 0)
+    {
+        khiter_t itr = kh_get(global_dicts, priv->global_dicts, shared->path);
+        kh_del(global_dicts, priv->global_dicts, itr);
+    }
+    else
+    {
+        shared = NULL;
+    }
+    enif_mutex_unlock(priv->global_dicts_lock);
+
+    if (shared != NULL)
+    {
+        bitcask_dict_free(shared->dict);
+        free(shared);
+    }
+}
+
 static void bitcask_nifs_file_resource_cleanup(ErlNifEnv* env, void* arg)
 {
     bitcask_file_handle* handle = (bitcask_file_handle*)arg;
@@ -2976,6 +7385,15 @@ static void bitcask_nifs_file_resource_cleanup(ErlNifEnv* env, void* arg)
     {
         close(handle->fd);
     }
+    if (handle->map != NULL)
+    {
+        munmap(handle->map, handle->map_size);
+    }
+}
+
+static void bitcask_nifs_merge_resource_cleanup(ErlNifEnv* env, void* arg)
+{
+    merge_copy_release((bitcask_merge_handle*)arg);
 }
 
 
@@ -3017,28 +7435,76 @@ static int on_load(ErlNifEnv* env, void** priv_data, ERL_NIF_TERM load_info)
                                                     ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER,
                                                     0);
 
+    bitcask_dict_RESOURCE = enif_open_resource_type_compat(env, "bitcask_dict_resource",
+                                                    &bitcask_nifs_dict_resource_cleanup,
+                                                    ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER,
+                                                    0);
+
+    bitcask_merge_RESOURCE = enif_open_resource_type_compat(env, "bitcask_merge_resource",
+                                                     &bitcask_nifs_merge_resource_cleanup,
+                                                     ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER,
+                                                     0);
+
+    // Cached values are plain bytes, nothing to clean up
+    bitcask_value_RESOURCE = enif_open_resource_type_compat(env, "bitcask_value_resource",
+                                                     NULL,
+                                                     ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER,
+                                                     0);
+
+    bitcask_crc32c_init();
+    bitcask_bloom_init();
+
     // Initialize shared keydir hashtable
     bitcask_priv_data* priv = malloc(sizeof(bitcask_priv_data));
     priv->global_biggest_file_id = kh_init(global_biggest_file_id);
     priv->global_keydirs = kh_init(global_keydirs);
     priv->global_keydirs_lock = enif_mutex_create("bitcask_global_handles_lock");
+    priv->global_dicts = kh_init(global_dicts);
+    priv->global_dicts_lock = enif_mutex_create("bitcask_global_dicts_lock");
     *priv_data = priv;
 
     // Initialize atoms that we use throughout the NIF.
     ATOM_ALLOCATION_ERROR = enif_make_atom(env, "allocation_error");
     ATOM_ALREADY_EXISTS = enif_make_atom(env, "already_exists");
+    ATOM_ARENA_LARGE_BYTES = enif_make_atom(env, "arena_large_bytes");
+    ATOM_ARENA_SLAB_BYTES = enif_make_atom(env, "arena_slab_bytes");
+    ATOM_ARENA_USED_BYTES = enif_make_atom(env, "arena_used_bytes");
+    ATOM_ARENA_UTILIZATION = enif_make_atom(env, "arena_utilization");
     ATOM_BITCASK_ENTRY = enif_make_atom(env, "bitcask_entry");
+    ATOM_BLOOM_BYTES = enif_make_atom(env, "bloom_bytes");
+    ATOM_BLOOM_FILTER = enif_make_atom(env, "bloom_filter");
+    ATOM_BYTES_PER_KEY = enif_make_atom(env, "bytes_per_key");
+    ATOM_COMPACT = enif_make_atom(env, "compact");
+    ATOM_ENTRY_BYTES = enif_make_atom(env, "entry_bytes");
+    ATOM_READ_SAMPLES = enif_make_atom(env, "read_samples");
+    ATOM_READ_USECS = enif_make_atom(env, "read_usecs");
+    ATOM_MERGE_BYTES = enif_make_atom(env, "merge_bytes");
+    ATOM_MERGE_THROTTLED_USECS = enif_make_atom(env, "merge_throttled_usecs");
+    ATOM_CACHE_HITS = enif_make_atom(env, "cache_hits");
+    ATOM_CACHE_MISSES = enif_make_atom(env, "cache_misses");
+    ATOM_CACHE_EVICTIONS = enif_make_atom(env, "cache_evictions");
+    ATOM_CACHE_ENTRIES = enif_make_atom(env, "cache_entries");
+    ATOM_CACHE_BYTES = enif_make_atom(env, "cache_bytes");
+    ATOM_ENTRY_LAYOUT = enif_make_atom(env, "entry_layout");
+    ATOM_EXPIRY_INDEX = enif_make_atom(env, "expiry_index");
+    ATOM_EXPIRY_INDEX_KEYS = enif_make_atom(env, "expiry_index_keys");
+    ATOM_DONE = enif_make_atom(env, "done");
     ATOM_ERROR = enif_make_atom(env, "error");
     ATOM_FALSE = enif_make_atom(env, "false");
     ATOM_FSTAT_ERROR = enif_make_atom(env, "fstat_error");
     ATOM_FTRUNCATE_ERROR = enif_make_atom(env, "ftruncate_error");
     ATOM_GETFL_ERROR = enif_make_atom(env, "getfl_error");
+    ATOM_HASH_BYTES = enif_make_atom(env, "hash_bytes");
     ATOM_ILT_CREATE_ERROR = enif_make_atom(env, "ilt_create_error");
+    ATOM_INVALID_HINTFILE = enif_make_atom(env, "invalid_hintfile");
     ATOM_ITERATION_IN_PROCESS = enif_make_atom(env, "iteration_in_process");
     ATOM_ITERATION_NOT_PERMITTED = enif_make_atom(env, "iteration_not_permitted");
     ATOM_ITERATION_NOT_STARTED = enif_make_atom(env, "iteration_not_started");
+    ATOM_KEY_COUNT = enif_make_atom(env, "key_count");
     ATOM_LOCK_NOT_WRITABLE = enif_make_atom(env, "lock_not_writable");
+    ATOM_NOT_EMPTY = enif_make_atom(env, "not_empty");
     ATOM_NOT_FOUND = enif_make_atom(env, "not_found");
+    ATOM_NOT_LOADED = enif_make_atom(env, "not_loaded");
     ATOM_NOT_READY = enif_make_atom(env, "not_ready");
     ATOM_OK = enif_make_atom(env, "ok");
     ATOM_OUT_OF_DATE = enif_make_atom(env, "out_of_date");
@@ -3046,9 +7512,24 @@ static int on_load(ErlNifEnv* env, void** priv_data, ERL_NIF_TERM load_info)
     ATOM_PWRITE_ERROR = enif_make_atom(env, "pwrite_error");
     ATOM_READY = enif_make_atom(env, "ready");
     ATOM_SETFL_ERROR = enif_make_atom(env, "setfl_error");
+    ATOM_STANDARD = enif_make_atom(env, "standard");
     ATOM_TRUE = enif_make_atom(env, "true");
+    ATOM_TRUNC_HINTFILE = enif_make_atom(env, "trunc_hintfile");
     ATOM_UNDEFINED = enif_make_atom(env, "undefined");
     ATOM_EOF = enif_make_atom(env, "eof");
+    ATOM_MORE = enif_make_atom(env, "more");
+    ATOM_WRAP = enif_make_atom(env, "wrap");
+    ATOM_FRESH = enif_make_atom(env, "fresh");
+    ATOM_ENTRY = enif_make_atom(env, "entry");
+    ATOM_BAD_ENTRY = enif_make_atom(env, "bad_entry");
+    ATOM_CRC32 = enif_make_atom(env, "crc32");
+    ATOM_CRC32C = enif_make_atom(env, "crc32c");
+    ATOM_UNCOMPRESSIBLE = enif_make_atom(env, "uncompressible");
+    ATOM_VALUE_CACHE = enif_make_atom(env, "value_cache");
+    ATOM_INVALID_DICT = enif_make_atom(env, "invalid_dict");
+    ATOM_TRAINING_FAILED = enif_make_atom(env, "training_failed");
+    ATOM_LZ4 = enif_make_atom(env, "lz4");
+    ATOM_ZSTD = enif_make_atom(env, "zstd");
     ATOM_CREATE = enif_make_atom(env, "create");
     ATOM_READONLY = enif_make_atom(env, "readonly");
     ATOM_O_SYNC = enif_make_atom(env, "o_sync");
@@ -0,0 +1,189 @@
+/* -------------------------------------------------------------------
+ *
+ * bitcask: Eric Brewer-inspired key/value store
+ *
+ * Copyright (c) 2010 Basho Technologies, Inc. All Rights Reserved.
+ *
+ * This file is provided to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file
+ * except in compliance with the License.  You may obtain
+ * a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ * ------------------------------------------------------------------- */
+#include <stdlib.h>
+#include <string.h>
+
+#include "bloom.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define BLOOM_AVX2 1
+#endif
+
+#define BLOCK_WORDS   8
+#define BLOCK_BYTES   (BLOCK_WORDS * sizeof(uint64_t))
+#define BITS_PER_KEY  12
+#define MIN_BLOCKS    8
+
+// Odd multipliers picking the bit each word gets from the low half of the
+// hash, as in the split block Bloom filter of Impala and Parquet
+static const uint32_t salts[BLOCK_WORDS] __attribute__((aligned(32))) =
+{
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+static int bloom_avx2 = 0;
+
+// The keydir shard and hash bucket come from the same hash, so mix it
+// before using it to pick a block
+static inline uint64_t mix(uint64_t hash)
+{
+    return hash * 0x9e3779b97f4a7c15ULL;
+}
+
+static inline uint64_t* block_of(const bitcask_bloom* bloom, uint64_t h)
+{
+    uint64_t block = ((h >> 32) * bloom->nblocks) >> 32;
+    return bloom->words + block * BLOCK_WORDS;
+}
+
+static inline uint64_t word_bit(uint32_t h, int i)
+{
+    return 1ULL << ((h * salts[i]) >> 26);
+}
+
+static int may_contain_sw(const uint64_t* block, uint32_t h)
+{
+    uint64_t missing = 0;
+    int i;
+    for (i = 0; i < BLOCK_WORDS; i++)
+    {
+        uint64_t bit = word_bit(h, i);
+        missing |= bit & ~__atomic_load_n(&block[i], __ATOMIC_RELAXED);
+    }
+    return missing == 0;
+}
+
+#if defined(BLOOM_AVX2)
+// Aligned 32 byte loads see each word either before or after a concurrent
+// atomic OR on it, like the atomic loads of the portable version do
+__attribute__((target("avx2")))
+static int may_contain_avx2(const uint64_t* block, uint32_t h)
+{
+    __m256i shifts = _mm256_srli_epi32(
+        _mm256_mullo_epi32(_mm256_set1_epi32((int)h),
+                           _mm256_load_si256((const __m256i*)salts)), 26);
+    __m256i one = _mm256_set1_epi64x(1);
+    __m256i lo = _mm256_sllv_epi64(
+        one, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(shifts)));
+    __m256i hi = _mm256_sllv_epi64(
+        one, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(shifts, 1)));
+    return _mm256_testc_si256(_mm256_load_si256((const __m256i*)block), lo) &
+        _mm256_testc_si256(_mm256_load_si256((const __m256i*)(block + 4)), hi);
+}
+#endif
+
+void bitcask_bloom_init(void)
+{
+#if defined(BLOOM_AVX2)
+    __builtin_cpu_init();
+    bloom_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+uint32_t bitcask_bloom_blocks_for(uint64_t keys)
+{
+    uint64_t keys_per_block = BLOCK_BYTES * 8 / BITS_PER_KEY;
+    uint64_t nblocks = (keys + keys_per_block - 1) / keys_per_block;
+    if (nblocks < MIN_BLOCKS)
+    {
+        return MIN_BLOCKS;
+    }
+    return nblocks > UINT32_MAX ? UINT32_MAX : (uint32_t)nblocks;
+}
+
+uint64_t bitcask_bloom_capacity(const bitcask_bloom* bloom)
+{
+    return (uint64_t)bloom->nblocks * (BLOCK_BYTES * 8 / BITS_PER_KEY);
+}
+
+size_t bitcask_bloom_bytes(const bitcask_bloom* bloom)
+{
+    return (size_t)bloom->nblocks * BLOCK_BYTES;
+}
+
+bitcask_bloom* bitcask_bloom_new(uint32_t nblocks)
+{
+    bitcask_bloom* bloom = malloc(sizeof(bitcask_bloom));
+    void* words;
+    if (bloom == NULL)
+    {
+        return NULL;
+    }
+    if (posix_memalign(&words, BLOCK_BYTES, (size_t)nblocks * BLOCK_BYTES) != 0)
+    {
+        free(bloom);
+        return NULL;
+    }
+    memset(words, 0, (size_t)nblocks * BLOCK_BYTES);
+    bloom->next = NULL;
+    bloom->nblocks = nblocks;
+    bloom->words = words;
+    return bloom;
+}
+
+void bitcask_bloom_free(bitcask_bloom* bloom)
+{
+    if (bloom != NULL)
+    {
+        free(bloom->words);
+        free(bloom);
+    }
+}
+
+void bitcask_bloom_clear(bitcask_bloom* bloom)
+{
+    size_t i, n = (size_t)bloom->nblocks * BLOCK_WORDS;
+    for (i = 0; i < n; i++)
+    {
+        __atomic_store_n(&bloom->words[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+void bitcask_bloom_add(bitcask_bloom* bloom, uint64_t hash)
+{
+    uint64_t h = mix(hash);
+    uint64_t* block = block_of(bloom, h);
+    int i;
+    for (i = 0; i < BLOCK_WORDS; i++)
+    {
+        uint64_t bit = word_bit((uint32_t)h, i);
+        if (!(__atomic_load_n(&block[i], __ATOMIC_RELAXED) & bit))
+        {
+            __atomic_fetch_or(&block[i], bit, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+int bitcask_bloom_may_contain(const bitcask_bloom* bloom, uint64_t hash)
+{
+    uint64_t h = mix(hash);
+    const uint64_t* block = block_of(bloom, h);
+#if defined(BLOOM_AVX2)
+    if (bloom_avx2)
+    {
+        return may_contain_avx2(block, (uint32_t)h);
+    }
+#endif
+    return may_contain_sw(block, (uint32_t)h);
+}
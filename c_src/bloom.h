@@ -0,0 +1,64 @@
+/* -------------------------------------------------------------------
+ *
+ * bitcask: Eric Brewer-inspired key/value store
+ *
+ * Copyright (c) 2010 Basho Technologies, Inc. All Rights Reserved.
+ *
+ * This file is provided to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file
+ * except in compliance with the License.  You may obtain
+ * a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ * ------------------------------------------------------------------- */
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Blocked Bloom filter over 64 bit key hashes. Each key sets one bit in
+ * each of the eight 64 bit words of a single 64 byte block, so adding or
+ * looking up a key touches one cache line. Bits are set with atomic ORs
+ * and read with atomic loads, so lookups need no lock while one writer
+ * at a time adds keys. Uses AVX2 for lookups when the CPU has it. Call
+ * bitcask_bloom_init() once before use. */
+typedef struct bitcask_bloom
+{
+    struct bitcask_bloom* next;  /* free for the owner to chain filters */
+    uint32_t  nblocks;
+    uint64_t* words;             /* nblocks * 8 words, 64 byte aligned */
+} bitcask_bloom;
+
+void bitcask_bloom_init(void);
+
+/* Blocks to hold keys keys at about 12 bits each, which gives under 1%
+ * false positives. */
+uint32_t bitcask_bloom_blocks_for(uint64_t keys);
+
+/* Keys the filter holds before it goes over 12 bits per key. */
+uint64_t bitcask_bloom_capacity(const bitcask_bloom* bloom);
+
+size_t bitcask_bloom_bytes(const bitcask_bloom* bloom);
+
+/* A filter with no keys, or NULL if out of memory. */
+bitcask_bloom* bitcask_bloom_new(uint32_t nblocks);
+void bitcask_bloom_free(bitcask_bloom* bloom);
+
+/* Drops all the keys. Lookups running meanwhile may miss keys. */
+void bitcask_bloom_clear(bitcask_bloom* bloom);
+
+void bitcask_bloom_add(bitcask_bloom* bloom, uint64_t hash);
+
+/* 0 if no key with this hash was added since the filter was cleared. */
+int bitcask_bloom_may_contain(const bitcask_bloom* bloom, uint64_t hash);
+
+#endif /* BLOOM_H */
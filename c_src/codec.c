@@ -0,0 +1,362 @@
+/* -------------------------------------------------------------------
+ *
+ * bitcask: Eric Brewer-inspired key/value store
+ *
+ * Copyright (c) 2010 Basho Technologies, Inc. All Rights Reserved.
+ *
+ * This file is provided to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file
+ * except in compliance with the License.  You may obtain
+ * a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ * ------------------------------------------------------------------- */
+#include <pthread.h>
+#include <stdint.h>
+
+#include <stdlib.h>
+
+// Each codec is only built in when the build found its library, see
+// rebar.config.script. Without it, values are never compressed with it
+// and values compressed with it cannot be read.
+#ifdef BITCASK_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef BITCASK_HAVE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+#include "codec.h"
+
+#define LZ4_PREFIX_SZ 4
+
+#ifdef BITCASK_HAVE_ZSTD
+
+// zstd contexts are costly to set up, so each scheduler thread keeps one
+// of each for its lifetime.
+static pthread_key_t zstd_cctx_key;
+static pthread_key_t zstd_dctx_key;
+static pthread_once_t zstd_keys_once = PTHREAD_ONCE_INIT;
+
+static void free_cctx(void* cctx)
+{
+    ZSTD_freeCCtx((ZSTD_CCtx*)cctx);
+}
+
+static void free_dctx(void* dctx)
+{
+    ZSTD_freeDCtx((ZSTD_DCtx*)dctx);
+}
+
+static void make_zstd_keys(void)
+{
+    pthread_key_create(&zstd_cctx_key, free_cctx);
+    pthread_key_create(&zstd_dctx_key, free_dctx);
+}
+
+static ZSTD_CCtx* thread_cctx(void)
+{
+    pthread_once(&zstd_keys_once, make_zstd_keys);
+    ZSTD_CCtx* cctx = pthread_getspecific(zstd_cctx_key);
+    if (cctx == NULL && (cctx = ZSTD_createCCtx()) != NULL)
+    {
+        pthread_setspecific(zstd_cctx_key, cctx);
+    }
+    return cctx;
+}
+
+static ZSTD_DCtx* thread_dctx(void)
+{
+    pthread_once(&zstd_keys_once, make_zstd_keys);
+    ZSTD_DCtx* dctx = pthread_getspecific(zstd_dctx_key);
+    if (dctx == NULL && (dctx = ZSTD_createDCtx()) != NULL)
+    {
+        pthread_setspecific(zstd_dctx_key, dctx);
+    }
+    return dctx;
+}
+#endif
+
+int bitcask_codec_available(int codec)
+{
+    switch (codec)
+    {
+#ifdef BITCASK_HAVE_LZ4
+    case BITCASK_CODEC_LZ4:
+        return 1;
+#endif
+#ifdef BITCASK_HAVE_ZSTD
+    case BITCASK_CODEC_ZSTD:
+        return 1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+size_t bitcask_compress_bound(int codec, size_t len)
+{
+    switch (codec)
+    {
+#ifdef BITCASK_HAVE_LZ4
+    case BITCASK_CODEC_LZ4:
+        if (len > LZ4_MAX_INPUT_SIZE)
+        {
+            return 0;
+        }
+        return LZ4_PREFIX_SZ + LZ4_compressBound((int)len);
+#endif
+#ifdef BITCASK_HAVE_ZSTD
+    case BITCASK_CODEC_ZSTD:
+        return ZSTD_compressBound(len);
+#endif
+    default:
+        return 0;
+    }
+}
+
+size_t bitcask_compress(int codec, const void* src, size_t len, void* dst)
+{
+    switch (codec)
+    {
+#ifdef BITCASK_HAVE_LZ4
+    case BITCASK_CODEC_LZ4:
+    {
+        unsigned char* p = dst;
+        int bound = LZ4_compressBound((int)len);
+        int n = LZ4_compress_default(src, (char*)p + LZ4_PREFIX_SZ,
+                                     (int)len, bound);
+        if (n <= 0)
+        {
+            return 0;
+        }
+        p[0] = (unsigned char)(len >> 24);
+        p[1] = (unsigned char)(len >> 16);
+        p[2] = (unsigned char)(len >> 8);
+        p[3] = (unsigned char)len;
+        return LZ4_PREFIX_SZ + (size_t)n;
+    }
+#endif
+#ifdef BITCASK_HAVE_ZSTD
+    case BITCASK_CODEC_ZSTD:
+    {
+        ZSTD_CCtx* cctx = thread_cctx();
+        if (cctx == NULL)
+        {
+            return 0;
+        }
+        size_t n = ZSTD_compressCCtx(cctx, dst, ZSTD_compressBound(len),
+                                     src, len, ZSTD_CLEVEL_DEFAULT);
+        return ZSTD_isError(n) ? 0 : n;
+    }
+#endif
+    default:
+        return 0;
+    }
+}
+
+size_t bitcask_decompressed_size(int codec, const void* src, size_t len)
+{
+    switch (codec)
+    {
+#ifdef BITCASK_HAVE_LZ4
+    case BITCASK_CODEC_LZ4:
+    {
+        const unsigned char* p = src;
+        if (len < LZ4_PREFIX_SZ)
+        {
+            return (size_t)-1;
+        }
+        return ((size_t)p[0] << 24) | ((size_t)p[1] << 16) |
+            ((size_t)p[2] << 8) | (size_t)p[3];
+    }
+#endif
+#ifdef BITCASK_HAVE_ZSTD
+    case BITCASK_CODEC_ZSTD:
+    {
+        unsigned long long n = ZSTD_getFrameContentSize(src, len);
+        if (n == ZSTD_CONTENTSIZE_UNKNOWN || n == ZSTD_CONTENTSIZE_ERROR ||
+            n > SIZE_MAX / 2)
+        {
+            return (size_t)-1;
+        }
+        return (size_t)n;
+    }
+#endif
+    default:
+        return (size_t)-1;
+    }
+}
+
+int bitcask_decompress(int codec, const void* src, size_t len,
+                       void* dst, size_t dst_len)
+{
+    switch (codec)
+    {
+#ifdef BITCASK_HAVE_LZ4
+    case BITCASK_CODEC_LZ4:
+    {
+        if (len < LZ4_PREFIX_SZ || dst_len > LZ4_MAX_INPUT_SIZE)
+        {
+            return -1;
+        }
+        int n = LZ4_decompress_safe((const char*)src + LZ4_PREFIX_SZ, dst,
+                                    (int)(len - LZ4_PREFIX_SZ), (int)dst_len);
+        return n == (int)dst_len ? 0 : -1;
+    }
+#endif
+#ifdef BITCASK_HAVE_ZSTD
+    case BITCASK_CODEC_ZSTD:
+    {
+        ZSTD_DCtx* dctx = thread_dctx();
+        if (dctx == NULL)
+        {
+            return -1;
+        }
+        size_t n = ZSTD_decompressDCtx(dctx, dst, dst_len, src, len);
+        return (!ZSTD_isError(n) && n == dst_len) ? 0 : -1;
+    }
+#endif
+    default:
+        return -1;
+    }
+}
+
+#ifdef BITCASK_HAVE_ZSTD
+struct bitcask_dict
+{
+    ZSTD_CDict* cdict;
+    ZSTD_DDict* ddict;
+    unsigned id;
+};
+
+bitcask_dict* bitcask_dict_new(const void* data, size_t len)
+{
+    unsigned id = ZDICT_getDictID(data, len);
+    if (id == 0)
+    {
+        return NULL;
+    }
+
+    bitcask_dict* dict = malloc(sizeof(bitcask_dict));
+    if (dict == NULL)
+    {
+        return NULL;
+    }
+    dict->id = id;
+    dict->cdict = ZSTD_createCDict(data, len, ZSTD_CLEVEL_DEFAULT);
+    dict->ddict = ZSTD_createDDict(data, len);
+    if (dict->cdict == NULL || dict->ddict == NULL)
+    {
+        bitcask_dict_free(dict);
+        return NULL;
+    }
+    return dict;
+}
+
+void bitcask_dict_free(bitcask_dict* dict)
+{
+    ZSTD_freeCDict(dict->cdict);
+    ZSTD_freeDDict(dict->ddict);
+    free(dict);
+}
+
+unsigned bitcask_dict_id(const bitcask_dict* dict)
+{
+    return dict->id;
+}
+
+size_t bitcask_compress_dict(const bitcask_dict* dict, const void* src,
+                             size_t len, void* dst)
+{
+    ZSTD_CCtx* cctx = thread_cctx();
+    if (cctx == NULL)
+    {
+        return 0;
+    }
+    size_t n = ZSTD_compress_usingCDict(cctx, dst, ZSTD_compressBound(len),
+                                        src, len, dict->cdict);
+    return ZSTD_isError(n) ? 0 : n;
+}
+
+int bitcask_decompress_dict(const bitcask_dict* dict, const void* src,
+                            size_t len, void* dst, size_t dst_len)
+{
+    ZSTD_DCtx* dctx = thread_dctx();
+    if (dctx == NULL)
+    {
+        return -1;
+    }
+    size_t n = ZSTD_decompress_usingDDict(dctx, dst, dst_len, src, len,
+                                          dict->ddict);
+    return (!ZSTD_isError(n) && n == dst_len) ? 0 : -1;
+}
+
+size_t bitcask_train_dict(void* dst, size_t cap, const void* samples,
+                          const size_t* sizes, unsigned n, unsigned id)
+{
+    unsigned char* p = dst;
+    size_t len = ZDICT_trainFromBuffer(dst, cap, samples, sizes, n);
+    if (ZDICT_isError(len) || len < 8)
+    {
+        return 0;
+    }
+    // The id follows the 4 byte magic number, little endian. Training
+    // picks a random one; use ours so dictionaries are numbered in order.
+    p[4] = (unsigned char)id;
+    p[5] = (unsigned char)(id >> 8);
+    p[6] = (unsigned char)(id >> 16);
+    p[7] = (unsigned char)(id >> 24);
+    return len;
+}
+
+#else
+
+// No dictionary can be loaded or trained, so none is ever used
+struct bitcask_dict
+{
+    unsigned id;
+};
+
+bitcask_dict* bitcask_dict_new(const void* data, size_t len)
+{
+    return NULL;
+}
+
+void bitcask_dict_free(bitcask_dict* dict)
+{
+    free(dict);
+}
+
+unsigned bitcask_dict_id(const bitcask_dict* dict)
+{
+    return dict->id;
+}
+
+size_t bitcask_compress_dict(const bitcask_dict* dict, const void* src,
+                             size_t len, void* dst)
+{
+    return 0;
+}
+
+int bitcask_decompress_dict(const bitcask_dict* dict, const void* src,
+                            size_t len, void* dst, size_t dst_len)
+{
+    return -1;
+}
+
+size_t bitcask_train_dict(void* dst, size_t cap, const void* samples,
+                          const size_t* sizes, unsigned n, unsigned id)
+{
+    return 0;
+}
+#endif
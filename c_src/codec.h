@@ -0,0 +1,76 @@
+/* -------------------------------------------------------------------
+ *
+ * bitcask: Eric Brewer-inspired key/value store
+ *
+ * Copyright (c) 2010 Basho Technologies, Inc. All Rights Reserved.
+ *
+ * This file is provided to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file
+ * except in compliance with the License.  You may obtain
+ * a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ * ------------------------------------------------------------------- */
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+
+/* Value codecs; the numbers are stored in data files */
+#define BITCASK_CODEC_LZ4  1
+#define BITCASK_CODEC_ZSTD 2
+
+/* Whether the build includes a codec. The others compress nothing, see
+ * bitcask_compress_bound(), and decompress nothing. */
+int bitcask_codec_available(int codec);
+
+/* Largest size bitcask_compress() may produce for len input bytes, or 0
+ * if the codec cannot compress them. */
+size_t bitcask_compress_bound(int codec, size_t len);
+
+/* Compress len bytes of src into dst, which must hold
+ * bitcask_compress_bound() bytes. Returns the compressed size, or 0 on
+ * failure. LZ4 output starts with the 32-bit big endian size of the
+ * input, zstd output is a frame that records it. */
+size_t bitcask_compress(int codec, const void* src, size_t len, void* dst);
+
+/* Size of the value compressed in src, or (size_t)-1 if src is not a
+ * valid compressed value. */
+size_t bitcask_decompressed_size(int codec, const void* src, size_t len);
+
+/* Decompress src into dst of exactly dst_len bytes, as returned by
+ * bitcask_decompressed_size(). Returns 0 on success. */
+int bitcask_decompress(int codec, const void* src, size_t len,
+                       void* dst, size_t dst_len);
+
+/* zstd dictionary, shareable between threads once created. */
+typedef struct bitcask_dict bitcask_dict;
+
+/* Load a dictionary trained by bitcask_train_dict(). Returns NULL if data
+ * is not a valid dictionary. */
+bitcask_dict* bitcask_dict_new(const void* data, size_t len);
+void bitcask_dict_free(bitcask_dict* dict);
+unsigned bitcask_dict_id(const bitcask_dict* dict);
+
+/* Like bitcask_compress() and bitcask_decompress() for zstd, against a
+ * dictionary. The frames record the dictionary id. */
+size_t bitcask_compress_dict(const bitcask_dict* dict, const void* src,
+                             size_t len, void* dst);
+int bitcask_decompress_dict(const bitcask_dict* dict, const void* src,
+                            size_t len, void* dst, size_t dst_len);
+
+/* Train a dictionary of at most cap bytes into dst from n samples laid
+ * out back to back in samples, and give it the id id. Returns the size
+ * of the dictionary, or 0 if training failed, e.g. for lack of samples. */
+size_t bitcask_train_dict(void* dst, size_t cap, const void* samples,
+                          const size_t* sizes, unsigned n, unsigned id);
+
+#endif /* CODEC_H */
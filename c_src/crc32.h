@@ -0,0 +1,39 @@
+/* -------------------------------------------------------------------
+ *
+ * bitcask: Eric Brewer-inspired key/value store
+ *
+ * Copyright (c) 2010 Basho Technologies, Inc. All Rights Reserved.
+ *
+ * This file is provided to you under the Apache License,
+ * Version 2.0 (the "License"); you may not use this file
+ * except in compliance with the License.  You may obtain
+ * a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ * ------------------------------------------------------------------- */
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Standard (zlib, IEEE 802.3) CRC-32, the same checksum erlang:crc32/1,2
+ * computes. Pass 0 as crc to start a new checksum. */
+uint32_t bitcask_crc32(uint32_t crc, const void* buf, size_t len);
+
+/* CRC-32C (Castagnoli), used by the newer data and hint file format.
+ * Uses the SSE4.2 or ARMv8 CRC instructions when the CPU has them and a
+ * slicing-by-8 table otherwise. Call bitcask_crc32c_init() once before
+ * use. Pass 0 as crc to start a new checksum. */
+void bitcask_crc32c_init(void);
+uint32_t bitcask_crc32c(uint32_t crc, const void* buf, size_t len);
+
+#endif /* CRC32_H */
@@ -66,7 +66,28 @@ extern "C" {
 
 #endif /* R14 */
 
+/* Dirty schedulers are always available from NIF 2.12 (OTP 20) on, and
+ * optionally from 2.7 when the emulator was built with them. On anything
+ * older the flags are dropped and the NIF runs on a normal scheduler, as
+ * it always did. Define BITCASK_NO_DIRTY_NIFS to force that behaviour. */
+#if !defined(BITCASK_NO_DIRTY_NIFS) && \
+    (ERL_NIF_MAJOR_VERSION > 2 || \
+     (ERL_NIF_MAJOR_VERSION == 2 && ERL_NIF_MINOR_VERSION >= 12) || \
+     defined(ERL_NIF_DIRTY_SCHEDULER_SUPPORT))
 
+#define ERL_NIF_DIRTY_IO_COMPAT  ERL_NIF_DIRTY_JOB_IO_BOUND
+#define ERL_NIF_DIRTY_CPU_COMPAT ERL_NIF_DIRTY_JOB_CPU_BOUND
+
+#define ERL_NIF_FUNC_COMPAT(N, A, F, FL) {N, A, F, FL}
+
+#else
+
+#define ERL_NIF_DIRTY_IO_COMPAT  0
+#define ERL_NIF_DIRTY_CPU_COMPAT 0
+
+#define ERL_NIF_FUNC_COMPAT(N, A, F, FL) {N, A, F}
+
+#endif /* dirty schedulers */
 
 #ifdef __cplusplus
 }
@@ -25,7 +25,9 @@
          close/1,
          close_write_file/1,
          get/2,
-         put/3,
+         get_many/2,
+         put/3, put/4,
+         put_many/2,
          delete/2,
          sync/1,
          list_keys/1,
@@ -37,7 +39,8 @@
          needs_merge/2,
          is_frozen/1,
          is_empty_estimate/1,
-         status/1]).
+         status/1,
+         io_stats/1]).
 
 -export([get_opt/2,
          get_filestate/2,
@@ -72,6 +75,41 @@
 %% This atom is the signal that it failed but is harmless in this situation.
 -define(POLL_FOR_MERGE_LOCK_PSEUDOFAILURE, pseudo_failure).
 
+%% With compression set to zstd_dict, a merge trains a new dictionary of
+%% DICT_SIZE bytes when the newest one is older than DICT_RETRAIN_SECS.
+%% Samples are taken from the start of the input files, newest first, up
+%% to DICT_SAMPLE_BYTES in all and DICT_FILE_SAMPLE_BYTES per file. Less
+%% than DICT_MIN_SAMPLE_BYTES of samples is not worth a dictionary.
+-define(DICT_SIZE, 65536).
+-define(DICT_RETRAIN_SECS, 86400).
+-define(DICT_SAMPLE_BYTES, 8388608).
+-define(DICT_FILE_SAMPLE_BYTES, 1048576).
+-define(DICT_MIN_SAMPLE_BYTES, 1048576).
+
+%% Bytes of an input file a merge copies natively between returns to
+%% Erlang, see merge_copy/5.
+-define(MERGE_COPY_BUDGET, 8388608).
+
+%% A merge writes a checkpoint of its progress, see
+%% write_merge_checkpoint/2, every MERGE_CHECKPOINT_BYTES of input.
+-define(MERGE_CHECKPOINT_BYTES, 268435456).
+
+%% With merge_io_latency_target set, get/2 times one in READ_SAMPLE_RATE
+%% reads for the merge throttle.
+-define(READ_SAMPLE_RATE, 16).
+
+%% Keydir epoch that sees the latest value of every key
+-define(MAX_EPOCH, 16#ffffffffffffffff).
+
+%% A put or delete of the writer waiting for its block to be written out:
+%% {Key, put, Entry, Value, Expiry, NowTstamp, OldFileId, OldOffset} or
+%% {Key, remove, OldTstamp, OldFileId, OldOffset}, with the arguments of
+%% the keydir_put or keydir_remove to make then
+-type block_put() ::
+        {binary(), put, #bitcask_entry{}, binary(), non_neg_integer(),
+         integer(), integer(), integer()} |
+        {binary(), remove, integer(), integer(), integer()}.
+
 %% @type bc_state().
 -record(bc_state, {dirname :: string(),
                    write_file :: 'fresh' | 'undefined' | #filestate{},     % File for writing
@@ -82,6 +120,17 @@
                    key_transform=fun kt_id/1 :: fun((binary()) -> binary()),
                    keydir :: reference(),       % Key directory
                    read_write_p :: integer(),    % integer() avoids atom -> NIF
+                   group_commit = false :: boolean(), % datasync after each put call
+                   sample_reads = false :: boolean(), % for the merge throttle
+                   value_cache = false :: boolean(), % keydir caches values read
+                   snapshot_time = 0 :: integer(), % Last keydir snapshot write
+                   expiry_sweeper :: pid() | undefined,
+                   % Keydir updates for the block the write file is filling,
+                   % newest first. They are only made once the block is
+                   % written out, see commit_block_puts/1
+                   block_puts = [] :: [block_put()],
+                   % Those of a written block a merge beat, oldest first
+                   block_retries = [] :: [block_put()],
                    % What tombstone style to write, for testing purposes only.
                    % 0 = old style without file id, 2 = new style with file id
                    tombstone_version = 2 :: 0 | 2
@@ -93,6 +142,10 @@
 -type bitcask_set() :: set().
 -endif.
 
+%% How far a merge got in an input file: the offset of the next entry to
+%% merge, 0 for the start of the file, or done
+-type merge_position() :: non_neg_integer() | done.
+
 -record(mstate, { dirname :: string(),
                   merge_lock :: reference(),
                   max_file_size :: integer(),
@@ -101,6 +154,9 @@
                   min_file_id :: non_neg_integer(),
                   tombstone_write_files :: [#filestate{}],
                   out_file :: 'fresh' | #filestate{},
+                  % Old locations of the entries in the block out_file is
+                  % filling, newest first
+                  block_puts = [] :: [{integer(), integer()}],
                   merge_coverage :: prefix | partial | full,
                   live_keydir :: reference(),
                   del_keydir :: reference(),
@@ -109,7 +165,21 @@
                   key_transform=fun kt_id/1 :: fun((binary()) -> binary()),
                   read_write_p :: integer(),    % integer() avoids atom -> NIF
                   opts :: list(),
-                  delete_files :: [#filestate{}]}).
+                  delete_files :: [#filestate{}],
+                  % Set in the workers of a parallel merge
+                  coordinator :: pid() | undefined,
+                  % Tombstones a worker leaves to the coordinator to
+                  % append to files outside the merge, newest first
+                  deferred_tombstones = [] :: [{binary(), binary(),
+                                                integer(), integer()}],
+                  throttle :: bitcask_merge_throttle:throttle(),
+                  % Position reached in each input file, for the checkpoint
+                  progress = [] :: [{string(), merge_position()}],
+                  % Input bytes merged since the last checkpoint
+                  checkpoint_bytes = 0 :: non_neg_integer(),
+                  % The merge_suspend option, asked between chunks of input
+                  suspend :: undefined | fun(() -> boolean()),
+                  suspended = false :: boolean()}).
 
 %% A bitcask is a directory containing:
 %% * One or more data files - {integer_timestamp}.bitcask.data
@@ -155,16 +225,35 @@ open(Dirname, Opts) ->
     %% Type of tombstone to write, for testing.
     TombstoneVersion = get_opt(tombstone_version, Opts),
 
+    %% Options used if this open creates the keydir
+    KeydirOpts = keydir_opts(Opts),
+    ScanOpts = scan_opts(Opts),
+
     %% Loop and wait for the keydir to come available.
     ReadWriteP = WritingFile /= undefined,
     ReadWriteI = case ReadWriteP of true  -> 1;
                                     false -> 0
                  end,
-    case init_keydir(Dirname, WaitTime, ReadWriteP, KeyTransformFun) of
+    case init_keydir(Dirname, WaitTime, ReadWriteP, KeyTransformFun,
+                     KeydirOpts, ScanOpts) of
         {ok, KeyDir, ReadFiles} ->
             %% Ensure that expiry_secs is in Opts and not just application env
             ExpOpts = [{expiry_secs,get_opt(expiry_secs,Opts)}|Opts],
 
+            GroupCommit = get_opt(sync_strategy, Opts) == group_commit,
+
+            %% The merge throttle slows down when these reads slow down
+            SampleReads = is_integer(get_opt(merge_io_latency_target, Opts)),
+
+            %% Gets go through the keydir value cache
+            ValueCache = lists:keymember(value_cache, 1, keydir_opts(Opts)),
+
+            %% Expired keys are swept by the cask that writes
+            Sweeper = case ReadWriteP of
+                          true  -> bitcask_expiry_sweep:start(Opts, KeyDir);
+                          false -> undefined
+                      end,
+
             Ref = make_ref(),
             erlang:put(Ref, #bc_state {dirname = Dirname,
                                        read_files = ReadFiles,
@@ -175,7 +264,12 @@ open(Dirname, Opts) ->
                                        keydir = KeyDir,
                                        key_transform = KeyTransformFun,
                                        tombstone_version = TombstoneVersion,
-                                       read_write_p = ReadWriteI}),
+                                       read_write_p = ReadWriteI,
+                                       group_commit = GroupCommit,
+                                       sample_reads = SampleReads,
+                                       value_cache = ValueCache,
+                                       snapshot_time = bitcask_time:tstamp(),
+                                       expiry_sweeper = Sweeper}),
             Ref;
         {error, Reason} ->
             {error, Reason}
@@ -193,11 +287,15 @@ close(Ref) ->
             ok;
         fresh ->
             ok;
-        WriteFile ->
-            _ = bitcask_fileops:close_for_writing(WriteFile),
-            ok = bitcask_lockops:release(State#bc_state.write_lock)
+        _ ->
+            {_, State1} = seal_write_file(fun bitcask_fileops:sync/1, State),
+            _ = bitcask_fileops:close_for_writing(State1#bc_state.write_file),
+            _ = maybe_write_keydir_snapshot(State1),
+            ok = bitcask_lockops:release(State1#bc_state.write_lock)
     end,
 
+    ok = bitcask_expiry_sweep:stop(State#bc_state.expiry_sweeper),
+
     %% Manually release the keydir. If, for some reason, this failed GC would
     %% still get the job done.
     bitcask_nifs:keydir_release(State#bc_state.keydir),
@@ -216,10 +314,12 @@ close_write_file(Ref) ->
         fresh ->
             ok;
         _ ->
-            LastWriteFile = bitcask_fileops:close_for_writing(WriteFile),
-            ok = bitcask_lockops:release(State#bc_state.write_lock),
-            S2 = State#bc_state { write_file = fresh,
-                                  read_files = [LastWriteFile | State#bc_state.read_files]},
+            {ok, State1} = seal_write_file(fun bitcask_fileops:sync/1, State),
+            LastWriteFile = bitcask_fileops:close_for_writing(
+                              State1#bc_state.write_file),
+            ok = bitcask_lockops:release(State1#bc_state.write_lock),
+            S2 = State1#bc_state { write_file = fresh,
+                                   read_files = [LastWriteFile | State1#bc_state.read_files]},
             put_state(Ref, S2)
     end.
 
@@ -234,7 +334,16 @@ get(Ref, Key) ->
 get(_Ref, _Key, 0) -> {error, nofile};
 get(Ref, Key, TryNum) ->
     State = get_state(Ref),
-    case bitcask_nifs:keydir_get(State#bc_state.keydir, Key) of
+    case lists:keyfind(Key, 1, State#bc_state.block_puts) of
+        false ->
+            get_keydir(Ref, Key, TryNum, State);
+        Put ->
+            block_put_result(Put, expiry_time(State#bc_state.opts))
+    end.
+
+get_keydir(Ref, Key, TryNum, State) ->
+    case bitcask_nifs:keydir_get(State#bc_state.keydir, Key, ?MAX_EPOCH,
+                                 bitcask_time:tstamp()) of
         not_found ->
             not_found;
         E when is_record(E, bitcask_entry) ->
@@ -252,37 +361,200 @@ get(Ref, Key, TryNum) ->
                             get(Ref, Key, TryNum-1)
                     end;
                 false ->
-                    %% HACK: Use a fully-qualified call to get_filestate/2 so that
-                    %% we can intercept calls w/ Pulse tests.
-                    case ?MODULE:get_filestate(E#bitcask_entry.file_id, State) of
-                        {error, enoent} ->
-                            %% merging deleted file between keydir_get and here
-                            get(Ref, Key, TryNum-1);
-                        {error, _} = Else ->
-                            Else;
-                        {Filestate, S2} ->
-                            put_state(Ref, S2),
-                            case bitcask_fileops:read(Filestate,
-                                                    E#bitcask_entry.offset,
-                                                    E#bitcask_entry.total_sz) of
-                                {ok, _Key, Value} ->
-                                    case is_tombstone(Value) of
-                                        true ->
-                                            not_found;
-                                        false ->
-                                            {ok, Value}
-                                    end;
-                                {error, eof} ->
-                                    not_found;
-                                {error, _} = Err ->
-                                    Err
-                            end
+                    case cache_get(State, E#bitcask_entry.file_id,
+                                   E#bitcask_entry.offset) of
+                        {ok, _} = Cached ->
+                            Cached;
+                        not_found ->
+                            get_read(Ref, Key, TryNum, State, E)
                     end
             end
     end.
 
+%% What get/2 finds for a key the writer updated in the block it is
+%% filling: the keydir does not know about it yet
+block_put_result({_Key, put, #bitcask_entry { tstamp = Tstamp }, Value, Expiry,
+                  _NowTstamp, _OldFileId, _OldOffset}, ExpiryTime) ->
+    case Tstamp < ExpiryTime orelse
+        (Expiry /= 0 andalso Expiry =< bitcask_time:tstamp()) of
+        true ->
+            not_found;
+        false ->
+            {ok, Value}
+    end;
+block_put_result({_Key, remove, _OldTstamp, _OldFileId, _OldOffset},
+                 _ExpiryTime) ->
+    not_found.
+
+get_read(Ref, Key, TryNum, State, E) ->
+    %% HACK: Use a fully-qualified call to get_filestate/2 so that
+    %% we can intercept calls w/ Pulse tests.
+    case ?MODULE:get_filestate(E#bitcask_entry.file_id, State) of
+        {error, enoent} ->
+            %% merging deleted file between keydir_get and here
+            get(Ref, Key, TryNum-1);
+        {error, _} = Else ->
+            Else;
+        {Filestate, S2} ->
+            put_state(Ref, S2),
+            cache_put(S2, E#bitcask_entry.file_id, E#bitcask_entry.offset,
+                      read_result(sample_read(S2, Filestate, E)))
+    end.
+
+%% Look a value up in the keydir value cache, if the cask uses one, before
+%% reading it from its data file
+cache_get(#bc_state { value_cache = true, keydir = Keydir }, FileId, Offset) ->
+    bitcask_nifs:keydir_cache_get(Keydir, FileId, Offset);
+cache_get(_State, _FileId, _Offset) ->
+    not_found.
+
+%% Offer a value read from a data file to the keydir value cache. Tombstones
+%% and errors are not cached.
+cache_put(#bc_state { value_cache = true, keydir = Keydir }, FileId, Offset,
+          {ok, Value} = Result) ->
+    ok = bitcask_nifs:keydir_cache_put(Keydir, FileId, Offset, Value),
+    Result;
+cache_put(_State, _FileId, _Offset, Result) ->
+    Result.
+
+%% Time one in READ_SAMPLE_RATE reads into the keydir, for
+%% bitcask_merge_throttle
+sample_read(#bc_state { sample_reads = true, keydir = Keydir }, Filestate, E) ->
+    case rand:uniform(?READ_SAMPLE_RATE) of
+        1 ->
+            T0 = erlang:monotonic_time(microsecond),
+            Result = bitcask_fileops:read(Filestate, E#bitcask_entry.offset,
+                                          E#bitcask_entry.total_sz),
+            T1 = erlang:monotonic_time(microsecond),
+            ok = bitcask_nifs:keydir_add_read_latency(Keydir, T1 - T0),
+            Result;
+        _ ->
+            bitcask_fileops:read(Filestate, E#bitcask_entry.offset,
+                                 E#bitcask_entry.total_sz)
+    end;
+sample_read(_State, Filestate, E) ->
+    bitcask_fileops:read(Filestate, E#bitcask_entry.offset,
+                         E#bitcask_entry.total_sz).
+
+read_result({ok, _Key, Value}) ->
+    case is_tombstone(Value) of
+        true ->
+            not_found;
+        false ->
+            {ok, Value}
+    end;
+read_result({error, eof}) ->
+    not_found;
+read_result({error, _} = Err) ->
+    Err.
+
+%% @doc Retrieve the values for several keys. All keydir entries are
+%% fetched with a single NIF call, then the reads are grouped per data
+%% file and issued in offset order so neighbouring values share a pread.
+%% Results are returned in the same order as Keys.
+-spec get_many(reference(), [binary()]) ->
+                      [not_found | {ok, Value::binary()} | {error, Err::term()}].
+get_many(Ref, Keys) ->
+    State = get_state(Ref),
+    Entries0 = bitcask_nifs:keydir_get_many(State#bc_state.keydir, Keys,
+                                            ?MAX_EPOCH, bitcask_time:tstamp()),
+    %% The writer's own updates waiting in its block come first
+    Entries = case State#bc_state.block_puts of
+                  [] ->
+                      Entries0;
+                  Puts ->
+                      lists:zipwith(fun(Key, E) ->
+                                            case lists:keyfind(Key, 1, Puts) of
+                                                false -> E;
+                                                Put -> {block_put, Put}
+                                            end
+                                    end, Keys, Entries0)
+              end,
+    ExpiryTime = expiry_time(State#bc_state.opts),
+    {Done, Retry, Locs} = get_many_plan(lists:zip(Keys, Entries), 1,
+                                        ExpiryTime, State, [], [], []),
+    {Read, Retry2, State2} = get_many_read(lists:sort(Locs), Done, Retry,
+                                           State),
+    put_state(Ref, State2),
+    %% Expired entries and files removed by a merge in the meantime are
+    %% rare; let get/2 deal with them one at a time.
+    Retried = [{I, get(Ref, Key)} || {I, Key} <- Retry2],
+    [Result || {_I, Result} <- lists:keysort(1, Read ++ Retried)].
+
+get_many_plan([], _I, _ExpiryTime, _State, Done, Retry, Locs) ->
+    {Done, Retry, Locs};
+get_many_plan([{_Key, {block_put, Put}} | Rest], I, ExpiryTime, State, Done,
+              Retry, Locs) ->
+    get_many_plan(Rest, I + 1, ExpiryTime, State,
+                  [{I, block_put_result(Put, ExpiryTime)} | Done], Retry, Locs);
+get_many_plan([{_Key, not_found} | Rest], I, ExpiryTime, State, Done, Retry,
+              Locs) ->
+    get_many_plan(Rest, I + 1, ExpiryTime, State, [{I, not_found} | Done],
+                  Retry, Locs);
+get_many_plan([{Key, E} | Rest], I, ExpiryTime, State, Done, Retry, Locs)
+  when E#bitcask_entry.tstamp < ExpiryTime ->
+    get_many_plan(Rest, I + 1, ExpiryTime, State, Done, [{I, Key} | Retry],
+                  Locs);
+get_many_plan([{Key, E} | Rest], I, ExpiryTime, State, Done, Retry, Locs) ->
+    FileId = E#bitcask_entry.file_id,
+    Offset = E#bitcask_entry.offset,
+    case cache_get(State, FileId, Offset) of
+        {ok, _} = Cached ->
+            get_many_plan(Rest, I + 1, ExpiryTime, State, [{I, Cached} | Done],
+                          Retry, Locs);
+        not_found ->
+            Loc = {FileId, Offset, E#bitcask_entry.total_sz, I, Key},
+            get_many_plan(Rest, I + 1, ExpiryTime, State, Done, Retry,
+                          [Loc | Locs])
+    end.
+
+%% Locs are sorted by file id and then offset; read one file at a time.
+get_many_read([], Done, Retry, State) ->
+    {Done, Retry, State};
+get_many_read([{FileId, _, _, _, _} | _] = Locs, Done, Retry, State) ->
+    {FileLocs, Rest} = lists:splitwith(fun(L) -> element(1, L) == FileId end,
+                                       Locs),
+    %% HACK: Use a fully-qualified call to get_filestate/2 so that
+    %% we can intercept calls w/ Pulse tests.
+    case ?MODULE:get_filestate(FileId, State) of
+        {error, enoent} ->
+            %% merging deleted file between keydir_get_many and here
+            Retry2 = [{I, Key} || {_, _, _, I, Key} <- FileLocs] ++ Retry,
+            get_many_read(Rest, Done, Retry2, State);
+        {error, _} = Else ->
+            Done2 = [{I, Else} || {_, _, _, I, _} <- FileLocs] ++ Done,
+            get_many_read(Rest, Done2, Retry, State);
+        {Filestate, S2} ->
+            Results = bitcask_fileops:read_many(
+                        Filestate,
+                        [{Offset, Size} || {_, Offset, Size, _, _} <- FileLocs]),
+            Done2 = lists:zipwith(fun({_, Offset, _, I, _}, R) ->
+                                          {I, cache_put(S2, FileId, Offset,
+                                                        read_result(R))}
+                                  end, FileLocs, Results) ++ Done,
+            get_many_read(Rest, Done2, Retry, S2)
+    end.
+
 %% @doc Store a key and value in a bitcase datastore.
 put(Ref, Key, Value) ->
+    put(Ref, Key, Value, []).
+
+%% @doc Store a key and value in a bitcask datastore. With {expires, Tstamp}
+%% in Opts, a bitcask_time:tstamp/0 value, gets, folds and iterators no
+%% longer find the key once that time is reached, and the next merge of
+%% its file drops it. 0 never expires. Values too large for the 32-bit
+%% size field of a data file give {error, value_too_large}.
+-spec put(reference(), binary(), binary() | tombstone,
+          [{expires, non_neg_integer()}]) -> ok | {error, term()}.
+put(Ref, Key, Value, Opts) ->
+    Expiry = case {Value, proplists:get_value(expires, Opts, 0)} of
+                 {tombstone, _} ->
+                     0;
+                 {_, E} when is_integer(E), E >= 0, E =< 16#ffffffff ->
+                     E;
+                 {_, E} ->
+                     erlang:error({badarg, {expires, E}})
+             end,
     #bc_state { write_file = WriteFile } = State = get_state(Ref),
 
     %% Make sure we have a file open to write
@@ -295,15 +567,62 @@ put(Ref, Key, Value) ->
     end,
 
     try
-        {Ret, State1} = do_put(Key, Value, State,
+        {Ret, State1} = do_put(Key, Value, Expiry, State,
                                ?DIABOLIC_BIG_INT, undefined),
-        put_state(Ref, State1),
-        Ret
+        {Ret2, State2} = maybe_group_commit(Ret, retry_block_puts(State1)),
+        put_state(Ref, State2),
+        Ret2
     catch throw:{unrecoverable, Error, State2} ->
             put_state(Ref, State2),
             {error, Error}
     end.
 
+%% @doc Store several keys and values (or tombstones, to delete a key) in
+%% one call. With the group_commit sync strategy the whole batch is made
+%% durable by a single fdatasync of the write file, instead of paying for
+%% a flush per put as o_sync does. Stops at the first failing put.
+-spec put_many(reference(), [{Key::binary(), Value::binary() | tombstone}]) ->
+                      ok | {error, term()}.
+put_many(Ref, KVs) ->
+    #bc_state { write_file = WriteFile } = State = get_state(Ref),
+
+    %% Make sure we have a file open to write
+    case WriteFile of
+        undefined ->
+            throw({error, read_only});
+
+        _ ->
+            ok
+    end,
+
+    try
+        {Ret, State1} = put_many_loop(KVs, State),
+        {Ret2, State2} = maybe_group_commit(Ret, retry_block_puts(State1)),
+        put_state(Ref, State2),
+        Ret2
+    catch throw:{unrecoverable, Error, State2} ->
+            put_state(Ref, State2),
+            {error, Error}
+    end.
+
+put_many_loop([], State) ->
+    {ok, State};
+put_many_loop([{Key, Value} | Rest], State) ->
+    case do_put(Key, Value, 0, State, ?DIABOLIC_BIG_INT, undefined) of
+        {ok, State1} ->
+            put_many_loop(Rest, State1);
+        {{error, _}, _State1} = Error ->
+            Error
+    end.
+
+%% Writes that wrapped to a new file were already synced when the old file
+%% was closed for writing, so only the current write file needs flushing.
+maybe_group_commit(ok, #bc_state { group_commit = true,
+                                   write_file = #filestate{} } = State) ->
+    seal_write_file(fun bitcask_fileops:datasync/1, State);
+maybe_group_commit(Ret, State) ->
+    {Ret, State}.
+
 %% @doc Delete a key from a bitcask datastore.
 -spec delete(reference(), Key::binary()) -> ok.
 delete(Ref, Key) ->
@@ -318,8 +637,10 @@ sync(Ref) ->
             ok;
         fresh ->
             ok;
-        File ->
-            ok = bitcask_fileops:sync(File)
+        _ ->
+            {ok, State1} = seal_write_file(fun bitcask_fileops:sync/1, State),
+            put_state(Ref, State1),
+            ok
     end.
 
 
@@ -346,6 +667,7 @@ fold_keys(Ref, Fun, Acc0) ->
                                                 term() | {error, any()}.
 fold_keys(Ref, Fun, Acc0, MaxAge, MaxPut, SeeTombstonesP) ->
     %% Fun should be of the form F(#bitcask_entry, A) -> A
+    _ = seal_write_block(Ref),
     ExpiryTime = expiry_time((get_state(Ref))#bc_state.opts),
     RealFun = fun(BCEntry, Acc) ->
         Key = BCEntry#bitcask_entry.key,
@@ -377,7 +699,7 @@ fold_keys(Ref, Fun, Acc0, MaxAge, MaxPut, SeeTombstonesP) ->
            fun((binary(), binary(), any()) -> any()),
            any()) -> any() | {error, any()}.
 fold(Ref, Fun, Acc0) when is_reference(Ref)->
-    State = get_state(Ref),
+    State = seal_write_block(Ref),
     fold(State, Fun, Acc0);
 fold(State, Fun, Acc0) ->
     MaxAge = get_opt(max_fold_age, State#bc_state.opts) * 1000, % convert from ms to us
@@ -392,7 +714,7 @@ fold(State, Fun, Acc0) ->
            non_neg_integer() | undefined, non_neg_integer() | undefined, boolean()) ->
                   any() | {error, any()}.
 fold(Ref, Fun, Acc0, MaxAge, MaxPut, SeeTombstonesP) when is_reference(Ref)->
-    State = get_state(Ref),
+    State = seal_write_block(Ref),
     fold(State, Fun, Acc0, MaxAge, MaxPut, SeeTombstonesP);
 fold(State, Fun, Acc0, MaxAge, MaxPut, SeeTombstonesP) ->
     KT = State#bc_state.key_transform,
@@ -403,6 +725,9 @@ fold(State, Fun, Acc0, MaxAge, MaxPut, SeeTombstonesP) ->
                                      ?OPEN_FOLD_RETRIES) of
                     {ok, Files, FoldEpoch} ->
                         ExpiryTime = expiry_time(State#bc_state.opts),
+                        %% Keys with their own expiry time are left out
+                        %% once it has passed
+                        FoldTime = bitcask_time:tstamp(),
                         SubFun = fun(K0,V,TStamp,{_FN,FTS,Offset,_Sz},Acc) ->
                                          K = try
                                                  KT(K0)
@@ -419,7 +744,7 @@ fold(State, Fun, Acc0, MaxAge, MaxPut, SeeTombstonesP) ->
                                              {_, false} ->
                                                  case bitcask_nifs:keydir_get(
                                                         State#bc_state.keydir, K,
-                                                        FoldEpoch) of
+                                                        FoldEpoch, FoldTime) of
                                                      not_found ->
                                                          Acc;
                                                      E when is_record(E, bitcask_entry) ->
@@ -452,6 +777,18 @@ fold(State, Fun, Acc0, MaxAge, MaxPut, SeeTombstonesP) ->
     KeyDir = State#bc_state.keydir,
     bitcask_nifs:keydir_frozen(KeyDir, FrozenFun, MaxAge, MaxPut).
 
+%% Let a fold see the entries of the block the write file is filling by
+%% sealing it, which puts them in the keydir. Only the process owning the
+%% write file may do this, so folds over a state passed to another process
+%% do not see them until the block is written.
+seal_write_block(Ref) ->
+    {_, State} = seal_write_file(fun(WriteFile) ->
+                                         bitcask_fileops:seal(
+                                           WriteFile, fun(_Entries) -> [] end)
+                                 end, get_state(Ref)),
+    put_state(Ref, State),
+    State.
+
 %%
 %% Get a list of readable files and attempt to open them for a fold. If we can't
 %% open any one of the files, get a fresh list of files and try again.
@@ -534,7 +871,7 @@ subfold(SubFun,[FD | Rest],Acc0) ->
 -spec iterator(reference(), integer(), integer()) ->
       ok | out_of_date | {error, iteration_in_process}.
 iterator(Ref, MaxAge, MaxPuts) ->
-    KeyDir = (get_state(Ref))#bc_state.keydir,
+    KeyDir = (seal_write_block(Ref))#bc_state.keydir,
     bitcask_nifs:keydir_itr(KeyDir, MaxAge, MaxPuts).
 
 %% @doc Get next entry from the iterator
@@ -572,7 +909,7 @@ merge(_Dirname, _Opts, []) ->
     ok;
 merge(Dirname,Opts,FilesToMerge) when is_list(FilesToMerge) ->
     merge(Dirname,Opts,{FilesToMerge,[]});
-merge(_Dirname, _Opts, {[],_}) ->
+merge(_Dirname, _Opts, {[],[]}) ->
     ok;
 merge(Dirname, Opts, {FilesToMerge0, ExpiredFiles0}) ->
     try
@@ -596,7 +933,7 @@ merge(Dirname, Opts, {FilesToMerge0, ExpiredFiles0}) ->
 %% Inner merge function, assumes that bitcask is running and all files exist.
 merge1(_Dirname, _Opts, [], []) ->
     ok;
-merge1(Dirname, Opts, FilesToMerge0, ExpiredFiles) ->
+merge1(Dirname, Opts, FilesToMerge1, ExpiredFiles0) ->
     KT = get_key_transform(get_opt(key_transform, Opts)),
 
     %% Try to lock for merging
@@ -608,12 +945,24 @@ merge1(Dirname, Opts, FilesToMerge0, ExpiredFiles) ->
             throw({error, {merge_locked, Reason, Dirname}})
     end,
 
+    %% A merge that was suspended or did not finish is picked up where
+    %% it left off before any other files are merged
+    {FilesToMerge0, ExpiredFiles, Progress} =
+        case read_merge_checkpoint(Dirname) of
+            undefined ->
+                {FilesToMerge1, ExpiredFiles0, []};
+            Checkpoint ->
+                error_logger:info_msg("Resuming the merge of ~s\n", [Dirname]),
+                {[F || {F, _} <- Checkpoint, bitcask_fileops:is_file(F)], [],
+                 Checkpoint}
+        end,
+
     %% Get the live keydir
     case bitcask_nifs:maybe_keydir_new(Dirname) of
         {ready, LiveKeyDir} ->
             %% Simplest case; a key dir is already available and
             %% loaded. Go ahead and open just the files we wish to
-            %% merge
+            %% merge. Expired files are dropped without opening them.
             InFiles0 = [begin
                             %% Handle open errors gracefully.  QuickCheck
                             %% plus PULSE showed that there are races where
@@ -623,28 +972,19 @@ merge1(Dirname, Opts, FilesToMerge0, ExpiredFiles) ->
                                 {error, _}      -> skip
                             end
                         end
-                        || F <- FilesToMerge0],
-            InFiles1 = [F || F <- InFiles0, F /= skip];
+                        || F <- FilesToMerge0,
+                           not lists:member(F, ExpiredFiles)],
+            InFiles2 = [F || F <- InFiles0, F /= skip];
         {error, not_ready} ->
             %% Someone else is loading the keydir, or this cask isn't open.
             %% We'll bail here and try again later.
 
             ok = bitcask_lockops:release(Lock),
             % Make erlc happy w/ non-local exit
-            LiveKeyDir = undefined, InFiles1 = [],
+            LiveKeyDir = undefined, InFiles2 = [],
             throw({error, not_ready})
     end,
 
-    {InFiles2,InExpiredFiles} = lists:foldl(fun(F, {InFilesAcc,InExpiredAcc}) ->
-                                            case lists:member(F#filestate.filename,
-                                                    ExpiredFiles) of
-                                                false ->
-                                                    {[F|InFilesAcc],InExpiredAcc};
-                                                true ->
-                                                    {InFilesAcc,[F|InExpiredAcc]}
-                                            end
-                            end, {[],[]}, InFiles1),
-
     %% Test to see if this is a complete or partial merge
     %% We perform this test now because our efforts to open the input files
     %% in the InFiles0 list comprehension above may have had an open
@@ -699,33 +1039,48 @@ merge1(Dirname, Opts, FilesToMerge0, ExpiredFiles) ->
                       key_transform = KT,
                       read_write_p = 0,
                       opts = Opts,
-                      delete_files = []},
+                      delete_files = [],
+                      throttle = bitcask_merge_throttle:new(Opts, LiveKeyDir),
+                      progress = [{Name, proplists:get_value(Name, Progress, 0)}
+                                  || #filestate { filename = Name } <- InFiles],
+                      suspend = get_opt(merge_suspend, Opts)},
 
     %% Finally, start the merge process
-    ExpiredFilesFinished = expiry_merge(InExpiredFiles, LiveKeyDir, KT, []),
-    State1 = merge_files(State),
-
-    %% Make sure to close the final output file
-    case State1#mstate.out_file of
-        fresh ->
-            ok;
-        Outfile ->
-            ok = bitcask_fileops:sync(Outfile),
-            ok = bitcask_fileops:close(Outfile)
-    end,
+    ExpiredFilesFinished = expiry_merge(ExpiredFiles, LiveKeyDir),
+    ok = bitcask_fileops:delete_unused_dicts(Dirname),
+    ok = maybe_train_dict(Dirname, Opts, InFiles),
+    IoStats = bitcask_nifs:keydir_io_stats(LiveKeyDir),
+    State1 = case merge_workers(Opts, InFiles) of
+                 1 ->
+                     %% Make sure to close the final output file
+                     State0 = close_merge_output(merge_files(State)),
+                     ok = bitcask_merge_throttle:finish(State0#mstate.throttle),
+                     State0;
+                 Workers ->
+                     merge_files_parallel(State, Workers)
+             end,
+    log_merge_throttled(Dirname, IoStats,
+                        bitcask_nifs:keydir_io_stats(LiveKeyDir)),
 
     _ = [begin
-             ok = bitcask_fileops:sync(TFile),
-             ok = bitcask_fileops:close(TFile)
+             {ok, TFile2} = bitcask_fileops:sync(TFile),
+             ok = bitcask_fileops:close(TFile2)
          end || TFile <- State1#mstate.tombstone_write_files],
 
     %% Close the original input files, schedule them for deletion,
     %% close keydirs, and release our lock
-    bitcask_fileops:close_all(State#mstate.input_files ++ ExpiredFilesFinished),
+    bitcask_fileops:close_all(State#mstate.input_files),
+    MergedFiles = case State1#mstate.suspended of
+                      false ->
+                          ok = delete_merge_checkpoint(Dirname),
+                          State1#mstate.delete_files;
+                      true ->
+                          suspend_merge(InFiles, State1)
+                  end,
     {_, _, _, {IterGeneration, _, _, _}, _} = bitcask_nifs:keydir_info(LiveKeyDir),
-    DelFiles = [F || F <- State1#mstate.delete_files ++ ExpiredFilesFinished],
-    FileNames = [F#filestate.filename || F <- DelFiles],
-    DelIds = [F#filestate.tstamp || F <- DelFiles],
+    FileNames = [F#filestate.filename || F <- MergedFiles] ++
+        ExpiredFilesFinished,
+    DelIds = [bitcask_fileops:file_tstamp(F) || F <- FileNames],
     _ = [bitcask_nifs:set_pending_delete(LiveKeyDir, DelId) || DelId <- DelIds],
     _ = [catch set_pending_delete_bit(F) || F <- FileNames],
     bitcask_merge_delete:defer_delete(Dirname, IterGeneration, FileNames),
@@ -736,6 +1091,36 @@ merge1(Dirname, Opts, FilesToMerge0, ExpiredFiles) ->
 
     ok = bitcask_lockops:release(Lock).
 
+%% Checkpoint the files a suspended merge has yet to finish and return
+%% the merged ones that can go now: those before the first unfinished
+%% one, since a tombstone dropped from a merged file may stand for a value
+%% in any earlier file.
+suspend_merge(InFiles, #mstate { dirname = Dirname, progress = Progress,
+                                 delete_files = DelFiles }) ->
+    Merged = [Name || #filestate { filename = Name } <-
+                          lists:takewhile(
+                            fun(#filestate { filename = Name }) ->
+                                    proplists:get_value(Name, Progress) == done
+                            end, InFiles)],
+    Left = [P || {Name, _} = P <- Progress, not lists:member(Name, Merged)],
+    ok = write_merge_checkpoint(Dirname, Left),
+    error_logger:info_msg("Suspended the merge of ~s with ~p files left\n",
+                          [Dirname, length(Left)]),
+    [F || F <- DelFiles, lists:member(F#filestate.filename, Merged)].
+
+log_merge_throttled(Dirname, Before, After) ->
+    Bytes = proplists:get_value(merge_bytes, After) -
+        proplists:get_value(merge_bytes, Before),
+    case proplists:get_value(merge_throttled_usecs, After) -
+        proplists:get_value(merge_throttled_usecs, Before) of
+        0 ->
+            ok;
+        Usecs ->
+            error_logger:info_msg("Merge of ~s did ~p bytes of I/O and was "
+                                  "throttled for ~.1f seconds\n",
+                                  [Dirname, Bytes, Usecs / 1000000])
+    end.
+
 %% @doc Predicate which determines whether or not a file should be considered for a merge.
 consider_for_merge(FragTrigger, DeadBytesTrigger, ExpirationGraceTime) ->
     fun (F) ->
@@ -790,11 +1175,17 @@ needs_merge(Ref, Opts) ->
     %% Update state with live files
     put_state(Ref, State#bc_state { read_files = LiveFiles }),
     Result0 =
-        case explicit_merge_files(Dirname) of
-            [] ->
-                run_merge_triggers(State, Summary);
-            MergeFiles ->
-                {true, {MergeFiles, []}}
+        case read_merge_checkpoint(Dirname) of
+            undefined ->
+                case explicit_merge_files(Dirname) of
+                    [] ->
+                        run_merge_triggers(State, Summary);
+                    MergeFiles ->
+                        {true, {MergeFiles, []}}
+                end;
+            Checkpoint ->
+                %% Finish the merge that was suspended first
+                {true, {[F || {F, _} <- Checkpoint], []}}
         end,
     MaxMergeSize = proplists:get_value(max_merge_size, Opts),
     case Result0 of
@@ -898,6 +1289,47 @@ read_lines(Filename) ->
             Err
     end.
 
+merge_checkpoint_file(Dirname) ->
+    filename:join(Dirname, "merge.checkpoint").
+
+%% Reads the progress of a suspended or interrupted merge, if any. An
+%% invalid checkpoint is deleted, as the files merged before it was
+%% written are still around and the next merge goes over them again.
+-spec read_merge_checkpoint(Dir :: string()) ->
+        undefined | [{string(), merge_position()}].
+read_merge_checkpoint(Dirname) ->
+    Filename = merge_checkpoint_file(Dirname),
+    case file:consult(Filename) of
+        {ok, [{merge_checkpoint, Progress}]} when is_list(Progress) ->
+            [P || {F, Pos} = P <- Progress, is_list(F),
+                  is_integer(Pos) orelse Pos == done];
+        {error, enoent} ->
+            undefined;
+        Other ->
+            error_logger:error_msg("Invalid merge checkpoint ~s, deleting : ~p",
+                                   [Filename, Other]),
+            _ = file:delete(Filename),
+            undefined
+    end.
+
+write_merge_checkpoint(Dirname, []) ->
+    delete_merge_checkpoint(Dirname);
+write_merge_checkpoint(Dirname, Progress) ->
+    Filename = merge_checkpoint_file(Dirname),
+    TmpFilename = Filename ++ ".tmp",
+    ok = file:write_file(TmpFilename,
+                         io_lib:format("~p.~n", [{merge_checkpoint, Progress}]),
+                         [raw, sync]),
+    file:rename(TmpFilename, Filename).
+
+delete_merge_checkpoint(Dirname) ->
+    case file:delete(merge_checkpoint_file(Dirname)) of
+        {error, enoent} ->
+            ok;
+        Res ->
+            Res
+    end.
+
 run_merge_triggers(State, Summary) ->
     %% Triggers that would require a merge:
     %%
@@ -935,8 +1367,20 @@ run_merge_triggers(State, Summary) ->
             CheckFile = fun(F) ->
                                 {F#file_status.filename, lists:flatten([T(F) || T <- Thresholds])}
                         end,
-            MergableFiles = [{N, R} || {N, R} <- [CheckFile(F) || F <- Summary],
-                                       R /= []],
+            MergableFiles0 = [{N, R} || {N, R} <- [CheckFile(F) || F <- Summary],
+                                        R /= []],
+
+            %% With merge_io_budget set, only the files that get back
+            %% the most for the I/O it allows
+            Planned = bitcask_merge_planner:plan(
+                        [F || F <- Summary,
+                              lists:keymember(F#file_status.filename, 1,
+                                              MergableFiles0)],
+                        ExpirationTime,
+                        get_opt(merge_io_budget, State#bc_state.opts)),
+            MergableFiles = [M || {N, _} = M <- MergableFiles0,
+                                  lists:keymember(N, #file_status.filename,
+                                                  Planned)],
 
             %% Log the reasons for needing a merge, if so configured
             %% TODO: At some point we may want to change this API to let the caller
@@ -1032,6 +1476,15 @@ status(Ref) ->
     {KeyCount, [{F#file_status.filename, F#file_status.fragmented,
                  F#file_status.dead_bytes, F#file_status.total_bytes} || F <- Summary]}.
 
+%% @doc Running totals of the sampled read latency and of the bytes merges
+%% read and wrote and the time they spent throttled, see
+%% bitcask_merge_throttle, and of the hits, misses and evictions of the
+%% keydir value cache with what it holds, see keydir_value_cache.
+-spec io_stats(reference()) -> [{atom(), non_neg_integer()}].
+io_stats(Ref) ->
+    #bc_state{keydir=Keydir} = get_state(Ref),
+    bitcask_nifs:keydir_io_stats(Keydir).
+
 current_files(Dirname, Keydir) ->
     {_, _, Fstats, {_, _, _, PendingEpoch}, Epoch} =
         bitcask_nifs:keydir_info(Keydir),
@@ -1186,36 +1639,12 @@ scan_key_files([Filename | Rest], KeyDir, Acc, CloseFile, KT) ->
             %% tombstones or data errors.  Otherwise we risk of
             %% reusing the file id for new data.
             _ = bitcask_nifs:increment_file_id(KeyDir, FileTstamp),
-            F = fun({tombstone, K0}, _Tstamp, {_Offset, _TotalSz}, _) ->
-                        K = try KT(K0) catch TxErr -> {key_tx_error, TxErr} end,
-                        case K of
-                            {key_tx_error, KeyTxErr} ->
-                                error_logger:error_msg("Invalid key on load ~p: ~p",
-                                                       [K0, KeyTxErr]),
-                                ok;
-                            _ ->
-                                bitcask_nifs:keydir_remove(KeyDir, KT(K))
-                        end,
-                        ok;
-                   (K0, Tstamp, {Offset, TotalSz}, _) ->
-                        K = try KT(K0) catch TxErr -> {key_tx_error, TxErr} end,
-                        case K of
-                            {key_tx_error, KeyTxErr} ->
-                                error_logger:error_msg("Invalid key on load ~p: ~p",
-                                                       [K0, KeyTxErr]);
-                            _ ->
-                                bitcask_nifs:keydir_put(KeyDir,
-                                                        K,
-                                                        FileTstamp,
-                                                        TotalSz,
-                                                        Offset,
-                                                        Tstamp,
-                                                        bitcask_time:tstamp(),
-                                                        false)
-                        end,
-                        ok
-                end,
-            bitcask_fileops:fold_keys(File, F, undefined, recovery),
+            case load_hintfile(File, KeyDir, KT) of
+                ok ->
+                    ok;
+                _ ->
+                    fold_key_file(File, KeyDir, KT)
+            end,
             if CloseFile == true ->
                     bitcask_fileops:close(File);
                true ->
@@ -1224,14 +1653,130 @@ scan_key_files([Filename | Rest], KeyDir, Acc, CloseFile, KT) ->
             scan_key_files(Rest, KeyDir, [File | Acc], CloseFile, KT)
     end.
 
+%% Same as scan_key_files/5, but with LoadThreads > 1 runs of hint files
+%% are loaded by the NIF on that many threads.
+scan_key_files(Filenames, KeyDir, Acc, CloseFile, KT, LoadThreads) ->
+    case LoadThreads > 1 andalso KT =:= fun kt_id/1 of
+        true ->
+            par_scan_key_files(Filenames, KeyDir, Acc, CloseFile, LoadThreads);
+        false ->
+            scan_key_files(Filenames, KeyDir, Acc, CloseFile, KT)
+    end.
+
+par_scan_key_files(Filenames, KeyDir, Acc, CloseFile, LoadThreads) ->
+    %% Restrictive pattern matching below is intentional
+    Files = [begin
+                 {ok, File} = bitcask_fileops:open_file(Filename),
+                 _ = bitcask_nifs:increment_file_id(
+                       KeyDir, bitcask_fileops:file_tstamp(File)),
+                 File
+             end || Filename <- Filenames],
+    par_scan_files(Files, KeyDir, Acc, CloseFile, LoadThreads).
+
+%% Files are applied in order: when one can't be loaded from its hint
+%% file it is folded over before the files after it are loaded, so their
+%% tombstones still land on top of its keys.
+par_scan_files([], _KeyDir, Acc, _CloseFile, _LoadThreads) ->
+    Acc;
+par_scan_files(Files, KeyDir, Acc, CloseFile, LoadThreads) ->
+    KT = fun kt_id/1,
+    case bitcask_fileops:load_hintfiles(Files, KeyDir, LoadThreads) of
+        {error, _} ->
+            %% Someone is iterating, go one file at a time
+            lists:foldl(fun(File, Acc1) ->
+                                case load_hintfile(File, KeyDir, KT) of
+                                    ok ->
+                                        ok;
+                                    _ ->
+                                        fold_key_file(File, KeyDir, KT)
+                                end,
+                                close_key_file(File, CloseFile),
+                                [File | Acc1]
+                        end, Acc, Files);
+        Results ->
+            {Loaded, Rest} = lists:splitwith(fun({_, R}) -> R == ok end,
+                                             lists:zip(Files, Results)),
+            Acc2 = lists:foldl(fun({File, ok}, Acc1) ->
+                                       close_key_file(File, CloseFile),
+                                       [File | Acc1]
+                               end, Acc, Loaded),
+            case Rest of
+                [] ->
+                    Acc2;
+                [{File, _} | Others] ->
+                    fold_key_file(File, KeyDir, KT),
+                    close_key_file(File, CloseFile),
+                    par_scan_files([F || {F, _} <- Others], KeyDir,
+                                   [File | Acc2], CloseFile, LoadThreads)
+            end
+    end.
+
+close_key_file(File, true) ->
+    bitcask_fileops:close(File);
+close_key_file(_File, _) ->
+    ok.
+
+%% Loads a data file into the keydir by reading the hint file through
+%% Erlang, or the data file itself if the hint file is missing or bad.
+fold_key_file(File, KeyDir, KT) ->
+    FileTstamp = bitcask_fileops:file_tstamp(File),
+    Put = fun(K0, Tstamp, {Offset, TotalSz}, Expiry) ->
+            K = try KT(K0) catch TxErr -> {key_tx_error, TxErr} end,
+            case K of
+                {key_tx_error, KeyTxErr} ->
+                    error_logger:error_msg("Invalid key on load ~p: ~p",
+                                           [K0, KeyTxErr]);
+                _ ->
+                    bitcask_nifs:keydir_put(KeyDir,
+                                            K,
+                                            FileTstamp,
+                                            TotalSz,
+                                            Offset,
+                                            Tstamp,
+                                            bitcask_time:tstamp(),
+                                            false,
+                                            0, 0,
+                                            Expiry)
+            end,
+            ok
+          end,
+    F = fun({tombstone, K0}, _Tstamp, {_Offset, _TotalSz}, _) ->
+            K = try KT(K0) catch TxErr -> {key_tx_error, TxErr} end,
+            case K of
+                {key_tx_error, KeyTxErr} ->
+                    error_logger:error_msg("Invalid key on load ~p: ~p",
+                                           [K0, KeyTxErr]),
+                    ok;
+                _ ->
+                    bitcask_nifs:keydir_remove(KeyDir, KT(K))
+            end,
+            ok;
+           ({expires, Expiry, K0}, Tstamp, PosInfo, _) ->
+            Put(K0, Tstamp, PosInfo, Expiry);
+           (K0, Tstamp, PosInfo, _) ->
+            Put(K0, Tstamp, PosInfo, 0)
+        end,
+    bitcask_fileops:fold_keys(File, F, undefined, recovery).
+
+%% Hint files are loaded by the NIF without calling back into Erlang for
+%% every key. It stores keys as they are on disk, so it is skipped when a
+%% key transformation is configured.
+load_hintfile(File, KeyDir, KT) ->
+    case KT =:= fun kt_id/1 of
+        true ->
+            bitcask_fileops:load_hintfile(File, KeyDir);
+        false ->
+            {error, key_transform}
+    end.
+
 %%
 %% Initialize a keydir for a given directory.
 %%
-init_keydir(Dirname, WaitTime, ReadWriteModeP, KT) ->
+init_keydir(Dirname, WaitTime, ReadWriteModeP, KT, KeydirOpts, ScanOpts) ->
     %% Get the named keydir for this directory. If we get it and it's already
     %% marked as ready, that indicates another caller has already loaded
     %% all the data from disk and we can short-circuit scanning all the files.
-    case bitcask_nifs:keydir_new(Dirname) of
+    case bitcask_nifs:keydir_new(Dirname, KeydirOpts) of
         {ready, KeyDir} ->
             %% A keydir already exists, nothing more to do here. We'll lazy
             %% open files as needed.
@@ -1260,7 +1805,7 @@ init_keydir(Dirname, WaitTime, ReadWriteModeP, KT) ->
                    true ->
                         ok
                 end,
-                init_keydir_scan_key_files(Dirname, KeyDir, KT)
+                init_keydir_scan_key_files(Dirname, KeyDir, KT, ScanOpts)
             catch
                 _:Detail ->
                     {error, {purge_setuid_or_init_scan, Detail}}
@@ -1292,23 +1837,147 @@ init_keydir(Dirname, WaitTime, ReadWriteModeP, KT) ->
                 Value when is_integer(Value), Value =< 0 -> %% avoids 'infinity'!
                     {error, timeout};
                 _ ->
-                    init_keydir(Dirname, WaitTime - 100, ReadWriteModeP, KT)
+                    init_keydir(Dirname, WaitTime - 100, ReadWriteModeP, KT,
+                                KeydirOpts, ScanOpts)
             end
     end.
 
-init_keydir_scan_key_files(Dirname, KeyDir, KT) ->
-    init_keydir_scan_key_files(Dirname, KeyDir, KT, ?DIABOLIC_BIG_INT).
+keydir_opts(Opts) ->
+    Layout = case get_opt(keydir_entry_layout, Opts) of
+                 compact -> [{entry_layout, compact}];
+                 _       -> []
+             end,
+    Index = case get_opt(keydir_expiry_index, Opts) of
+                true -> [{expiry_index, true}];
+                _    -> []
+            end,
+    Bloom = case get_opt(keydir_bloom_filter, Opts) of
+                true -> [{bloom_filter, true}];
+                _    -> []
+            end,
+    Cache = case get_opt(keydir_value_cache, Opts) of
+                Bytes when is_integer(Bytes), Bytes > 0 ->
+                    [{value_cache, Bytes}];
+                _ ->
+                    []
+            end,
+    Layout ++ Index ++ Bloom ++ Cache.
+
+%% Options used if this open loads the keydir from disk
+scan_opts(Opts) ->
+    LoadThreads = case get_opt(keydir_load_threads, Opts) of
+                      N when is_integer(N), N > 1 -> N;
+                      _ -> 1
+                  end,
+    [{load_threads, LoadThreads},
+     {snapshot, get_opt(keydir_snapshot, Opts) /= false}].
+
+%% A keydir snapshot holds the keydir as it was when a writer closed the
+%% cask, along with the data and hint file sizes it was built from. While
+%% those files are untouched only the newer ones need scanning on open;
+%% any merge or other change to them makes the snapshot stale and the
+%% whole directory is scanned again.
+keydir_snapshot_file(Dirname) ->
+    filename:join(Dirname, "bitcask.keydir").
+
+snapshot_file_specs(Filenames) ->
+    [{bitcask_fileops:file_tstamp(F), file_size(F),
+      file_size(bitcask_fileops:hintfile_name(F))} || F <- Filenames].
+
+file_size(Filename) ->
+    case bitcask_fileops:read_file_info(Filename) of
+        {ok, #file_info{size = Size}} ->
+            Size;
+        {error, _} ->
+            0
+    end.
+
+%% Returns the files still to be scanned: the ones newer than the
+%% snapshot, or all of them when there is no usable snapshot.
+load_keydir_snapshot(Dirname, KeyDir, SortedFiles) ->
+    SnapshotFile = keydir_snapshot_file(Dirname),
+    case filelib:is_regular(SnapshotFile) of
+        false ->
+            SortedFiles;
+        true ->
+            case bitcask_nifs:keydir_load_snapshot(
+                   KeyDir, SnapshotFile, snapshot_file_specs(SortedFiles)) of
+                {ok, Covered} ->
+                    [_ = bitcask_nifs:increment_file_id(KeyDir, Id) ||
+                        Id <- Covered],
+                    CoveredSet = sets:from_list(Covered),
+                    [F || F <- SortedFiles,
+                          not sets:is_element(bitcask_fileops:file_tstamp(F),
+                                              CoveredSet)];
+                {error, Reason} ->
+                    error_logger:info_msg("Not using keydir snapshot ~s: ~p\n",
+                                          [SnapshotFile, Reason]),
+                    SortedFiles
+            end
+    end.
 
-init_keydir_scan_key_files(_Dirname, _Keydir, _KT, 0) ->
+%% Holds the merge lock so no merge swaps files under the keydir while it
+%% is being saved. Pending delete files are left out: nothing in the
+%% keydir points to them anymore.
+write_keydir_snapshot(Dirname, KeyDir) ->
+    case bitcask_lockops:acquire(merge, Dirname) of
+        {ok, Lock} ->
+            try
+                Files = [F || F <- list_data_files(Dirname, undefined, undefined),
+                              not has_pending_delete_bit(F)],
+                bitcask_nifs:keydir_write_snapshot(KeyDir,
+                                                   keydir_snapshot_file(Dirname),
+                                                   snapshot_file_specs(Files))
+            after
+                bitcask_lockops:release(Lock)
+            end;
+        {error, _} = Error ->
+            Error
+    end.
+
+%% Only called between closing one write file and opening the next, so
+%% every entry in the keydir points to a file that is no longer written.
+maybe_write_keydir_snapshot(#bc_state{dirname = Dirname, keydir = KeyDir,
+                                      opts = Opts}) ->
+    case get_opt(keydir_snapshot, Opts) of
+        false ->
+            ok;
+        _ ->
+            write_keydir_snapshot(Dirname, KeyDir)
+    end.
+
+maybe_checkpoint_keydir(#bc_state{snapshot_time = Last, opts = Opts} = State) ->
+    Now = bitcask_time:tstamp(),
+    case get_opt(keydir_snapshot_interval, Opts) of
+        Interval when is_integer(Interval), Interval > 0,
+                      Now - Last >= Interval ->
+            _ = maybe_write_keydir_snapshot(State),
+            State#bc_state{snapshot_time = Now};
+        _ ->
+            State
+    end.
+
+init_keydir_scan_key_files(Dirname, KeyDir, KT, ScanOpts) ->
+    init_keydir_scan_key_files(Dirname, KeyDir, KT, ScanOpts,
+                               ?DIABOLIC_BIG_INT).
+
+init_keydir_scan_key_files(_Dirname, _Keydir, _KT, _ScanOpts, 0) ->
     %% If someone launches enough parallel merge operations to
     %% interfere with our attempts to scan this keydir for this many
     %% times, then we are just plain unlucky.  Or QuickCheck smites us
     %% from lofty Mt. Stochastic.
     {error, {init_keydir_scan_key_files, too_many_iterations}};
-init_keydir_scan_key_files(Dirname, KeyDir, KT, Count) ->
+init_keydir_scan_key_files(Dirname, KeyDir, KT, ScanOpts, Count) ->
     try
         {SortedFiles, SetuidFiles} = readable_and_setuid_files(Dirname),
-        _ = scan_key_files(SortedFiles, KeyDir, [], true, KT),
+        ScanFiles = case proplists:get_value(snapshot, ScanOpts) of
+                        true ->
+                            load_keydir_snapshot(Dirname, KeyDir, SortedFiles);
+                        false ->
+                            SortedFiles
+                    end,
+        LoadThreads = proplists:get_value(load_threads, ScanOpts),
+        _ = scan_key_files(ScanFiles, KeyDir, [], true, KT, LoadThreads),
         %% There may be a setuid data file that has a larger tstamp name than
         %% any non-setuid data file.  Tell the keydir about it, so that we
         %% don't try to reuse that tstamp name.
@@ -1323,9 +1992,17 @@ init_keydir_scan_key_files(Dirname, KeyDir, KT, Count) ->
     catch _X:_Y ->
             error_msg_perhaps("scan_key_files: ~p ~p @ ~p\n",
                               [_X, _Y, erlang:get_stacktrace()]),
-            init_keydir_scan_key_files(Dirname, KeyDir, KT, Count - 1)
+            init_keydir_scan_key_files(Dirname, KeyDir, KT, ScanOpts,
+                                       Count - 1)
     end.
 
+get_filestate(FileId,
+              State=#bc_state{ write_file = #filestate{ tstamp = FileId,
+                                                       block_size = BlockSize }
+                                   = WriteFile })
+  when BlockSize > 0 ->
+    %% Only the write file state has the entries of the block being filled
+    {WriteFile, State};
 get_filestate(FileId,
               State=#bc_state{ dirname = Dirname, read_files = ReadFiles }) ->
     case get_filestate(FileId, Dirname, ReadFiles, readonly) of
@@ -1369,14 +2046,21 @@ list_data_files(Dirname, WritingFile, MergingFile) ->
 
 merge_files(#mstate { input_files = [] } = State) ->
     State;
+merge_files(#mstate { suspended = true } = State) ->
+    State;
 merge_files(#mstate {  dirname = Dirname,
                        input_files = [File | Rest],
-                       key_transform = KT
+                       key_transform = KT,
+                       progress = Progress,
+                       delete_files = DelFiles0
                     } = State) ->
+    ok = check_coordinator(State),
     FileId = bitcask_fileops:file_tstamp(File),
-    F = fun(K0, V, Tstamp, Pos, State0) ->
+    F = fun(K0, V, Tstamp, Expiry, {_, _, _, Size} = Pos, State00) ->
+                State0 = merge_charge(Size, State00),
                 try KT(K0) of
-                    K -> merge_single_entry(K, V, Tstamp, FileId, Pos, State0)
+                    K -> merge_single_entry(K, V, Tstamp, Expiry, FileId, Pos,
+                                            State0)
                 catch
                     What:Why ->
                         error_logger:error_msg("Invalid key on merge ~p: ~p",
@@ -1384,19 +2068,354 @@ merge_files(#mstate {  dirname = Dirname,
                         State0
                 end
         end,
-    State2 = try bitcask_fileops:fold(File, F, State) of
-                 #mstate{delete_files = DelFiles} = State1 ->
-                     State1#mstate{delete_files = [File|DelFiles]}
-             catch
-                 throw:{fold_error, Error, _PartialAcc} ->
-                     error_logger:error_msg(
-                       "merge_files: skipping file ~s in ~s: ~p\n",
-                       [File#filestate.filename, Dirname, Error]),
-                     State
+    State2 = case proplists:get_value(File#filestate.filename, Progress) of
+                 done ->
+                     %% Merged before the merge was suspended
+                     State#mstate{delete_files = [File|DelFiles0]};
+                 Pos ->
+                     case merge_suspend_due(State) of
+                         true ->
+                             State#mstate{suspended = true};
+                         false ->
+                             try merge_file(File, Pos, F, State) of
+                                 #mstate{suspended = true} = State1 ->
+                                     State1;
+                                 #mstate{delete_files = DelFiles} = State1 ->
+                                     maybe_merge_checkpoint(
+                                       merge_progress(
+                                         File, done,
+                                         State1#mstate{delete_files =
+                                                           [File|DelFiles]}))
+                             catch
+                                 throw:{fold_error, Error, PartialAcc} ->
+                                     error_logger:error_msg(
+                                       "merge_files: skipping file ~s in ~s:"
+                                       " ~p\n",
+                                       [File#filestate.filename, Dirname,
+                                        Error]),
+                                     PartialAcc
+                             end
+                     end
              end,
     merge_files(State2#mstate { input_files = Rest }).
 
-merge_single_entry(K, V, Tstamp, FileId, {_, _, Offset, _} = Pos, State) ->
+%% Run the entries of File from Pos on through F, or have
+%% bitcask_nifs:merge_copy/7 copy the live ones when both File and the
+%% output file are in a format that allows it and there is no key
+%% transform to apply.
+merge_file(File, Pos, F, #mstate { key_transform = KT } = State) ->
+    Start = max(Pos, bitcask_fileops:data_start(File)),
+    Cursor = case KT =:= fun kt_id/1 andalso
+                 bitcask_fileops:copy_format(File) /= undefined of
+                 true ->
+                     bitcask_nifs:merge_copy_open(File#filestate.filename);
+                 false ->
+                     undefined
+             end,
+    case Cursor of
+        {ok, Ref} ->
+            try
+                merge_copy(File, Ref, Start, F, State)
+            after
+                bitcask_nifs:merge_copy_close(Ref)
+            end;
+        _ ->
+            bitcask_fileops:fold_from(File, Start, F, State)
+    end.
+
+%% Copy the live values of File from Pos on. Tombstones and expired
+%% entries come back one at a time for F, as do all entries once the
+%% output file is in another format or an entry fails its CRC, which the
+%% fold handles.
+merge_copy(File, Cursor, Pos, F, #mstate { out_file = Outfile } = State) ->
+    Format = bitcask_fileops:copy_format(File),
+    case Outfile /= fresh andalso
+        bitcask_fileops:copy_format(Outfile) /= Format of
+        true ->
+            bitcask_fileops:fold_from(File, Pos, F, State);
+        false ->
+            Input = {bitcask_fileops:file_tstamp(File), Pos, Format},
+            Output = case Outfile of
+                         fresh ->
+                             fresh;
+                         #filestate { filename = OutName, ofs = OutOfs } ->
+                             {OutName, bitcask_fileops:file_tstamp(Outfile),
+                              OutOfs, bitcask_fileops:data_start(Outfile),
+                              State#mstate.max_file_size}
+                     end,
+            {Status, Pos2, OutOfs2, Hints} =
+                bitcask_nifs:merge_copy(Cursor, State#mstate.live_keydir,
+                                        State#mstate.del_keydir, Input, Output,
+                                        State#mstate.expiry_time,
+                                        bitcask_merge_throttle:budget(
+                                          State#mstate.throttle,
+                                          ?MERGE_COPY_BUDGET)),
+            %% An entry handed back is charged by F
+            Read = case Status of
+                       {entry, _, _, _, _, EntrySize} ->
+                           Pos2 - Pos - EntrySize;
+                       _ ->
+                           Pos2 - Pos
+                   end,
+            State1 = case Outfile of
+                         fresh ->
+                             merge_charge(Read, State);
+                         #filestate { ofs = OutOfs } ->
+                             {ok, Outfile2} =
+                                 bitcask_fileops:copied(Outfile, OutOfs2, Hints),
+                             merge_charge(Read + OutOfs2 - OutOfs,
+                                          State#mstate { out_file = Outfile2 })
+                     end,
+            merge_copy_next(Status, File, Cursor, Pos2, F, State1)
+    end.
+
+merge_copy_next(eof, _File, _Cursor, _Pos, _F, State) ->
+    State;
+merge_copy_next(more, File, Cursor, Pos, F, State) ->
+    merge_copy_on(File, Cursor, Pos, F, State);
+merge_copy_next(wrap, File, Cursor, Pos, F, State) ->
+    merge_copy_on(File, Cursor, Pos, F, next_merge_file(State));
+merge_copy_next({entry, K, V, Tstamp, Offset, Size}, File, Cursor, Pos, F,
+                State) ->
+    PosInfo = {File#filestate.filename, File#filestate.tstamp, Offset, Size},
+    %% Copy only walks files without codecs, which hold no expiry times
+    merge_copy(File, Cursor, Pos, F, F(K, V, Tstamp, 0, PosInfo, State));
+merge_copy_next(bad_entry, File, _Cursor, Pos, F, State) ->
+    bitcask_fileops:fold_from(File, Pos, F, State);
+merge_copy_next({error, Reason}, _File, _Cursor, _Pos, _F, State) ->
+    %% State has the copies made so far, the output file must carry on
+    %% after them
+    throw({fold_error, Reason, State}).
+
+%% Everything before Pos is merged: the merge can stop there, or carry on
+merge_copy_on(File, Cursor, Pos, F, State) ->
+    State1 = merge_progress(File, Pos, State),
+    case merge_suspend_due(State1) of
+        true ->
+            State1#mstate { suspended = true };
+        false ->
+            merge_copy(File, Cursor, Pos, F, maybe_merge_checkpoint(State1))
+    end.
+
+merge_suspend_due(#mstate { suspend = undefined }) ->
+    false;
+merge_suspend_due(#mstate { suspend = Suspend }) ->
+    Suspend() =:= true.
+
+%% Record that File is merged up to Pos, or done
+merge_progress(#filestate { filename = Name }, Pos,
+               #mstate { progress = Progress,
+                         checkpoint_bytes = Bytes } = State) ->
+    Before = case proplists:get_value(Name, Progress, 0) of
+                 done -> 0;
+                 Ofs -> Ofs
+             end,
+    After = case Pos of
+                done -> filelib:file_size(Name);
+                _ -> Pos
+            end,
+    State#mstate { progress = lists:keystore(Name, 1, Progress, {Name, Pos}),
+                   checkpoint_bytes = Bytes + max(0, After - Before) }.
+
+%% Write a checkpoint once enough input is merged since the last one.
+%% What it has as merged must be on disk first: the output so far, and
+%% the tombstones appended to files outside the merge. The workers of a
+%% parallel merge hand their progress to the coordinator, which keeps
+%% the checkpoint for all of them.
+maybe_merge_checkpoint(#mstate { checkpoint_bytes = Bytes } = State)
+  when Bytes < ?MERGE_CHECKPOINT_BYTES ->
+    State;
+maybe_merge_checkpoint(State0) ->
+    State = commit_merge_block(State0),
+    case State#mstate.out_file of
+        fresh ->
+            ok;
+        Outfile ->
+            %% commit_merge_block/1 left no block to seal
+            {ok, Outfile} = bitcask_fileops:sync(Outfile)
+    end,
+    State1 = case State#mstate.coordinator of
+                 undefined ->
+                     merge_checkpoint(State);
+                 _ ->
+                     ok = merge_call(State,
+                                     {progress, State#mstate.progress,
+                                      lists:reverse(
+                                        State#mstate.deferred_tombstones)}),
+                     State#mstate { deferred_tombstones = [] }
+             end,
+    State1#mstate { checkpoint_bytes = 0 }.
+
+merge_checkpoint(#mstate { dirname = Dirname, progress = Progress,
+                           tombstone_write_files = TFiles } = State) ->
+    TFiles2 = [begin
+                   {ok, TFile2} = bitcask_fileops:sync(TFile),
+                   TFile2
+               end || TFile <- TFiles],
+    ok = write_merge_checkpoint(Dirname, Progress),
+    State#mstate { tombstone_write_files = TFiles2 }.
+
+%% Take Bytes of merge I/O from the throttle, if any
+merge_charge(Bytes, #mstate { throttle = Throttle } = State) ->
+    State#mstate { throttle = bitcask_merge_throttle:charge(Bytes, Throttle) }.
+
+merge_workers(Opts, InFiles) ->
+    case get_opt(merge_workers, Opts) of
+        N when is_integer(N), N > 1 ->
+            max(1, min(N, length(InFiles)));
+        _ ->
+            1
+    end.
+
+%% Merge the input files in Workers processes, each taking a run of
+%% consecutive files and writing output files of its own. Within a run
+%% files are visited in order, as merge_files/1 needs. Between runs the
+%% conditional keydir puts settle which copy of a value stays live, the
+%% same way they settle races with the writer, and the deleted keys go
+%% to the shared del keydir. Tombstones for files outside the merge are
+%% appended here, as the workers checkpoint and once they are done, since
+%% two workers could be appending to the same file.
+merge_files_parallel(#mstate { input_files = InFiles, progress = Progress,
+                               throttle = Throttle } = State, Workers) ->
+    Coordinator = self(),
+    WorkerThrottle = bitcask_merge_throttle:share(Throttle, Workers),
+    Procs = [spawn_monitor(
+               fun() ->
+                       RunProgress = [P || {Name, _} = P <- Progress,
+                                           lists:keymember(Name,
+                                                           #filestate.filename,
+                                                           Run)],
+                       merge_worker(State#mstate { input_files = Run,
+                                                   coordinator = Coordinator,
+                                                   throttle = WorkerThrottle,
+                                                   progress = RunProgress })
+               end) || Run <- merge_runs(InFiles, Workers)],
+    {Results, State1} = merge_coordinate(State, Procs, [], []),
+    case [Error || {error, Error} <- Results] of
+        [] ->
+            Done = [S || {ok, S} <- Results],
+            State2 = State1#mstate {
+                       delete_files = lists:append(
+                                        [S#mstate.delete_files || S <- Done]),
+                       progress = lists:foldl(fun merge_run_progress/2,
+                                              State1#mstate.progress,
+                                              [S#mstate.progress || S <- Done]),
+                       suspended = lists:any(fun(S) -> S#mstate.suspended end,
+                                             Done) },
+            append_tombstones(
+              lists:append([lists:reverse(S#mstate.deferred_tombstones) ||
+                               S <- Done]), State2);
+        [{Class, Reason, Stacktrace} | _] ->
+            erlang:raise(Class, Reason, Stacktrace)
+    end.
+
+%% Cut the files into up to Workers runs of consecutive files of about
+%% the same size. A run takes the next file while that leaves it closer
+%% to its share of what is left.
+merge_runs([], _Workers) ->
+    [];
+merge_runs(Files, 1) ->
+    [Files];
+merge_runs([File | Rest] = Files, Workers) ->
+    Size = fun(F) -> filelib:file_size(F#filestate.filename) end,
+    Target = lists:sum([Size(F) || F <- Files]) div Workers,
+    {Run, Rest2} = merge_run(Rest, Target - Size(File), Size, [File]),
+    [Run | merge_runs(Rest2, Workers - 1)].
+
+merge_run([File | Rest] = Files, Room, Size, Run) ->
+    case Size(File) of
+        FileSize when FileSize div 2 < Room ->
+            merge_run(Rest, Room - FileSize, Size, [File | Run]);
+        _ ->
+            {lists:reverse(Run), Files}
+    end;
+merge_run([], _Room, _Size, Run) ->
+    {lists:reverse(Run), []}.
+
+merge_run_progress(RunProgress, Progress) ->
+    lists:foldl(fun({Name, _} = P, Acc) -> lists:keystore(Name, 1, Acc, P) end,
+                Progress, RunProgress).
+
+append_tombstones(Tombstones, State) ->
+    lists:foldl(fun({K, V, Tstamp, OldFileId}, S) ->
+                        append_tombstone(K, V, Tstamp, OldFileId, S)
+                end, State, Tombstones).
+
+%% File handles belong to the process that opened them, so the worker
+%% opens its run again. A file that fails to open is left alone, as in
+%% merge1/4.
+merge_worker(#mstate { coordinator = Coordinator, input_files = Run } = State) ->
+    Files = [F || {ok, F} <- [bitcask_fileops:open_file(F#filestate.filename)
+                              || F <- Run]],
+    Result = try
+                 State1 = close_merge_output(
+                            merge_files(State#mstate { input_files = Files })),
+                 ok = bitcask_merge_throttle:finish(State1#mstate.throttle),
+                 {ok, State1}
+             catch
+                 Class:Reason ->
+                     {error, {Class, Reason, erlang:get_stacktrace()}}
+             after
+                 bitcask_fileops:close_all(Files)
+             end,
+    Coordinator ! {merge_done, self(), Result}.
+
+%% Keep the merge lock listing the files the workers are writing and the
+%% checkpoint with the progress they made until they are all done, and
+%% return their results in run order
+merge_coordinate(State, [], _Outputs, Results) ->
+    {[Result || {_, Result} <- lists:reverse(Results)], State};
+merge_coordinate(State, [{Pid, MRef} | Rest] = Procs, Outputs, Results) ->
+    receive
+        {merge_call, From, Ref, {output, Filename}} ->
+            Outputs1 = lists:keystore(From, 1, Outputs, {From, Filename}),
+            From ! {Ref, bitcask_lockops:write_activefiles(
+                           State#mstate.merge_lock,
+                           [F || {_, F} <- Outputs1])},
+            merge_coordinate(State, Procs, Outputs1, Results);
+        {merge_call, From, Ref, {progress, RunProgress, Tombstones}} ->
+            State1 = merge_checkpoint(
+                       (append_tombstones(Tombstones, State))#mstate {
+                         progress = merge_run_progress(
+                                      RunProgress, State#mstate.progress) }),
+            From ! {Ref, ok},
+            merge_coordinate(State1, Procs, Outputs, Results);
+        {merge_done, Pid, Result} ->
+            erlang:demonitor(MRef, [flush]),
+            merge_coordinate(State, Rest, Outputs, [{Pid, Result} | Results]);
+        {'DOWN', MRef, process, Pid, Reason} ->
+            merge_coordinate(State, Rest, Outputs,
+                             [{Pid, {error, {exit, Reason, []}}} | Results])
+    end.
+
+%% A parallel merge worker gives up along with its coordinator
+check_coordinator(#mstate { coordinator = undefined }) ->
+    ok;
+check_coordinator(#mstate { coordinator = Coordinator }) ->
+    case is_process_alive(Coordinator) of
+        true ->
+            ok;
+        false ->
+            exit(coordinator_down)
+    end.
+
+merge_single_entry(K, V, Tstamp, Expiry, FileId, {_, _, Offset, _} = Pos,
+                   State) ->
+    case Expiry > 0 andalso Expiry =< bitcask_time:tstamp() of
+        true ->
+            %% Past its own expiry time. Remove it if it is still the
+            %% current entry in the keydir, then merge it as a tombstone so
+            %% that older values of the key cannot come back.
+            _ = bitcask_nifs:keydir_remove(State#mstate.live_keydir, K,
+                                           Tstamp, FileId, Offset),
+            merge_unexpired_entry(K, ?TOMBSTONE0, Tstamp, 0, FileId, Pos,
+                                  State);
+        false ->
+            merge_unexpired_entry(K, V, Tstamp, Expiry, FileId, Pos, State)
+    end.
+
+merge_unexpired_entry(K, V, Tstamp, Expiry, FileId, {_, _, Offset, _} = Pos,
+                      State) ->
     case out_of_date(State, K, Tstamp, FileId, Pos, State#mstate.expiry_time,
                      false,
                      [State#mstate.live_keydir, State#mstate.del_keydir]) of
@@ -1436,7 +2455,7 @@ merge_single_entry(K, V, Tstamp, FileId, {_, _, Offset, _} = Pos, State) ->
                                                  bitcask_time:tstamp()),
                     case State#mstate.merge_coverage of
                         partial ->
-                            inner_merge_write(K, V, Tstamp, FileId, Offset,
+                            inner_merge_write(K, V, Tstamp, 0, FileId, Offset,
                                               State);
                         _ ->
                             % Full or prefix merge, safe to drop the tombstone
@@ -1444,7 +2463,8 @@ merge_single_entry(K, V, Tstamp, FileId, {_, _, Offset, _} = Pos, State) ->
                     end;
                 false ->
                     ok = bitcask_nifs:keydir_remove(State#mstate.del_keydir, K),
-                    inner_merge_write(K, V, Tstamp, FileId, Offset, State)
+                    inner_merge_write(K, V, Tstamp, Expiry, FileId, Offset,
+                                      State)
             end
     end.
 
@@ -1461,7 +2481,7 @@ merge_single_tombstone(K,V, Tstamp, FileId, Offset, State) ->
                 partial ->
                     V2 = <<?TOMBSTONE1_STR, FileId:32>>,
                     %% Merging only some files, forward tombstone
-                    inner_merge_write(K, V2, Tstamp, FileId, Offset,
+                    inner_merge_write(K, V2, Tstamp, 0, FileId, Offset,
                                       State);
                 _ ->
                     %% Full or prefix merge, so safe to drop tombstone
@@ -1472,7 +2492,7 @@ merge_single_tombstone(K,V, Tstamp, FileId, Offset, State) ->
                 true ->
                     State;
                 false ->
-                    inner_merge_write(K, V, Tstamp, FileId, Offset,
+                    inner_merge_write(K, V, Tstamp, 0, FileId, Offset,
                                       State)
             end;
         {at, OldFileId} ->
@@ -1484,80 +2504,69 @@ merge_single_tombstone(K,V, Tstamp, FileId, Offset, State) ->
                     State;
                 false ->
                     %% Append to original file
-                    case get_filestate(OldFileId, State) of
-                        {error, enoent} ->
-                            %% Original file is gone, safe to drop
-                            State;
-                        {TFile,
-                         State2 = #mstate{tombstone_write_files=TFiles}} ->
-                            %% Original file still around, append to it
-                            {ok, TFile2, _, TSize} =
-                                bitcask_fileops:write(TFile, K, V,
-                                                      Tstamp),
-                            ok = bitcask_nifs:update_fstats(
-                                   State#mstate.live_keydir,
-                                   OldFileId, Tstamp,
-                                   _LiveKeys = 0,
-                                   _TotalKeysIncr = 0,
-                                   _LiveIncr = 0,
-                                   _TotalIncr = TSize,
-                                   _ShouldCreate = 0),
-                            TFiles2 = lists:keyreplace(
-                                        TFile#filestate.filename,
-                                        #filestate.filename,
-                                        TFiles,
-                                        TFile2),
-                            State2#mstate{tombstone_write_files=TFiles2}
-                    end
+                    append_tombstone(K, V, Tstamp, OldFileId, State)
             end;
         no_tombstone ->
             %% Regular value not currently in keydir, ignore
             State
     end.
 
--spec inner_merge_write(binary(), binary(), integer(), integer(), integer(),
-                        #mstate{}) -> #mstate{}.
+append_tombstone(K, V, Tstamp, OldFileId,
+                 #mstate { coordinator = Coordinator,
+                           deferred_tombstones = Deferred } = State)
+  when Coordinator /= undefined ->
+    %% Parallel merge worker, see merge_files_parallel/2
+    State#mstate { deferred_tombstones = [{K, V, Tstamp, OldFileId} |
+                                          Deferred] };
+append_tombstone(K, V, Tstamp, OldFileId, State) ->
+    case get_filestate(OldFileId, State) of
+        {error, enoent} ->
+            %% Original file is gone, safe to drop
+            State;
+        {TFile,
+         State2 = #mstate{tombstone_write_files=TFiles}} ->
+            %% Original file still around, append to it
+            {ok, TFile2, _, TSize} =
+                bitcask_fileops:write(TFile, K, V,
+                                      Tstamp),
+            ok = bitcask_nifs:update_fstats(
+                   State#mstate.live_keydir,
+                   OldFileId, Tstamp,
+                   _LiveKeys = 0,
+                   _TotalKeysIncr = 0,
+                   _LiveIncr = 0,
+                   _TotalIncr = TSize,
+                   _ShouldCreate = 0),
+            TFiles2 = lists:keyreplace(
+                        TFile#filestate.filename,
+                        #filestate.filename,
+                        TFiles,
+                        TFile2),
+            State2#mstate{tombstone_write_files=TFiles2}
+    end.
+
+-spec inner_merge_write(binary(), binary(), integer(), non_neg_integer(),
+                        integer(), integer(), #mstate{}) -> #mstate{}.
 
-inner_merge_write(K, V, Tstamp, OldFileId, OldOffset, State) ->
+inner_merge_write(K, V, Tstamp, Expiry, OldFileId, OldOffset, State00) ->
     %% write a single item while inside the merge process
+    State = merge_out_codecs(Expiry, State00),
 
     %% See if it's time to rotate to the next file
-    State1 =
+    State0 =
         case bitcask_fileops:check_write(State#mstate.out_file,
                                          K, size(V),
                                          State#mstate.max_file_size) of
-            wrap ->
-                %% Close the current output file
-                ok = bitcask_fileops:sync(State#mstate.out_file),
-                ok = bitcask_fileops:close(State#mstate.out_file),
-
-                %% Start our next file and update state
-                {ok, NewFile} = bitcask_fileops:create_file(
-                                  State#mstate.dirname,
-                                  State#mstate.opts,
-                                  State#mstate.live_keydir),
-                NewFileName = bitcask_fileops:filename(NewFile),
-                ok = bitcask_lockops:write_activefile(
-                       State#mstate.merge_lock,
-                       NewFileName),
-                State#mstate { out_file = NewFile };
             ok ->
                 State;
-            fresh ->
-                %% create the output file and take the lock.
-                {ok, NewFile} = bitcask_fileops:create_file(
-                                  State#mstate.dirname,
-                                  State#mstate.opts,
-                                  State#mstate.live_keydir),
-                NewFileName = bitcask_fileops:filename(NewFile),
-                ok = bitcask_lockops:write_activefile(
-                       State#mstate.merge_lock,
-                       NewFileName),
-                State#mstate { out_file = NewFile }
+            _WrapOrFresh ->
+                next_merge_file(State)
         end,
 
     {ok, Outfile, Offset, Size} =
-        bitcask_fileops:write(State1#mstate.out_file, K, V, Tstamp),
+        bitcask_fileops:write(State0#mstate.out_file, K, V, Tstamp, Expiry,
+                              merge_commit_fun(State0)),
+    State1 = merge_charge(Size, State0),
 
     OutFileId = bitcask_fileops:file_tstamp(Outfile),
     case OutFileId =< OldFileId of
@@ -1567,6 +2576,84 @@ inner_merge_write(K, V, Tstamp, OldFileId, OldOffset, State) ->
         false ->
             ok
     end,
+    case Outfile#filestate.block_size of
+        0 ->
+            merge_keydir_put(K, V, Tstamp, Expiry, OldFileId, OldOffset,
+                             Outfile, Offset, Size, State1);
+        _ ->
+            %% The keydir is updated once the block is written out
+            Puts = case Offset band ?BLOCK_SLOT_MASK of
+                       0 -> []; % The write sealed the previous block
+                       _ -> State1#mstate.block_puts
+                   end,
+            State1#mstate { out_file = Outfile,
+                            block_puts = [{OldFileId, OldOffset} | Puts] }
+    end.
+
+%% Only files with codecs can hold an expiry time, so the first value with
+%% one moves the merge on to such files for the rest of its output
+merge_out_codecs(0, State) ->
+    State;
+merge_out_codecs(_Expiry, #mstate { out_file = #filestate { codecs = true } } =
+                     State) ->
+    State;
+merge_out_codecs(_Expiry, #mstate { out_file = Outfile, opts = Opts } = State) ->
+    State1 = case proplists:get_bool(codecs, Opts) of
+                 true -> State;
+                 false -> State#mstate { opts = [{codecs, true} | Opts] }
+             end,
+    case Outfile of
+        fresh -> State1;
+        _ -> next_merge_file(State1)
+    end.
+
+%% Start the next merge output file, closing the current one if any
+next_merge_file(#mstate { out_file = fresh } = State) ->
+    %% create the output file and take the lock.
+    {ok, NewFile} = bitcask_fileops:create_file(State#mstate.dirname,
+                                                State#mstate.opts,
+                                                State#mstate.live_keydir),
+    NewFileName = bitcask_fileops:filename(NewFile),
+    ok = write_merge_activefile(State, NewFileName),
+    State#mstate { out_file = NewFile };
+next_merge_file(State) ->
+    %% Start our next file and update state
+    next_merge_file(close_merge_output(State)).
+
+%% Write out and close the current merge output file, if any
+close_merge_output(State) ->
+    case commit_merge_block(State) of
+        #mstate { out_file = fresh } = State0 ->
+            State0;
+        #mstate { out_file = Outfile } = State0 ->
+            {ok, Outfile2} = bitcask_fileops:sync(Outfile),
+            ok = bitcask_fileops:close(Outfile2),
+            State0#mstate { out_file = fresh }
+    end.
+
+%% The workers of a parallel merge share the merge lock through their
+%% coordinator, which lists all the files they are writing in it
+write_merge_activefile(#mstate { coordinator = undefined, merge_lock = Lock },
+                       Filename) ->
+    bitcask_lockops:write_activefile(Lock, Filename);
+write_merge_activefile(State, Filename) ->
+    merge_call(State, {output, Filename}).
+
+%% Ask the coordinator of a parallel merge, see merge_coordinate/4
+merge_call(#mstate { coordinator = Coordinator }, Request) ->
+    MRef = erlang:monitor(process, Coordinator),
+    Coordinator ! {merge_call, self(), MRef, Request},
+    receive
+        {MRef, Reply} ->
+            erlang:demonitor(MRef, [flush]),
+            Reply;
+        {'DOWN', MRef, process, Coordinator, _Reason} ->
+            exit(coordinator_down)
+    end.
+
+merge_keydir_put(K, V, Tstamp, Expiry, OldFileId, OldOffset, Outfile, Offset,
+                 Size, State1) ->
+    OutFileId = bitcask_fileops:file_tstamp(Outfile),
     Outfile2 =
         case is_tombstone(V) of
             false ->
@@ -1577,8 +2664,8 @@ inner_merge_write(K, V, Tstamp, OldFileId, OldOffset, State) ->
                 case bitcask_nifs:keydir_put(State1#mstate.live_keydir, K,
                                              OutFileId,
                                              Size, Offset, Tstamp,
-                                             bitcask_time:tstamp(),
-                                             OldFileId, OldOffset) of
+                                             bitcask_time:tstamp(), false,
+                                             OldFileId, OldOffset, Expiry) of
                     ok ->
                         Outfile;
                     already_exists ->
@@ -1605,6 +2692,44 @@ inner_merge_write(K, V, Tstamp, OldFileId, OldOffset, State) ->
         end,
     State1#mstate { out_file = Outfile2 }.
 
+%% Write out the block of the merge output file, if it is filling one
+commit_merge_block(#mstate { out_file = fresh } = State) ->
+    State;
+commit_merge_block(#mstate { out_file = Outfile } = State) ->
+    {ok, Outfile2} = bitcask_fileops:seal(Outfile, merge_commit_fun(State)),
+    State#mstate { out_file = Outfile2, block_puts = [] }.
+
+%% Points the live keydir at the entries of a merge output block once
+%% bitcask_fileops:seal/2 has written it, returning the ones a newer write
+%% beat, as merge_keydir_put/10 would have undone them.
+merge_commit_fun(#mstate { live_keydir = LiveKeyDir, out_file = Outfile,
+                           block_puts = Puts }) ->
+    fun(Entries) ->
+            OutFileId = bitcask_fileops:file_tstamp(Outfile),
+            [Offset ||
+                {{K, Tstamp, TombInt, Offset, Size, Expiry},
+                 {OldFileId, OldOffset}}
+                    <- lists:zip(Entries, lists:reverse(Puts)),
+                not merge_commit(LiveKeyDir, K, Tstamp, TombInt, OutFileId,
+                                 Offset, Size, OldFileId, OldOffset, Expiry)]
+    end.
+
+merge_commit(LiveKeyDir, K, Tstamp, 0, OutFileId, Offset, Size,
+             OldFileId, OldOffset, Expiry) ->
+    ok == bitcask_nifs:keydir_put(LiveKeyDir, K, OutFileId, Size, Offset,
+                                  Tstamp, bitcask_time:tstamp(), false,
+                                  OldFileId, OldOffset, Expiry);
+merge_commit(LiveKeyDir, K, Tstamp, 1, OutFileId, _Offset, Size,
+             _OldFileId, _OldOffset, _Expiry) ->
+    case bitcask_nifs:keydir_get(LiveKeyDir, K) of
+        not_found ->
+            ok = bitcask_nifs:update_fstats(LiveKeyDir, OutFileId, Tstamp,
+                                            0, 0, 0, Size, _ShouldCreate = 1),
+            true;
+        #bitcask_entry{} ->
+            false
+    end.
+
 
 out_of_date(_State, _Key, _Tstamp, _FileId, _Pos, _ExpiryTime,
             EverFound, []) ->
@@ -1687,17 +2812,19 @@ readable_files(Dirname) ->
 readable_and_setuid_files(Dirname) ->
     %% Check the write and/or merge locks to see what files are currently
     %% being written to. Generate our list excepting those.
+    %% A parallel merge writes several files at once.
     WritingFile = bitcask_lockops:read_activefile(write, Dirname),
-    MergingFile = bitcask_lockops:read_activefile(merge, Dirname),
+    MergingFiles = bitcask_lockops:read_activefiles(merge, Dirname),
 
     %% Filter out files with setuid bit set: they've been marked for
     %% deletion by an earlier *successful* merge.
-    Fs = [F || F <- list_data_files(Dirname, WritingFile, MergingFile)],
+    Fs = [F || F <- list_data_files(Dirname, WritingFile, undefined),
+               not lists:member(F, MergingFiles)],
 
     WritingFile2 = bitcask_lockops:read_activefile(write, Dirname),
-    MergingFile2 = bitcask_lockops:read_activefile(merge, Dirname),
-    case {WritingFile2, MergingFile2} of
-        {WritingFile, MergingFile} ->
+    MergingFiles2 = bitcask_lockops:read_activefiles(merge, Dirname),
+    case {WritingFile2, MergingFiles2} of
+        {WritingFile, MergingFiles} ->
             lists:partition(fun(F) -> not has_pending_delete_bit(F) end, Fs);
         _ ->
             % Changed while fetching file list, retry
@@ -1706,10 +2833,14 @@ readable_and_setuid_files(Dirname) ->
 
 %% Internal put - have validated that the file is opened for write
 %% and looked up the state at this point
-do_put(_Key, _Value, State, 0, LastErr) ->
+do_put(_Key, _Value, _Expiry, State, 0, LastErr) ->
     {{error, LastErr}, State};
-do_put(Key, Value, #bc_state{write_file = WriteFile} = State,
-       Retries, _LastErr) ->
+do_put(_Key, Value, _Expiry, State, _Retries, _LastErr)
+  when is_binary(Value), size(Value) > ?MAXVALSIZE - ?MAXVALOVERHEAD ->
+    %% Refused before anything is written, whatever file it would go to
+    {{error, value_too_large}, State};
+do_put(Key, Value, Expiry, State0, Retries, _LastErr) ->
+    #bc_state{write_file = WriteFile} = State = put_codecs(Expiry, State0),
     ValSize =
         case Value of
             tombstone ->
@@ -1757,11 +2888,12 @@ do_put(Key, Value, #bc_state{write_file = WriteFile} = State,
     case Value of
         BinValue when is_binary(BinValue) ->
             % Replacing value from a previous file, so write tombstone for it.
-            case bitcask_nifs:keydir_get(State2#bc_state.keydir, Key) of
+            case write_keydir_get(State2, Key) of
                 #bitcask_entry{file_id=OldFileId}
                   when OldFileId > WriteFileId ->
                     State3 = wrap_write_file(State2),
-                    do_put(Key, Value, State3, Retries - 1, already_exists);
+                    do_put(Key, Value, Expiry, State3, Retries - 1,
+                           already_exists);
 
                 #bitcask_entry{file_id=OldFileId,offset=OldOffset} ->
                     State3 =
@@ -1771,28 +2903,30 @@ do_put(Key, Value, #bc_state{write_file = WriteFile} = State,
                                 {ok, WriteFile1, _, _} =
                                     bitcask_fileops:write(WriteFile0, Key,
                                                           PrevTomb, Tstamp),
-                                State2#bc_state{write_file = WriteFile1};
+                                set_write_file(State2, WriteFile1);
                             false ->
                                 State2
                         end,
-                    write_and_keydir_put(State3, Key, Value, Tstamp, Retries,
-                                         bitcask_time:tstamp(), OldFileId, OldOffset);
+                    write_and_keydir_put(State3, Key, Value, Expiry, Tstamp,
+                                         Retries, bitcask_time:tstamp(),
+                                         OldFileId, OldOffset);
 
                 _ ->
                     State3 = State2#bc_state{write_file = WriteFile0},
-                    write_and_keydir_put(State3, Key, Value, Tstamp, Retries,
-                                         bitcask_time:tstamp(), 0, 0)
+                    write_and_keydir_put(State3, Key, Value, Expiry, Tstamp,
+                                         Retries, bitcask_time:tstamp(), 0, 0)
             end;
 
         tombstone ->
-            case bitcask_nifs:keydir_get(State2#bc_state.keydir, Key) of
+            case write_keydir_get(State2, Key) of
                 not_found ->
                     {ok, State2};
                 #bitcask_entry{file_id=OldFileId} when OldFileId > WriteFileId ->
                     % A merge wrote this key in a file > current write file
                     % Start a new write file > the merge output file
                     State3 = wrap_write_file(State2),
-                    do_put(Key, Value, State3, Retries - 1, already_exists);
+                    do_put(Key, Value, Expiry, State3, Retries - 1,
+                           already_exists);
                 #bitcask_entry{tstamp=OldTstamp, file_id=OldFileId,
                                offset=OldOffset} ->
                     Tombstone = <<?TOMBSTONE2_STR, OldFileId:32>>,
@@ -1803,9 +2937,9 @@ do_put(Key, Value, #bc_state{write_file = WriteFile} = State,
                                    State2#bc_state.keydir,
                                    bitcask_fileops:file_tstamp(WriteFile2), Tstamp,
                                    0, 0, 0, TSize, _ShouldCreate = 1),
-                            case bitcask_nifs:keydir_remove(State2#bc_state.keydir,
-                                                            Key, OldTstamp, OldFileId,
-                                                            OldOffset) of
+                            case write_keydir_remove(State2, WriteFile2, Key,
+                                                     OldTstamp, OldFileId,
+                                                     OldOffset) of
                                 already_exists ->
                                     %% Merge updated the keydir after tombstone
                                     %% write.  beat us, so undo and retry in a
@@ -1815,10 +2949,10 @@ do_put(Key, Value, #bc_state{write_file = WriteFile} = State,
                                     State3 = wrap_write_file(
                                                State2#bc_state {
                                                  write_file = WriteFile3 }),
-                                    do_put(Key, Value, State3,
+                                    do_put(Key, Value, Expiry, State3,
                                            Retries - 1, already_exists);
-                                ok ->
-                                    {ok, State2#bc_state { write_file = WriteFile2 }}
+                                {ok, _} = Removed ->
+                                    Removed
                             end;
                         {error, _} = ErrorTomb ->
                             throw({unrecoverable, ErrorTomb, State2})
@@ -1826,15 +2960,29 @@ do_put(Key, Value, #bc_state{write_file = WriteFile} = State,
             end
     end.
 
-write_and_keydir_put(State2, Key, Value, Tstamp, Retries, NowTstamp, OldFileId, OldOffset) ->
+write_and_keydir_put(State2, Key, Value, Expiry, Tstamp, Retries, NowTstamp,
+                     OldFileId, OldOffset) ->
+    %% Like bitcask_fileops:write/4, nothing to commit when a block fills,
+    %% set_write_file/2 makes its keydir updates once it is written
     case bitcask_fileops:write(State2#bc_state.write_file,
-                               Key, Value, Tstamp) of
+                               Key, Value, Tstamp, Expiry,
+                               fun(_Entries) -> [] end) of
+        {ok, #filestate { block_size = BlockSize } = WriteFile2, Offset, Size}
+          when BlockSize > 0 ->
+            #bc_state { block_puts = Puts } = State3 =
+                set_write_file(State2, WriteFile2),
+            E = #bitcask_entry { key = Key,
+                                 file_id = bitcask_fileops:file_tstamp(WriteFile2),
+                                 total_sz = Size, offset = Offset,
+                                 tstamp = Tstamp },
+            Put = {Key, put, E, Value, Expiry, NowTstamp, OldFileId, OldOffset},
+            {ok, State3#bc_state { block_puts = [Put | Puts] }};
         {ok, WriteFile2, Offset, Size} ->
             case bitcask_nifs:keydir_put(State2#bc_state.keydir, Key,
                                          bitcask_fileops:file_tstamp(WriteFile2),
                                          Size, Offset, Tstamp,
                                          NowTstamp, true,
-                                         OldFileId, OldOffset) of
+                                         OldFileId, OldOffset, Expiry) of
                 ok ->
                     {ok, State2#bc_state { write_file = WriteFile2 }};
                 already_exists ->
@@ -1851,15 +2999,33 @@ write_and_keydir_put(State2, Key, Value, Tstamp, Retries, NowTstamp, OldFileId,
                     {ok, WriteFile3} = bitcask_fileops:un_write(WriteFile2),
                     State3 = wrap_write_file(
                                State2#bc_state { write_file = WriteFile3 }),
-                    do_put(Key, Value, State3, Retries - 1, already_exists)
+                    do_put(Key, Value, Expiry, State3, Retries - 1,
+                           already_exists)
             end;
         Error2 ->
             throw({unrecoverable, Error2, State2})
     end.
 
-wrap_write_file(#bc_state{write_file = WriteFile} = State) ->
+%% Only files with codecs can hold an expiry time, so the first put with
+%% one moves the cask on to such write files
+put_codecs(0, State) ->
+    State;
+put_codecs(_Expiry, #bc_state{write_file = #filestate{codecs = true}} = State) ->
+    State;
+put_codecs(_Expiry, #bc_state{write_file = WriteFile, opts = Opts} = State) ->
+    State1 = case proplists:get_bool(codecs, Opts) of
+                 true -> State;
+                 false -> State#bc_state{opts = [{codecs, true} | Opts]}
+             end,
+    case WriteFile of
+        fresh -> State1;
+        _ -> wrap_write_file(State1)
+    end.
+
+wrap_write_file(#bc_state{write_file = WriteFile} = State0) ->
     try
         LastWriteFile = bitcask_fileops:close_for_writing(WriteFile),
+        State = maybe_checkpoint_keydir(commit_block_puts(State0)),
         {ok, NewWriteFile} = bitcask_fileops:create_file(
                                State#bc_state.dirname,
                                State#bc_state.opts,
@@ -1872,9 +3038,125 @@ wrap_write_file(#bc_state{write_file = WriteFile} = State) ->
                                       State#bc_state.read_files]}
     catch
         error:{badmatch,Error} ->
-            throw({unrecoverable, Error, State})
+            throw({unrecoverable, Error, State0})
+    end.
+
+%% The keydir entry of Key as the writer sees it, with the updates of the
+%% block it is filling
+write_keydir_get(#bc_state { block_puts = Puts, keydir = KeyDir }, Key) ->
+    case lists:keyfind(Key, 1, Puts) of
+        {Key, put, E, _Value, _Expiry, _NowTstamp, _OldFileId, _OldOffset} ->
+            E;
+        {Key, remove, _OldTstamp, _OldFileId, _OldOffset} ->
+            not_found;
+        false ->
+            bitcask_nifs:keydir_get(KeyDir, Key)
     end.
 
+%% Remove Key from the keydir now the tombstone written to WriteFile can be
+%% read, or once its block is written out
+write_keydir_remove(State, #filestate { block_size = 0 } = WriteFile, Key,
+                    OldTstamp, OldFileId, OldOffset) ->
+    case bitcask_nifs:keydir_remove(State#bc_state.keydir, Key, OldTstamp,
+                                    OldFileId, OldOffset) of
+        ok ->
+            {ok, State#bc_state { write_file = WriteFile }};
+        already_exists ->
+            already_exists
+    end;
+write_keydir_remove(State, WriteFile, Key, OldTstamp, OldFileId, OldOffset) ->
+    #bc_state { block_puts = Puts } = State2 = set_write_file(State, WriteFile),
+    Remove = {Key, remove, OldTstamp, OldFileId, OldOffset},
+    {ok, State2#bc_state { block_puts = [Remove | Puts] }}.
+
+%% Take the write file back from a write, which seals the block being
+%% filled when the entry does not fit, and make the keydir updates of the
+%% sealed block
+set_write_file(#bc_state { write_file = #filestate { tstamp = FileId,
+                                                     ofs = Offset } } = State,
+               #filestate { tstamp = FileId, ofs = Offset } = WriteFile) ->
+    State#bc_state { write_file = WriteFile };
+set_write_file(State, WriteFile) ->
+    commit_block_puts(State#bc_state { write_file = WriteFile }).
+
+%% Make the keydir updates of the writer's block, which has just been
+%% written out. A merge may have moved one of the keys to a newer file in
+%% the meantime, which the keydir refuses the update for, as it does when
+%% a put races with a merge. Those are kept for retry_block_puts/1 to
+%% write again in a new file.
+commit_block_puts(#bc_state { block_puts = [] } = State) ->
+    State;
+commit_block_puts(#bc_state { block_puts = Puts, block_retries = Retries,
+                              keydir = KeyDir } = State) ->
+    Beaten = [Put || Put <- lists:reverse(Puts),
+                     commit_block_put(KeyDir, Put) /= ok],
+    State#bc_state { block_puts = [], block_retries = Retries ++ Beaten }.
+
+commit_block_put(KeyDir, {Key, put, E, _Value, Expiry, NowTstamp, OldFileId,
+                          OldOffset}) ->
+    bitcask_nifs:keydir_put(KeyDir, Key, E#bitcask_entry.file_id,
+                            E#bitcask_entry.total_sz, E#bitcask_entry.offset,
+                            E#bitcask_entry.tstamp, NowTstamp, true,
+                            OldFileId, OldOffset, Expiry);
+commit_block_put(KeyDir, {Key, remove, OldTstamp, OldFileId, OldOffset}) ->
+    bitcask_nifs:keydir_remove(KeyDir, Key, OldTstamp, OldFileId, OldOffset).
+
+%% Write again the updates commit_block_puts/1 could not make, in a new
+%% write file. Only the last one of a key matters, and none if the key was
+%% written again since.
+retry_block_puts(#bc_state { block_retries = [] } = State) ->
+    State;
+retry_block_puts(#bc_state { block_retries = Retries,
+                             block_puts = Puts } = State0) ->
+    Latest = latest_block_puts(Retries, Puts),
+    State = wrap_write_file(State0#bc_state { block_retries = [] }),
+    retry_block_puts(Latest, State).
+
+retry_block_puts([], State) ->
+    retry_block_puts(State);
+retry_block_puts([Put | Rest], State) ->
+    {Key, Value, Expiry} = case Put of
+                               {K, put, _, V, X, _, _, _} -> {K, V, X};
+                               {K, remove, _, _, _}       -> {K, tombstone, 0}
+                           end,
+    case do_put(Key, Value, Expiry, State, ?DIABOLIC_BIG_INT,
+                already_exists) of
+        {ok, State1} ->
+            retry_block_puts(Rest, State1);
+        {Error, State1} ->
+            throw({unrecoverable, Error, State1})
+    end.
+
+latest_block_puts([], _Puts) ->
+    [];
+latest_block_puts([Put | Rest], Puts) ->
+    Key = element(1, Put),
+    case lists:keymember(Key, 1, Rest) orelse lists:keymember(Key, 1, Puts) of
+        true ->
+            latest_block_puts(Rest, Puts);
+        false ->
+            [Put | latest_block_puts(Rest, Puts)]
+    end.
+
+%% Seal the block the write file is filling with Seal, bitcask_fileops:sync/1
+%% for instance, and make its keydir updates, until none are left to write
+%% again.
+seal_write_file(Seal, #bc_state { write_file = #filestate{} = WriteFile } =
+                    State) ->
+    case Seal(WriteFile) of
+        {ok, WriteFile2} ->
+            case commit_block_puts(State#bc_state { write_file = WriteFile2 }) of
+                #bc_state { block_retries = [] } = State2 ->
+                    {ok, State2};
+                State2 ->
+                    seal_write_file(Seal, retry_block_puts(State2))
+            end;
+        {error, _} = Error ->
+            {Error, State}
+    end;
+seal_write_file(_Seal, State) ->
+    {ok, State}.
+
 %% Versions of Bitcask prior to
 %% https://github.com/basho/bitcask/pull/156 used the setuid bit to
 %% indicate that the data file has been deleted logically and is
@@ -1953,36 +3235,86 @@ poll_for_merge_lock(Dirname, N) ->
     end.
 
 %% Internal merge function for cache_merge functionality.
-expiry_merge([], _LiveKeyDir, _KT, Acc) ->
-    Acc;
-expiry_merge([File | Files], LiveKeyDir, KT, Acc0) ->
-    FileId = bitcask_fileops:file_tstamp(File),
-    Fun = fun({tombstone, _}, _, _, Acc) ->
-                  Acc;
-             (K0, Tstamp, {Offset, _TotalSz}, Acc) ->
-                  try KT(K0) of
-                      K ->
-                          bitcask_nifs:keydir_remove(LiveKeyDir, K, Tstamp,
-                                                     FileId, Offset)
-                  catch
-                      What:Why ->
-                          error_logger:error_msg("Invalid key on merge ~p: ~p",
-                                                 [K0, {What, Why}])
-                  end,
-                  Acc
-        end,
-    case bitcask_fileops:fold_keys(File, Fun, ok, default) of
+%% Drop the keys of files whose data all expired from the keydir, as a
+%% merge would, and return the files to delete. The keydir knows which
+%% keys are in a file, so the file itself is never read.
+expiry_merge(Files, LiveKeyDir) ->
+    [File || File <- Files, expiry_merge1(File, LiveKeyDir)].
+
+expiry_merge1(File, LiveKeyDir) ->
+    case bitcask_nifs:keydir_remove_file(LiveKeyDir,
+                                         bitcask_fileops:file_tstamp(File)) of
+        ok ->
+            error_logger:info_msg("All keys expired in: ~p scheduling "
+                                  "file for deletion\n", [File]),
+            true;
         {error, Reason} ->
-            error_logger:error_msg("Error folding keys for ~p: ~p\n",
-                                   [File#filestate.filename,Reason]),
-            Acc = Acc0;
+            error_logger:error_msg("Error dropping the keys of ~p: ~p\n",
+                                   [File, Reason]),
+            false
+    end.
+
+%% Train a new compression dictionary from the files about to be merged,
+%% so the merge output is compressed against it already. Files keep the
+%% id of their dictionary, so values compressed against older ones stay
+%% readable until they are merged.
+maybe_train_dict(Dirname, Opts, InFiles) ->
+    case get_opt(compression, Opts) of
+        zstd_dict ->
+            case bitcask_fileops:dict_files(Dirname) of
+                [] ->
+                    train_dict(Dirname, 1, InFiles);
+                Dicts ->
+                    {Id, Filename} = lists:last(Dicts),
+                    case dict_age(Filename) >= ?DICT_RETRAIN_SECS of
+                        true ->
+                            train_dict(Dirname, Id + 1, InFiles);
+                        false ->
+                            ok
+                    end
+            end;
         _ ->
-            error_logger:info_msg("All keys expired in: ~p scheduling "
-                                  "file for deletion\n",
-                                  [File#filestate.filename]),
-            Acc = lists:append(Acc0, [File])
-    end,
-    expiry_merge(Files, LiveKeyDir, KT, Acc).
+            ok
+    end.
+
+dict_age(Filename) ->
+    case bitcask_fileops:read_file_info(Filename) of
+        {ok, #file_info{mtime = MTime}} ->
+            calendar:datetime_to_gregorian_seconds(calendar:local_time()) -
+                calendar:datetime_to_gregorian_seconds(MTime);
+        _ ->
+            0
+    end.
+
+train_dict(Dirname, Id, InFiles) ->
+    Samples = dict_samples(lists:reverse(InFiles), ?DICT_SAMPLE_BYTES, []),
+    case iolist_size(Samples) >= ?DICT_MIN_SAMPLE_BYTES andalso
+        bitcask_nifs:zstd_train_dict(Samples, ?DICT_SIZE, Id) of
+        false ->
+            ok;
+        {ok, Dict} ->
+            case bitcask_fileops:write_dict(Dirname, Id, Dict) of
+                ok ->
+                    ok;
+                {error, Reason} ->
+                    error_logger:error_msg("Failed to store compression "
+                                           "dictionary ~p in ~s: ~p\n",
+                                           [Id, Dirname, Reason])
+            end;
+        {error, Reason} ->
+            %% Merge files keep using the previous dictionary or plain zstd
+            error_logger:info_msg("Could not train a compression dictionary "
+                                  "for ~s: ~p\n", [Dirname, Reason])
+    end.
+
+dict_samples([], _Budget, Acc) ->
+    Acc;
+dict_samples(_Files, Budget, Acc) when Budget =< 0 ->
+    Acc;
+dict_samples([File | Files], Budget, Acc) ->
+    Samples = bitcask_fileops:sample_values(
+                File, min(Budget, ?DICT_FILE_SAMPLE_BYTES)),
+    dict_samples(Files, Budget - iolist_size(Samples), Samples ++ Acc).
 
 get_key_transform(KT)
   when is_function(KT) ->
@@ -2055,6 +3387,757 @@ a0_test2() ->
 roundtrip_test_() ->
     {timeout, 60, fun roundtrip_test2/0}.
 
+get_many_test_() ->
+    {timeout, 60, fun get_many_test2/0}.
+
+get_many_test2() ->
+    os:cmd("rm -rf /tmp/bc.test.getmany"),
+    B = bitcask:open("/tmp/bc.test.getmany", [read_write,
+                                              {max_file_size, 4096}]),
+    Keys = [<<X:32>> || X <- lists:seq(1, 200)],
+    [ok = bitcask:put(B, K, <<K/binary, K/binary>>) || K <- Keys],
+    ok = bitcask:put(B, <<10:32>>, <<"updated">>),
+    ok = bitcask:delete(B, <<20:32>>),
+
+    [] = bitcask:get_many(B, []),
+    Lookup = lists:reverse(Keys) ++ [<<"missing">>, <<5:32>>],
+    Expected = [bitcask:get(B, K) || K <- Lookup],
+    Expected = bitcask:get_many(B, Lookup),
+    [{ok, <<"updated">>}, not_found, not_found, {ok, <<5:32, 5:32>>}] =
+        bitcask:get_many(B, [<<10:32>>, <<20:32>>, <<"missing">>, <<5:32>>]),
+    close(B).
+
+value_cache_test_() ->
+    {timeout, 60, fun value_cache_test2/0}.
+
+value_cache_test2() ->
+    Dir = "/tmp/bc.test.valuecache",
+    os:cmd("rm -rf " ++ Dir),
+    B = bitcask:open(Dir, [read_write, {keydir_value_cache, 1048576}]),
+    Keys = [<<X:32>> || X <- lists:seq(1, 100)],
+    [ok = bitcask:put(B, K, <<K/binary, K/binary>>) || K <- Keys],
+    %% The first gets read the files, the next ones hit the cache
+    [{ok, <<K/binary, K/binary>>} = bitcask:get(B, K) || K <- Keys],
+    [{ok, <<K/binary, K/binary>>} = bitcask:get(B, K) || K <- Keys],
+    Stats = io_stats(B),
+    100 = proplists:get_value(cache_hits, Stats),
+    100 = proplists:get_value(cache_misses, Stats),
+    100 = proplists:get_value(cache_entries, Stats),
+    %% Updated and deleted keys do not find their old values
+    ok = bitcask:put(B, <<1:32>>, <<"updated">>),
+    ok = bitcask:delete(B, <<2:32>>),
+    {ok, <<"updated">>} = bitcask:get(B, <<1:32>>),
+    not_found = bitcask:get(B, <<2:32>>),
+    [{ok, <<"updated">>}, not_found, {ok, <<3:32, 3:32>>}] =
+        bitcask:get_many(B, [<<1:32>>, <<2:32>>, <<3:32>>]),
+    close(B),
+
+    %% Off unless asked for
+    B2 = bitcask:open(Dir),
+    {ok, <<3:32, 3:32>>} = bitcask:get(B2, <<3:32>>),
+    0 = proplists:get_value(cache_misses, io_stats(B2)),
+    close(B2).
+
+put_many_test_() ->
+    {timeout, 60, fun put_many_test2/0}.
+
+put_many_test2() ->
+    os:cmd("rm -rf /tmp/bc.test.putmany"),
+    B = bitcask:open("/tmp/bc.test.putmany", [read_write,
+                                              {sync_strategy, group_commit},
+                                              {max_file_size, 1024}]),
+    ok = bitcask:put_many(B, []),
+    KVs = [{<<X:32>>, <<X:64>>} || X <- lists:seq(1, 100)],
+    ok = bitcask:put_many(B, KVs),
+    ok = bitcask:put_many(B, [{<<1:32>>, <<"one">>}, {<<2:32>>, tombstone}]),
+    ok = bitcask:put(B, <<3:32>>, <<"three">>),
+    {ok, <<"one">>} = bitcask:get(B, <<1:32>>),
+    not_found = bitcask:get(B, <<2:32>>),
+    {ok, <<"three">>} = bitcask:get(B, <<3:32>>),
+    {ok, <<100:64>>} = bitcask:get(B, <<100:32>>),
+    close(B),
+
+    B2 = bitcask:open("/tmp/bc.test.putmany"),
+    {ok, <<"one">>} = bitcask:get(B2, <<1:32>>),
+    not_found = bitcask:get(B2, <<2:32>>),
+    99 = length(bitcask:list_keys(B2)),
+    close(B2).
+
+mmap_reads_test_() ->
+    {timeout, 60, fun mmap_reads_test2/0}.
+
+mmap_reads_test2() ->
+    Dir = "/tmp/bc.test.mmapreads",
+    os:cmd("rm -rf " ++ Dir),
+    OldVal = application:get_env(bitcask, mmap_reads),
+    try
+        application:set_env(bitcask, mmap_reads, true),
+        B = bitcask:open(Dir, [read_write, {max_file_size, 4096}]),
+        Keys = [<<X:32>> || X <- lists:seq(1, 300)],
+        [ok = bitcask:put(B, K, <<K/binary, K/binary>>) || K <- Keys],
+        %% Files closed by wrapping are mapped, the write file is not
+        #bc_state{read_files = ReadFiles, write_file = WriteFile} = get(B),
+        ?assertNotEqual([], ReadFiles),
+        [?assertNotEqual(undefined, F#filestate.mmap) || F <- ReadFiles],
+        ?assertEqual(undefined, WriteFile#filestate.mmap),
+        Expected = [{ok, <<K/binary, K/binary>>} || K <- Keys],
+        ?assertEqual(Expected, [bitcask:get(B, K) || K <- Keys]),
+        ?assertEqual(Expected, bitcask:get_many(B, Keys)),
+        {ok, Held} = bitcask:get(B, <<1:32>>),
+        ok = bitcask:close(B),
+
+        %% Files opened for reading are mapped too
+        B2 = bitcask:open(Dir),
+        ?assertEqual(Expected, [bitcask:get(B2, K) || K <- Keys]),
+        ok = bitcask:close(B2),
+
+        %% Ranges past the end of the mapping are left to pread
+        [File | _] = readable_files(Dir),
+        {ok, FS} = bitcask_fileops:open_file(File),
+        {ok, #file_info{size = Size}} = bitcask_fileops:read_file_info(File),
+        ?assertEqual(eof, bitcask_nifs:file_mmap_pread(FS#filestate.mmap,
+                                                       Size - 1, 2)),
+        ?assertEqual({error, eof}, bitcask_fileops:read(FS, Size, 10)),
+        ok = bitcask_fileops:close(FS),
+
+        %% A value read from a mapping outlives the files it came from
+        erlang:garbage_collect(),
+        ?assertEqual(<<1:32, 1:32>>, Held)
+    after
+        case OldVal of
+            {ok, Val} -> application:set_env(bitcask, mmap_reads, Val);
+            undefined -> application:unset_env(bitcask, mmap_reads)
+        end
+    end.
+
+crc32c_test() ->
+    ?assertEqual(16#e3069283, bitcask_nifs:crc32c(<<"123456789">>)),
+    ?assertEqual(16#e3069283, bitcask_nifs:crc32c(["1", [<<"23">>, $4], <<"56789">>])),
+    ?assertEqual(16#e3069283,
+                 bitcask_nifs:crc32c(bitcask_nifs:crc32c(<<"1234">>), <<"56789">>)),
+    ?assertEqual(0, bitcask_nifs:crc32c(<<>>)),
+    ?assertError(badarg, bitcask_nifs:crc32c([256])).
+
+checksum_formats_test_() ->
+    {timeout, 60, fun checksum_formats_test2/0}.
+
+checksum_formats_test2() ->
+    Dir = "/tmp/bc.test.checksums",
+    os:cmd("rm -rf " ++ Dir),
+    Keys = [<<X:32>> || X <- lists:seq(1, 200)],
+    %% Files in the original CRC-32 format, as older versions wrote them
+    B1 = bitcask:open(Dir, [read_write, {max_file_size, 2048},
+                            {checksum, crc32}]),
+    [ok = bitcask:put(B1, K, K) || K <- Keys],
+    ok = bitcask:close(B1),
+    OldFiles = readable_files(Dir),
+
+    %% Files written since then use CRC-32C, next to the old ones
+    B2 = bitcask:open(Dir, [read_write, {max_file_size, 2048}]),
+    [ok = bitcask:put(B2, K, <<"v2">>) || <<X:32>> = K <- Keys, X rem 2 == 0],
+    [ok = bitcask:delete(B2, K) || <<X:32>> = K <- Keys, X rem 3 == 0],
+    ok = bitcask:close(B2),
+    NewFiles = readable_files(Dir) -- OldFiles,
+    Checksums = fun(Files) ->
+                        lists:usort(
+                          [begin
+                               {ok, FS} = bitcask_fileops:open_file(F),
+                               ok = bitcask_fileops:close(FS),
+                               FS#filestate.checksum
+                           end || F <- Files])
+                end,
+    ?assertEqual([crc32], Checksums(OldFiles)),
+    ?assertEqual([crc32c], Checksums(NewFiles)),
+    [begin
+         {ok, <<Header:?CRC32C_FILE_HEADER_SIZE/binary, _/binary>>} =
+             file:read_file(F),
+         ?assertEqual(?CRC32C_FILE_HEADER, Header)
+     end || F <- NewFiles],
+    [?assert(bitcask_fileops:has_valid_hintfile(
+               #filestate{filename = F})) || F <- OldFiles ++ NewFiles],
+
+    Expected = fun(<<X:32>> = K) when X rem 3 == 0 -> {K, not_found};
+                  (<<X:32>> = K) when X rem 2 == 0 -> {K, {ok, <<"v2">>}};
+                  (K) -> {K, {ok, K}}
+               end,
+    Check = fun(Ref) ->
+                    [?assertEqual(Expected(K), {K, bitcask:get(Ref, K)}) ||
+                        K <- Keys],
+                    Folded = bitcask:fold(Ref, fun(K, V, Acc) -> [{K, {ok, V}} | Acc] end,
+                                          []),
+                    ?assertEqual([Expected(K) || K <- Keys,
+                                                 Expected(K) /= {K, not_found}],
+                                 lists:sort(Folded))
+            end,
+    %% Hint files of both kinds load, and so do the data files without them
+    B3 = bitcask:open(Dir),
+    Check(B3),
+    ok = bitcask:close(B3),
+    [ok = file:delete(bitcask_fileops:hintfile_name(F)) ||
+        F <- OldFiles ++ NewFiles],
+    _ = file:delete(keydir_snapshot_file(Dir)),
+    B4 = bitcask:open(Dir),
+    Check(B4),
+    ok = bitcask:close(B4),
+
+    %% A merge rewrites everything as CRC-32C
+    M = bitcask:open(Dir),
+    ok = merge(Dir),
+    ok = bitcask:close(M),
+    ?assertEqual([crc32c], Checksums(readable_files(Dir))),
+    B5 = bitcask:open(Dir),
+    Check(B5),
+    ok = bitcask:close(B5).
+
+compress_nif_test() ->
+    Json = iolist_to_binary(lists:duplicate(40, <<"{\"key\":\"abc\",\"n\":42},">>)),
+    Random = crypto:strong_rand_bytes(1000),
+    Big = binary:copy(Json, 2000),
+    [begin
+         {ok, C} = bitcask_nifs:compress(Codec, V),
+         ?assert(byte_size(C) < byte_size(V)),
+         ?assertEqual({ok, V}, bitcask_nifs:decompress(Codec, C)),
+         ?assertEqual(uncompressible, bitcask_nifs:compress(Codec, Random)),
+         ?assertEqual(error, bitcask_nifs:decompress(Codec, <<>>))
+     end || Codec <- bitcask_nifs:compression_codecs(), V <- [Json, Big]],
+    [?assertEqual(uncompressible, bitcask_nifs:compress(Codec, Json))
+     || Codec <- [lz4, zstd] -- bitcask_nifs:compression_codecs()],
+    ?assertError(badarg, bitcask_nifs:compress(snappy, Json)).
+
+compression_test_() ->
+    {timeout, 60, fun compression_test2/0}.
+
+compression_test2() ->
+    [compression_test2(Codec) || Codec <- bitcask_nifs:compression_codecs()].
+
+compression_test2(Codec) ->
+    Dir = "/tmp/bc.test.compression",
+    os:cmd("rm -rf " ++ Dir),
+    Json = fun(X) ->
+                   iolist_to_binary(
+                     [io_lib:format("{\"id\":~b,\"name\":\"item\",\"tags\":[]},",
+                                    [X]) || _ <- lists:seq(1, 20)])
+           end,
+    Keys = [<<X:32>> || X <- lists:seq(1, 300)],
+    Expected = fun(<<X:32>> = K) when X rem 5 == 0 -> {K, not_found};
+                   (<<X:32>> = K) when X rem 3 == 0 -> {K, {ok, K}};
+                   (<<X:32>> = K) when X rem 7 == 0 ->
+                        {K, {ok, binary:part(Json(X), 0, 40)}};
+                   (<<X:32>> = K) -> {K, {ok, Json(X)}}
+               end,
+    Check = fun(Ref) ->
+                    [?assertEqual(Expected(K), {K, bitcask:get(Ref, K)}) ||
+                        K <- Keys],
+                    Folded = bitcask:fold(Ref, fun(K, V, Acc) -> [{K, {ok, V}} | Acc] end,
+                                          []),
+                    ?assertEqual([Expected(K) || K <- Keys,
+                                                 Expected(K) /= {K, not_found}],
+                                 lists:sort(Folded)),
+                    ?assertEqual(lists:sort([K || K <- Keys,
+                                                  Expected(K) /= {K, not_found}]),
+                                 lists:sort(bitcask:list_keys(Ref)))
+            end,
+    B1 = bitcask:open(Dir, [read_write, {max_file_size, 16384},
+                            {compression, Codec}]),
+    %% Small, incompressible and compressible values side by side
+    [ok = bitcask:put(B1, K, Json(X)) || <<X:32>> = K <- Keys],
+    [ok = bitcask:put(B1, K, K) || <<X:32>> = K <- Keys, X rem 3 == 0],
+    [ok = bitcask:put(B1, K, binary:part(Json(X), 0, 40)) ||
+        <<X:32>> = K <- Keys, X rem 7 == 0, X rem 3 /= 0],
+    [ok = bitcask:delete(B1, K) || <<X:32>> = K <- Keys, X rem 5 == 0],
+    Check(B1),
+    ok = bitcask:close(B1),
+    Files = readable_files(Dir),
+    [begin
+         {ok, <<Header:?CRC32C_FILE_HEADER_SIZE/binary, _/binary>>} =
+             file:read_file(F),
+         ?assertEqual(?CODEC_FILE_HEADER, Header)
+     end || F <- Files],
+    Stored = lists:sum([filelib:file_size(F) || F <- Files]),
+    Raw = lists:sum([byte_size(Json(X)) || <<X:32>> <- Keys]),
+    ?assert(Stored < Raw div 2),
+
+    B2 = bitcask:open(Dir),
+    Check(B2),
+    ok = bitcask:close(B2),
+    [ok = file:delete(bitcask_fileops:hintfile_name(F)) || F <- Files],
+    _ = file:delete(keydir_snapshot_file(Dir)),
+    B3 = bitcask:open(Dir),
+    Check(B3),
+    ok = bitcask:close(B3),
+
+    %% Merging without compression rewrites the values uncompressed
+    M = bitcask:open(Dir),
+    ok = merge(Dir),
+    ok = bitcask:close(M),
+    [begin
+         {ok, FS} = bitcask_fileops:open_file(F),
+         ok = bitcask_fileops:close(FS),
+         ?assertNot(FS#filestate.codecs)
+     end || F <- readable_files(Dir)],
+    B4 = bitcask:open(Dir),
+    Check(B4),
+    ok = bitcask:close(B4).
+
+compression_dict_test_() ->
+    case lists:member(zstd, bitcask_nifs:compression_codecs()) of
+        true  -> {timeout, 120, fun compression_dict_test2/0};
+        false -> []
+    end.
+
+compression_dict_test2() ->
+    Dir = "/tmp/bc.test.compressiondict",
+    os:cmd("rm -rf " ++ Dir),
+    Opts = [{max_file_size, 262144}, {compression, zstd_dict}],
+    Value = fun(X, Gen) ->
+                    iolist_to_binary(
+                      io_lib:format("{\"id\":~b,\"gen\":~b,\"name\":\"user~b\","
+                                    "\"email\":\"user~b@example.com\","
+                                    "\"created\":\"2024-01-~2..0bT10:~2..0b:00Z\","
+                                    "\"roles\":[\"reader\",\"writer\"],"
+                                    "\"settings\":{\"theme\":\"dark\","
+                                    "\"lang\":\"en\",\"notify\":~p}}",
+                                    [X, Gen, X, X, 1 + X rem 28, X rem 60,
+                                     X rem 2 == 0]))
+            end,
+    Put = fun(Ref, Gen, Xs) ->
+                  [ok = bitcask:put(Ref, <<X:32>>, Value(X, Gen)) || X <- Xs]
+          end,
+    Expected = fun(X) when X =< 2000 -> {<<X:32>>, {ok, Value(X, 2)}};
+                  (X) -> {<<X:32>>, {ok, Value(X, 1)}}
+               end,
+    Check = fun(Ref) ->
+                    [?assertEqual(Expected(X), {<<X:32>>, bitcask:get(Ref, <<X:32>>)})
+                     || X <- lists:seq(1, 10000)],
+                    Folded = bitcask:fold(Ref, fun(K, V, Acc) ->
+                                                       [{K, {ok, V}} | Acc]
+                                               end, []),
+                    ?assertEqual([Expected(X) || X <- lists:seq(1, 10000)],
+                                 lists:sort(Folded))
+            end,
+    DictIds = fun() -> [Id || {Id, _} <- bitcask_fileops:dict_files(Dir)] end,
+    FileDicts = fun(Files) ->
+                        lists:usort(
+                          [begin
+                               {ok, <<Header:?CRC32C_FILE_HEADER_SIZE/binary,
+                                      Id:32, _/binary>>} = file:read_file(F),
+                               case Header of
+                                   ?CODEC_FILE_HEADER -> 0;
+                                   ?DICT_FILE_HEADER -> Id
+                               end
+                           end || F <- Files])
+                end,
+
+    %% Plain zstd until a merge has trained the first dictionary
+    B1 = bitcask:open(Dir, [read_write | Opts]),
+    Put(B1, 1, lists:seq(1, 6000)),
+    ok = bitcask:close(B1),
+    ?assertEqual([], DictIds()),
+    ?assertEqual([0], FileDicts(readable_files(Dir))),
+    Plain = lists:sum([filelib:file_size(F) || F <- readable_files(Dir)]),
+
+    M1 = bitcask:open(Dir),
+    ok = merge(Dir, Opts),
+    ok = bitcask:close(M1),
+    ?assertEqual([1], DictIds()),
+    ?assertEqual([1], FileDicts(readable_files(Dir))),
+    ?assert(lists:sum([filelib:file_size(F) || F <- readable_files(Dir)]) < Plain),
+
+    %% New files use the dictionary too
+    Merged = readable_files(Dir),
+    B2 = bitcask:open(Dir, [read_write | Opts]),
+    Put(B2, 2, lists:seq(1, 2000)),
+    Put(B2, 1, lists:seq(6001, 10000)),
+    ok = bitcask:close(B2),
+    New = readable_files(Dir) -- Merged,
+    ?assertEqual([1], FileDicts(New)),
+
+    %% Once it is old enough a merge trains a second one, and the files
+    %% compressed against the first stay readable
+    ok = file:change_time(filename:join(Dir, "bitcask.dict.1"),
+                          {{2000, 1, 1}, {0, 0, 0}}),
+    M2 = bitcask:open(Dir),
+    ok = merge(Dir, Opts, New),
+    ok = bitcask:close(M2),
+    ok = bitcask_merge_delete:testonly__delete_trigger(),
+    ?assertEqual([1, 2], DictIds()),
+    ?assertEqual([1, 2], FileDicts(readable_files(Dir))),
+    B3 = bitcask:open(Dir),
+    Check(B3),
+    ok = bitcask:close(B3),
+    [ok = file:delete(bitcask_fileops:hintfile_name(F)) ||
+        F <- readable_files(Dir)],
+    _ = file:delete(keydir_snapshot_file(Dir)),
+    B4 = bitcask:open(Dir),
+    Check(B4),
+    ok = bitcask:close(B4),
+
+    %% The first dictionary goes away with the last file using it
+    M3 = bitcask:open(Dir),
+    ok = merge(Dir, Opts),
+    ok = bitcask:close(M3),
+    ok = bitcask_merge_delete:testonly__delete_trigger(),
+    ?assertEqual([2], FileDicts(readable_files(Dir))),
+    ok = bitcask_fileops:delete_unused_dicts(Dir),
+    ?assertEqual([2], DictIds()),
+    B5 = bitcask:open(Dir),
+    Check(B5),
+    ok = bitcask:close(B5).
+
+block_format_test_() ->
+    {timeout, 60, fun block_format_test2/0}.
+
+block_format_test2() ->
+    Dir = "/tmp/bc.test.blocks",
+    PlainDir = "/tmp/bc.test.blocks.plain",
+    os:cmd("rm -rf " ++ Dir ++ " " ++ PlainDir),
+    Opts = [{max_file_size, 16384}, {block_size, 1024}, {compression, lz4}],
+    Keys = [<<X:32>> || X <- lists:seq(1, 500)],
+    %% Larger than a block, so it gets one of its own
+    Big = crypto:strong_rand_bytes(3000),
+    Expected = fun(<<X:32>> = K) when X rem 5 == 0 -> {K, not_found};
+                  (<<X:32>> = K) when X rem 3 == 0 -> {K, {ok, <<"v2">>}};
+                  (<<X:32>> = K) when X rem 101 == 0 -> {K, {ok, Big}};
+                  (<<X:32>> = K) when X rem 7 == 0 -> {K, {ok, binary:copy(K, 50)}};
+                  (K) -> {K, {ok, K}}
+               end,
+    Write = fun(Ref) ->
+                    [ok = bitcask:put(Ref, K, K) || K <- Keys],
+                    [ok = bitcask:put(Ref, K, <<"v2">>) ||
+                        <<X:32>> = K <- Keys, X rem 3 == 0],
+                    [ok = bitcask:put(Ref, K, Big) ||
+                        <<X:32>> = K <- Keys, X rem 101 == 0, X rem 3 /= 0],
+                    [ok = bitcask:put(Ref, K, binary:copy(K, 50)) ||
+                        <<X:32>> = K <- Keys, X rem 7 == 0, X rem 3 /= 0],
+                    [ok = bitcask:delete(Ref, K) || <<X:32>> = K <- Keys,
+                                                    X rem 5 == 0]
+            end,
+    Check = fun(Ref) ->
+                    [?assertEqual(Expected(K), {K, bitcask:get(Ref, K)}) ||
+                        K <- Keys],
+                    ?assertEqual([R || {_, R} <- [Expected(K) || K <- Keys]],
+                                 bitcask:get_many(Ref, Keys)),
+                    Folded = bitcask:fold(Ref, fun(K, V, Acc) -> [{K, {ok, V}} | Acc] end,
+                                          []),
+                    ?assertEqual([Expected(K) || K <- Keys,
+                                                 Expected(K) /= {K, not_found}],
+                                 lists:sort(Folded))
+            end,
+    BlockFiles = fun() ->
+                         lists:usort(
+                           [begin
+                                {ok, FS} = bitcask_fileops:open_file(F),
+                                ok = bitcask_fileops:close(FS),
+                                FS#filestate.block_size
+                            end || F <- readable_files(Dir)])
+                 end,
+
+    %% The writer reads entries of the block still being filled from memory
+    B1 = bitcask:open(Dir, [read_write | Opts]),
+    Write(B1),
+    Check(B1),
+    ok = bitcask:close(B1),
+    ?assertEqual([1024], BlockFiles()),
+    P = bitcask:open(PlainDir, [read_write | Opts -- [{block_size, 1024}]]),
+    Write(P),
+    ok = bitcask:close(P),
+    ?assert(lists:sum([filelib:file_size(F) || F <- readable_files(Dir)]) <
+            lists:sum([filelib:file_size(F) || F <- readable_files(PlainDir)])),
+
+    %% Keys load from the hint files, or the data files without them
+    B2 = bitcask:open(Dir),
+    Check(B2),
+    ok = bitcask:close(B2),
+    [ok = file:delete(bitcask_fileops:hintfile_name(F)) ||
+        F <- readable_files(Dir)],
+    _ = file:delete(keydir_snapshot_file(Dir)),
+    B3 = bitcask:open(Dir),
+    Check(B3),
+    ok = bitcask:close(B3),
+
+    M = bitcask:open(Dir),
+    ok = merge(Dir, Opts),
+    ok = bitcask:close(M),
+    ?assertEqual([1024], BlockFiles()),
+    B4 = bitcask:open(Dir),
+    Check(B4),
+    ok = bitcask:close(B4).
+
+block_seal_test() ->
+    Dir = "/tmp/bc.test.blockseal",
+    os:cmd("rm -rf " ++ Dir),
+    {ok, KeyDir} = bitcask_nifs:keydir_new(),
+    {ok, F0} = bitcask_fileops:create_file(Dir, [{block_size, 4096}], KeyDir),
+    {ok, F1, OfsA, _} = bitcask_fileops:write(F0, <<"a">>, <<"1">>, 100),
+    {ok, F2, OfsB, _} = bitcask_fileops:write(F1, <<"b">>, <<"2">>, 90),
+    {ok, F3, _, _} = bitcask_fileops:write(F2, <<"c">>, <<"3">>, 110),
+    {ok, F4} = bitcask_fileops:un_write(F3),
+    ?assertEqual({ok, <<"b">>, <<"2">>}, bitcask_fileops:read(F4, OfsB, 0)),
+    %% Entries the commit finds out of date are marked dead
+    Commit = fun(Entries) ->
+                     ?assertMatch([{<<"a">>, 100, 0, OfsA, _, 0},
+                                   {<<"b">>, 90, 0, OfsB, _, 0}], Entries),
+                     [OfsA]
+             end,
+    {ok, F5} = bitcask_fileops:seal(F4, Commit),
+    ?assertEqual({ok, <<"b">>, <<"2">>}, bitcask_fileops:read(F5, OfsB, 0)),
+    ok = bitcask_fileops:close(F5),
+    {ok, R} = bitcask_fileops:open_file(bitcask_fileops:filename(F5)),
+    ?assertEqual({error, bad_value}, bitcask_fileops:read(R, OfsA, 0)),
+    ?assertEqual([{<<"b">>, <<"2">>, 90}],
+                 bitcask_fileops:fold(R, fun(K, V, T, _Pos, Acc) ->
+                                                 [{K, V, T} | Acc]
+                                         end, [])),
+    KeyFold = fun(K, T, {Ofs, _}, Acc) -> [{K, T, Ofs} | Acc] end,
+    ?assertEqual([{<<"b">>, 90, OfsB}],
+                 bitcask_fileops:fold_keys(R, KeyFold, [], hintfile)),
+    ?assertEqual([{<<"b">>, 90, OfsB}],
+                 bitcask_fileops:fold_keys(R, KeyFold, [], datafile)),
+    ok = bitcask_fileops:close(R),
+    bitcask_nifs:keydir_release(KeyDir).
+
+%% Other processes sharing the keydir only find the writer's updates once
+%% their block is on disk, and a sealed block is never written again
+block_visibility_test() ->
+    Dir = "/tmp/bc.test.blockvisibility",
+    os:cmd("rm -rf " ++ Dir),
+    W = bitcask:open(Dir, [read_write, {block_size, 4096}]),
+    R = bitcask:open(Dir),
+    ok = bitcask:put(W, <<"a">>, <<"1">>),
+    ?assertEqual({ok, <<"1">>}, bitcask:get(W, <<"a">>)),
+    ?assertEqual(not_found, bitcask:get(R, <<"a">>)),
+    ok = bitcask:sync(W),
+    ?assertEqual({ok, <<"1">>}, bitcask:get(R, <<"a">>)),
+    [File] = filelib:wildcard(Dir ++ "/*.bitcask.data"),
+    {ok, Sealed} = file:read_file(File),
+    ok = bitcask:put(W, <<"b">>, <<"2">>),
+    ok = bitcask:delete(W, <<"a">>),
+    ?assertEqual(not_found, bitcask:get(W, <<"a">>)),
+    ?assertEqual([not_found, {ok, <<"2">>}],
+                 bitcask:get_many(W, [<<"a">>, <<"b">>])),
+    ?assertEqual({ok, <<"1">>}, bitcask:get(R, <<"a">>)),
+    ?assertEqual(not_found, bitcask:get(R, <<"b">>)),
+    ok = bitcask:sync(W),
+    {ok, Synced} = file:read_file(File),
+    ?assert(byte_size(Synced) > byte_size(Sealed)),
+    ?assertEqual(Sealed, binary:part(Synced, 0, byte_size(Sealed))),
+    ?assertEqual(not_found, bitcask:get(R, <<"a">>)),
+    ?assertEqual({ok, <<"2">>}, bitcask:get(R, <<"b">>)),
+    ok = bitcask:close(R),
+    ok = bitcask:close(W).
+
+native_merge_test_() ->
+    {timeout, 60, fun native_merge_test2/0}.
+
+%% Merge the same data natively and through the Erlang fold, which a key
+%% transform selects, and expect the same result
+native_merge_test2() ->
+    Dir = "/tmp/bc.test.nativemerge",
+    ErlDir = "/tmp/bc.test.nativemerge.erl",
+    os:cmd("rm -rf " ++ Dir ++ " " ++ ErlDir),
+    Opts = [{max_file_size, 32768}],
+    KT = fun(K) -> K end,
+    Keys = [<<X:32>> || X <- lists:seq(1, 2000)],
+    Expected = fun(<<X:32>> = K) when X rem 5 == 0 -> {K, not_found};
+                   (<<X:32>> = K) when X rem 3 == 0 -> {K, {ok, <<"v2">>}};
+                   (K) -> {K, {ok, binary:copy(K, 10)}}
+               end,
+    Write = fun(D, WOpts) ->
+                    B = bitcask:open(D, [read_write | WOpts]),
+                    [ok = bitcask:put(B, K, binary:copy(K, 10)) || K <- Keys],
+                    [ok = bitcask:put(B, K, <<"v2">>) ||
+                        <<X:32>> = K <- Keys, X rem 3 == 0],
+                    [ok = bitcask:delete(B, K) || <<X:32>> = K <- Keys,
+                                                  X rem 5 == 0],
+                    ok = bitcask:close(B)
+            end,
+    Check = fun(D, COpts) ->
+                    B = bitcask:open(D, COpts),
+                    [?assertEqual(Expected(K), {K, bitcask:get(B, K)}) ||
+                        K <- Keys],
+                    Folded = bitcask:fold(B, fun(K, V, Acc) ->
+                                                     [{K, {ok, V}} | Acc]
+                                             end, []),
+                    ?assertEqual([Expected(K) || K <- Keys,
+                                                 Expected(K) /= {K, not_found}],
+                                 lists:sort(Folded)),
+                    ok = bitcask:close(B)
+            end,
+    Sizes = fun(D) -> [filelib:file_size(F) || F <- readable_files(D)] end,
+
+    Write(Dir, Opts),
+    Write(ErlDir, [{key_transform, KT} | Opts]),
+    [begin
+         {ok, FS} = bitcask_fileops:open_file(F),
+         ?assertEqual(crc32c, bitcask_fileops:copy_format(FS)),
+         ok = bitcask_fileops:close(FS)
+     end || F <- readable_files(Dir)],
+    ok = merge(Dir, Opts),
+    ok = merge(ErlDir, [{key_transform, KT} | Opts]),
+    ?assert(length(Sizes(Dir)) > 1),
+    ?assertEqual(Sizes(ErlDir), Sizes(Dir)),
+    Check(Dir, []),
+    Check(ErlDir, [{key_transform, KT}]),
+
+    %% The keys load from the hint files the copies were given
+    _ = file:delete(keydir_snapshot_file(Dir)),
+    Check(Dir, []),
+    [ok = file:delete(bitcask_fileops:hintfile_name(F)) ||
+        F <- readable_files(Dir)],
+    Check(Dir, []).
+
+parallel_merge_test_() ->
+    {timeout, 60, fun parallel_merge_test2/0}.
+
+parallel_merge_test2() ->
+    Dir = "/tmp/bc.test.parallelmerge",
+    os:cmd("rm -rf " ++ Dir),
+    Opts = [{max_file_size, 16384}, {merge_workers, 4}],
+    Keys = [<<X:32>> || X <- lists:seq(1, 2000)],
+    Expected = fun(<<X:32>> = K) when X rem 5 == 0 -> {K, not_found};
+                   (<<X:32>> = K) when X rem 3 == 0 -> {K, {ok, <<"v2">>}};
+                   (K) -> {K, {ok, binary:copy(K, 10)}}
+               end,
+    B = bitcask:open(Dir, [read_write | Opts]),
+    [ok = bitcask:put(B, K, binary:copy(K, 10)) || K <- Keys],
+    [ok = bitcask:put(B, K, <<"v2">>) || <<X:32>> = K <- Keys, X rem 3 == 0],
+    [ok = bitcask:delete(B, K) || <<X:32>> = K <- Keys, X rem 5 == 0],
+    ok = bitcask:close(B),
+    Check = fun() ->
+                    B2 = bitcask:open(Dir),
+                    [?assertEqual(Expected(K), {K, bitcask:get(B2, K)}) ||
+                        K <- Keys],
+                    Folded = bitcask:fold(B2, fun(K, V, Acc) ->
+                                                      [{K, {ok, V}} | Acc]
+                                              end, []),
+                    ?assertEqual([Expected(K) || K <- Keys,
+                                                 Expected(K) /= {K, not_found}],
+                                 lists:sort(Folded)),
+                    ok = bitcask:close(B2)
+            end,
+
+    %% Leaving out the first file, the tombstones for the values it holds
+    %% go back into it
+    [First | Rest] = readable_files(Dir),
+    ?assert(length(Rest) > 4),
+    FirstSize = filelib:file_size(First),
+    ok = merge(Dir, Opts, Rest),
+    ?assert(filelib:file_size(First) > FirstSize),
+    Check(),
+
+    ok = merge(Dir, Opts),
+    ?assert(length(readable_files(Dir)) > 1),
+    Check(),
+
+    %% Nothing deleted comes back when the keys load from the data files
+    _ = file:delete(keydir_snapshot_file(Dir)),
+    [ok = file:delete(bitcask_fileops:hintfile_name(F)) ||
+        F <- readable_files(Dir)],
+    Check().
+
+suspend_merge_test_() ->
+    {timeout, 60, fun() ->
+                          suspend_merge_test2("/tmp/bc.test.suspendmerge", []),
+                          suspend_merge_test2("/tmp/bc.test.suspendmerge2",
+                                              [{merge_workers, 2}])
+                  end}.
+
+suspend_merge_test2(Dir, Opts0) ->
+    os:cmd("rm -rf " ++ Dir),
+    Opts = [{max_file_size, 16384} | Opts0],
+    Keys = [<<X:32>> || X <- lists:seq(1, 2000)],
+    Expected = fun(<<X:32>> = K) when X rem 5 == 0 -> {K, not_found};
+                  (<<X:32>> = K) when X rem 3 == 0 -> {K, {ok, <<"v2">>}};
+                  (K) -> {K, {ok, binary:copy(K, 10)}}
+               end,
+    B = bitcask:open(Dir, [read_write | Opts]),
+    [ok = bitcask:put(B, K, binary:copy(K, 10)) || K <- Keys],
+    [ok = bitcask:put(B, K, <<"v2">>) || <<X:32>> = K <- Keys, X rem 3 == 0],
+    [ok = bitcask:delete(B, K) || <<X:32>> = K <- Keys, X rem 5 == 0],
+    ok = bitcask:close(B),
+    Check = fun() ->
+                    B2 = bitcask:open(Dir),
+                    [?assertEqual(Expected(K), {K, bitcask:get(B2, K)}) ||
+                        K <- Keys],
+                    ok = bitcask:close(B2)
+            end,
+    Files = readable_files(Dir),
+
+    %% Stopped a few chunks in, the merge leaves the files it has yet to
+    %% finish in the checkpoint. Each worker counts its own chunks.
+    Suspend = fun() ->
+                      Calls = case get(suspend_calls) of
+                                  undefined -> 1;
+                                  N -> N + 1
+                              end,
+                      put(suspend_calls, Calls),
+                      Calls > 4
+              end,
+    ok = merge(Dir, [{merge_suspend, Suspend} | Opts]),
+    erase(suspend_calls),
+    Left = [F || {F, _} <- read_merge_checkpoint(Dir)],
+    ?assert(Left /= []),
+    ?assert(length(Left) < length(Files)),
+    ?assert(lists:suffix(Left, Files)),
+    Check(),
+
+    %% The next merge finishes those first
+    B3 = bitcask:open(Dir),
+    ?assertEqual({true, {Left, []}}, needs_merge(B3)),
+    ok = bitcask:close(B3),
+    ok = merge(Dir, Opts),
+    ?assertEqual(undefined, read_merge_checkpoint(Dir)),
+    ?assertEqual([], [F || F <- Files, lists:member(F, readable_files(Dir))]),
+    Check().
+
+throttled_merge_test_() ->
+    {timeout, 60, fun throttled_merge_test2/0}.
+
+throttled_merge_test2() ->
+    Dir = "/tmp/bc.test.throttledmerge",
+    os:cmd("rm -rf " ++ Dir),
+    Opts = [{max_file_size, 262144}, {merge_io_rate, 2097152},
+            {merge_io_latency_target, 100}],
+    Keys = [<<X:32>> || X <- lists:seq(1, 400)],
+    B = bitcask:open(Dir, [read_write | Opts]),
+    [ok = bitcask:put(B, K, binary:copy(K, 512)) || K <- Keys],
+    ok = bitcask:close(B),
+
+    B2 = bitcask:open(Dir, Opts),
+    [{ok, _} = bitcask:get(B2, K) || K <- Keys],
+    Stats0 = io_stats(B2),
+    ?assert(proplists:get_value(read_samples, Stats0) > 0),
+    ?assertEqual(0, proplists:get_value(merge_bytes, Stats0)),
+
+    %% Reading and writing 800KB at 2MB/s takes a while
+    Start = os:timestamp(),
+    ok = merge(Dir, Opts),
+    ?assert(timer:now_diff(os:timestamp(), Start) > 500000),
+    Stats = io_stats(B2),
+    ?assert(proplists:get_value(merge_bytes, Stats) > 1600000),
+    ?assert(proplists:get_value(merge_throttled_usecs, Stats) > 0),
+    [?assertEqual({ok, binary:copy(K, 512)}, bitcask:get(B2, K)) || K <- Keys],
+    ok = bitcask:close(B2).
+
+merge_runs_test() ->
+    Dir = "/tmp/bc.test.mergeruns",
+    os:cmd("rm -rf " ++ Dir),
+    ok = filelib:ensure_dir(filename:join(Dir, "x")),
+    Files = [begin
+                 F = filename:join(Dir, integer_to_list(I)),
+                 ok = file:write_file(F, binary:copy(<<0>>, Size)),
+                 #filestate { filename = F }
+             end || {I, Size} <- lists:zip(lists:seq(1, 6),
+                                           [100, 100, 100, 100, 400, 10])],
+    Runs = fun(W) ->
+                   [[filename:basename(F#filestate.filename) || F <- Run] ||
+                       Run <- merge_runs(Files, W)]
+           end,
+    ?assertEqual([["1", "2", "3", "4", "5", "6"]], Runs(1)),
+    ?assertEqual([["1", "2", "3", "4"], ["5", "6"]], Runs(2)),
+    ?assertEqual([["1", "2", "3"], ["4"], ["5", "6"]], Runs(3)),
+    ?assertEqual([["1"], ["2"], ["3"], ["4"], ["5"], ["6"]], Runs(8)).
+
 roundtrip_test2() ->
     os:cmd("rm -rf /tmp/bc.test.roundtrip"),
     B = bitcask:open("/tmp/bc.test.roundtrip", [read_write]),
@@ -2126,6 +4209,10 @@ list_data_files_race_test() ->
                                 File
                         end
                 end),
+    meck:expect(bitcask_lockops, read_activefiles,
+                fun(Kind, D) ->
+                        [bitcask_lockops:read_activefile(Kind, D)]
+                end),
     ReadFiles = lists:usort(bitcask:readable_files(Dir)),
     meck:unload(),
     ?assertEqual([Fname(N)||N<-lists:seq(1,5)],
@@ -3569,6 +5656,102 @@ merge_expired_test2() ->
     ?assertEqual(ExpectedKeys, ActualKeys1),
     ?assertEqual(ExpectedKeys, ActualKeys2).
 
+merge_drops_expired_test_() ->
+    {timeout, 120, fun merge_drops_expired_test2/0}.
+
+merge_drops_expired_test2() ->
+    Dir = "/tmp/bc.merge.drops.expired",
+    KF = fun(N) -> <<N:8/integer>> end,
+    KVGen = fun(S, E) ->
+                    [{KF(N), <<"v">>} || N <- lists:seq(S, E)]
+            end,
+    B = init_dataset(Dir, [{max_file_size, 1}], KVGen(1, 3)),
+    put_kvs(B, KVGen(4, 6)),
+    %% Expired files are dropped with the keydir alone, so their contents
+    %% do not matter, and nothing else needs merging
+    First = Dir ++ "/1.bitcask.data",
+    ok = file:write_file(First, <<"garbage">>),
+    _ = file:delete(bitcask_fileops:hintfile_name(First)),
+    ?assertEqual(ok, bitcask:merge(Dir, [], {[], [First]})),
+    ?assertEqual([KF(N) || N <- lists:seq(2, 6)],
+                 lists:sort(bitcask:list_keys(B))),
+    ok = bitcask_merge_delete:testonly__delete_trigger(),
+    ?assertNot(lists:member(First, readable_files(Dir))),
+    bitcask:close(B).
+
+put_expires_test_() ->
+    {timeout, 120, fun put_expires_test2/0}.
+
+put_expires_test2() ->
+    Dir = "/tmp/bc.put.expires",
+    B = init_dataset(Dir, [{max_file_size, 1}],
+                     [{<<"k1">>, <<"v1">>}, {<<"k2">>, <<"v2">>}]),
+    Now = bitcask_time:tstamp(),
+    Later = Now + 3600,
+    %% An expiry time already past hides the key, and its older value too
+    ok = bitcask:put(B, <<"k1">>, <<"gone">>, [{expires, Now - 1}]),
+    ok = bitcask:put(B, <<"k2">>, <<"v2-2">>, [{expires, Later}]),
+    ok = bitcask:put(B, <<"k3">>, <<"v3">>, [{expires, 0}]),
+    ?assertError({badarg, {expires, -1}},
+                 bitcask:put(B, <<"k4">>, <<"v4">>, [{expires, -1}])),
+    Check = fun(C) ->
+                    ?assertEqual(not_found, bitcask:get(C, <<"k1">>)),
+                    ?assertEqual({ok, <<"v2-2">>}, bitcask:get(C, <<"k2">>)),
+                    ?assertEqual([not_found, {ok, <<"v2-2">>}],
+                                 bitcask:get_many(C, [<<"k1">>, <<"k2">>])),
+                    ?assertEqual([<<"k2">>, <<"k3">>],
+                                 lists:sort(bitcask:list_keys(C))),
+                    ?assertEqual([<<"k2">>, <<"k3">>],
+                                 lists:sort(bitcask:fold(
+                                              C, fun(K, _V, A) -> [K | A] end,
+                                              [])))
+            end,
+    Check(B),
+    %% The expiry times come back from the hint files
+    bitcask:close(B),
+    B2 = bitcask:open(Dir, [read_write, {max_file_size, 1}]),
+    Check(B2),
+    %% A merge drops the expired key and keeps the expiry time of the other
+    ?assertEqual(ok, bitcask:merge(Dir)),
+    Check(B2),
+    bitcask:close(B2),
+    B3 = bitcask:open(Dir),
+    try
+        Check(B3),
+        bitcask_time:test__set_fudge(Later),
+        ?assertEqual(not_found, bitcask:get(B3, <<"k2">>)),
+        ?assertEqual([<<"k3">>], bitcask:list_keys(B3))
+    after
+        bitcask_time:test__clear_fudge(),
+        bitcask:close(B3)
+    end.
+
+expiry_sweep_test_() ->
+    {timeout, 60, fun expiry_sweep_test2/0}.
+
+expiry_sweep_test2() ->
+    Dir = "/tmp/bc.expiry.sweep",
+    B = init_dataset(Dir, [{keydir_expiry_index, true}],
+                     [{<<"k1">>, <<"v1">>}]),
+    Now = bitcask_time:tstamp(),
+    ok = bitcask:put(B, <<"k2">>, <<"v2">>, [{expires, Now - 1}]),
+    ok = bitcask:put(B, <<"k3">>, <<"v3">>, [{expires, Now + 3600}]),
+    #bc_state { expiry_sweeper = Sweeper } = get_state(B),
+    ?assert(is_pid(Sweeper)),
+    %% The sweeper removes k2 without anyone asking for it
+    ?assert(retry_until_true(fun() -> testhelper_keydir_count(B) == 2 end,
+                             100, 50)),
+    ?assertEqual([<<"k1">>, <<"k3">>], lists:sort(bitcask:list_keys(B))),
+    bitcask:close(B),
+    ?assertNot(is_process_alive(Sweeper)),
+    %% Read-only opens leave the sweeping to the writer
+    B2 = bitcask:open(Dir, [{keydir_expiry_index, true}]),
+    try
+        ?assertEqual(undefined, (get_state(B2))#bc_state.expiry_sweeper)
+    after
+        bitcask:close(B2)
+    end.
+
 max_merge_size_test_() ->
     {timeout, 120, fun max_merge_size_test2/0}.
 
@@ -3674,6 +5857,216 @@ update_tombstones_test() ->
     TombCount = bitcask:subfold(CountF, Fds, 0),
     ?assertEqual(1, TombCount).
 
+native_hintfile_load_test_() ->
+    {timeout, 60, fun native_hintfile_load_test2/0}.
+
+native_hintfile_load_test2() ->
+    Dir = "/tmp/bc.test.nativehint",
+    os:cmd("rm -rf " ++ Dir),
+    B = bitcask:open(Dir, [read_write, {max_file_size, 4096}]),
+    Keys = [<<X:32>> || X <- lists:seq(1, 500)],
+    [ok = bitcask:put(B, K, K) || K <- Keys],
+    [ok = bitcask:put(B, K, <<"again">>) || <<X:32>> = K <- Keys, X rem 3 == 0],
+    [ok = bitcask:delete(B, K) || <<X:32>> = K <- Keys, X rem 5 == 0],
+    bitcask:close(B),
+
+    {Files, _} = readable_and_setuid_files(Dir),
+    Load = fun(KT) ->
+                   {ok, KeyDir} = bitcask_nifs:keydir_new(),
+                   _ = scan_key_files(Files, KeyDir, [], true, KT),
+                   KeyDir
+           end,
+    Native = Load(fun kt_id/1),
+    Erlang = Load(fun(K) -> K end),
+    [?assertEqual(bitcask_nifs:keydir_get(Erlang, K),
+                  bitcask_nifs:keydir_get(Native, K)) || K <- Keys],
+    {Count, _, _, _, _} = bitcask_nifs:keydir_info(Erlang),
+    {Count, _, _, _, _} = bitcask_nifs:keydir_info(Native),
+    ?assertEqual(400, Count),
+    ok = bitcask_nifs:keydir_release(Native),
+    ok = bitcask_nifs:keydir_release(Erlang).
+
+parallel_hintfile_load_test_() ->
+    {timeout, 60, fun parallel_hintfile_load_test2/0}.
+
+parallel_hintfile_load_test2() ->
+    Dir = "/tmp/bc.test.parhint",
+    os:cmd("rm -rf " ++ Dir),
+    B = bitcask:open(Dir, [read_write, {max_file_size, 4096}]),
+    Keys = [<<X:32>> || X <- lists:seq(1, 500)],
+    [ok = bitcask:put(B, K, K) || K <- Keys],
+    [ok = bitcask:put(B, K, <<"again">>) || <<X:32>> = K <- Keys, X rem 3 == 0],
+    [ok = bitcask:delete(B, K) || <<X:32>> = K <- Keys, X rem 5 == 0],
+    bitcask:close(B),
+
+    {Files, _} = readable_and_setuid_files(Dir),
+    %% A bad hint file halfway through makes the loader fall back to the
+    %% data file for it and carry on in parallel after it.
+    BadHint = bitcask_fileops:hintfile_name(lists:nth(length(Files) div 2, Files)),
+    {ok, HintBin} = file:read_file(BadHint),
+    ok = file:write_file(BadHint, <<0, HintBin/binary>>),
+    Load = fun(KT, Threads) ->
+                   {ok, KeyDir} = bitcask_nifs:keydir_new(),
+                   _ = scan_key_files(Files, KeyDir, [], true, KT, Threads),
+                   KeyDir
+           end,
+    Erlang = Load(fun(K) -> K end, 1),
+    {Count, KeyBytes, Fstats, _, _} = bitcask_nifs:keydir_info(Erlang),
+    ?assertEqual(400, Count),
+    lists:foreach(
+      fun(Threads) ->
+              Par = Load(fun kt_id/1, Threads),
+              [?assertEqual(bitcask_nifs:keydir_get(Erlang, K),
+                            bitcask_nifs:keydir_get(Par, K)) || K <- Keys],
+              {ParCount, ParKeyBytes, ParFstats, _, _} =
+                  bitcask_nifs:keydir_info(Par),
+              ?assertEqual({Count, KeyBytes, lists:sort(Fstats)},
+                           {ParCount, ParKeyBytes, lists:sort(ParFstats)}),
+              ok = bitcask_nifs:keydir_release(Par)
+      end, [2, 4, 16]),
+    ok = bitcask_nifs:keydir_release(Erlang).
+
+keydir_snapshot_test_() ->
+    {timeout, 60, fun keydir_snapshot_test2/0}.
+
+keydir_snapshot_test2() ->
+    Dir = "/tmp/bc.test.kdsnap",
+    os:cmd("rm -rf " ++ Dir),
+    Keys = [<<X:32>> || X <- lists:seq(1, 500)],
+    B1 = bitcask:open(Dir, [read_write, {max_file_size, 4096}]),
+    [ok = bitcask:put(B1, K, K) || K <- Keys],
+    [ok = bitcask:delete(B1, K) || <<X:32>> = K <- Keys, X rem 5 == 0],
+    ok = bitcask:close(B1),
+    ?assert(filelib:is_regular(keydir_snapshot_file(Dir))),
+
+    %% Every file is covered, and the keydir matches a full scan
+    {Files, _} = readable_and_setuid_files(Dir),
+    {ok, Scanned} = bitcask_nifs:keydir_new(),
+    _ = scan_key_files(Files, Scanned, [], true, fun kt_id/1, 1),
+    {ok, Loaded} = bitcask_nifs:keydir_new(),
+    ?assertEqual([], load_keydir_snapshot(Dir, Loaded, Files)),
+    [?assertEqual(bitcask_nifs:keydir_get(Scanned, K),
+                  bitcask_nifs:keydir_get(Loaded, K)) || K <- Keys],
+    {Count, KeyBytes, Fstats, _, _} = bitcask_nifs:keydir_info(Scanned),
+    {Count, KeyBytes, LoadedFstats, _, _} = bitcask_nifs:keydir_info(Loaded),
+    ?assertEqual(400, Count),
+    ?assertEqual([element(1, F) || F <- lists:sort(Fstats)],
+                 [element(1, F) || F <- lists:sort(LoadedFstats)]),
+    ok = bitcask_nifs:keydir_release(Scanned),
+    ok = bitcask_nifs:keydir_release(Loaded),
+
+    %% Writes made after the snapshot come from scanning the newer files
+    B2 = bitcask:open(Dir, [read_write, {max_file_size, 4096},
+                            {keydir_snapshot, false}]),
+    [ok = bitcask:put(B2, K, <<"again">>) || <<X:32>> = K <- Keys, X rem 3 == 0],
+    [ok = bitcask:delete(B2, K) || <<X:32>> = K <- Keys, X rem 7 == 0],
+    ok = bitcask:close(B2),
+    Expected = fun(<<X:32>> = K) when X rem 7 == 0 -> {K, not_found};
+                  (<<X:32>> = K) when X rem 3 == 0 -> {K, {ok, <<"again">>}};
+                  (<<X:32>> = K) when X rem 5 == 0 -> {K, not_found};
+                  (K) -> {K, {ok, K}}
+               end,
+    Check = fun(Ref) ->
+                    [?assertEqual(Expected(K), {K, bitcask:get(Ref, K)}) ||
+                        K <- Keys]
+            end,
+    {Files2, _} = readable_and_setuid_files(Dir),
+    {ok, Partial} = bitcask_nifs:keydir_new(),
+    ?assertEqual(Files2 -- Files, load_keydir_snapshot(Dir, Partial, Files2)),
+    ok = bitcask_nifs:keydir_release(Partial),
+    B3 = bitcask:open(Dir, [read_write]),
+    Check(B3),
+    ok = bitcask:close(B3),
+
+    %% A merge replaces the covered files, so the snapshot is not used
+    M = bitcask:open(Dir),
+    ok = merge(Dir),
+    ok = bitcask:close(M),
+    {Files3, _} = readable_and_setuid_files(Dir),
+    {ok, Stale} = bitcask_nifs:keydir_new(),
+    ?assertEqual(Files3, load_keydir_snapshot(Dir, Stale, Files3)),
+    ok = bitcask_nifs:keydir_release(Stale),
+    B4 = bitcask:open(Dir),
+    Check(B4),
+    ok = bitcask:close(B4).
+
+-ifdef(TIMING_TEST_NOT_EUNIT_TEST).
+
+hintfile_load_timing_test_() ->
+    {timeout, 3600, fun() -> hintfile_load_timing(1000000) end}.
+
+%% Compare keydir startup from hint files through the native loader, on
+%% one and several threads, with the Erlang fold (selected by passing a
+%% non-identity key transform).
+hintfile_load_timing(NumKeys) ->
+    Dir = "/tmp/bc.test.hintload",
+    os:cmd("rm -rf " ++ Dir),
+    B = bitcask:open(Dir, [read_write, {max_file_size, 64 * 1024 * 1024}]),
+    [ok = bitcask:put(B, <<X:64>>, <<X:128>>) || X <- lists:seq(1, NumKeys)],
+    bitcask:close(B),
+
+    {Files, _} = readable_and_setuid_files(Dir),
+    Time = fun(KT, Threads) ->
+                   {ok, KeyDir} = bitcask_nifs:keydir_new(),
+                   {Us, _} = timer:tc(fun() ->
+                                              scan_key_files(Files, KeyDir, [],
+                                                             true, KT, Threads)
+                                      end),
+                   {NumKeys, _, _, _, _} = bitcask_nifs:keydir_info(KeyDir),
+                   ok = bitcask_nifs:keydir_release(KeyDir),
+                   Us
+           end,
+    Native = Time(fun kt_id/1, 1),
+    Erlang = Time(fun(K) -> K end, 1),
+    io:format(user, "\nkeydir load of ~p keys from ~p hint files: "
+              "native ~p ms, erlang ~p ms (~.1fx)\n",
+              [NumKeys, length(Files), Native div 1000, Erlang div 1000,
+               Erlang / max(1, Native)]),
+    [begin
+         Par = Time(fun kt_id/1, Threads),
+         io:format(user, "  ~p threads: ~p ms (~.1fx over 1 thread)\n",
+                   [Threads, Par div 1000, Native / max(1, Par)])
+     end || Threads <- [2, 4, 8]],
+    ok.
+
+merge_timing_test_() ->
+    {timeout, 3600, fun() -> merge_timing(1000000, 1024) end}.
+
+%% Merge throughput, in MB of input data files per second, of the native
+%% copy and of the Erlang fold (selected by passing a non-identity key
+%% transform). Every other key is overwritten, so half the data is live.
+merge_timing(NumKeys, ValueSize) ->
+    Dir = "/tmp/bc.test.mergetiming",
+    Opts = [{max_file_size, 64 * 1024 * 1024}],
+    Value = crypto:strong_rand_bytes(ValueSize),
+    Time = fun(MergeOpts) ->
+                   os:cmd("rm -rf " ++ Dir),
+                   B = bitcask:open(Dir, [read_write | Opts]),
+                   [ok = bitcask:put(B, <<X:64>>, Value) ||
+                       X <- lists:seq(1, NumKeys)],
+                   [ok = bitcask:put(B, <<X:64>>, Value) ||
+                       X <- lists:seq(1, NumKeys, 2)],
+                   ok = bitcask:close(B),
+                   Bytes = lists:sum([filelib:file_size(F) ||
+                                         F <- readable_files(Dir)]),
+                   M = bitcask:open(Dir, MergeOpts ++ Opts),
+                   {Us, ok} = timer:tc(fun() ->
+                                               merge(Dir, MergeOpts ++ Opts)
+                                       end),
+                   ok = bitcask:close(M),
+                   {Bytes, Us}
+           end,
+    {Bytes, Native} = Time([]),
+    {Bytes, Erlang} = Time([{key_transform, fun(K) -> K end}]),
+    MBs = fun(Us) -> Bytes / 1048576 / max(1, Us) * 1000000 end,
+    io:format(user, "\nmerge of ~p MB: native ~.1f MB/s, erlang ~.1f MB/s "
+              "(~.1fx)\n",
+              [Bytes div 1048576, MBs(Native), MBs(Erlang),
+               Erlang / max(1, Native)]),
+    ok.
+
+-endif. % TIMING_TEST_NOT_EUNIT_TEST
+
 make_merge_file(Dir, Seed, Probability) ->
     random:seed(Seed),
     case filelib:is_dir(Dir) of
@@ -0,0 +1,132 @@
+%% -------------------------------------------------------------------
+%%
+%% bitcask: Eric Brewer-inspired key/value store
+%%
+%% Copyright (c) 2026 Basho Technologies, Inc. All Rights Reserved.
+%%
+%% This file is provided to you under the Apache License,
+%% Version 2.0 (the "License"); you may not use this file
+%% except in compliance with the License.  You may obtain
+%% a copy of the License at
+%%
+%%   http://www.apache.org/licenses/LICENSE-2.0
+%%
+%% Unless required by applicable law or agreed to in writing,
+%% software distributed under the License is distributed on an
+%% "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+%% KIND, either express or implied.  See the License for the
+%% specific language governing permissions and limitations
+%% under the License.
+%%
+%% -------------------------------------------------------------------
+
+%% @doc Process removing the keys put with an expiry time from the keydir
+%% once they expire, instead of waiting for a get or a merge to find them.
+%%
+%% With keydir_expiry_index set, the keydir indexes those keys by when
+%% they expire. A cask opened for writing starts a sweeper that asks it
+%% for the expired ones every second, a slice of 4096 index entries
+%% at a time, see bitcask_nifs:keydir_sweep_expired/3. The sweeper goes
+%% away with the process that opened the cask.
+-module(bitcask_expiry_sweep).
+
+-export([start/2, stop/1]).
+
+-ifdef(TEST).
+-include_lib("eunit/include/eunit.hrl").
+-endif.
+
+%% Time between sweeps once one gets to the current second
+-define(INTERVAL_MSECS, 1000).
+%% Index entries looked at by a call into the keydir
+-define(MAX_NODES, 4096).
+
+%% @doc A sweeper for Keydir if the options ask for the expiry index, or
+%% undefined.
+-spec start([term()], reference()) -> pid() | undefined.
+start(Opts, Keydir) ->
+    case bitcask:get_opt(keydir_expiry_index, Opts) of
+        true ->
+            Owner = self(),
+            proc_lib:spawn(fun() -> init(Owner, Keydir) end);
+        _ ->
+            undefined
+    end.
+
+%% @doc Stop Sweeper and wait for it, so that it is done with the keydir.
+-spec stop(pid() | undefined) -> ok.
+stop(undefined) ->
+    ok;
+stop(Sweeper) ->
+    MRef = erlang:monitor(process, Sweeper),
+    Sweeper ! stop,
+    receive
+        {'DOWN', MRef, process, Sweeper, _Reason} ->
+            ok
+    end.
+
+%% ===================================================================
+%% Internal functions
+%% ===================================================================
+
+init(Owner, Keydir) ->
+    MRef = erlang:monitor(process, Owner),
+    loop(MRef, Keydir).
+
+loop(MRef, Keydir) ->
+    Wait = case bitcask_nifs:keydir_sweep_expired(Keydir, bitcask_time:tstamp(),
+                                                  ?MAX_NODES) of
+               {more, _Removed} -> 0;
+               {done, _Removed} -> ?INTERVAL_MSECS
+           end,
+    receive
+        stop ->
+            ok;
+        {'DOWN', MRef, process, _Owner, _Reason} ->
+            ok
+    after Wait ->
+            loop(MRef, Keydir)
+    end.
+
+%% ===================================================================
+%% EUnit tests
+%% ===================================================================
+-ifdef(TEST).
+
+no_index_test() ->
+    ?assertEqual(undefined, start([{keydir_expiry_index, false}], undefined)),
+    ?assertEqual(ok, stop(undefined)).
+
+sweep_test_() ->
+    {timeout, 60, fun sweep_test2/0}.
+
+sweep_test2() ->
+    {not_ready, Keydir} = bitcask_nifs:keydir_new("bitcask_expiry_sweep_test",
+                                                  [{expiry_index, true}]),
+    bitcask_nifs:keydir_mark_ready(Keydir),
+    Now = bitcask_time:tstamp(),
+    ok = bitcask_nifs:keydir_put(Keydir, <<"a">>, 1, 100, 0, 1, Now, false,
+                                 0, 0, Now - 1),
+    ok = bitcask_nifs:keydir_put(Keydir, <<"b">>, 1, 100, 100, 1, Now, false,
+                                 0, 0, Now + 3600),
+    Sweeper = start([{keydir_expiry_index, true}], Keydir),
+    ?assert(is_pid(Sweeper)),
+    ok = wait_for_key_count(Keydir, 1, 50),
+    not_found = bitcask_nifs:keydir_get(Keydir, <<"a">>),
+    ok = stop(Sweeper),
+    ?assertNot(is_process_alive(Sweeper)),
+    ok = bitcask_nifs:keydir_release(Keydir).
+
+wait_for_key_count(_Keydir, _Count, 0) ->
+    timeout;
+wait_for_key_count(Keydir, Count, Tries) ->
+    Info = bitcask_nifs:keydir_memory_info(Keydir),
+    case proplists:get_value(key_count, Info) of
+        Count ->
+            ok;
+        _ ->
+            timer:sleep(100),
+            wait_for_key_count(Keydir, Count, Tries - 1)
+    end.
+
+-endif.
@@ -29,7 +29,7 @@
 
 %% API
 
--export([file_open/2, file_close/1, file_sync/1,
+-export([file_open/2, file_close/1, file_sync/1, file_datasync/1,
          file_pread/3, file_read/2,
          file_pwrite/3, file_write/2,
          file_position/2, file_seekbof/1, file_truncate/1,
@@ -62,6 +62,9 @@ file_close(Pid) ->
 file_sync(Pid) ->
     file_request(Pid, file_sync).
 
+file_datasync(Pid) ->
+    file_request(Pid, file_datasync).
+
 file_pread(Pid, Offset, Size) ->
     file_request(Pid, {file_pread, Offset, Size}).
 
@@ -159,6 +162,10 @@ handle_call(file_sync, From, State=#state{fd=Fd}) ->
     check_owner(From, State),
     Reply = file:sync(Fd),
     {reply, Reply, State};
+handle_call(file_datasync, From, State=#state{fd=Fd}) ->
+    check_owner(From, State),
+    Reply = file:datasync(Fd),
+    {reply, Reply, State};
 handle_call({file_pread, Offset, Size}, From, State=#state{fd=Fd}) ->
     check_owner(From, State),
     Reply = file:pread(Fd, Offset, Size),
@@ -30,18 +30,30 @@
          close_all/1,
          close_for_writing/1,
          data_file_tstamps/1,
-         write/4,
+         write/4, write/5, write/6,
+         seal/2,
          read/3,
+         read_many/2,
          sync/1,
+         datasync/1,
          delete/1,
-         fold/3,
+         fold/3, fold_from/4,
          fold_keys/3, fold_keys/4,
+         load_hintfile/2,
+         load_hintfiles/3,
          mk_filename/2,
          filename/1,
          hintfile_name/1,
          file_tstamp/1,
          check_write/4,
-         un_write/1]).
+         un_write/1,
+         data_start/1,
+         copy_format/1,
+         copied/3]).
+-export([dict_files/1,
+         write_dict/3,
+         sample_values/2,
+         delete_unused_dicts/1]).
 -export([read_file_info/1, write_file_info/2, is_file/1]).
 
 -include_lib("kernel/include/file.hrl").
@@ -50,6 +62,25 @@
 
 -define(HINT_RECORD_SZ, 18). % Tstamp(4) + KeySz(2) + TotalSz(4) + Offset(8)
 
+%% read_many/2 merges neighbouring entries into one pread when the hole
+%% between them is at most READ_MANY_MAX_GAP bytes and the merged read
+%% stays within READ_MANY_MAX_SPAN bytes.
+-define(READ_MANY_MAX_GAP, 4096).
+-define(READ_MANY_MAX_SPAN, 262144).
+
+%% Values shorter than this are not worth a compression attempt
+-define(MIN_COMPRESS_SIZE, 64).
+
+%% Largest varint header of a block entry: tstamp delta(5) + key size(3) +
+%% value size and codec(6)
+-define(MAX_BLOCK_ENTRY_HEADER, 14).
+
+%% Called by seal/2 once a block is on disk, with its entries as
+%% {Key, Tstamp, TombInt, Offset, TotalSz, Expiry} in slot order. Returns
+%% the offsets of the entries to mark dead and leave out of the hint file.
+-type commit_fun() :: fun(([{binary(), integer(), 0 | 1, integer(),
+                             integer(), non_neg_integer()}]) -> [integer()]).
+
 -ifdef(PULSE).
 -compile({parse_transform, pulse_instrument}).
 -endif.
@@ -88,12 +119,57 @@ create_file(DirName, Opts0, Keydir) ->
                             Opts
                     end,
 
+                %% Blocks are only written out once full or synced, which
+                %% o_sync is meant to rule out
+                BlockSize = case {bitcask:get_opt(block_size, Opts),
+                                  lists:member(o_sync, FinalOpts)} of
+                                {N, false} when is_integer(N), N > 0 ->
+                                    min(N, ?MAXVALSIZE);
+                                _ ->
+                                    0
+                            end,
+                %% Values with an expiry time need a codec field to flag
+                %% it, see write/6
+                ForceCodecs = proplists:get_bool(codecs, Opts),
+                %% Only write the original format if asked to, e.g. to keep
+                %% the files readable by older versions
+                Checksum = case bitcask:get_opt(checksum, Opts) of
+                               crc32 when BlockSize == 0,
+                                          not ForceCodecs -> crc32;
+                               _     -> crc32c
+                           end,
+                Compression = case bitcask:get_opt(compression, Opts) of
+                                  lz4       -> lz4;
+                                  zstd      -> zstd;
+                                  zstd_dict -> zstd_dict;
+                                  _         -> none
+                              end,
+                %% Without a trained dictionary yet, plain zstd will do
+                {Compression1, DictId, Dict} =
+                    case Compression of
+                        zstd_dict ->
+                            case newest_dict(DirName) of
+                                {Id, Ref} -> {zstd_dict, Id, Ref};
+                                undefined -> {zstd, 0, undefined}
+                            end;
+                        _ ->
+                            {Compression, 0, undefined}
+                    end,
+
                 {ok, FD} = bitcask_io:file_open(Filename, FinalOpts),
                 HintFD = open_hint_file(Filename, FinalOpts),
-                {ok, #filestate{mode = read_write,
-                                filename = Filename,
-                                tstamp = file_tstamp(Filename),
-                                hintfd = HintFD, fd = FD, ofs = 0}}
+                State = #filestate{mode = read_write,
+                                   filename = Filename,
+                                   tstamp = file_tstamp(Filename),
+                                   hintfd = HintFD, fd = FD,
+                                   checksum = Checksum,
+                                   codecs = Compression1 /= none
+                                            orelse BlockSize > 0
+                                            orelse ForceCodecs,
+                                   compression = Compression1,
+                                   dict = Dict, dict_id = DictId,
+                                   block_size = BlockSize},
+                {ok, State#filestate{ofs = write_file_header(State)}}
             catch Error:Reason ->
                     %% if we fail somehow, do we need to nuke any partial
                     %% state?
@@ -131,6 +207,7 @@ open_file(Filename) ->
 open_file(Filename, append) ->
     case bitcask_io:file_open(Filename, []) of
         {ok, FD} ->
+            {Checksum, Codecs, DictId, BlockSize} = file_format(FD),
             case bitcask_io:file_position(FD, {eof, 0}) of
                 {ok, 0} ->
                     % File was deleted and we just opened a new one, undo.
@@ -153,6 +230,11 @@ open_file(Filename, append) ->
                                         fd = FD,
                                         hintfd = HintFD,
                                         hintcrc = HintCRC,
+                                        checksum = Checksum,
+                                        codecs = Codecs,
+                                        dict_id = DictId,
+                                        dict = open_dict(Filename, DictId),
+                                        block_size = BlockSize,
                                         ofs = Ofs
                                        }}
                     end
@@ -163,9 +245,14 @@ open_file(Filename, append) ->
 open_file(Filename, readonly) ->
     case bitcask_io:file_open(Filename, [readonly]) of
         {ok, FD} ->
+            {Checksum, Codecs, DictId, BlockSize} = file_format(FD),
             {ok, #filestate{mode = read_only,
                             filename = Filename, tstamp = file_tstamp(Filename),
-                            fd = FD, ofs = 0}};
+                            fd = FD, mmap = maybe_mmap(Filename),
+                            checksum = Checksum, codecs = Codecs,
+                            dict_id = DictId, dict = open_dict(Filename, DictId),
+                            block_size = BlockSize,
+                            ofs = 0}};
         {error, Reason} ->
             {error, Reason}
     end.
@@ -202,7 +289,7 @@ prepare_hintfile_for_append(HintFD) ->
                 error ->
                     bitcask_io:file_close(HintFD),
                     {undefined, 0};
-                HintCRC ->
+                {_Checksum, HintCRC} ->
                     bitcask_io:file_position(HintFD,
                                              {eof, -?HINT_RECORD_SZ}),
                     bitcask_io:file_truncate(HintFD),
@@ -217,7 +304,8 @@ prepare_hintfile_for_append(HintFD) ->
 -spec close(#filestate{} | fresh | undefined) -> ok.
 close(fresh) -> ok;
 close(undefined) -> ok;
-close(State = #filestate{ fd = FD }) ->
+close(State0 = #filestate{ fd = FD }) ->
+    {ok, State} = seal(State0, fun no_commit/1),
     _ = close_hintfile(State),
     bitcask_io:file_close(FD),
     ok.
@@ -232,19 +320,41 @@ close_all(FileStates) ->
 -spec close_for_writing(#filestate{} | fresh | undefined) -> #filestate{} | ok.
 close_for_writing(fresh) -> ok;
 close_for_writing(undefined) -> ok;
-close_for_writing(State = #filestate{ mode = read_write, fd = Fd }) ->
+close_for_writing(State0 = #filestate{ mode = read_write, fd = Fd }) ->
+    {ok, State} = seal(State0, fun no_commit/1),
     S2 = close_hintfile(State),
     bitcask_io:file_sync(Fd),
-    S2#filestate { mode = read_only }.
+    S2#filestate { mode = read_only,
+                   mmap = maybe_mmap(S2#filestate.filename) }.
+
+%% Map a file that is no longer written so reads can return binaries
+%% pointing into the page cache instead of copying through pread. Reads
+%% beyond the mapped size still go through the file handle.
+maybe_mmap(Filename) ->
+    case application:get_env(bitcask, mmap_reads) of
+        {ok, true} ->
+            case bitcask_nifs:file_mmap(Filename) of
+                {ok, Map} ->
+                    Map;
+                {error, _} ->
+                    undefined
+            end;
+        _ ->
+            undefined
+    end.
 
 close_hintfile(State = #filestate { hintfd = undefined }) ->
     State;
-close_hintfile(State = #filestate { hintfd = HintFd, hintcrc = HintCRC }) ->
+close_hintfile(State = #filestate { hintfd = HintFd, hintcrc = HintCRC,
+                                   checksum = Checksum }) ->
     %% Write out CRC check at end of hint file.  Write with an empty key, zero
     %% timestamp and offset as large as the file format supports so opening with
     %% an older version of bitcask will just reject the record at the end of the
-    %% hintfile and otherwise work normally.
-    Iolist = hintfile_entry(<<>>, 0, 0, ?MAXOFFSET_V2, HintCRC),
+    %% hintfile and otherwise work normally. CRC-32C hint files mark the record
+    %% with a timestamp of 1 instead, which older versions take for a bad
+    %% pointer and fall back to the data file.
+    Iolist = hintfile_entry(<<>>, hint_crc_tstamp(Checksum), 0, ?MAXOFFSET_V2,
+                            HintCRC),
     _ = bitcask_io:file_write(HintFd, Iolist),
     _ = bitcask_io:file_sync(HintFd),
     _ = bitcask_io:file_close(HintFd),
@@ -286,22 +396,81 @@ delete(#filestate{ filename = FN } = State) ->
             Key :: binary(), Value :: binary(), Tstamp :: integer()) ->
         {ok, #filestate{}, Offset :: integer(), Size :: integer()} |
         {error, read_only}.
-write(#filestate { mode = read_only }, _K, _V, _Tstamp) ->
+write(Filestate, Key, Value, Tstamp) ->
+    write(Filestate, Key, Value, Tstamp, fun no_commit/1).
+
+%% @doc Write to a file, sealing the block being filled with Commit if it
+%% has no room left for the entry. See seal/2.
+-spec write(#filestate{},
+            Key :: binary(), Value :: binary(), Tstamp :: integer(),
+            commit_fun()) ->
+        {ok, #filestate{}, Offset :: integer(), Size :: integer()} |
+        {error, read_only}.
+write(Filestate, Key, Value, Tstamp, Commit) ->
+    write(Filestate, Key, Value, Tstamp, 0, Commit).
+
+%% @doc Write a value that reads as not found from the Expiry tstamp on,
+%% or never if 0. Only files with codecs can hold an expiry time, see the
+%% codecs option of create_file/3.
+-spec write(#filestate{},
+            Key :: binary(), Value :: binary(), Tstamp :: integer(),
+            Expiry :: non_neg_integer(), commit_fun()) ->
+        {ok, #filestate{}, Offset :: integer(), Size :: integer()} |
+        {error, term()}.
+write(#filestate { mode = read_only }, _K, _V, _Tstamp, _Expiry, _Commit) ->
     {error, read_only};
+write(Filestate=#filestate{block_size = BlockSize}, Key, Value, Tstamp, Expiry,
+      Commit)
+  when BlockSize > 0 ->
+    KeySz = size(Key),
+    true = (KeySz =< ?MAXKEYSIZE),
+    {Codec, Stored} = encode_value(Filestate, Value, Expiry),
+    try
+        ok = check_value_size(size(Stored)),
+        {ok, Filestate1} =
+            case block_has_room(Filestate, KeySz + size(Stored)) of
+                true  -> {ok, Filestate};
+                false -> seal(Filestate, Commit)
+            end,
+        #filestate{ofs = Offset, block = Block, block_count = Count,
+                   block_bytes = Bytes} = Filestate1,
+        Base = case Count of
+                   0 -> Tstamp;
+                   _ -> Filestate1#filestate.block_tstamp
+               end,
+        TombInt = case bitcask:is_tombstone(Value) of
+                      true  -> 1;
+                      false -> 0
+                  end,
+        Header = block_entry_header(Tstamp - Base, KeySz, size(Stored), Codec),
+        TotalSz = size(Header) + KeySz + size(Stored),
+        Entry = {Key, Tstamp, TombInt, Codec, Stored, Header},
+        {ok, Filestate1#filestate{block = [Entry | Block],
+                                  block_count = Count + 1,
+                                  block_bytes = Bytes + TotalSz,
+                                  block_tstamp = Base},
+         block_address(Offset, Count), TotalSz}
+    catch
+        error:{badmatch,Error} ->
+            Error
+    end;
 write(Filestate=#filestate{fd = FD, hintfd = HintFD,
-                           hintcrc = HintCRC0, ofs = Offset},
-      Key, Value, Tstamp) ->
+                           hintcrc = HintCRC0, checksum = Checksum,
+                           ofs = Offset},
+      Key, Value, Tstamp, Expiry, _Commit) ->
     KeySz = size(Key),
     true = (KeySz =< ?MAXKEYSIZE),
-    ValueSz = size(Value),
-    true = (ValueSz =< ?MAXVALSIZE),
+    {Codec, Stored} = encode_value(Filestate, Value, Expiry),
+    Field = value_field(Filestate, Codec, Stored),
+    ValueSz = iolist_size(Field),
 
     %% Setup io_list for writing -- avoid merging binaries if we can help it
     Bytes0 = [<<Tstamp:?TSTAMPFIELD>>, <<KeySz:?KEYSIZEFIELD>>,
-              <<ValueSz:?VALSIZEFIELD>>, Key, Value],
-    Bytes  = [<<(erlang:crc32(Bytes0)):?CRCSIZEFIELD>> | Bytes0],
+              <<ValueSz:?VALSIZEFIELD>>, Key, Field],
+    Bytes  = [<<(checksum(Checksum, Bytes0)):?CRCSIZEFIELD>> | Bytes0],
     %% Store the full entry in the data file
     try
+        ok = check_value_size(ValueSz),
         ok = bitcask_io:file_pwrite(FD, Offset, Bytes),
         %% Create and store the corresponding hint entry
         TotalSz = iolist_size(Bytes),
@@ -309,7 +478,7 @@ write(Filestate=#filestate{fd = FD, hintfd = HintFD,
                       true  -> 1;
                       false -> 0
                   end,
-        Iolist = hintfile_entry(Key, Tstamp, TombInt, Offset, TotalSz),
+        Iolist = hintfile_entry(Key, Tstamp, TombInt, Offset, TotalSz, Expiry),
         case HintFD of
             undefined ->
                 ok;
@@ -317,7 +486,7 @@ write(Filestate=#filestate{fd = FD, hintfd = HintFD,
                 ok = bitcask_io:file_write(HintFD, Iolist)
         end,
         %% Record our final offset
-        HintCRC = erlang:crc32(HintCRC0, Iolist), % compute crc of hint
+        HintCRC = checksum(Checksum, HintCRC0, Iolist), % compute crc of hint
         {ok, Filestate#filestate{ofs = Offset + TotalSz,
                                  hintcrc = HintCRC,
                                  l_ofs = Offset,
@@ -328,7 +497,49 @@ write(Filestate=#filestate{fd = FD, hintfd = HintFD,
             Error
     end.
 
+%% @doc The checksum of a data file whose entries can be copied as they
+%% are to another file of the same format, by bitcask_nifs:merge_copy/7.
+%% That takes one record per entry with nothing but the size in the value
+%% size field. undefined for the other formats.
+-spec copy_format(fresh | #filestate{}) -> crc32 | crc32c | undefined.
+copy_format(#filestate { block_size = 0, codecs = false,
+                         checksum = Checksum }) ->
+    Checksum;
+copy_format(_) ->
+    undefined.
+
+%% @doc Take in the entries bitcask_nifs:merge_copy/7 wrote to the file,
+%% which now ends at Offset, appending the hint records of the live ones.
+-spec copied(#filestate{}, integer(), binary()) ->
+        {ok, #filestate{}} | {error, term()}.
+copied(Filestate, Offset, <<>>) ->
+    {ok, Filestate#filestate { ofs = Offset }};
+copied(#filestate { hintfd = HintFD, hintcrc = HintCRC0,
+                    checksum = Checksum } = Filestate, Offset, Hints) ->
+    try
+        case HintFD of
+            undefined ->
+                ok;
+            _ ->
+                ok = bitcask_io:file_write(HintFD, Hints)
+        end,
+        {ok, Filestate#filestate { ofs = Offset,
+                                   hintcrc = checksum(Checksum, HintCRC0,
+                                                      Hints) }}
+    catch
+        error:{badmatch,Error} ->
+            Error
+    end.
+
 %% WARNING: We can only undo the last write.
+un_write(Filestate=#filestate{block_size = BlockSize,
+                              block = [{Key, _, _, _, Stored, Header} | Block],
+                              block_count = Count, block_bytes = Bytes})
+  when BlockSize > 0 ->
+    %% The entry never left the pending block
+    {ok, Filestate#filestate{block = Block, block_count = Count - 1,
+                             block_bytes = Bytes - size(Header) - size(Key) -
+                                 size(Stored)}};
 un_write(Filestate=#filestate{fd = FD, hintfd = HintFD,
                               l_ofs = LastOffset,
                               l_hbytes = LastHintBytes,
@@ -341,6 +552,136 @@ un_write(Filestate=#filestate{fd = FD, hintfd = HintFD,
     {ok, Filestate#filestate{ofs = LastOffset,
                              hintcrc = LastHintCRC}}.
 
+%% @doc Write out the block being filled, if any, and start a new one.
+%% The entries of a block only reach the disk with it, so a merge, whose
+%% keydir updates must not point other processes at data they cannot
+%% read yet, makes them from Commit. Entries Commit finds out of date are
+%% marked dead in the block so no fold or hint file brings them back.
+-spec seal(#filestate{}, commit_fun()) -> {ok, #filestate{}} | {error, term()}.
+seal(#filestate { block_count = 0 } = Filestate, _Commit) ->
+    {ok, Filestate};
+seal(#filestate { fd = FD, hintfd = HintFD, hintcrc = HintCRC0,
+                  checksum = Checksum, ofs = Offset } = Filestate, Commit) ->
+    Block = block_image(Filestate),
+    try
+        ok = bitcask_io:file_pwrite(FD, Offset, Block),
+        Entries = block_slots(Filestate),
+        Dead = Commit(Entries),
+        case Dead of
+            [] ->
+                ok;
+            _ ->
+                %% Same size, only the codecs change
+                ok = bitcask_io:file_pwrite(
+                       FD, Offset, block_image(mark_dead(Filestate, Dead)))
+        end,
+        Iolist = [hintfile_entry(Key, Tstamp, TombInt, Address, TotalSz,
+                                 Expiry) ||
+                     {Key, Tstamp, TombInt, Address, TotalSz, Expiry}
+                         <- Entries,
+                     not lists:member(Address, Dead)],
+        case HintFD of
+            undefined ->
+                ok;
+            _ ->
+                ok = bitcask_io:file_write(HintFD, Iolist)
+        end,
+        HintCRC = checksum(Checksum, HintCRC0, Iolist),
+        {ok, Filestate#filestate{ofs = Offset + iolist_size(Block),
+                                 hintcrc = HintCRC,
+                                 block = [], block_count = 0,
+                                 block_bytes = 0}}
+    catch
+        error:{badmatch,Error} ->
+            Error
+    end.
+
+no_commit(_Entries) ->
+    [].
+
+block_has_room(#filestate { block_count = 0 }, _Size) ->
+    true;
+block_has_room(#filestate { block_count = Count }, _Size)
+  when Count >= ?MAX_BLOCK_ENTRIES ->
+    false;
+block_has_room(#filestate { block_size = BlockSize, block_bytes = Bytes },
+               Size) ->
+    Bytes + ?MAX_BLOCK_ENTRY_HEADER + Size =< BlockSize.
+
+block_address(BlockOffset, Slot) ->
+    (BlockOffset bsl ?BLOCK_SLOT_BITS) bor Slot.
+
+block_image(#filestate { block = Block, block_count = Count,
+                         block_bytes = Bytes, block_tstamp = Base }) ->
+    Payload = lists:foldl(fun({Key, _, _, _, Stored, Header}, Acc) ->
+                                  [Header, Key, Stored | Acc]
+                          end, [], Block),
+    Body = [<<Bytes:32, Base:?TSTAMPFIELD, Count:16>> | Payload],
+    [<<(bitcask_nifs:crc32c(Body)):?CRCSIZEFIELD>> | Body].
+
+%% The entries of the block being filled as seal/2 hands them to Commit
+block_slots(#filestate { ofs = Offset, block = Block, block_count = Count }) ->
+    {_, Entries} =
+        lists:foldl(fun({Key, Tstamp, TombInt, Codec, Stored, Header},
+                        {Slot, Acc}) ->
+                            TotalSz = size(Header) + size(Key) + size(Stored),
+                            {Slot - 1, [{Key, Tstamp, TombInt,
+                                         block_address(Offset, Slot), TotalSz,
+                                         stored_expiry(Codec, Stored)}
+                                        | Acc]}
+                    end, {Count - 1, []}, Block),
+    Entries.
+
+mark_dead(#filestate { ofs = Offset, block = Block, block_count = Count,
+                       block_tstamp = Base } = Filestate, Dead) ->
+    {_, Block2} =
+        lists:foldl(fun({Key, Tstamp, TombInt, _, Stored, _} = Entry,
+                        {Slot, Acc}) ->
+                            case lists:member(block_address(Offset, Slot),
+                                              Dead) of
+                                true ->
+                                    Header = block_entry_header(
+                                               Tstamp - Base, size(Key),
+                                               size(Stored), ?CODEC_DEAD),
+                                    {Slot - 1, [{Key, Tstamp, TombInt,
+                                                 ?CODEC_DEAD, Stored, Header}
+                                                | Acc]};
+                                false ->
+                                    {Slot - 1, [Entry | Acc]}
+                            end
+                    end, {Count - 1, []}, Block),
+    Filestate#filestate { block = lists:reverse(Block2) }.
+
+block_entry_header(TstampDelta, KeySz, ValueSz, Codec) ->
+    true = (ValueSz =< ?MAXVALSIZE),
+    <<(varint(zigzag(TstampDelta)))/binary, (varint(KeySz))/binary,
+      (varint((ValueSz bsl ?CODECFIELD) bor Codec))/binary>>.
+
+decode_block_entry(Bytes0, Base) ->
+    {TstampDelta, Bytes1} = get_varint(Bytes0),
+    {KeySz, Bytes2} = get_varint(Bytes1),
+    {SizeField, Bytes3} = get_varint(Bytes2),
+    ValueSz = SizeField bsr ?CODECFIELD,
+    <<Key:KeySz/bytes, Stored:ValueSz/bytes, Rest/binary>> = Bytes3,
+    {Base + unzigzag(TstampDelta), Key, SizeField band 16#f, Stored, Rest}.
+
+varint(N) when N < 16#80 ->
+    <<N>>;
+varint(N) ->
+    <<1:1, (N band 16#7f):7, (varint(N bsr 7))/binary>>.
+
+get_varint(<<0:1, N:7, Rest/binary>>) ->
+    {N, Rest};
+get_varint(<<1:1, Low:7, Rest0/binary>>) ->
+    {High, Rest} = get_varint(Rest0),
+    {(High bsl 7) bor Low, Rest}.
+
+zigzag(N) when N >= 0 -> N bsl 1;
+zigzag(N)             -> ((-N) bsl 1) - 1.
+
+unzigzag(Z) when Z band 1 == 0 -> Z bsr 1;
+unzigzag(Z)                    -> -((Z + 1) bsr 1).
+
 %% @doc Given an Offset and Size, get the corresponding k/v from Filename.
 -spec read(Filename :: string() | #filestate{}, Offset :: integer(),
            Size :: integer()) ->
@@ -353,49 +694,273 @@ read(Filename, Offset, Size) when is_list(Filename) ->
         {error, Reason} ->
             {error, Reason}
     end;
-read(#filestate { fd = FD }, Offset, Size) ->
+read(#filestate { block_size = BlockSize } = Filestate, Offset, _Size)
+  when BlockSize > 0 ->
+    hd(read_slots(Filestate, [Offset]));
+read(#filestate { mmap = Map } = Filestate, Offset, Size)
+  when Map /= undefined ->
+    case bitcask_nifs:file_mmap_pread(Map, Offset, Size) of
+        {ok, Entry} ->
+            decode_entry(Entry, entry_format(Filestate));
+        eof ->
+            read(Filestate#filestate { mmap = undefined }, Offset, Size)
+    end;
+read(#filestate { fd = FD } = Filestate, Offset, Size) ->
     case bitcask_io:file_pread(FD, Offset, Size) of
-        {ok, <<Crc32:?CRCSIZEFIELD/unsigned, Bytes/binary>>} ->
-            %% Verify the CRC of the data
-            case erlang:crc32(Bytes) of
-                Crc32 ->
-                    %% Unpack the actual data
-                    <<_Tstamp:?TSTAMPFIELD,
-                     KeySz:?KEYSIZEFIELD, ValueSz:?VALSIZEFIELD,
-                     Key:KeySz/bytes, Value:ValueSz/bytes>> = Bytes,
-                    {ok, Key, Value};
-                _BadCrc ->
-                    {error, bad_crc}
-            end;
+        {ok, Entry} ->
+            decode_entry(Entry, entry_format(Filestate));
         eof ->
             {error, eof};
         {error, Reason} ->
             {error, Reason}
     end.
 
+%% @doc Read several entries from the same file. Locations must be sorted
+%% by offset. Entries lying close together are fetched with a single pread
+%% and split afterwards. Results are returned in the order of Locations.
+-spec read_many(#filestate{}, [{Offset :: integer(), Size :: integer()}]) ->
+        [{ok, Key :: binary(), Value :: binary()} |
+         {error, bad_crc} | {error, atom()}].
+read_many(#filestate { block_size = BlockSize } = Filestate, Locations)
+  when BlockSize > 0 ->
+    lists:append([read_slots(Filestate, Run) || Run <- block_runs(Locations)]);
+read_many(#filestate { mmap = Map } = Filestate, Locations)
+  when Map /= undefined ->
+    %% Nothing to save by coalescing reads from a mapping
+    [read(Filestate, Offset, Size) || {Offset, Size} <- Locations];
+read_many(Filestate, Locations) ->
+    lists:append([read_run(Filestate, Run) ||
+                      Run <- coalesce_reads(Locations)]).
+
+read_run(Filestate, [{Offset, Size}]) ->
+    [read(Filestate, Offset, Size)];
+read_run(#filestate { fd = FD } = Filestate, [{Start, _} | _] = Run) ->
+    End = lists:max([Offset + Size || {Offset, Size} <- Run]),
+    Format = entry_format(Filestate),
+    case bitcask_io:file_pread(FD, Start, End - Start) of
+        {ok, Bytes} ->
+            [split_run(Bytes, Offset - Start, Size, Format) ||
+                {Offset, Size} <- Run];
+        eof ->
+            [{error, eof} || _ <- Run];
+        {error, _} = Error ->
+            [Error || _ <- Run]
+    end.
+
+split_run(Bytes, Pos, Size, Format) when Pos + Size =< byte_size(Bytes) ->
+    %% Copy the entry out so the caller does not keep the whole run alive
+    decode_entry(binary:copy(binary:part(Bytes, Pos, Size)), Format);
+split_run(_Bytes, _Pos, _Size, _Format) ->
+    {error, eof}.
+
+%% Group sorted locations into runs that can be read with one pread.
+coalesce_reads([]) ->
+    [];
+coalesce_reads([{Offset, Size} = Loc | Rest]) ->
+    coalesce_reads(Rest, Offset, Offset + Size, [Loc], []).
+
+coalesce_reads([], _Start, _End, Run, Runs) ->
+    lists:reverse([lists:reverse(Run) | Runs]);
+coalesce_reads([{Offset, Size} = Loc | Rest], Start, End, Run, Runs)
+  when Offset - End =< ?READ_MANY_MAX_GAP,
+       Offset + Size - Start =< ?READ_MANY_MAX_SPAN ->
+    coalesce_reads(Rest, Start, max(End, Offset + Size), [Loc | Run], Runs);
+coalesce_reads([{Offset, Size} = Loc | Rest], _Start, _End, Run, Runs) ->
+    coalesce_reads(Rest, Offset, Offset + Size, [Loc],
+                   [lists:reverse(Run) | Runs]).
+
+%% Group sorted locations in a block file by the block they are in
+block_runs([]) ->
+    [];
+block_runs([{Address, _} | _] = Locations) ->
+    BlockOffset = Address bsr ?BLOCK_SLOT_BITS,
+    {Run, Rest} = lists:splitwith(
+                    fun({A, _}) -> A bsr ?BLOCK_SLOT_BITS == BlockOffset end,
+                    Locations),
+    [[A || {A, _} <- Run] | block_runs(Rest)].
+
+%% Read entries of the same block, given their addresses
+read_slots(#filestate { mode = read_write, ofs = Offset } = Filestate,
+           [Address | _] = Addresses)
+  when Address bsr ?BLOCK_SLOT_BITS == Offset ->
+    %% Still being filled
+    [pending_entry(Filestate, A band ?BLOCK_SLOT_MASK) || A <- Addresses];
+read_slots(#filestate { dict = Dict } = Filestate, [Address | _] = Addresses) ->
+    case read_block(Filestate, Address bsr ?BLOCK_SLOT_BITS) of
+        {ok, Base, Payload} ->
+            [block_entry(Payload, Base, A band ?BLOCK_SLOT_MASK, Dict) ||
+                A <- Addresses];
+        {error, _} = Error ->
+            [Error || _ <- Addresses]
+    end.
+
+pending_entry(#filestate { block = Block, block_count = Count, dict = Dict },
+              Slot) when Slot < Count ->
+    {Key, _, _, Codec, Stored, _} = lists:nth(Count - Slot, Block),
+    entry_result(Key, decode_value(Codec, Stored, Dict));
+pending_entry(_Filestate, _Slot) ->
+    {error, eof}.
+
+block_entry(<<>>, _Base, _Slot, _Dict) ->
+    {error, eof};
+block_entry(Payload, Base, 0, Dict) ->
+    {_Tstamp, Key, Codec, Stored, _Rest} = decode_block_entry(Payload, Base),
+    entry_result(Key, decode_value(Codec, Stored, Dict));
+block_entry(Payload, Base, Slot, Dict) ->
+    {_, _, _, _, Rest} = decode_block_entry(Payload, Base),
+    block_entry(Rest, Base, Slot - 1, Dict).
+
+entry_result(Key, {ok, Value}) ->
+    {ok, Key, Value};
+entry_result(_Key, error) ->
+    {error, bad_value}.
+
+%% Read the block at Offset, returning its base tstamp and payload once
+%% its CRC checks out
+read_block(#filestate { mmap = Map } = Filestate, Offset)
+  when Map /= undefined ->
+    case bitcask_nifs:file_mmap_pread(Map, Offset, ?BLOCK_HEADER_SIZE) of
+        {ok, <<_:?CRCSIZEFIELD, Len:32, _/binary>> = Header} ->
+            case bitcask_nifs:file_mmap_pread(Map, Offset + ?BLOCK_HEADER_SIZE,
+                                              Len) of
+                {ok, Payload} ->
+                    check_block(Header, Payload);
+                eof ->
+                    read_block(Filestate#filestate { mmap = undefined }, Offset)
+            end;
+        eof ->
+            read_block(Filestate#filestate { mmap = undefined }, Offset)
+    end;
+read_block(#filestate { fd = FD, block_size = BlockSize }, Offset) ->
+    case bitcask_io:file_pread(FD, Offset, ?BLOCK_HEADER_SIZE + BlockSize) of
+        {ok, <<Header:?BLOCK_HEADER_SIZE/bytes, Rest/binary>>} ->
+            <<_:?CRCSIZEFIELD, Len:32, _/binary>> = Header,
+            case Rest of
+                <<Payload:Len/bytes, _/binary>> ->
+                    check_block(Header, Payload);
+                _ ->
+                    %% Holds an entry larger than the block size
+                    case bitcask_io:file_pread(FD, Offset + ?BLOCK_HEADER_SIZE,
+                                               Len) of
+                        {ok, <<Payload:Len/bytes>>} ->
+                            check_block(Header, Payload);
+                        {error, _} = Error ->
+                            Error;
+                        _ ->
+                            {error, eof}
+                    end
+            end;
+        {error, _} = Error ->
+            Error;
+        _ ->
+            {error, eof}
+    end.
+
+check_block(<<Crc32:?CRCSIZEFIELD, Rest/binary>>, Payload) ->
+    case bitcask_nifs:crc32c([Rest, Payload]) of
+        Crc32 ->
+            <<_Len:32, Base:?TSTAMPFIELD, _Count:16>> = Rest,
+            {ok, Base, Payload};
+        _BadCrc ->
+            {error, bad_crc}
+    end.
+
+decode_entry(<<Crc32:?CRCSIZEFIELD/unsigned, Bytes/binary>>,
+             {Checksum, Codecs, Dict}) ->
+    %% Verify the CRC of the data
+    case checksum(Checksum, Bytes) of
+        Crc32 ->
+            %% Unpack the actual data
+            <<_Tstamp:?TSTAMPFIELD, KeySz:?KEYSIZEFIELD,
+              ValueSz:?VALSIZEFIELD, Rest/binary>> = Bytes,
+            <<Key:KeySz/bytes, Field:ValueSz/bytes>> = Rest,
+            {Codec, Stored} = split_value_field(Codecs, Field),
+            case decode_value(Codec, Stored, Dict) of
+                {ok, Value} ->
+                    {ok, Key, Value};
+                error ->
+                    {error, bad_value}
+            end;
+        _BadCrc ->
+            {error, bad_crc}
+    end.
+
 %% @doc Call the OS's fsync(2) system call on the cask and hint files.
--spec sync(#filestate{}) -> ok.
-sync(#filestate { mode = read_write, fd = Fd, hintfd = HintFd }) ->
+%% The block being filled is sealed first, so the next write starts a new
+%% one; as with a block filled by write/4, its keydir updates are up to
+%% the caller.
+-spec sync(#filestate{}) -> {ok, #filestate{}}.
+sync(#filestate { mode = read_write } = Filestate0) ->
+    {ok, #filestate { fd = Fd, hintfd = HintFd } = Filestate} =
+        seal(Filestate0, fun no_commit/1),
     ok = bitcask_io:file_sync(Fd),
-    ok = bitcask_io:file_sync(HintFd).
+    ok = bitcask_io:file_sync(HintFd),
+    {ok, Filestate}.
+
+%% @doc Flush the cask and hint files to stable storage with fdatasync(2)
+%% where available. Used to make a group of writes durable at once. Seals
+%% the block being filled like sync/1.
+-spec datasync(#filestate{}) -> {ok, #filestate{}} | {error, term()}.
+datasync(#filestate { mode = read_write } = Filestate0) ->
+    case seal(Filestate0, fun no_commit/1) of
+        {ok, #filestate { fd = Fd, hintfd = HintFd } = Filestate} ->
+            case bitcask_io:file_datasync(Fd) of
+                ok when HintFd == undefined ->
+                    {ok, Filestate};
+                ok ->
+                    case bitcask_io:file_datasync(HintFd) of
+                        ok -> {ok, Filestate};
+                        {error, _} = Error -> Error
+                    end;
+                {error, _} = Error ->
+                    Error
+            end;
+        {error, _} = Error ->
+            Error
+    end.
+
+-type fold_fun() ::
+        fun((binary(), binary(), integer(),
+             {list(), integer(), integer(), integer()}, any()) -> any()) |
+        fun((binary(), binary(), integer(), non_neg_integer(),
+             {list(), integer(), integer(), integer()}, any()) -> any()).
 
--spec fold(fresh | #filestate{},
-           fun((binary(), binary(), integer(),
-                {list(), integer(), integer(), integer()}, any()) -> any()),
-           any()) ->
+%% @doc Fold over the entries of a data file. Fun is called as
+%% Fun(Key, Value, Tstamp, PosInfo, Acc), or with the expiry time of the
+%% entry (0 if none) after Tstamp if it takes six arguments.
+-spec fold(fresh | #filestate{}, fold_fun(), any()) ->
         any() | {error, any()}.
 fold(fresh, _Fun, Acc) -> Acc;
-fold(#filestate { fd=Fd, filename=Filename, tstamp=FTStamp }, Fun, Acc0) ->
+fold(State, Fun, Acc) ->
+    fold_from(State, data_start(State), Fun, Acc).
+
+%% @doc Fold over the entries of a data file from the one at Start, which
+%% must be the offset of an entry.
+-spec fold_from(#filestate{}, integer(), fold_fun(), any()) ->
+        any() | {error, any()}.
+fold_from(State, Start, Fun, Acc0) when is_function(Fun, 5) ->
+    fold_from(State, Start,
+              fun(K, V, Tstamp, _Expiry, PosInfo, Acc) ->
+                      Fun(K, V, Tstamp, PosInfo, Acc)
+              end, Acc0);
+fold_from(#filestate { fd=Fd, filename=Filename, tstamp=FTStamp } = State,
+          Start, Fun, Acc0) ->
     %% TODO: Add some sort of check that this is a read-only file
-    ok = bitcask_io:file_seekbof(Fd),
-    case fold_file_loop(Fd, regular, fun fold_int_loop/5, Fun, Acc0,
-                        {Filename, FTStamp, 0, 0}) of
+    {ok, Start} = bitcask_io:file_position(Fd, Start),
+    case fold_file_loop(Fd, regular, data_fold_loop(State, values), Fun, Acc0,
+                        {Filename, FTStamp, Start, 0,
+                         entry_format(State)}) of
         {error, Reason} ->
             {error, Reason};
         Acc -> Acc
     end.
 
--type key_fold_fun() :: fun((binary(), integer(), {integer(), integer()}, any()) -> any()).
+%% Keys come as {tombstone, Key} for tombstones and as
+%% {expires, Expiry, Key} for values with an expiry time
+-type key_fold_fun() :: fun((binary() | {tombstone, binary()} |
+                             {expires, non_neg_integer(), binary()},
+                             integer(), {integer(), integer()}, any()) ->
+                                   any()).
 -type key_fold_mode() :: datafile | hintfile | default | recovery.
 -spec fold_keys(fresh | #filestate{}, key_fold_fun(), any()) ->
         any() | {error, any()}.
@@ -406,7 +971,7 @@ fold_keys(State, Fun, Acc) ->
 -spec fold_keys(fresh | #filestate{}, key_fold_fun(), any(), key_fold_mode()) ->
         any() | {error, any()}.
 fold_keys(State, Fun, Acc, datafile) ->
-    fold_keys_loop(State, 0, Fun, Acc);
+    fold_keys_loop(State, data_start(State), Fun, Acc);
 fold_keys(#filestate { fd = _Fd } = State, Fun, Acc, hintfile) ->
     fold_hintfile(State, Fun, Acc);
 fold_keys(State, Fun, Acc, Mode) ->
@@ -415,11 +980,11 @@ fold_keys(State, Fun, Acc, Mode) ->
 fold_keys(State, Fun, Acc, default, true) ->
     fold_hintfile(State, Fun, Acc);
 fold_keys(State, Fun, Acc, default, false) ->
-    fold_keys_loop(State, 0, Fun, Acc);
+    fold_keys_loop(State, data_start(State), Fun, Acc);
 fold_keys(State, Fun, Acc, recovery, true) ->
     fold_keys(State, Fun, Acc, recovery, true, has_valid_hintfile(State));
 fold_keys(State, Fun, Acc, recovery, false) ->
-    fold_keys_loop(State, 0, Fun, Acc).
+    fold_keys_loop(State, data_start(State), Fun, Acc).
 
 fold_keys(State, Fun, Acc, recovery, _, true) ->
     case fold_hintfile(State, Fun, Acc) of
@@ -429,7 +994,7 @@ fold_keys(State, Fun, Acc, recovery, _, true) ->
             HintFile = hintfile_name(State),
             error_logger:warning_msg("Hintfile '~s' failed fold: ~p\n",
                                      [HintFile, Reason]),
-            fold_keys_loop(State, 0, Fun, Acc);
+            fold_keys_loop(State, data_start(State), Fun, Acc);
         Acc1 ->
             Acc1
     end;
@@ -437,7 +1002,75 @@ fold_keys(State, Fun, Acc, recovery, _, false) ->
     HintFile = hintfile_name(State),
     error_logger:warning_msg("Hintfile '~s' invalid\n",
                              [HintFile]),
-    fold_keys_loop(State, 0, Fun, Acc).
+    fold_keys_loop(State, data_start(State), Fun, Acc).
+
+%% @doc Load the hint file of a data file directly into a keydir with the
+%% native loader. The keydir is left untouched when an error is returned
+%% (no hint file, bad CRC, ...), so callers can fall back to a recovery
+%% mode fold_keys/4.
+-spec load_hintfile(#filestate{}, reference()) -> ok | {error, term()}.
+load_hintfile(#filestate { filename = Filename, tstamp = FileTstamp } = State,
+              Keydir) ->
+    HintFile = hintfile_name(State),
+    case read_file_info(Filename) of
+        {ok, DataI} ->
+            DataSize = address_limit(State, DataI#file_info.size),
+            case bitcask_nifs:keydir_load_hintfile(Keydir, HintFile,
+                                                   FileTstamp, DataSize) of
+                ok ->
+                    ok;
+                {trunc_hintfile, Offset, TotalSz} ->
+                    error_logger:warning_msg("Hintfile '~s' contains pointer ~p ~p "
+                                             "that is greater than total data size ~p\n",
+                                             [HintFile, Offset, TotalSz, DataSize]),
+                    ok;
+                {error, _} = Error ->
+                    Error
+            end;
+        {error, _} = Error ->
+            Error
+    end.
+
+%% @doc Load the hint files of several data files into the keydir, in
+%% order, using up to Threads threads. Returns the outcome of each file:
+%% ok, {error, Reason} for the first one that could not be loaded, and
+%% not_loaded for the ones after it.
+-spec load_hintfiles([#filestate{}], reference(), pos_integer()) ->
+          [ok | {error, term()} | not_loaded] | {error, term()}.
+load_hintfiles(Files, Keydir, Threads) ->
+    Specs = [hintfile_spec(File) || File <- Files],
+    {Loadable, Rest} = lists:splitwith(fun({_, _, _}) -> true;
+                                          ({error, _}) -> false
+                                       end, Specs),
+    case bitcask_nifs:keydir_load_hintfiles(Keydir, Loadable, Threads) of
+        {error, _} = Error ->
+            Error;
+        Results ->
+            Loaded = lists:zipwith(fun hintfile_result/2, Loadable, Results),
+            case Rest of
+                [] ->
+                    Loaded;
+                [Error | NotLoaded] ->
+                    Loaded ++ [Error | [not_loaded || _ <- NotLoaded]]
+            end
+    end.
+
+hintfile_spec(#filestate { filename = Filename, tstamp = FileTstamp } = State) ->
+    case read_file_info(Filename) of
+        {ok, DataI} ->
+            {hintfile_name(State), FileTstamp,
+             address_limit(State, DataI#file_info.size)};
+        {error, _} = Error ->
+            Error
+    end.
+
+hintfile_result({HintFile, _FileId, DataSize}, {trunc_hintfile, Offset, TotalSz}) ->
+    error_logger:warning_msg("Hintfile '~s' contains pointer ~p ~p "
+                             "that is greater than total data size ~p\n",
+                             [HintFile, Offset, TotalSz, DataSize]),
+    ok;
+hintfile_result(_Spec, Result) ->
+    Result.
 
 -spec mk_filename(string(), integer()) -> string().
 mk_filename(Dirname, Tstamp) ->
@@ -460,14 +1093,157 @@ file_tstamp(#filestate{tstamp=Tstamp}) ->
 file_tstamp(Filename) when is_list(Filename) ->
     list_to_integer(filename:basename(Filename, ".bitcask.data")).
 
+%% @doc List the compression dictionaries of a cask directory as
+%% {Id, Filename}, oldest first.
+-spec dict_files(string()) -> [{pos_integer(), string()}].
+dict_files(Dirname) ->
+    case list_dir(Dirname) of
+        {ok, Files} ->
+            lists:sort(
+              [{list_to_integer(Id), filename:join(Dirname, F)} ||
+                  F <- Files,
+                  ["bitcask", "dict", Id] <- [string:tokens(F, ".")],
+                  lists:all(fun(C) -> C >= $0 andalso C =< $9 end, Id)]);
+        _ ->
+            []
+    end.
+
+dict_filename(Dirname, Id) ->
+    filename:join(Dirname, "bitcask.dict." ++ integer_to_list(Id)).
+
+%% @doc Store a trained dictionary as the newest one of a cask directory.
+%% Files created from then on compress their values against it.
+-spec write_dict(string(), pos_integer(), binary()) -> ok | {error, term()}.
+write_dict(Dirname, Id, Dict) ->
+    Filename = dict_filename(Dirname, Id),
+    TmpFilename = Filename ++ ".tmp",
+    case file:write_file(TmpFilename, Dict, [raw, sync]) of
+        ok ->
+            file:rename(TmpFilename, Filename);
+        {error, _} = Error ->
+            _ = file:delete(TmpFilename),
+            Error
+    end.
+
+%% Load the newest dictionary of a directory to compress a new file with
+newest_dict(Dirname) ->
+    case lists:reverse(dict_files(Dirname)) of
+        [{Id, Filename} | _] ->
+            case bitcask_nifs:zstd_dict_open(Filename) of
+                {ok, Dict} ->
+                    {Id, Dict};
+                {error, Reason} ->
+                    error_logger:error_msg("Failed to load compression "
+                                           "dictionary ~s: ~p\n",
+                                           [Filename, Reason]),
+                    undefined
+            end;
+        [] ->
+            undefined
+    end.
+
+%% Load the dictionary named by the header of a data file. Values
+%% compressed against it read as bad_value if it cannot be loaded.
+open_dict(_Filename, 0) ->
+    undefined;
+open_dict(Filename, Id) ->
+    DictFilename = dict_filename(filename:dirname(Filename), Id),
+    case bitcask_nifs:zstd_dict_open(DictFilename) of
+        {ok, Dict} ->
+            Dict;
+        {error, Reason} ->
+            error_logger:error_msg("Failed to load compression dictionary "
+                                   "~s for ~s: ~p\n",
+                                   [DictFilename, Filename, Reason]),
+            undefined
+    end.
+
+%% @doc Return the live values stored in the first MaxBytes of a data file,
+%% uncompressed, to train a dictionary with.
+-spec sample_values(#filestate{}, pos_integer()) -> [binary()].
+sample_values(#filestate { fd = FD, filename = Filename,
+                           tstamp = FTStamp } = State, MaxBytes) ->
+    Start = data_start(State),
+    case bitcask_io:file_pread(FD, Start, MaxBytes) of
+        {ok, Bytes} ->
+            Fun = fun(_K, V, _Tstamp, _Expiry, _PosInfo, Acc) ->
+                          case bitcask:is_tombstone(V) of
+                              true  -> Acc;
+                              false -> [V | Acc]
+                          end
+                  end,
+            Args = {Filename, FTStamp, Start, 0, entry_format(State)},
+            FoldFn = data_fold_loop(State, values),
+            case FoldFn(Bytes, Fun, [], 0, Args) of
+                {more, Acc, _, _} -> Acc;
+                {done, Acc}       -> Acc
+            end;
+        _ ->
+            []
+    end.
+
+%% @doc Delete the dictionaries of a directory that no data file refers to
+%% any more, except the newest one.
+-spec delete_unused_dicts(string()) -> ok.
+delete_unused_dicts(Dirname) ->
+    case dict_files(Dirname) of
+        [] ->
+            ok;
+        Dicts ->
+            %% Hold the create lock so no file is being created with a
+            %% dictionary we are about to find unused
+            case catch get_create_lock(Dirname) of
+                {ok, Lock} ->
+                    try
+                        Used = [file_dict_id(F) ||
+                                   {_, F} <- data_file_tstamps(Dirname)],
+                        delete_unused_dicts(Dicts, Used)
+                    after
+                        bitcask_lockops:release(Lock)
+                    end;
+                _ ->
+                    %% Try again at the next merge
+                    ok
+            end
+    end.
+
+delete_unused_dicts(Dicts, Used) ->
+    case lists:member(unknown, Used) of
+        true ->
+            ok;
+        false ->
+            {Newest, _} = lists:last(Dicts),
+            _ = [file:delete(F) || {Id, F} <- Dicts, Id /= Newest,
+                                   not lists:member(Id, Used)],
+            ok
+    end.
+
+file_dict_id(Filename) ->
+    case bitcask_io:file_open(Filename, [readonly]) of
+        {ok, FD} ->
+            {_, _, DictId, _} = file_format(FD),
+            bitcask_io:file_close(FD),
+            DictId;
+        {error, enoent} ->
+            %% Deleted since the directory was listed
+            0;
+        {error, _} ->
+            unknown
+    end.
+
 -spec check_write(fresh | #filestate{}, binary(), non_neg_integer(), integer()) ->
       fresh | wrap | ok.
 check_write(fresh, _Key, _ValSize, _MaxSize) ->
     %% for the very first write, special-case
     fresh;
-check_write(#filestate { ofs = Offset }, Key, ValSize, MaxSize) ->
+check_write(#filestate { ofs = Offset, block_bytes = BlockBytes }, Key,
+            ValSize, MaxSize) ->
     Size = ?HEADER_SIZE + size(Key) + ValSize,
-    case (Offset + Size) > MaxSize of
+    Pending = case BlockBytes of
+                  0 -> 0;
+                  _ -> ?BLOCK_HEADER_SIZE + BlockBytes
+              end,
+    case (Offset + Pending + Size) > MaxSize of
         true ->
             wrap;
         false ->
@@ -486,7 +1262,12 @@ has_valid_hintfile(State) ->
             try
                 {ok, HintI} = read_file_info(HintFile),
                 HintSize = HintI#file_info.size,
-                hintfile_validate_loop(HintFd, 0, HintSize)
+                case hintfile_checksum(HintFd, HintSize) of
+                    error ->
+                        false;
+                    Checksum ->
+                        hintfile_validate_loop(HintFd, Checksum, 0, HintSize)
+                end
             after
                 bitcask_io:file_close(HintFd)
             end;
@@ -494,7 +1275,25 @@ has_valid_hintfile(State) ->
             false
     end.
 
-hintfile_validate_loop(Fd, CRC0, Rem) ->
+%% The CRC record at the end tells which checksum the file uses
+hintfile_checksum(Fd, HintSize) when HintSize >= ?HINT_RECORD_SZ ->
+    case bitcask_io:file_pread(Fd, HintSize - ?HINT_RECORD_SZ,
+                               ?HINT_RECORD_SZ) of
+        {ok, Bytes} ->
+            case decode_crc(Bytes) of
+                {Checksum, _} ->
+                    {ok, 0} = bitcask_io:file_position(Fd, 0),
+                    Checksum;
+                error ->
+                    error
+            end;
+        _ ->
+            error
+    end;
+hintfile_checksum(_Fd, _HintSize) ->
+    error.
+
+hintfile_validate_loop(Fd, Checksum, CRC0, Rem) ->
     {ReadLen, HasCRC} =
         case Rem =< ?CHUNK_SIZE of
             true ->
@@ -512,12 +1311,12 @@ hintfile_validate_loop(Fd, CRC0, Rem) ->
         {ok, Bytes} ->
             case HasCRC of
                 true ->
-                    ExpectCRC = read_crc(Fd),
-                    CRC = erlang:crc32(CRC0, Bytes),
-                    ExpectCRC =:= CRC;
+                    Expect = read_crc(Fd),
+                    CRC = checksum(Checksum, CRC0, Bytes),
+                    Expect =:= {Checksum, CRC};
                 false ->
-                    hintfile_validate_loop(Fd,
-                                           erlang:crc32(CRC0, Bytes),
+                    hintfile_validate_loop(Fd, Checksum,
+                                           checksum(Checksum, CRC0, Bytes),
                                            Rem - ReadLen);
                 error ->
                     false
@@ -527,103 +1326,368 @@ hintfile_validate_loop(Fd, CRC0, Rem) ->
 
 read_crc(Fd) ->
     case bitcask_io:file_read(Fd, ?HINT_RECORD_SZ) of
-        {ok, <<0:?TSTAMPFIELD,
-               0:?KEYSIZEFIELD,
-               ExpectCRC:?TOTALSIZEFIELD,
-               _TombInt:?TOMBSTONEFIELD_V2,
-               (?MAXOFFSET_V2):?OFFSETFIELD_V2>>} ->
-            ExpectCRC;
+        {ok, Bytes} ->
+            decode_crc(Bytes);
         _ -> error
     end.
 
+decode_crc(<<?HINT_CRC32_TSTAMP:?TSTAMPFIELD,
+             0:?KEYSIZEFIELD,
+             ExpectCRC:?TOTALSIZEFIELD,
+             _TombInt:?TOMBSTONEFIELD_V2,
+             (?MAXOFFSET_V2):?OFFSETFIELD_V2>>) ->
+    {crc32, ExpectCRC};
+decode_crc(<<?HINT_CRC32C_TSTAMP:?TSTAMPFIELD,
+             0:?KEYSIZEFIELD,
+             ExpectCRC:?TOTALSIZEFIELD,
+             _TombInt:?TOMBSTONEFIELD_V2,
+             (?MAXOFFSET_V2):?OFFSETFIELD_V2>>) ->
+    {crc32c, ExpectCRC};
+decode_crc(_) ->
+    error.
+
+hint_crc_tstamp(crc32) -> ?HINT_CRC32_TSTAMP;
+hint_crc_tstamp(crc32c) -> ?HINT_CRC32C_TSTAMP.
+
+checksum(crc32, Data) -> erlang:crc32(Data);
+checksum(crc32c, Data) -> bitcask_nifs:crc32c(Data).
+
+checksum(crc32, CRC, Data) -> erlang:crc32(CRC, Data);
+checksum(crc32c, CRC, Data) -> bitcask_nifs:crc32c(CRC, Data).
+
+%% Returns the checksum used by an open data file, whether its value
+%% size fields carry a codec, the id of its zstd dictionary (0 if none)
+%% and its block size (0 if not in blocks), from its header
+file_format(FD) ->
+    case bitcask_io:file_pread(FD, 0, ?BLOCK_FILE_HEADER_SIZE) of
+        {ok, <<Header:?CRC32C_FILE_HEADER_SIZE/binary, Rest/binary>>} ->
+            header_format(Header, Rest);
+        _ ->
+            {crc32, false, 0, 0}
+    end.
+
+header_format(?CRC32C_FILE_HEADER, _) ->
+    {crc32c, false, 0, 0};
+header_format(?CODEC_FILE_HEADER, _) ->
+    {crc32c, true, 0, 0};
+header_format(?DICT_FILE_HEADER, <<DictId:32, _/binary>>) ->
+    {crc32c, true, DictId, 0};
+header_format(?BLOCK_FILE_HEADER, <<BlockSize:32, DictId:32>>) ->
+    {crc32c, true, DictId, BlockSize};
+header_format(_, _) ->
+    {crc32, false, 0, 0}.
+
+write_file_header(#filestate { fd = FD, block_size = BlockSize,
+                               dict_id = DictId }) when BlockSize > 0 ->
+    ok = bitcask_io:file_pwrite(FD, 0, [?BLOCK_FILE_HEADER,
+                                        <<BlockSize:32, DictId:32>>]),
+    ?BLOCK_FILE_HEADER_SIZE;
+write_file_header(#filestate { checksum = crc32 }) ->
+    0;
+write_file_header(#filestate { fd = FD, codecs = false }) ->
+    ok = bitcask_io:file_pwrite(FD, 0, ?CRC32C_FILE_HEADER),
+    ?CRC32C_FILE_HEADER_SIZE;
+write_file_header(#filestate { fd = FD, dict_id = 0 }) ->
+    ok = bitcask_io:file_pwrite(FD, 0, ?CODEC_FILE_HEADER),
+    ?CRC32C_FILE_HEADER_SIZE;
+write_file_header(#filestate { fd = FD, dict_id = DictId }) ->
+    ok = bitcask_io:file_pwrite(FD, 0, [?DICT_FILE_HEADER, <<DictId:32>>]),
+    ?DICT_FILE_HEADER_SIZE.
+
+%% Offset of the first entry of a data file
+data_start(#filestate { block_size = BlockSize }) when BlockSize > 0 ->
+    ?BLOCK_FILE_HEADER_SIZE;
+data_start(#filestate { checksum = crc32 }) -> 0;
+data_start(#filestate { dict_id = 0 }) -> ?CRC32C_FILE_HEADER_SIZE;
+data_start(#filestate {}) -> ?DICT_FILE_HEADER_SIZE.
+
+entry_format(#filestate { checksum = Checksum, codecs = Codecs, dict = Dict }) ->
+    {Checksum, Codecs, Dict}.
+
+%% A value with an expiry time is stored after it, flagged in the codec
+encode_value(Filestate, Value, 0) ->
+    encode_value(Filestate, Value);
+encode_value(Filestate, Value, Expiry) ->
+    {Codec, Stored} = encode_value(Filestate, Value),
+    {Codec bor ?CODEC_EXPIRES, <<Expiry:?EXPIRYFIELD, Stored/binary>>}.
+
+encode_value(#filestate { compression = none }, Value) ->
+    {?CODEC_NONE, Value};
+encode_value(_Filestate, Value) when byte_size(Value) < ?MIN_COMPRESS_SIZE ->
+    {?CODEC_NONE, Value};
+encode_value(#filestate { compression = zstd_dict, dict = Dict }, Value) ->
+    case bitcask_nifs:compress_dict(Dict, Value) of
+        {ok, Compressed} ->
+            {?CODEC_ZSTD_DICT, Compressed};
+        uncompressible ->
+            {?CODEC_NONE, Value}
+    end;
+encode_value(#filestate { compression = Compression }, Value) ->
+    case bitcask_nifs:compress(Compression, Value) of
+        {ok, Compressed} ->
+            {codec_id(Compression), Compressed};
+        uncompressible ->
+            {?CODEC_NONE, Value}
+    end.
+
+decode_value(?CODEC_NONE, Value, _Dict) ->
+    {ok, Value};
+decode_value(Codec, <<_Expiry:?EXPIRYFIELD, Stored/binary>>, Dict)
+  when Codec band ?CODEC_EXPIRES /= 0, Codec /= ?CODEC_DEAD ->
+    decode_value(Codec band ?CODEC_BASE_MASK, Stored, Dict);
+decode_value(?CODEC_ZSTD_DICT, _Stored, undefined) ->
+    %% The file's dictionary is missing
+    error;
+decode_value(?CODEC_ZSTD_DICT, Stored, Dict) ->
+    bitcask_nifs:decompress_dict(Dict, Stored);
+decode_value(Codec, Stored, _Dict) ->
+    case codec_name(Codec) of
+        undefined ->
+            error;
+        Name ->
+            bitcask_nifs:decompress(Name, Stored)
+    end.
+
+codec_id(lz4)  -> ?CODEC_LZ4;
+codec_id(zstd) -> ?CODEC_ZSTD.
+
+codec_name(?CODEC_LZ4)  -> lz4;
+codec_name(?CODEC_ZSTD) -> zstd;
+codec_name(_)           -> undefined.
+
+%% The expiry time a value was stored with, 0 if none
+stored_expiry(?CODEC_DEAD, _Stored) ->
+    0;
+stored_expiry(Codec, <<Expiry:?EXPIRYFIELD, _/binary>>)
+  when Codec band ?CODEC_EXPIRES /= 0 ->
+    Expiry;
+stored_expiry(_Codec, _Stored) ->
+    0.
+
+%% What a key fold hands its fun for an entry. Tombstones are never
+%% compressed and never expire.
+key_plus(Key, ?CODEC_NONE, Stored) ->
+    case bitcask:is_tombstone(Stored) of
+        true  -> {tombstone, Key};
+        false -> Key
+    end;
+key_plus(Key, Codec, Stored) ->
+    case stored_expiry(Codec, Stored) of
+        0      -> Key;
+        Expiry -> {expires, Expiry, Key}
+    end.
+
+%% What follows the key in an entry of a data file that is not made of
+%% blocks: the value as stored, after its codec in a codec file
+value_field(#filestate { codecs = false }, ?CODEC_NONE, Stored) ->
+    Stored;
+value_field(#filestate { codecs = true }, Codec, Stored) ->
+    [<<Codec:?CODECBYTEFIELD>>, Stored].
+
+split_value_field(false, Field) ->
+    {?CODEC_NONE, Field};
+split_value_field(true, <<Codec:?CODECBYTEFIELD, Stored/binary>>) ->
+    {Codec, Stored};
+split_value_field(true, <<>>) ->
+    %% Only a corrupt entry has no codec, see decode_value/3
+    {?CODEC_DEAD, <<>>}.
+
+check_value_size(ValueSz) when ValueSz =< ?MAXVALSIZE ->
+    ok;
+check_value_size(_ValueSz) ->
+    {error, value_too_large}.
+
 
 %% ===================================================================
 %% Internal functions
 %% ===================================================================
 
-fold_int_loop(_Bytes, _Fun, Acc, _Consumed, {Filename, _, Offset, 20}) ->
+fold_int_loop(_Bytes, _Fun, Acc, _Consumed, {Filename, _, Offset, 20, _}) ->
     error_logger:error_msg("fold_loop: CRC error limit at file ~p offset ~p\n",
                            [Filename, Offset]),
     {done, Acc};
-fold_int_loop(<<Crc32:?CRCSIZEFIELD, Tstamp:?TSTAMPFIELD,
-                KeySz:?KEYSIZEFIELD, ValueSz:?VALSIZEFIELD,
-                Key:KeySz/bytes, Value:ValueSz/bytes, Rest/binary>>,
+fold_int_loop(<<Crc32:?CRCSIZEFIELD, Header:?ENTRY_HEADER_SIZE/bytes,
+                Rest0/binary>>,
               Fun, Acc0, Consumed0,
-              {Filename, FTStamp, Offset, CrcSkipCount}) ->
-    TotalSz = KeySz + ValueSz + ?HEADER_SIZE,
-    case erlang:crc32([<<Tstamp:?TSTAMPFIELD, KeySz:?KEYSIZEFIELD,
-                         ValueSz:?VALSIZEFIELD>>, Key, Value]) of
-        Crc32 ->
-            PosInfo = {Filename, FTStamp, Offset, TotalSz},
-            Acc = Fun(Key, Value, Tstamp, PosInfo, Acc0),
-            fold_int_loop(Rest, Fun, Acc, Consumed0 + TotalSz,
-                          {Filename, FTStamp, Offset + TotalSz,
-                           CrcSkipCount});
+              {Filename, FTStamp, Offset, CrcSkipCount,
+               {Checksum, Codecs, Dict} = Format} = Args) ->
+    <<Tstamp:?TSTAMPFIELD, KeySz:?KEYSIZEFIELD,
+      ValueSz:?VALSIZEFIELD>> = Header,
+    case Rest0 of
+        <<Key:KeySz/bytes, Field:ValueSz/bytes, Rest/binary>> ->
+            TotalSz = KeySz + ValueSz + ?HEADER_SIZE,
+            {Codec, Stored} = split_value_field(Codecs, Field),
+            Decoded = case checksum(Checksum, [Header, Key, Field]) of
+                          Crc32 -> decode_value(Codec, Stored, Dict);
+                          _     -> error
+                      end,
+            case Decoded of
+                {ok, Value} ->
+                    PosInfo = {Filename, FTStamp, Offset, TotalSz},
+                    Acc = Fun(Key, Value, Tstamp, stored_expiry(Codec, Stored),
+                              PosInfo, Acc0),
+                    fold_int_loop(Rest, Fun, Acc, Consumed0 + TotalSz,
+                                  {Filename, FTStamp, Offset + TotalSz,
+                                   CrcSkipCount, Format});
+                error ->
+                    error_logger:error_msg("fold_loop: CRC error at file ~s "
+                                           "offset ~p, skipping ~p bytes\n",
+                                           [Filename, Offset, TotalSz]),
+                    fold_int_loop(Rest, Fun, Acc0, Consumed0 + TotalSz,
+                                  {Filename, FTStamp, Offset + TotalSz,
+                                   CrcSkipCount + 1, Format})
+            end;
         _ ->
-            error_logger:error_msg("fold_loop: CRC error at file ~s offset ~p, "
-                                   "skipping ~p bytes\n",
-                                   [Filename, Offset, TotalSz]),
-            fold_int_loop(Rest, Fun, Acc0, Consumed0 + TotalSz,
-                          {Filename, FTStamp, Offset + TotalSz,
-                           CrcSkipCount + 1})
+            {more, Acc0, Consumed0, Args}
     end;
 fold_int_loop(_Bytes, _Fun, Acc, Consumed, Args) ->
     {more, Acc, Consumed, Args}.
 
-fold_keys_loop(#filestate{fd=Fd, filename=Filename, tstamp=FTStamp}, Offset,
-               Fun, Acc0) ->
+fold_keys_loop(#filestate{fd=Fd, filename=Filename, tstamp=FTStamp} = State,
+               Offset, Fun, Acc0) ->
     case bitcask_io:file_position(Fd, Offset) of
         {ok, Offset} -> ok;
         Other -> error(Other)
     end,
 
-    case fold_file_loop(Fd, regular, fun fold_keys_int_loop/5, Fun, Acc0,
-                        {Filename, FTStamp, Offset, 0}) of
+    case fold_file_loop(Fd, regular, data_fold_loop(State, keys), Fun, Acc0,
+                        {Filename, FTStamp, Offset, 0,
+                         entry_format(State)}) of
         {error, Reason} ->
             {error, Reason};
         Acc -> Acc
     end.
 
-fold_keys_int_loop(_Bytes, _Fun, Acc, _Consumed, {Filename, _, Offset, 20}) ->
+fold_keys_int_loop(_Bytes, _Fun, Acc, _Consumed, {Filename, _, Offset, 20, _}) ->
     error_logger:error_msg("fold_loop: CRC error limit at file ~p offset ~p\n",
                            [Filename, Offset]),
     {done, Acc};
-fold_keys_int_loop(<<Crc32:?CRCSIZEFIELD, Tstamp:?TSTAMPFIELD,
-                     KeySz:?KEYSIZEFIELD, ValueSz:?VALSIZEFIELD,
-                     Key:KeySz/bytes, Value:ValueSz/bytes, Rest/binary>>,
+fold_keys_int_loop(<<Crc32:?CRCSIZEFIELD, Header:?ENTRY_HEADER_SIZE/bytes,
+                     Rest0/binary>>,
                    Fun, Acc0, Consumed0,
-                   {Filename, FTStamp, Offset, CrcSkipCount}) ->
-    TotalSz = KeySz + ValueSz + ?HEADER_SIZE,
-    case erlang:crc32([<<Tstamp:?TSTAMPFIELD, KeySz:?KEYSIZEFIELD,
-                         ValueSz:?VALSIZEFIELD>>, Key, Value]) of
-        Crc32 ->
-            PosInfo = {Offset, TotalSz},
-            KeyPlus = case bitcask:is_tombstone(Value) of
-                          true  -> {tombstone, Key};
-                          false -> Key
-                      end,
-            Acc = Fun(KeyPlus, Tstamp, PosInfo, Acc0),
-            fold_keys_int_loop(Rest, Fun, Acc, Consumed0 + TotalSz,
-                               {Filename, FTStamp, Offset + TotalSz,
-                                CrcSkipCount});
+                   {Filename, FTStamp, Offset, CrcSkipCount,
+                    {Checksum, Codecs, _Dict} = Format} = Args) ->
+    <<Tstamp:?TSTAMPFIELD, KeySz:?KEYSIZEFIELD,
+      ValueSz:?VALSIZEFIELD>> = Header,
+    case Rest0 of
+        <<Key:KeySz/bytes, Field:ValueSz/bytes, Rest/binary>> ->
+            TotalSz = KeySz + ValueSz + ?HEADER_SIZE,
+            case checksum(Checksum, [Header, Key, Field]) of
+                Crc32 ->
+                    PosInfo = {Offset, TotalSz},
+                    {Codec, Stored} = split_value_field(Codecs, Field),
+                    Acc = Fun(key_plus(Key, Codec, Stored), Tstamp, PosInfo,
+                              Acc0),
+                    fold_keys_int_loop(Rest, Fun, Acc, Consumed0 + TotalSz,
+                                       {Filename, FTStamp, Offset + TotalSz,
+                                        CrcSkipCount, Format});
+                _ ->
+                    error_logger:error_msg("fold_loop: CRC error at file ~s "
+                                           "offset ~p, skipping ~p bytes\n",
+                                           [Filename, Offset, TotalSz]),
+                    fold_keys_int_loop(Rest, Fun, Acc0, Consumed0 + TotalSz,
+                                       {Filename, FTStamp, Offset + TotalSz,
+                                        CrcSkipCount + 1, Format})
+            end;
         _ ->
-            error_logger:error_msg("fold_loop: CRC error at file ~s offset ~p, "
-                                   "skipping ~p bytes\n",
-                                   [Filename, Offset, TotalSz]),
-            fold_keys_int_loop(Rest, Fun, Acc0, Consumed0 + TotalSz,
-                               {Filename, FTStamp, Offset + TotalSz,
-                                CrcSkipCount + 1})
+            {more, Acc0, Consumed0, Args}
     end;
 fold_keys_int_loop(_Bytes, _Fun, Acc, Consumed, Args) ->
     {more, Acc, Consumed, Args}.
 
+%% The fold_file_loop function parsing the entries of a data file
+data_fold_loop(#filestate { block_size = 0 }, values) ->
+    fun fold_int_loop/5;
+data_fold_loop(#filestate { block_size = 0 }, keys) ->
+    fun fold_keys_int_loop/5;
+data_fold_loop(#filestate {}, values) ->
+    fun fold_block_loop/5;
+data_fold_loop(#filestate {}, keys) ->
+    fun fold_keys_block_loop/5.
+
+fold_block_loop(Bytes, Fun, Acc, Consumed, Args) ->
+    fold_blocks(values, Bytes, Fun, Acc, Consumed, Args).
+
+fold_keys_block_loop(Bytes, Fun, Acc, Consumed, Args) ->
+    fold_blocks(keys, Bytes, Fun, Acc, Consumed, Args).
+
+fold_blocks(_Mode, _Bytes, _Fun, Acc, _Consumed,
+            {Filename, _, Offset, CrcSkipCount, _}) when CrcSkipCount >= 20 ->
+    error_logger:error_msg("fold_loop: CRC error limit at file ~p offset ~p\n",
+                           [Filename, Offset]),
+    {done, Acc};
+fold_blocks(Mode, <<Header:?BLOCK_HEADER_SIZE/bytes, Rest0/binary>>,
+            Fun, Acc0, Consumed0,
+            {Filename, FTStamp, Offset, CrcSkipCount, Format} = Args) ->
+    <<_:?CRCSIZEFIELD, Len:32, _/binary>> = Header,
+    case Rest0 of
+        <<Payload:Len/bytes, Rest/binary>> ->
+            Size = ?BLOCK_HEADER_SIZE + Len,
+            case check_block(Header, Payload) of
+                {ok, Base, _} ->
+                    {Acc, Errors} =
+                        fold_block_entries(Mode, Payload, Base,
+                                           block_address(Offset, 0),
+                                           Fun, Acc0, 0, Args),
+                    fold_blocks(Mode, Rest, Fun, Acc, Consumed0 + Size,
+                                {Filename, FTStamp, Offset + Size,
+                                 CrcSkipCount + Errors, Format});
+                {error, bad_crc} ->
+                    error_logger:error_msg("fold_loop: CRC error at file ~s "
+                                           "offset ~p, skipping ~p bytes\n",
+                                           [Filename, Offset, Size]),
+                    fold_blocks(Mode, Rest, Fun, Acc0, Consumed0 + Size,
+                                {Filename, FTStamp, Offset + Size,
+                                 CrcSkipCount + 1, Format})
+            end;
+        _ ->
+            {more, Acc0, Consumed0, Args}
+    end;
+fold_blocks(_Mode, _Bytes, _Fun, Acc, Consumed, Args) ->
+    {more, Acc, Consumed, Args}.
+
+fold_block_entries(_Mode, <<>>, _Base, _Address, _Fun, Acc, Errors, _Args) ->
+    {Acc, Errors};
+fold_block_entries(Mode, Payload, Base, Address, Fun, Acc0, Errors0, Args) ->
+    {Tstamp, Key, Codec, Stored, Rest} = decode_block_entry(Payload, Base),
+    TotalSz = byte_size(Payload) - byte_size(Rest),
+    {Acc, Errors} = fold_block_entry(Mode, Key, Tstamp, Codec, Stored,
+                                     {Address, TotalSz}, Fun, Acc0, Errors0,
+                                     Args),
+    fold_block_entries(Mode, Rest, Base, Address + 1, Fun, Acc, Errors, Args).
+
+fold_block_entry(_Mode, _Key, _Tstamp, ?CODEC_DEAD, _Stored, _Pos, _Fun, Acc,
+                 Errors, _Args) ->
+    {Acc, Errors};
+fold_block_entry(keys, Key, Tstamp, Codec, Stored, PosInfo, Fun, Acc, Errors,
+                 _Args) ->
+    {Fun(key_plus(Key, Codec, Stored), Tstamp, PosInfo, Acc), Errors};
+fold_block_entry(values, Key, Tstamp, Codec, Stored, {Address, TotalSz}, Fun,
+                 Acc, Errors, {Filename, FTStamp, _, _, {_, _, Dict}}) ->
+    case decode_value(Codec, Stored, Dict) of
+        {ok, Value} ->
+            PosInfo = {Filename, FTStamp, Address, TotalSz},
+            {Fun(Key, Value, Tstamp, stored_expiry(Codec, Stored), PosInfo,
+                 Acc), Errors};
+        error ->
+            error_logger:error_msg("fold_loop: bad value at file ~s "
+                                   "offset ~p\n", [Filename, Address]),
+            {Acc, Errors + 1}
+    end.
+
+%% Bound for offset + size of the entries of a data file of DataSize bytes
+address_limit(#filestate { block_size = 0 }, DataSize) ->
+    DataSize;
+address_limit(#filestate {}, DataSize) ->
+    DataSize bsl ?BLOCK_SLOT_BITS.
+
 fold_hintfile(State, Fun, Acc0) ->
     HintFile = hintfile_name(State),
     case bitcask_io:file_open(HintFile, [readonly, read_ahead]) of
         {ok, HintFd} ->
             try
                 {ok, DataI} = read_file_info(State#filestate.filename),
-                DataSize = DataI#file_info.size,
+                DataSize = address_limit(State, DataI#file_info.size),
                 case fold_file_loop(HintFd, hint, fun fold_hintfile_loop/5, Fun,
                                     Acc0, {DataSize, HintFile}) of
                     {error, Reason} ->
@@ -641,37 +1705,54 @@ fold_hintfile(State, Fun, Acc0) ->
 %% conditional end match here, checking that we get the expected CRC-containing
 %% hint record, three-tuple done indicates that we've exhausted all bytes, or
 %% it's an error
-fold_hintfile_loop(<<0:?TSTAMPFIELD, 0:?KEYSIZEFIELD,
+fold_hintfile_loop(<<CrcTstamp:?TSTAMPFIELD, 0:?KEYSIZEFIELD,
                      _ExpectCRC:?TOTALSIZEFIELD,
                      _TombInt:?TOMBSTONEFIELD_V2, (?MAXOFFSET_V2):?OFFSETFIELD_V2>>,
-                   _Fun, Acc, Consumed, _Args) ->
+                   _Fun, Acc, Consumed, _Args)
+  when CrcTstamp == ?HINT_CRC32_TSTAMP; CrcTstamp == ?HINT_CRC32C_TSTAMP ->
     {done, Acc, Consumed + ?HINT_RECORD_SZ};
 %% main work loop here, containing the full match of hint record and key.
 %% if it gets a match, it proceeds to recurse over the rest of the big
 %% binary
 fold_hintfile_loop(<<Tstamp:?TSTAMPFIELD, KeySz:?KEYSIZEFIELD,
                      TotalSz:?TOTALSIZEFIELD,
-                     TombInt:?TOMBSTONEFIELD_V2, Offset:?OFFSETFIELD_V2,
+                     TombInt:?TOMBSTONEFIELD_V2, 0:?EXPIRESFIELD,
+                     Offset:?OFFSETFIELD_V3,
                      Key:KeySz/bytes, Rest/binary>>,
-                   Fun, Acc0, Consumed0, {DataSize, HintFile} = Args) ->
+                   Fun, Acc0, Consumed0, Args) ->
+    fold_hint_record(Key, Tstamp, TombInt, Offset, TotalSz, 0,
+                     KeySz + ?HINT_RECORD_SZ + Consumed0, Rest, Fun, Acc0,
+                     Args);
+fold_hintfile_loop(<<Tstamp:?TSTAMPFIELD, KeySz:?KEYSIZEFIELD,
+                     TotalSz:?TOTALSIZEFIELD,
+                     TombInt:?TOMBSTONEFIELD_V2, 1:?EXPIRESFIELD,
+                     Offset:?OFFSETFIELD_V3,
+                     Key:KeySz/bytes, Expiry:?EXPIRYFIELD, Rest/binary>>,
+                   Fun, Acc0, Consumed0, Args) ->
+    fold_hint_record(Key, Tstamp, TombInt, Offset, TotalSz, Expiry,
+                     KeySz + ?HINT_RECORD_SZ + ?EXPIRYFIELD div 8 + Consumed0,
+                     Rest, Fun, Acc0, Args);
+%% catchall case where we don't get enough bytes from fold_file_loop
+fold_hintfile_loop(_Bytes, _Fun, Acc0, Consumed0, Args) ->
+    {more, Acc0, Consumed0, Args}.
+
+fold_hint_record(Key, Tstamp, TombInt, Offset, TotalSz, Expiry, Consumed,
+                 Rest, Fun, Acc0, {DataSize, HintFile} = Args) ->
     case Offset + TotalSz =< DataSize + 1 of
         true ->
             PosInfo = {Offset, TotalSz},
             KeyPlus = if TombInt == 1 -> {tombstone, Key};
+                         Expiry > 0   -> {expires, Expiry, Key};
                          true         -> Key
                       end,
             Acc = Fun(KeyPlus, Tstamp, PosInfo, Acc0),
-            Consumed = KeySz + ?HINT_RECORD_SZ + Consumed0,
             fold_hintfile_loop(Rest, Fun, Acc, Consumed, Args);
         false ->
             error_logger:warning_msg("Hintfile '~s' contains pointer ~p ~p "
                                      "that is greater than total data size ~p\n",
                                      [HintFile, Offset, TotalSz, DataSize]),
             {error, {trunc_hintfile, Acc0}}
-    end;
-%% catchall case where we don't get enough bytes from fold_file_loop
-fold_hintfile_loop(_Bytes, _Fun, Acc0, Consumed0, Args) ->
-    {more, Acc0, Consumed0, Args}.
+    end.
 
 
 %% @doc scaffolding for faster folds over large files.
@@ -778,9 +1859,17 @@ open_hint_file(Filename, FinalOpts, Count) ->
     end.
 
 hintfile_entry(Key, Tstamp, TombInt, Offset, TotalSz) ->
+    hintfile_entry(Key, Tstamp, TombInt, Offset, TotalSz, 0).
+
+hintfile_entry(Key, Tstamp, TombInt, Offset, TotalSz, 0) ->
+    KeySz = size(Key),
+    [<<Tstamp:?TSTAMPFIELD, KeySz:?KEYSIZEFIELD, TotalSz:?TOTALSIZEFIELD,
+       TombInt:?TOMBSTONEFIELD_V2, Offset:?OFFSETFIELD_V2>>, Key];
+hintfile_entry(Key, Tstamp, TombInt, Offset, TotalSz, Expiry) ->
     KeySz = size(Key),
     [<<Tstamp:?TSTAMPFIELD, KeySz:?KEYSIZEFIELD, TotalSz:?TOTALSIZEFIELD,
-       TombInt:?TOMBSTONEFIELD_V2, Offset:?OFFSETFIELD_V2>>, Key].
+       TombInt:?TOMBSTONEFIELD_V2, 1:?EXPIRESFIELD, Offset:?OFFSETFIELD_V3>>,
+     Key, <<Expiry:?EXPIRYFIELD>>].
 
 %% ===================================================================
 %% file/filelib avoidance code. Only needed for pre OTP-21 releases.
@@ -21,7 +21,7 @@
 %% -------------------------------------------------------------------
 -module(bitcask_io).
 
--export([file_open/2, file_close/1, file_sync/1,
+-export([file_open/2, file_close/1, file_sync/1, file_datasync/1,
          file_read/2, file_pread/3,
          file_write/2, file_pwrite/3,
          file_seekbof/1, file_position/2, file_truncate/1]).
@@ -47,6 +47,10 @@ file_sync(Ref) ->
     M = file_module(),
     M:file_sync(Ref).
 
+file_datasync(Ref) ->
+    M = file_module(),
+    M:file_datasync(Ref).
+
 file_pread(Ref, Offset, Size) ->
     M = file_module(),
     M:file_pread(Ref, Offset, Size).
@@ -25,7 +25,9 @@
          release/1,
          delete_stale_lock/2,
          read_activefile/2,
-         write_activefile/2]).
+         read_activefiles/2,
+         write_activefile/2,
+         write_activefiles/2]).
 
 -ifdef(PULSE).
 -compile({parse_transform, pulse_instrument}).
@@ -86,12 +88,45 @@ read_activefile(Type, Dirname) ->
             undefined
     end.
 
+%% @doc Read all the active filenames stored in a given lockfile. See
+%% write_activefiles/2.
+-spec read_activefiles(Type::lock_types(), Dirname::string()) -> [string()].
+read_activefiles(Type, Dirname) ->
+    LockFilename = lock_filename(Type, Dirname),
+    case bitcask_nifs:lock_acquire(LockFilename, 0) of
+        {ok, Lock} ->
+            try
+                case read_lock_data(Lock) of
+                    {ok, _Pid, undefined} ->
+                        [];
+                    {ok, _Pid, ActiveFile} ->
+                        [ActiveFile | read_more_activefiles(Lock)];
+                    _ ->
+                        []
+                end
+            after
+                bitcask_nifs:lock_release(Lock)
+            end;
+        {error, _Reason} ->
+            []
+    end.
+
 %% @doc Write a new active filename to an open lockfile.
 -spec write_activefile(reference(), string()) -> {ftruncate_error, integer()} | {pwrite_error, integer()} | ok | {error, lock_not_writable}.
 write_activefile(Lock, ActiveFilename) ->
     Contents = iolist_to_binary([os:getpid(), " ", ActiveFilename, "\n"]),
     bitcask_nifs:lock_writedata(Lock, Contents).
 
+%% @doc Write several active filenames to an open lockfile, one per line.
+%% read_activefile/2 only sees the first one.
+-spec write_activefiles(reference(), [string()]) -> {ftruncate_error, integer()} | {pwrite_error, integer()} | ok | {error, lock_not_writable}.
+write_activefiles(Lock, []) ->
+    bitcask_nifs:lock_writedata(Lock, iolist_to_binary([os:getpid(), " \n"]));
+write_activefiles(Lock, ActiveFilenames) ->
+    Contents = iolist_to_binary([os:getpid(), " ",
+                                 [[F, "\n"] || F <- ActiveFilenames]]),
+    bitcask_nifs:lock_writedata(Lock, Contents).
+
 delete_stale_lock(Type, Dirname) ->
     delete_stale_lock(lock_filename(Type,Dirname)).
 
@@ -118,6 +153,16 @@ read_lock_data(Lock) ->
             {error, Reason}
     end.
 
+%% The active filenames after the first one
+read_more_activefiles(Lock) ->
+    case bitcask_nifs:lock_readdata(Lock) of
+        {ok, Contents} ->
+            [_First | More] = re:split(Contents, "\n", [{return, list}, trim]),
+            More;
+        {error, _} ->
+            []
+    end.
+
 os_pid_exists(Pid) ->
     %% Use kill -0 trick to determine if a process exists. This _should_ be
     %% portable across all unix variants we are interested in.
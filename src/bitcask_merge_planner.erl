@@ -0,0 +1,299 @@
+%% -------------------------------------------------------------------
+%%
+%% bitcask: Eric Brewer-inspired key/value store
+%%
+%% Copyright (c) 2026 Basho Technologies, Inc. All Rights Reserved.
+%%
+%% This file is provided to you under the Apache License,
+%% Version 2.0 (the "License"); you may not use this file
+%% except in compliance with the License.  You may obtain
+%% a copy of the License at
+%%
+%%   http://www.apache.org/licenses/LICENSE-2.0
+%%
+%% Unless required by applicable law or agreed to in writing,
+%% software distributed under the License is distributed on an
+%% "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+%% KIND, either express or implied.  See the License for the
+%% specific language governing permissions and limitations
+%% under the License.
+%%
+%% -------------------------------------------------------------------
+
+%% @doc Picks the files a merge goes over within merge_io_budget.
+%%
+%% Merging a file costs reading all of it and writing its live bytes
+%% again, and gets back its dead bytes. The planner takes the candidate
+%% files by dead bytes per byte of I/O, older files first among equals,
+%% for as long as they fit in the budget. A file whose data all expired
+%% comes for free, as nothing of it is copied, and is always taken.
+%%
+%% simulate/2 replays fstats snapshots of a cask, taken while it was not
+%% merging, to compare how much a policy would have got back for how
+%% much I/O.
+-module(bitcask_merge_planner).
+
+-export([plan/3, cost/1, reclaim/2]).
+-export([policy/1, simulate/2, simulate_file/2]).
+
+-include("bitcask.hrl").
+
+-ifdef(TEST).
+-include_lib("eunit/include/eunit.hrl").
+-endif.
+
+%% As in bitcask_nifs:keydir_info/1: {FileId, LiveCount, TotalCount,
+%% LiveBytes, TotalBytes, OldestTstamp, NewestTstamp, ExpirationEpoch}
+-type fstats() :: {integer(), non_neg_integer(), non_neg_integer(),
+                   non_neg_integer(), non_neg_integer(), integer(), integer(),
+                   non_neg_integer()}.
+-type policy() :: fun(([#file_status{}]) -> [#file_status{}]).
+-export_type([policy/0]).
+
+%% @doc The Candidates worth merging within Budget bytes of I/O, in the
+%% order they came in. Files whose newest entry is older than
+%% ExpiryCutoff are taken whatever the budget. When no other file fits,
+%% the best one is taken anyway so that merges still get somewhere.
+-spec plan([#file_status{}], integer(), unlimited | non_neg_integer()) ->
+        [#file_status{}].
+plan(Candidates, _ExpiryCutoff, Budget) when not is_integer(Budget) ->
+    Candidates;
+plan(Candidates, ExpiryCutoff, Budget) ->
+    {Expired, Others} = lists:partition(fun(F) -> expired(F, ExpiryCutoff) end,
+                                        Candidates),
+    Ranked = [F || {_, _, F} <- lists:sort([{-score(F),
+                                              F#file_status.oldest_tstamp, F}
+                                             || F <- Others])],
+    Picked = case pick(Ranked, Budget, []) of
+                 [] when Ranked /= [] ->
+                     [hd(Ranked)];
+                 Picked0 ->
+                     Picked0
+             end,
+    [F || F <- Candidates, lists:member(F, Expired ++ Picked)].
+
+%% @doc Bytes of I/O merging F takes: reading it, and writing its live
+%% bytes out again.
+-spec cost(#file_status{}) -> non_neg_integer().
+cost(#file_status { total_bytes = Total, dead_bytes = Dead }) ->
+    Total + max(0, Total - Dead).
+
+%% @doc Bytes merging F gets back.
+-spec reclaim(#file_status{}, integer()) -> non_neg_integer().
+reclaim(#file_status { total_bytes = Total } = F, ExpiryCutoff) ->
+    case expired(F, ExpiryCutoff) of
+        true -> Total;
+        false -> max(0, F#file_status.dead_bytes)
+    end.
+
+%% @doc A policy to compare in simulate/2: {budget, Bytes} plans within
+%% Bytes of I/O out of the files with dead bytes, {threshold, Frag, Dead}
+%% takes the files at least Frag percent fragmented or with at least Dead
+%% dead bytes, as frag_threshold and dead_bytes_threshold do.
+-spec policy({budget, unlimited | non_neg_integer()} |
+             {threshold, non_neg_integer(), non_neg_integer()}) -> policy().
+policy({budget, Budget}) ->
+    fun(Summary) ->
+            plan([F || F <- Summary, F#file_status.dead_bytes > 0], 0, Budget)
+    end;
+policy({threshold, FragThreshold, DeadBytesThreshold}) ->
+    fun(Summary) ->
+            [F || F <- Summary,
+                  F#file_status.fragmented >= FragThreshold orelse
+                      F#file_status.dead_bytes >= DeadBytesThreshold]
+    end.
+
+%% @doc Replay Snapshots, the fstats of a cask in the order they were
+%% taken, through each of Policies. Before each snapshot the policy
+%% merges the files it picks; the live bytes of those move to an output
+%% file, which then loses the values the later snapshots have dying in
+%% the merged files. Returns the bytes each policy got back, the bytes
+%% of I/O that took, and how many merges and file merges it did.
+-spec simulate([[fstats()]], [{term(), policy()}]) ->
+        [{term(), [{atom(), non_neg_integer()}]}].
+simulate(Snapshots, Policies) ->
+    [{Name, simulate1(Snapshots, Policy)} || {Name, Policy} <- Policies].
+
+%% @doc simulate/2 on the snapshots in Filename, one list of fstats per
+%% term.
+-spec simulate_file(string(), [{term(), policy()}]) ->
+        [{term(), [{atom(), non_neg_integer()}]}] | {error, term()}.
+simulate_file(Filename, Policies) ->
+    case file:consult(Filename) of
+        {ok, Snapshots} ->
+            simulate(Snapshots, Policies);
+        Error ->
+            Error
+    end.
+
+%% ===================================================================
+%% Internal functions
+%% ===================================================================
+
+expired(#file_status { newest_tstamp = Newest }, ExpiryCutoff) ->
+    Newest < ExpiryCutoff.
+
+score(F) ->
+    reclaim(F, 0) / max(1, cost(F)).
+
+pick([], _Budget, Picked) ->
+    Picked;
+pick([F | Rest], Budget, Picked) ->
+    case cost(F) of
+        Cost when Cost =< Budget ->
+            pick(Rest, Budget - Cost, [F | Picked]);
+        _ ->
+            pick(Rest, Budget, Picked)
+    end.
+
+%% The simulated cask: files by name, each {LiveBytes, TotalBytes,
+%% OldestTstamp, NewestTstamp}, and where the values of merged files
+%% went.
+-record(sim, { files = [] :: [{string(), {integer(), integer(), integer(),
+                                          integer()}}],
+               moved = [] :: [{string(), string()}],
+               outputs = 0 :: non_neg_integer(),
+               reclaimed = 0 :: non_neg_integer(),
+               io = 0 :: non_neg_integer(),
+               merges = 0 :: non_neg_integer(),
+               merged_files = 0 :: non_neg_integer() }).
+
+simulate1(Snapshots, Policy) ->
+    {_, Sim} = lists:foldl(fun(Snapshot, {Prev, Sim0}) ->
+                                   Sim1 = sim_merge(Policy,
+                                                    sim_apply(Prev, Snapshot,
+                                                              Sim0)),
+                                   {Snapshot, Sim1}
+                           end, {[], #sim{}}, Snapshots),
+    [{reclaimed, Sim#sim.reclaimed}, {io, Sim#sim.io},
+     {merges, Sim#sim.merges}, {merged_files, Sim#sim.merged_files}].
+
+%% Carry what changed since the previous snapshot over to the files
+%% that hold the values now
+sim_apply(Prev, Snapshot, Sim) ->
+    lists:foldl(fun(Fstats, S) ->
+                        sim_apply1(lists:keyfind(element(1, Fstats), 1, Prev),
+                                   Fstats, S)
+                end, Sim, Snapshot).
+
+sim_apply1(false, {Id, _, _, Live, Total, Oldest, Newest, _},
+           #sim { files = Files } = Sim) ->
+    Name = integer_to_list(Id),
+    Sim#sim { files = lists:keystore(Name, 1, Files,
+                                     {Name, {Live, Total, Oldest, Newest}}) };
+sim_apply1({Id, _, _, PrevLive, PrevTotal, _, _, _},
+           {Id, _, _, Live, Total, _, Newest, _},
+           #sim { files = Files, moved = Moved } = Sim) ->
+    Name = integer_to_list(Id),
+    Holder = sim_holder(Name, Moved),
+    case lists:keyfind(Holder, 1, Files) of
+        {Holder, {HLive, HTotal, HOldest, HNewest}} ->
+            %% Tombstones appended to a merged file went away with it
+            HTotal2 = case Holder of
+                          Name -> HTotal + max(0, Total - PrevTotal);
+                          _ -> HTotal
+                      end,
+            HLive2 = max(0, HLive - max(0, PrevLive - Live)),
+            Sim#sim { files = lists:keystore(
+                                Holder, 1, Files,
+                                {Holder, {HLive2, HTotal2, HOldest,
+                                          max(HNewest, Newest)}}) };
+        false ->
+            Sim
+    end.
+
+sim_holder(Name, Moved) ->
+    case lists:keyfind(Name, 1, Moved) of
+        {Name, To} -> sim_holder(To, Moved);
+        false -> Name
+    end.
+
+sim_merge(Policy, #sim { files = Files } = Sim) ->
+    Summary = [#file_status { filename = Name,
+                              fragmented = sim_fragmented(Live, Total),
+                              dead_bytes = Total - Live,
+                              total_bytes = Total,
+                              oldest_tstamp = Oldest,
+                              newest_tstamp = Newest,
+                              expiration_epoch = 0 }
+               || {Name, {Live, Total, Oldest, Newest}} <- Files],
+    case Policy(Summary) of
+        [] ->
+            Sim;
+        Merge ->
+            Names = [F#file_status.filename || F <- Merge],
+            Live = lists:sum([F#file_status.total_bytes -
+                                  F#file_status.dead_bytes || F <- Merge]),
+            Out = "merged." ++ integer_to_list(Sim#sim.outputs),
+            Output = {Out, {Live, Live,
+                            lists:min([F#file_status.oldest_tstamp ||
+                                          F <- Merge]),
+                            lists:max([F#file_status.newest_tstamp ||
+                                          F <- Merge])}},
+            Sim#sim { files = [Output | [F || {Name, _} = F <- Files,
+                                              not lists:member(Name, Names)]],
+                      moved = [{Name, Out} || Name <- Names] ++ Sim#sim.moved,
+                      outputs = Sim#sim.outputs + 1,
+                      reclaimed = Sim#sim.reclaimed +
+                          lists:sum([reclaim(F, 0) || F <- Merge]),
+                      io = Sim#sim.io + lists:sum([cost(F) || F <- Merge]),
+                      merges = Sim#sim.merges + 1,
+                      merged_files = Sim#sim.merged_files + length(Merge) }
+    end.
+
+sim_fragmented(_Live, 0) ->
+    0;
+sim_fragmented(Live, Total) ->
+    trunc((1 - Live / Total) * 100).
+
+%% ===================================================================
+%% EUnit tests
+%% ===================================================================
+-ifdef(TEST).
+
+status(Name, Dead, Total, Newest) ->
+    #file_status { filename = Name, fragmented = 0, dead_bytes = Dead,
+                   total_bytes = Total, oldest_tstamp = 1,
+                   newest_tstamp = Newest, expiration_epoch = 0 }.
+
+plan_test() ->
+    A = status("1", 90, 100, 10),   % costs 110 for 90
+    B = status("2", 50, 100, 10),   % costs 150 for 50
+    C = status("3", 10, 1000, 10),  % costs 1990 for 10
+    D = status("4", 0, 500, 5),     % all expired
+    All = [A, B, C, D],
+    ?assertEqual(All, plan(All, 8, unlimited)),
+    ?assertEqual([A, B, D], plan(All, 8, 300)),
+    ?assertEqual([A, D], plan(All, 8, 200)),
+    ?assertEqual([A, B], plan(All, 0, 300)),
+    %% Nothing fits, the best goes anyway
+    ?assertEqual([A], plan([A, C], 0, 50)),
+    ?assertEqual([], plan([], 0, 50)).
+
+simulate_test() ->
+    %% Ten 1000 byte files; the first five lose most of their values
+    %% early, the rest lose a few of them at every snapshot
+    Snapshot = fun(N) ->
+                       [{Id, 0, 0,
+                         case Id =< 5 of
+                             true when N > 0 -> 100;
+                             true -> 1000;
+                             false -> max(0, 1000 - 50 * N)
+                         end, 1000, Id, Id, 0} || Id <- lists:seq(1, 10)]
+               end,
+    Snapshots = [Snapshot(N) || N <- lists:seq(0, 5)],
+    [{budget, Budget}, {threshold, Threshold}] =
+        simulate(Snapshots, [{budget, policy({budget, 2000})},
+                             {threshold, policy({threshold, 20, 100})}]),
+    %% On a budget the cheap files go first and the I/O stays within it
+    ?assert(proplists:get_value(io, Budget) =< 6 * 2000),
+    ?assert(proplists:get_value(reclaimed, Budget) >= 4500),
+    %% Going by thresholds gets back more, for far more I/O per byte
+    ?assert(proplists:get_value(io, Threshold) >
+                proplists:get_value(io, Budget)),
+    ?assert(proplists:get_value(reclaimed, Budget) /
+                proplists:get_value(io, Budget) >
+                proplists:get_value(reclaimed, Threshold) /
+                proplists:get_value(io, Threshold)).
+
+-endif.
@@ -0,0 +1,234 @@
+%% -------------------------------------------------------------------
+%%
+%% bitcask: Eric Brewer-inspired key/value store
+%%
+%% Copyright (c) 2026 Basho Technologies, Inc. All Rights Reserved.
+%%
+%% This file is provided to you under the Apache License,
+%% Version 2.0 (the "License"); you may not use this file
+%% except in compliance with the License.  You may obtain
+%% a copy of the License at
+%%
+%%   http://www.apache.org/licenses/LICENSE-2.0
+%%
+%% Unless required by applicable law or agreed to in writing,
+%% software distributed under the License is distributed on an
+%% "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+%% KIND, either express or implied.  See the License for the
+%% specific language governing permissions and limitations
+%% under the License.
+%%
+%% -------------------------------------------------------------------
+
+%% @doc Token bucket on the bytes a merge reads and writes.
+%%
+%% The bucket fills at merge_io_rate bytes per second and holds a tenth
+%% of a second worth of them, so the merge I/O comes in small bursts
+%% instead of saturating the disk. With merge_io_latency_target set, the
+%% rate also follows the foreground read latency the cask samples into
+%% the keydir: it halves whenever the mean latency over the last second
+%% is above the target and climbs back to merge_io_rate by an eighth of
+%% it each second it is not. Bytes and time spent waiting for tokens are
+%% added to the keydir, see bitcask_nifs:keydir_io_stats/1.
+-module(bitcask_merge_throttle).
+
+-export([new/2, share/2, charge/2, budget/2, finish/1]).
+
+-ifdef(TEST).
+-include_lib("eunit/include/eunit.hrl").
+-endif.
+
+%% How often the rate follows the read latency, and how often the bytes
+%% and time spent waiting are added to the keydir
+-define(ADAPT_USECS, 1000000).
+%% The bucket holds BURST_DIV-th of a second worth of tokens, but never
+%% less than MIN_BURST bytes
+-define(BURST_DIV, 10).
+-define(MIN_BURST, 65536).
+%% Adapting never takes the rate below MIN_RATE_DIV-th of merge_io_rate
+-define(MIN_RATE_DIV, 64).
+
+-record(throttle, { keydir :: reference(),
+                    max_rate :: pos_integer(),      % bytes per second
+                    rate :: pos_integer(),          % bytes per second
+                    tokens :: integer(),
+                    last :: integer(),              % usecs, monotonic
+                    latency_target :: undefined | pos_integer(), % usecs
+                    adapt_at :: integer(),          % usecs, monotonic
+                    reads :: {non_neg_integer(), non_neg_integer()},
+                    bytes = 0 :: non_neg_integer(), % not yet in the keydir
+                    waited = 0 :: non_neg_integer() % not yet in the keydir
+                  }).
+
+-type throttle() :: undefined | #throttle{}.
+-export_type([throttle/0]).
+
+%% @doc A throttle for the merge of the cask Keydir belongs to, or
+%% undefined when merge_io_rate is unlimited.
+-spec new([term()], reference()) -> throttle().
+new(Opts, Keydir) ->
+    case bitcask:get_opt(merge_io_rate, Opts) of
+        Rate when is_integer(Rate), Rate > 0 ->
+            Target = case bitcask:get_opt(merge_io_latency_target, Opts) of
+                         Ms when is_integer(Ms), Ms > 0 ->
+                             Ms * 1000;
+                         _ ->
+                             undefined
+                     end,
+            Now = now_usecs(),
+            #throttle { keydir = Keydir,
+                        max_rate = Rate,
+                        rate = Rate,
+                        tokens = burst(Rate),
+                        last = Now,
+                        latency_target = Target,
+                        adapt_at = Now + ?ADAPT_USECS,
+                        reads = read_stats(Keydir) };
+        _ ->
+            undefined
+    end.
+
+%% @doc The throttle for each of Workers processes merging at once, which
+%% together keep to the rate of Throttle.
+-spec share(throttle(), pos_integer()) -> throttle().
+share(undefined, _Workers) ->
+    undefined;
+share(#throttle { max_rate = MaxRate, rate = Rate } = Throttle, Workers) ->
+    Rate2 = max(1, Rate div Workers),
+    Throttle#throttle { max_rate = max(1, MaxRate div Workers),
+                        rate = Rate2,
+                        tokens = burst(Rate2) }.
+
+%% @doc Take Bytes of I/O from the bucket, waiting for them if needed.
+-spec charge(non_neg_integer(), throttle()) -> throttle().
+charge(_Bytes, undefined) ->
+    undefined;
+charge(Bytes, #throttle { bytes = Charged } = Throttle) ->
+    Now = now_usecs(),
+    Throttle2 = maybe_adapt(Now, refill(Now, Throttle)),
+    Tokens = Throttle2#throttle.tokens - Bytes,
+    Throttle3 = Throttle2#throttle { tokens = Tokens, bytes = Charged + Bytes },
+    case Tokens < 0 of
+        true ->
+            wait(-Tokens * 1000000 div Throttle3#throttle.rate, Now,
+                 Throttle3);
+        false ->
+            Throttle3
+    end.
+
+%% @doc Bytes to do at once, out of Default: no more than the bucket
+%% holds.
+-spec budget(throttle(), pos_integer()) -> pos_integer().
+budget(undefined, Default) ->
+    Default;
+budget(#throttle { rate = Rate }, Default) ->
+    min(Default, burst(Rate)).
+
+%% @doc Add what is left of the bytes and time spent waiting to the
+%% keydir.
+-spec finish(throttle()) -> ok.
+finish(undefined) ->
+    ok;
+finish(Throttle) ->
+    _ = report(Throttle),
+    ok.
+
+%% ===================================================================
+%% Internal functions
+%% ===================================================================
+
+now_usecs() ->
+    erlang:monotonic_time(microsecond).
+
+burst(Rate) ->
+    max(?MIN_BURST, Rate div ?BURST_DIV).
+
+refill(Now, #throttle { rate = Rate, tokens = Tokens, last = Last } = Throttle) ->
+    Tokens2 = min(burst(Rate), Tokens + (Now - Last) * Rate div 1000000),
+    Throttle#throttle { tokens = Tokens2, last = Now }.
+
+wait(Usecs, Start, #throttle { waited = Waited } = Throttle) ->
+    timer:sleep((Usecs + 999) div 1000),
+    Now = now_usecs(),
+    refill(Now, Throttle#throttle { waited = Waited + (Now - Start) }).
+
+maybe_adapt(Now, #throttle { adapt_at = AdaptAt } = Throttle)
+  when Now < AdaptAt ->
+    Throttle;
+maybe_adapt(Now, Throttle) ->
+    (report(adapt(Throttle)))#throttle { adapt_at = Now + ?ADAPT_USECS }.
+
+adapt(#throttle { latency_target = undefined } = Throttle) ->
+    Throttle;
+adapt(#throttle { keydir = Keydir, max_rate = MaxRate, rate = Rate,
+                  latency_target = Target, reads = {Samples, Usecs} } =
+          Throttle) ->
+    {Samples2, Usecs2} = Reads = read_stats(Keydir),
+    Rate2 = next_rate(Samples2 - Samples, Usecs2 - Usecs, Target, Rate,
+                      MaxRate),
+    Throttle#throttle { rate = Rate2, reads = Reads }.
+
+%% Halve the rate while the foreground reads are slower than the target
+%% on average, and win it back in steps otherwise
+next_rate(Samples, Usecs, Target, Rate, MaxRate)
+  when Samples > 0, Usecs div Samples > Target ->
+    max(max(1, MaxRate div ?MIN_RATE_DIV), Rate div 2);
+next_rate(_Samples, _Usecs, _Target, Rate, MaxRate) ->
+    min(MaxRate, Rate + max(1, MaxRate div 8)).
+
+read_stats(Keydir) ->
+    Stats = bitcask_nifs:keydir_io_stats(Keydir),
+    {proplists:get_value(read_samples, Stats),
+     proplists:get_value(read_usecs, Stats)}.
+
+report(#throttle { keydir = Keydir, bytes = Bytes, waited = Waited } =
+           Throttle) ->
+    ok = bitcask_nifs:keydir_add_merge_io(Keydir, Bytes, Waited),
+    Throttle#throttle { bytes = 0, waited = 0 }.
+
+%% ===================================================================
+%% EUnit tests
+%% ===================================================================
+-ifdef(TEST).
+
+unlimited_test() ->
+    ?assertEqual(undefined, new([{merge_io_rate, unlimited}], undefined)),
+    ?assertEqual(undefined, charge(1 bsl 30, undefined)),
+    ?assertEqual(8388608, budget(undefined, 8388608)),
+    ?assertEqual(ok, finish(undefined)).
+
+next_rate_test() ->
+    Max = 6400,
+    %% Slow reads halve the rate, down to a 64th of the maximum
+    ?assertEqual(3200, next_rate(10, 10 * 5000, 1000, Max, Max)),
+    ?assertEqual(100, next_rate(10, 10 * 5000, 1000, 150, Max)),
+    %% No reads or fast ones win it back an eighth at a time
+    ?assertEqual(4000, next_rate(0, 0, 1000, 3200, Max)),
+    ?assertEqual(4000, next_rate(10, 10 * 500, 1000, 3200, Max)),
+    ?assertEqual(Max, next_rate(10, 10 * 500, 1000, 6000, Max)).
+
+charge_test_() ->
+    {timeout, 60, fun charge_test2/0}.
+
+charge_test2() ->
+    {ok, Keydir} = bitcask_nifs:keydir_new(),
+    Rate = 1048576,
+    T0 = new([{merge_io_rate, Rate}, {merge_io_latency_target, off}], Keydir),
+    ?assertEqual(burst(Rate), budget(T0, 8388608)),
+    %% The first burst is free, the rest of 1MB takes most of a second
+    Start = now_usecs(),
+    T1 = lists:foldl(fun(_, T) -> charge(65536, T) end, T0,
+                     lists:seq(1, 16)),
+    Elapsed = now_usecs() - Start,
+    ?assert(Elapsed >= 800000),
+    ?assert(Elapsed < 3000000),
+    ok = finish(T1),
+    Stats = bitcask_nifs:keydir_io_stats(Keydir),
+    ?assertEqual(1048576, proplists:get_value(merge_bytes, Stats)),
+    ?assert(proplists:get_value(merge_throttled_usecs, Stats) >= 800000),
+    %% Shared by two, each gets half the rate
+    T2 = share(T0, 2),
+    ?assertEqual(Rate div 2, T2#throttle.rate),
+    ok = bitcask_nifs:keydir_release(Keydir).
+
+-endif.
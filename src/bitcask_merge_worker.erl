@@ -37,14 +37,16 @@
 %% API
 -export([start_link/0,
          merge/1, merge/2, merge/3,
-         status/0]).
+         status/0,
+         suspend/0, resume/0]).
 
 %% gen_server callbacks
 -export([init/1, handle_call/3, handle_cast/2, handle_info/2,
          terminate/2, code_change/3]).
 
 -record(state, { queue :: list(),
-                worker :: undefined | pid()}).
+                worker :: undefined | pid(),
+                suspended = false :: boolean()}).
 
 %% ====================================================================
 %% API
@@ -65,6 +67,15 @@ merge(Dir, Opts, Files) ->
 status() ->
     gen_server:call(?MODULE, {status}, infinity).
 
+%% @doc Have the running merge checkpoint its progress and stop, and hold
+%% the queued ones, e.g. while the node is under load. The next merge of
+%% the cask after resume/0 picks up where it stopped.
+suspend() ->
+    gen_server:call(?MODULE, {suspend, true}, infinity).
+
+resume() ->
+    gen_server:call(?MODULE, {suspend, false}, infinity).
+
 %% ====================================================================
 %% gen_server callbacks
 %% ====================================================================
@@ -112,7 +123,7 @@ handle_call({merge, Args0}, _From, #state { queue = Q } = State) ->
             {reply, ok, State#state{ queue = Q1 }};
         false ->
             case State#state.worker of
-                undefined ->
+                undefined when not State#state.suspended ->
                     WorkerPid = spawn_link(fun() -> do_merge(Args0) end),
                     {reply, ok, State#state { worker = WorkerPid }};
                 _ ->
@@ -121,6 +132,10 @@ handle_call({merge, Args0}, _From, #state { queue = Q } = State) ->
     end;
 handle_call({status}, _From, #state { queue = Q, worker = Worker } = State) ->
     {reply, {length(Q), Worker}, State};
+handle_call({suspend, Suspend}, _From, State) ->
+    {reply, ok, maybe_start_worker(State#state { suspended = Suspend })};
+handle_call(suspended, _From, #state { suspended = Suspended } = State) ->
+    {reply, Suspended, State};
 handle_call(_, _From, State) ->
     {reply, unknown_call, State}.
 
@@ -128,16 +143,8 @@ handle_cast(_Msg, State) ->
     {noreply, State}.
 
 
-handle_info({'EXIT', _Pid, normal}, #state { queue = Q } = State) ->
-    case Q of
-        [] ->
-            {noreply, State#state { worker = undefined }};
-        [Args0|Q2] ->
-            Args = tuple_to_list(Args0),
-            WorkerPid = spawn_link(fun() -> do_merge(Args) end),
-            {noreply, State#state { queue = Q2,
-                                    worker = WorkerPid }}
-    end;
+handle_info({'EXIT', _Pid, normal}, State) ->
+    {noreply, maybe_start_worker(State#state { worker = undefined })};
 
 handle_info({'EXIT', Pid, Reason}, #state { worker = Pid } = State) ->
     error_logger:error_msg("Merge worker PID exited: ~p\n", [Reason]),
@@ -154,6 +161,14 @@ code_change(_OldVsn, State, _Extra) ->
 %% private functions
 %% ====================================================================
 
+maybe_start_worker(#state { queue = [Args0|Q2], worker = undefined,
+                             suspended = false } = State) ->
+    Args = tuple_to_list(Args0),
+    WorkerPid = spawn_link(fun() -> do_merge(Args) end),
+    State#state { queue = Q2, worker = WorkerPid };
+maybe_start_worker(State) ->
+    State.
+
 merge_items(New, Old) ->
     %% first element will always match
     Dirname = element(1, New),
@@ -187,10 +202,15 @@ merge_files(New, Old) ->
 %% Internal worker
 %% ====================================================================
 
-do_merge(Args) ->
+do_merge(Args0) ->
     {_, {Hour, _, _}} = calendar:local_time(),
     case in_merge_window(Hour, merge_window()) of
         true ->
+            %% The merge stops at the end of the window or on suspend/0,
+            %% leaving a checkpoint to carry on from
+            [Dirname, Opts | Rest] = Args0,
+            Args = [Dirname, [{merge_suspend, fun merge_suspend/0} | Opts] |
+                    Rest],
             Start = os:timestamp(),
             Result = (catch apply(bitcask, merge, Args)),
             ElapsedSecs = timer:now_diff(os:timestamp(), Start) / 1000000,
@@ -207,6 +227,11 @@ do_merge(Args) ->
             ok
     end.
 
+merge_suspend() ->
+    {_, {Hour, _, _}} = calendar:local_time(),
+    not in_merge_window(Hour, merge_window()) orelse
+        gen_server:call(?MODULE, suspended, infinity).
+
 merge_window() ->
     case application:get_env(bitcask, merge_window) of
         {ok, always} ->
@@ -22,17 +22,24 @@
 -module(bitcask_nifs).
 
 -export([init/0,
-         keydir_new/0, keydir_new/1,
+         keydir_new/0, keydir_new/1, keydir_new/2,
          maybe_keydir_new/1,
          keydir_mark_ready/1,
          keydir_put/7,
          keydir_put/8,
          keydir_put/9,
          keydir_put/10,
+         keydir_put/11,
          keydir_get/2,
          keydir_get/3,
+         keydir_get/4,
+         keydir_get_many/2,
+         keydir_get_many/3,
+         keydir_get_many/4,
          keydir_get_epoch/1,
          keydir_remove/2, keydir_remove/5,
+         keydir_remove_file/2,
+         keydir_sweep_expired/3,
          keydir_copy/1,
          keydir_fold/5,
          keydir_itr/3,
@@ -41,12 +48,34 @@
          keydir_frozen/4,
          keydir_wait_pending/1,
          keydir_info/1,
+         keydir_memory_info/1,
+         keydir_io_stats/1,
+         keydir_add_read_latency/2,
+         keydir_add_merge_io/3,
+         keydir_cache_get/3,
+         keydir_cache_put/4,
          keydir_release/1,
+         keydir_load_hintfile/4,
+         keydir_load_hintfiles/3,
+         keydir_write_snapshot/3,
+         keydir_load_snapshot/3,
          increment_file_id/1,
          increment_file_id/2,
          keydir_trim_fstats/2,
          update_fstats/8,
          set_pending_delete/2,
+         crc32c/1,
+         crc32c/2,
+         compression_codecs/0,
+         compress/2,
+         decompress/2,
+         zstd_dict_open/1,
+         zstd_train_dict/3,
+         compress_dict/2,
+         decompress_dict/2,
+         merge_copy_open/1,
+         merge_copy_close/1,
+         merge_copy/7,
          lock_acquire/2,
          lock_release/1,
          lock_readdata/1,
@@ -54,7 +83,10 @@
          file_open/2,
          file_close/1,
          file_sync/1,
+         file_datasync/1,
          file_pread/3,
+         file_mmap/1,
+         file_mmap_pread/3,
          file_pwrite/3,
          file_read/2,
          file_write/2,
@@ -66,6 +98,9 @@
 
 -include("bitcask.hrl").
 
+%% Size from which compress/decompress move to a dirty scheduler
+-define(DIRTY_CODEC_SIZE, 65536).
+
 -ifdef(PULSE).
 -compile({parse_transform, pulse_instrument}).
 -export([set_pulse_pid/1]).
@@ -125,6 +160,23 @@ keydir_new() ->
 keydir_new(Name) when is_list(Name) ->
     erlang:nif_error({error, not_loaded}).
 
+%% Options only apply when the named keydir is created by this call.
+%% {entry_layout, compact} stores entries in a packed format using less
+%% memory per key. {expiry_index, true} also indexes the keys put with an
+%% expiry time by when they expire, for keydir_sweep_expired/3.
+%% {bloom_filter, true} keeps a Bloom filter of the keys, so that most
+%% lookups of absent keys return not_found without taking any lock.
+%% {value_cache, Bytes} caches up to Bytes of values read from the data
+%% files, see keydir_cache_get/3.
+-spec keydir_new(string(), [{entry_layout, standard | compact} |
+                            {expiry_index, boolean()} |
+                            {bloom_filter, boolean()} |
+                            {value_cache, non_neg_integer()}]) ->
+        {ready, reference()} | {not_ready, reference()} |
+        {error, not_ready}.
+keydir_new(Name, Opts) when is_list(Name), is_list(Opts) ->
+    erlang:nif_error({error, not_loaded}).
+
 -spec maybe_keydir_new(string()) ->
         {ready, reference()} |
         {error, not_ready}.
@@ -157,17 +209,29 @@ keydir_put(Ref, Key, FileId, TotalSz, Offset, Tstamp, NowSec, OldFileId, OldOffs
 
 keydir_put(Ref, Key, FileId, TotalSz, Offset, Tstamp, NowSec, NewestPutB,
            OldFileId, OldOffset) ->
+    keydir_put(Ref, Key, FileId, TotalSz, Offset, Tstamp, NowSec, NewestPutB,
+               OldFileId, OldOffset, 0).
+
+%% @doc Expiry is the tstamp from which keydir_get/4 and iterators treat
+%% the key as not found, or 0 if it never expires.
+-spec keydir_put(reference(), binary(), integer(), integer(),
+                 integer(), integer(), integer(), boolean(), integer(),
+                 integer(), non_neg_integer()) ->
+        ok | already_exists.
+keydir_put(Ref, Key, FileId, TotalSz, Offset, Tstamp, NowSec, NewestPutB,
+           OldFileId, OldOffset, Expiry) ->
     keydir_put_int(Ref, Key, FileId, TotalSz, <<Offset:64/unsigned-native>>,
                    Tstamp, NowSec, if not NewestPutB -> 0;
                                       true           -> 1
                                    end,
-                   OldFileId, <<OldOffset:64/unsigned-native>>).
+                   OldFileId, <<OldOffset:64/unsigned-native>>, Expiry).
 
 -spec keydir_put_int(reference(), binary(), integer(), integer(),
-                     binary(), integer(), 0 | 1, integer(), integer(), binary()) ->
+                     binary(), integer(), 0 | 1, integer(), integer(), binary(),
+                     non_neg_integer()) ->
         ok | already_exists.
 keydir_put_int(_Ref, _Key, _FileId, _TotalSz, _Offset, _Tstamp, _NowSec,
-               _NewestPutI, _OldFileId, _OldOffset) ->
+               _NewestPutI, _OldFileId, _OldOffset, _Expiry) ->
     erlang:nif_error({error, not_loaded}).
 
 -spec keydir_get(reference(), binary()) ->
@@ -178,7 +242,15 @@ keydir_get(Ref, Key) ->
 -spec keydir_get(reference(), binary(), integer()) ->
         not_found | #bitcask_entry{}.
 keydir_get(Ref, Key, Epoch) ->
-    case keydir_get_int(Ref, Key, Epoch) of
+    keydir_get(Ref, Key, Epoch, 0).
+
+%% @doc Like keydir_get/3, but a key whose expiry time is NowSec or earlier
+%% is not found. A NowSec of 0 finds it regardless, as the merge and the
+%% write path need to.
+-spec keydir_get(reference(), binary(), integer(), non_neg_integer()) ->
+        not_found | #bitcask_entry{}.
+keydir_get(Ref, Key, Epoch, NowSec) ->
+    case keydir_get_int(Ref, Key, Epoch, NowSec) of
         E when is_record(E, bitcask_entry) ->
             <<Offset:64/unsigned-native>> = E#bitcask_entry.offset,
             E#bitcask_entry{offset = Offset};
@@ -186,9 +258,38 @@ keydir_get(Ref, Key, Epoch) ->
             not_found
     end.
 
--spec keydir_get_int(reference(), binary(), integer()) ->
+-spec keydir_get_int(reference(), binary(), integer(), non_neg_integer()) ->
         not_found | #bitcask_entry{}.
-keydir_get_int(_Ref, _Key, _Epoch) ->
+keydir_get_int(_Ref, _Key, _Epoch, _NowSec) ->
+    erlang:nif_error({error, not_loaded}).
+
+%% @doc Look up several keys at once. The result list has one element,
+%% either an entry or not_found, per key and in the same order as Keys.
+-spec keydir_get_many(reference(), [binary()]) ->
+        [not_found | #bitcask_entry{}].
+keydir_get_many(Ref, Keys) ->
+    keydir_get_many(Ref, Keys, 16#ffffffffffffffff).
+
+-spec keydir_get_many(reference(), [binary()], integer()) ->
+        [not_found | #bitcask_entry{}].
+keydir_get_many(Ref, Keys, Epoch) ->
+    keydir_get_many(Ref, Keys, Epoch, 0).
+
+%% @doc Expired keys are not found, as with keydir_get/4.
+-spec keydir_get_many(reference(), [binary()], integer(), non_neg_integer()) ->
+        [not_found | #bitcask_entry{}].
+keydir_get_many(Ref, Keys, Epoch, NowSec) ->
+    [case E of
+         #bitcask_entry{offset = <<Offset:64/unsigned-native>>} ->
+             E#bitcask_entry{offset = Offset};
+         _ ->
+             not_found
+     end || E <- keydir_get_many_int(Ref, Keys, Epoch, NowSec)].
+
+-spec keydir_get_many_int(reference(), [binary()], integer(),
+                          non_neg_integer()) ->
+        [not_found | #bitcask_entry{}].
+keydir_get_many_int(_Ref, _Keys, _Epoch, _NowSec) ->
     erlang:nif_error({error, not_loaded}).
 
 keydir_get_epoch(_Ref) ->
@@ -211,11 +312,33 @@ keydir_remove(Ref, Key, Tstamp, FileId, Offset) ->
 keydir_remove_int(_Ref, _Key, _Tstamp, _FileId, _Offset, _TStamp) ->
     erlang:nif_error({error, not_loaded}).
 
+%% @doc Remove the keys whose current entry is in FileId, as keydir_remove/5
+%% would one by one, without reading the file.
+-spec keydir_remove_file(reference(), integer()) ->
+        ok | {error, allocation_error}.
+keydir_remove_file(Ref, FileId) ->
+    keydir_remove_file_int(Ref, FileId, bitcask_time:tstamp()).
+
+keydir_remove_file_int(_Ref, _FileId, _TStamp) ->
+    erlang:nif_error({error, not_loaded}).
+
+%% @doc Remove the keys that have expired by Now from a keydir created with
+%% {expiry_index, true}, as keydir_remove/5 would. Gives up after walking
+%% about MaxNodes index entries and returns more if there are some left to
+%% look at for Now. Keydirs without the index return {done, 0}.
+-spec keydir_sweep_expired(reference(), non_neg_integer(),
+                           non_neg_integer()) ->
+        {more | done, non_neg_integer()}.
+keydir_sweep_expired(_Ref, _Now, _MaxNodes) ->
+    erlang:nif_error({error, not_loaded}).
+
 -spec keydir_copy(reference()) ->
         {ok, reference()}.
 keydir_copy(_Ref) ->
     erlang:nif_error({error, not_loaded}).
 
+%% @doc Start iterating the keydir. Keys that have expired by now are
+%% skipped.
 -spec keydir_itr(reference(), integer(), integer()) ->
         ok | out_of_date | {error, iteration_in_process}.
 keydir_itr(Ref, MaxAge, MaxPuts) ->
@@ -339,11 +462,111 @@ keydir_wait_ready() ->
 keydir_info(_Ref) ->
     erlang:nif_error({error, not_loaded}).
 
+%% Memory held by the keydir entries and hash tables, not counting
+%% allocator overhead.
+-spec keydir_memory_info(reference()) ->
+        [{entry_layout, standard | compact} |
+         {key_count, non_neg_integer()} |
+         {entry_bytes, non_neg_integer()} |
+         {hash_bytes, non_neg_integer()} |
+         {bytes_per_key, float()} |
+         {expiry_index_keys, non_neg_integer()} |
+         {bloom_bytes, non_neg_integer()}].
+keydir_memory_info(_Ref) ->
+    erlang:nif_error({error, not_loaded}).
+
+%% Running totals of the sampled foreground read latency and of the
+%% merge I/O, see bitcask_merge_throttle, then those of the value cache
+%% and what it holds, all zero for a keydir without one.
+-spec keydir_io_stats(reference()) ->
+        [{read_samples, non_neg_integer()} |
+         {read_usecs, non_neg_integer()} |
+         {merge_bytes, non_neg_integer()} |
+         {merge_throttled_usecs, non_neg_integer()} |
+         {cache_hits, non_neg_integer()} |
+         {cache_misses, non_neg_integer()} |
+         {cache_evictions, non_neg_integer()} |
+         {cache_entries, non_neg_integer()} |
+         {cache_bytes, non_neg_integer()}].
+keydir_io_stats(_Ref) ->
+    erlang:nif_error({error, not_loaded}).
+
+-spec keydir_add_read_latency(reference(), non_neg_integer()) -> ok.
+keydir_add_read_latency(_Ref, _Usecs) ->
+    erlang:nif_error({error, not_loaded}).
+
+-spec keydir_add_merge_io(reference(), non_neg_integer(),
+                          non_neg_integer()) -> ok.
+keydir_add_merge_io(_Ref, _Bytes, _ThrottledUsecs) ->
+    erlang:nif_error({error, not_loaded}).
+
+%% The value stored at Offset of data file FileId, if the value cache of
+%% the keydir holds it. The binary shares the cached bytes. Values are
+%% never rewritten in place, so there is nothing to invalidate: the cache
+%% drops values no longer asked for, overwritten or not, as it fills up.
+-spec keydir_cache_get(reference(), non_neg_integer(), non_neg_integer()) ->
+        {ok, binary()} | not_found.
+keydir_cache_get(_Ref, _FileId, _Offset) ->
+    erlang:nif_error({error, not_loaded}).
+
+%% Offer the cache of the keydir the value just read from Offset of data
+%% file FileId. Values the cache does not take are ignored.
+-spec keydir_cache_put(reference(), non_neg_integer(), non_neg_integer(),
+                       binary()) -> ok.
+keydir_cache_put(_Ref, _FileId, _Offset, _Value) ->
+    erlang:nif_error({error, not_loaded}).
+
 -spec keydir_release(reference()) ->
         ok.
 keydir_release(_Ref) ->
     erlang:nif_error({error, not_loaded}).
 
+%% @doc Load the hint file for data file FileId straight into the keydir.
+%% DataSize is the size of the data file, used to detect hint records
+%% pointing past its end.
+-spec keydir_load_hintfile(reference(), string(), integer(), integer()) ->
+        ok | {trunc_hintfile, integer(), integer()} |
+        {error, invalid_hintfile | atom()}.
+keydir_load_hintfile(Ref, HintFile, FileId, DataSize) ->
+    keydir_load_hintfile_int(Ref, HintFile, FileId, DataSize,
+                             bitcask_time:tstamp()).
+
+keydir_load_hintfile_int(_Ref, _HintFile, _FileId, _DataSize, _NowSec) ->
+    erlang:nif_error({error, not_loaded}).
+
+%% @doc Load several hint files, in list order, spreading the work over up
+%% to Threads threads. The result gives the outcome of each file as
+%% keydir_load_hintfile/4 would. Loading stops at the first file that
+%% fails and the ones after it are reported as not_loaded. Refused while
+%% the keydir is being iterated.
+-spec keydir_load_hintfiles(reference(),
+                            [{string(), integer(), integer()}],
+                            pos_integer()) ->
+        [ok | {trunc_hintfile, integer(), integer()} |
+         {error, invalid_hintfile | atom()} | not_loaded] |
+        {error, iteration_in_process}.
+keydir_load_hintfiles(_Ref, _HintFiles, _Threads) ->
+    erlang:nif_error({error, not_loaded}).
+
+%% @doc Save the keydir entries and file stats to SnapshotFile. Files
+%% gives {FileId, DataSize, HintSize} for every data file the keydir
+%% covers, HintSize being 0 when there is no hint file.
+-spec keydir_write_snapshot(reference(), string(),
+                            [{integer(), integer(), integer()}]) ->
+        ok | {error, out_of_date | iteration_in_process | atom()}.
+keydir_write_snapshot(_Ref, _SnapshotFile, _Files) ->
+    erlang:nif_error({error, not_loaded}).
+
+%% @doc Fill an empty keydir from SnapshotFile, if the files it covers are
+%% still in Files with the same sizes and all the others are newer.
+%% Returns the ids of the covered files; the rest are left to the caller.
+-spec keydir_load_snapshot(reference(), string(),
+                           [{integer(), integer(), integer()}]) ->
+        {ok, [integer()]} |
+        {error, out_of_date | not_empty | atom()}.
+keydir_load_snapshot(_Ref, _SnapshotFile, _Files) ->
+    erlang:nif_error({error, not_loaded}).
+
 -spec keydir_trim_fstats(reference(), [integer()]) ->
         {ok, integer()} | {error, atom()}.
 keydir_trim_fstats(_Ref, _IDList) ->
@@ -362,6 +585,131 @@ update_fstats(_Ref, _FileId, _Tstamp,
 set_pending_delete(_Ref, _FileId) ->
     erlang:nif_error({error, not_loaded}).
 
+%% @doc CRC-32C of an iolist, computed with the CPU's CRC instructions
+%% where available. Same interface as erlang:crc32/1,2.
+-spec crc32c(iodata()) -> non_neg_integer().
+crc32c(_Data) ->
+    erlang:nif_error({error, not_loaded}).
+
+-spec crc32c(non_neg_integer(), iodata()) -> non_neg_integer().
+crc32c(_PrevCrc, _Data) ->
+    erlang:nif_error({error, not_loaded}).
+
+%% @doc The codecs this build includes. compress/2 finds every value
+%% uncompressible with the others, and decompress/2 fails.
+-spec compression_codecs() -> [lz4 | zstd].
+compression_codecs() ->
+    erlang:nif_error({error, not_loaded}).
+
+%% @doc Compress a value with LZ4 or zstd. Returns uncompressible when the
+%% result would not be smaller than the value. Values of at least
+%% 64 KB are handled on a dirty CPU scheduler; smaller
+%% ones finish well within a normal scheduler's time slice.
+-spec compress(lz4 | zstd, binary()) -> {ok, binary()} | uncompressible.
+compress(Codec, Value) when byte_size(Value) < ?DIRTY_CODEC_SIZE ->
+    compress_int(Codec, Value);
+compress(Codec, Value) ->
+    compress_dirty_int(Codec, Value).
+
+compress_int(_Codec, _Value) ->
+    erlang:nif_error({error, not_loaded}).
+
+compress_dirty_int(_Codec, _Value) ->
+    erlang:nif_error({error, not_loaded}).
+
+%% @doc Decompress a value written by compress/2 with the same codec.
+-spec decompress(lz4 | zstd, binary()) -> {ok, binary()} | error.
+decompress(Codec, Stored) when byte_size(Stored) < ?DIRTY_CODEC_SIZE ->
+    decompress_int(Codec, Stored);
+decompress(Codec, Stored) ->
+    decompress_dirty_int(Codec, Stored).
+
+decompress_int(_Codec, _Stored) ->
+    erlang:nif_error({error, not_loaded}).
+
+decompress_dirty_int(_Codec, _Stored) ->
+    erlang:nif_error({error, not_loaded}).
+
+%% @doc Load a zstd dictionary file. Handles for the same path share one
+%% copy of the dictionary, which is freed once the last handle is gone.
+-spec zstd_dict_open(string()) -> {ok, reference()} | {error, atom()}.
+zstd_dict_open(Filename) ->
+    zstd_dict_open_int(Filename).
+
+zstd_dict_open_int(_Filename) ->
+    erlang:nif_error({error, not_loaded}).
+
+%% @doc Train a zstd dictionary of at most Capacity bytes from a list of
+%% sample values, stamping it with Id. Always runs on a dirty CPU scheduler.
+-spec zstd_train_dict([binary()], pos_integer(), pos_integer()) ->
+        {ok, binary()} | {error, atom()}.
+zstd_train_dict(Samples, Capacity, Id) ->
+    zstd_train_dict_int(Samples, Capacity, Id).
+
+zstd_train_dict_int(_Samples, _Capacity, _Id) ->
+    erlang:nif_error({error, not_loaded}).
+
+%% @doc Compress a value against a dictionary opened by zstd_dict_open/1.
+%% The zstd frame records the dictionary id.
+-spec compress_dict(reference(), binary()) -> {ok, binary()} | uncompressible.
+compress_dict(Dict, Value) when byte_size(Value) < ?DIRTY_CODEC_SIZE ->
+    compress_dict_int(Dict, Value);
+compress_dict(Dict, Value) ->
+    compress_dict_dirty_int(Dict, Value).
+
+compress_dict_int(_Dict, _Value) ->
+    erlang:nif_error({error, not_loaded}).
+
+compress_dict_dirty_int(_Dict, _Value) ->
+    erlang:nif_error({error, not_loaded}).
+
+%% @doc Decompress a value written by compress_dict/2 with the same dictionary.
+-spec decompress_dict(reference(), binary()) -> {ok, binary()} | error.
+decompress_dict(Dict, Stored) when byte_size(Stored) < ?DIRTY_CODEC_SIZE ->
+    decompress_dict_int(Dict, Stored);
+decompress_dict(Dict, Stored) ->
+    decompress_dict_dirty_int(Dict, Stored).
+
+decompress_dict_int(_Dict, _Stored) ->
+    erlang:nif_error({error, not_loaded}).
+
+decompress_dict_dirty_int(_Dict, _Stored) ->
+    erlang:nif_error({error, not_loaded}).
+
+%% @doc Open a merge cursor on a data file for merge_copy/7.
+-spec merge_copy_open(string()) -> {ok, reference()} | {error, atom()}.
+merge_copy_open(_Filename) ->
+    erlang:nif_error({error, not_loaded}).
+
+-spec merge_copy_close(reference()) -> ok.
+merge_copy_close(_Cursor) ->
+    erlang:nif_error({error, not_loaded}).
+
+%% @doc Copy the live records of a data file, from InOffset on, to a merge
+%% output file, and point LiveKeyDir at the copies. Records are copied as
+%% they are, so the input must use Checksum and one record per entry with
+%% no codec. Stops at the end of the file, after Budget bytes of it
+%% (more), when the output file is full or there is none yet (wrap), at a
+%% tombstone or expired record, returned to the caller as an entry, or at
+%% a record failing its CRC (bad_entry). Returns where the input stopped,
+%% where the output file now ends and the hint records of the copies, to
+%% append to the output hint file. Copies made before an I/O error are
+%% returned with it.
+-spec merge_copy(reference(), reference(), reference(),
+                 {integer(), integer(), crc32 | crc32c},
+                 fresh | {string(), integer(), integer(), integer(), integer()},
+                 integer(), pos_integer()) ->
+        {eof | more | wrap | bad_entry | {error, atom()} |
+         {entry, binary(), binary(), integer(), integer(), integer()},
+         integer(), integer(), binary()}.
+merge_copy(Cursor, LiveKeyDir, DelKeyDir, Input, Output, ExpiryTime, Budget) ->
+    merge_copy_int(Cursor, LiveKeyDir, DelKeyDir, Input, Output, ExpiryTime,
+                   Budget, bitcask_time:tstamp()).
+
+merge_copy_int(_Cursor, _LiveKeyDir, _DelKeyDir, _Input, _Output, _ExpiryTime,
+               _Budget, _NowSec) ->
+    erlang:nif_error({error, not_loaded}).
+
 -spec lock_acquire(string(), integer()) ->
         {ok, reference()} | {error, atom()}.
 lock_acquire(Filename, IsWriteLock) ->
@@ -423,6 +771,13 @@ file_sync(Ref) ->
 file_sync_int(_Ref) ->
     erlang:nif_error({error, not_loaded}).
 
+file_datasync(Ref) ->
+    bitcask_bump:big(),
+    file_datasync_int(Ref).
+
+file_datasync_int(_Ref) ->
+    erlang:nif_error({error, not_loaded}).
+
 file_pread(Ref, Offset, Size) ->
     bitcask_bump:big(),
     file_pread_int(Ref, Offset, Size).
@@ -430,6 +785,23 @@ file_pread(Ref, Offset, Size) ->
 file_pread_int(_Ref, _Offset, _Size) ->
     erlang:nif_error({error, not_loaded}).
 
+%% @doc Map a whole file read-only, for use with file_mmap_pread/3.
+file_mmap(Filename) ->
+    bitcask_bump:big(),
+    file_mmap_int(Filename).
+
+file_mmap_int(_Filename) ->
+    erlang:nif_error({error, not_loaded}).
+
+%% @doc Read from a file_mmap/1 mapping without copying. Returns eof when
+%% the range is not entirely mapped, e.g. if the file grew after mapping.
+file_mmap_pread(Ref, Offset, Size) ->
+    bitcask_bump:big(),
+    file_mmap_pread_int(Ref, Offset, Size).
+
+file_mmap_pread_int(_Ref, _Offset, _Size) ->
+    erlang:nif_error({error, not_loaded}).
+
 file_pwrite(Ref, Offset, Bytes) ->
     bitcask_bump:big(),
     file_pwrite_int(Ref, Offset, Bytes).
@@ -509,6 +881,165 @@ keydir_basic_test2() ->
     ok = keydir_remove(Ref, <<"abc">>),
     not_found = keydir_get(Ref, <<"abc">>).
 
+keydir_remove_file_test() ->
+    {ok, Ref} = keydir_new(),
+    Keys = [<<X:32>> || X <- lists:seq(1, 100)],
+    [ok = keydir_put(Ref, K, X rem 2, 100, X * 100, 1, bitcask_time:tstamp())
+     || <<X:32>> = K <- Keys],
+    %% A newer value elsewhere stays
+    ok = keydir_put(Ref, <<1:32>>, 2, 100, 0, 2, bitcask_time:tstamp()),
+    ok = keydir_remove_file(Ref, 1),
+    {51, _, _, _, _} = keydir_info(Ref),
+    not_found = keydir_get(Ref, <<3:32>>),
+    #bitcask_entry{file_id = 0} = keydir_get(Ref, <<2:32>>),
+    #bitcask_entry{file_id = 2} = keydir_get(Ref, <<1:32>>),
+    ok = keydir_release(Ref).
+
+keydir_get_many_test_() ->
+    {timeout, 60, fun keydir_get_many_test2/0}.
+
+keydir_get_many_test2() ->
+    {ok, Ref} = keydir_new(),
+    [] = keydir_get_many(Ref, []),
+    Keys = [<<X:32>> || X <- lists:seq(1, 100)],
+    [ok = keydir_put(Ref, K, X rem 3, 100 + X, X * 1000, 1,
+                     bitcask_time:tstamp())
+     || <<X:32>> = K <- Keys],
+
+    Lookup = [<<7:32>>, <<"missing">>, <<99:32>>, <<7:32>>],
+    [#bitcask_entry{key = <<7:32>>, file_id = 1, total_sz = 107, offset = 7000},
+     not_found,
+     #bitcask_entry{key = <<99:32>>, file_id = 0, total_sz = 199, offset = 99000},
+     #bitcask_entry{key = <<7:32>>}] = keydir_get_many(Ref, Lookup),
+
+    Got = keydir_get_many(Ref, Keys),
+    Got = [keydir_get(Ref, K) || K <- Keys],
+
+    ok = keydir_remove(Ref, <<99:32>>),
+    [not_found] = keydir_get_many(Ref, [<<99:32>>]),
+    ?assertError(badarg, keydir_get_many(Ref, [not_a_binary])).
+
+keydir_expiry_test() ->
+    {ok, Ref} = keydir_new(),
+    ok = keydir_put(Ref, <<"a">>, 1, 100, 0, 1, 1, false, 0, 0, 1000),
+    ok = keydir_put(Ref, <<"b">>, 1, 100, 100, 1, 1),
+    %% Only hidden when asked to look at the time
+    #bitcask_entry{} = keydir_get(Ref, <<"a">>),
+    #bitcask_entry{} = keydir_get(Ref, <<"a">>, 16#ffffffffffffffff, 999),
+    not_found = keydir_get(Ref, <<"a">>, 16#ffffffffffffffff, 1000),
+    [not_found, #bitcask_entry{key = <<"b">>}] =
+        keydir_get_many(Ref, [<<"a">>, <<"b">>], 16#ffffffffffffffff, 1000),
+    %% Iterators skip the keys expired by the time they start
+    ok = keydir_itr_int(Ref, 1000, -1, -1),
+    #bitcask_entry{key = <<"b">>} = keydir_itr_next(Ref),
+    not_found = keydir_itr_next(Ref),
+    ok = keydir_itr_release(Ref),
+    %% A put without an expiry time clears it
+    ok = keydir_put(Ref, <<"a">>, 1, 100, 200, 2, 1),
+    #bitcask_entry{offset = 200} =
+        keydir_get(Ref, <<"a">>, 16#ffffffffffffffff, 5000),
+    ok = keydir_release(Ref).
+
+keydir_sweep_expired_test() ->
+    {not_ready, Ref} = keydir_new("keydir_sweep_expired_test",
+                                  [{expiry_index, true}]),
+    keydir_mark_ready(Ref),
+    Keys = [<<X:32>> || X <- lists:seq(1, 100)],
+    [ok = keydir_put(Ref, K, 1, 100, Ofs, 1, 1, false, 0, 0, 1000 + Ofs)
+     || <<Ofs:32>> = K <- Keys],
+    ok = keydir_put(Ref, <<"forever">>, 1, 100, 0, 1, 1),
+    100 = proplists:get_value(expiry_index_keys, keydir_memory_info(Ref)),
+    %% Putting a key again with a later expiry time keeps it past the first,
+    %% and moves its index entry instead of adding one
+    ok = keydir_put(Ref, <<1:32>>, 1, 100, 1, 2, 1, false, 0, 0, 5000),
+    100 = proplists:get_value(expiry_index_keys, keydir_memory_info(Ref)),
+    {done, 0} = keydir_sweep_expired(Ref, 1000, 1000),
+    %% A small budget takes several calls
+    {more, N1} = keydir_sweep_expired(Ref, 1050, 16),
+    ?assert(N1 < 49),
+    49 = sweep_all(Ref, 1050, 16, N1),
+    Info = keydir_memory_info(Ref),
+    52 = proplists:get_value(key_count, Info),
+    51 = proplists:get_value(expiry_index_keys, Info),
+    not_found = keydir_get(Ref, <<2:32>>),
+    #bitcask_entry{} = keydir_get(Ref, <<1:32>>),
+    #bitcask_entry{} = keydir_get(Ref, <<51:32>>),
+    ok = keydir_release(Ref),
+
+    %% Nothing indexed without the option
+    {ok, Ref2} = keydir_new(),
+    ok = keydir_put(Ref2, <<"a">>, 1, 100, 0, 1, 1, false, 0, 0, 1000),
+    {done, 0} = keydir_sweep_expired(Ref2, 5000, 1000),
+    #bitcask_entry{} = keydir_get(Ref2, <<"a">>),
+    ok = keydir_release(Ref2).
+
+keydir_bloom_filter_test_() ->
+    {timeout, 60, fun keydir_bloom_filter_test2/0}.
+
+keydir_bloom_filter_test2() ->
+    {not_ready, Ref} = keydir_new("keydir_bloom_filter_test",
+                                  [{bloom_filter, true}]),
+    keydir_mark_ready(Ref),
+    Bytes0 = proplists:get_value(bloom_bytes, keydir_memory_info(Ref)),
+    ?assert(Bytes0 > 0),
+    %% Enough keys for the filters to grow, which must not lose any
+    Keys = [<<X:32>> || X <- lists:seq(1, 20000)],
+    [ok = keydir_put(Ref, K, 1, 100, X, 1, 1) || <<X:32>> = K <- Keys],
+    ?assert(proplists:get_value(bloom_bytes, keydir_memory_info(Ref)) > Bytes0),
+    [#bitcask_entry{key = K} = keydir_get(Ref, K) || K <- Keys],
+    [not_found = keydir_get(Ref, <<X:64>>) || X <- lists:seq(1, 1000)],
+    [#bitcask_entry{}, not_found] =
+        keydir_get_many(Ref, [<<1:32>>, <<1:64>>]),
+    %% Removing most keys rebuilds the filters, the others are still found
+    {Gone, Kept} = lists:split(15000, Keys),
+    [ok = keydir_remove(Ref, K) || K <- Gone],
+    [not_found = keydir_get(Ref, K) || K <- Gone],
+    [#bitcask_entry{key = K} = keydir_get(Ref, K) || K <- Kept],
+    ok = keydir_release(Ref),
+
+    {not_ready, Ref2} = keydir_new("keydir_bloom_filter_test2", []),
+    0 = proplists:get_value(bloom_bytes, keydir_memory_info(Ref2)),
+    ?assertError(badarg, keydir_new("keydir_bloom_filter_test3",
+                                    [{bloom_filter, yes}])),
+    ok = keydir_release(Ref2).
+
+keydir_value_cache_test() ->
+    {not_ready, Ref} = keydir_new("keydir_value_cache_test",
+                                  [{value_cache, 1048576}]),
+    keydir_mark_ready(Ref),
+    not_found = keydir_cache_get(Ref, 1, 0),
+    ok = keydir_cache_put(Ref, 1, 0, <<"value">>),
+    {ok, <<"value">>} = keydir_cache_get(Ref, 1, 0),
+    not_found = keydir_cache_get(Ref, 1, 5),
+    not_found = keydir_cache_get(Ref, 2, 0),
+    %% Values no longer asked for make room for new ones
+    [begin
+         not_found = keydir_cache_get(Ref, 3, X),
+         ok = keydir_cache_put(Ref, 3, X, <<X:8192>>)
+     end || X <- lists:seq(1, 2000)],
+    Stats = keydir_io_stats(Ref),
+    1 = proplists:get_value(cache_hits, Stats),
+    2003 = proplists:get_value(cache_misses, Stats),
+    ?assert(proplists:get_value(cache_evictions, Stats) > 0),
+    ?assert(proplists:get_value(cache_bytes, Stats) =< 1048576),
+    ?assert(proplists:get_value(cache_entries, Stats) < 2001),
+    ?assertError(badarg, keydir_cache_put(Ref, 1, 0, not_a_binary)),
+    ok = keydir_release(Ref),
+
+    %% Without a cache nothing is kept
+    {ok, Ref2} = keydir_new(),
+    ok = keydir_cache_put(Ref2, 1, 0, <<"value">>),
+    not_found = keydir_cache_get(Ref2, 1, 0),
+    ?assertError(badarg, keydir_new("keydir_value_cache_test2",
+                                    [{value_cache, lots}])),
+    ok = keydir_release(Ref2).
+
+sweep_all(Ref, Now, MaxNodes, Acc) ->
+    case keydir_sweep_expired(Ref, Now, MaxNodes) of
+        {more, N} -> sweep_all(Ref, Now, MaxNodes, Acc + N);
+        {done, N} -> Acc + N
+    end.
+
 keydir_itr_anon_test_() ->
     {timeout, 60, fun keydir_itr_anon_test2/0}.
 
@@ -538,6 +1069,72 @@ keydir_itr_test_base(Ref) ->
     true = lists:keymember(<<"def">>, #bitcask_entry.key, List),
     true = lists:keymember(<<"hij">>, #bitcask_entry.key, List).
 
+keydir_compact_test_() ->
+    {timeout, 60, fun keydir_compact_test2/0}.
+
+keydir_compact_test2() ->
+    {not_ready, Ref} = keydir_new("keydir_compact_test",
+                                  [{entry_layout, compact}]),
+    keydir_mark_ready(Ref),
+    keydir_itr_test_base(Ref),
+
+    %% Offsets too large for the compact layout are still kept exactly
+    Big = 1 bsl 50,
+    ok = keydir_put(Ref, <<"abc">>, 2, 1234, Big, 4, bitcask_time:tstamp()),
+    #bitcask_entry{offset = Big} = keydir_get(Ref, <<"abc">>),
+    ok = keydir_put(Ref, <<"abc">>, 3, 1234, 10, 5, bitcask_time:tstamp()),
+    #bitcask_entry{file_id = 3, offset = 10} = keydir_get(Ref, <<"abc">>),
+
+    Info = keydir_memory_info(Ref),
+    compact = proplists:get_value(entry_layout, Info),
+    3 = proplists:get_value(key_count, Info),
+    true = proplists:get_value(bytes_per_key, Info) > 0,
+    ok = keydir_release(Ref).
+
+keydir_memory_info_test_() ->
+    {timeout, 60, fun keydir_memory_info_test2/0}.
+
+keydir_memory_info_test2() ->
+    Keys = [<<X:32>> || X <- lists:seq(1, 1000)],
+    Fill = fun(Ref) ->
+                   [ok = keydir_put(Ref, K, 0, 10, 0, 1, bitcask_time:tstamp())
+                    || K <- Keys],
+                   proplists:get_value(entry_bytes, keydir_memory_info(Ref))
+           end,
+    {not_ready, Std} = keydir_new("keydir_memory_std", []),
+    {not_ready, Compact} = keydir_new("keydir_memory_compact",
+                                      [{entry_layout, compact}]),
+    StdBytes = Fill(Std),
+    CompactBytes = Fill(Compact),
+    ?assert(CompactBytes < StdBytes),
+
+    [ok = keydir_remove(Compact, K) || K <- Keys],
+    Info = keydir_memory_info(Compact),
+    0 = proplists:get_value(entry_bytes, Info),
+    0 = proplists:get_value(arena_used_bytes, Info),
+    %% Slabs are kept for reuse until the keydir itself is dropped
+    ?assert(proplists:get_value(arena_slab_bytes, Info) > 0),
+    0.0 = proplists:get_value(arena_utilization, Info),
+    ok = keydir_release(Std),
+    ok = keydir_release(Compact).
+
+keydir_io_stats_test() ->
+    {ok, Ref} = keydir_new(),
+    [{read_samples, 0}, {read_usecs, 0},
+     {merge_bytes, 0}, {merge_throttled_usecs, 0},
+     {cache_hits, 0}, {cache_misses, 0}, {cache_evictions, 0},
+     {cache_entries, 0}, {cache_bytes, 0}] = keydir_io_stats(Ref),
+    ok = keydir_add_read_latency(Ref, 150),
+    ok = keydir_add_read_latency(Ref, 50),
+    ok = keydir_add_merge_io(Ref, 4096, 0),
+    ok = keydir_add_merge_io(Ref, 4096, 2500),
+    [{read_samples, 2}, {read_usecs, 200},
+     {merge_bytes, 8192}, {merge_throttled_usecs, 2500},
+     {cache_hits, 0}, {cache_misses, 0}, {cache_evictions, 0},
+     {cache_entries, 0}, {cache_bytes, 0}] = keydir_io_stats(Ref),
+    {'EXIT', {badarg, _}} = (catch keydir_add_read_latency(Ref, -1)),
+    ok = keydir_release(Ref).
+
 keydir_copy_test_() ->
     {timeout, 60, fun keydir_copy_test2/0}.
 
@@ -966,6 +1563,52 @@ iter(Fun, N) ->
     Fun(N),
     iter(Fun, N-1).
 
+%% Keydir lock contention: N processes doing a 90/10 get/put mix against
+%% the same named keydir.  Throughput should scale with the number of
+%% keydir shards rather than flatten out at one process.
+-define(CONTENTION_KEYS, 100000).
+-define(CONTENTION_OPS, 200000).
+
+contention_test_() ->
+    {timeout, 6666, fun() -> [contention(N) || N <- [1, 2, 4, 8, 16, 32]] end}.
+
+contention(NumProcs) ->
+    {not_ready, Ref} = keydir_new("contention_test"),
+    ok = keydir_mark_ready(Ref),
+    try
+        Now = bitcask_time:tstamp(),
+        iter(fun(X) ->
+                     ok = keydir_put(Ref, <<X:32>>, 0, 0, X, Now, Now)
+             end, ?CONTENTION_KEYS),
+        Self = self(),
+        OpsPerProc = ?CONTENTION_OPS div NumProcs,
+        Worker = fun(Seed) ->
+                         Op = fun(X) ->
+                                      Key = <<((X * 7919 + Seed) rem
+                                               ?CONTENTION_KEYS + 1):32>>,
+                                      case X rem 10 of
+                                          0 ->
+                                              keydir_put(Ref, Key, 1, 0, X,
+                                                         Now, Now);
+                                          _ ->
+                                              keydir_get(Ref, Key)
+                                      end
+                              end,
+                         iter(Op, OpsPerProc),
+                         Self ! {done, Seed}
+                 end,
+        T0 = os:timestamp(),
+        [spawn_link(fun() -> Worker(Seed) end) ||
+            Seed <- lists:seq(1, NumProcs)],
+        [receive {done, Seed} -> ok end || Seed <- lists:seq(1, NumProcs)],
+        Elapsed = timer:now_diff(os:timestamp(), T0),
+        Ops = OpsPerProc * NumProcs,
+        io:format(user, "contention procs=~p ops=~p usec=~p ops/sec=~p\n",
+                  [NumProcs, Ops, Elapsed, Ops * 1000000 div max(1, Elapsed)])
+    after
+        ok = keydir_release(Ref)
+    end.
+
 -endif. % TIMING_TEST_NOT_EUNIT_TEST
 
 -endif. % EQC
@@ -23,12 +23,27 @@ basic_schema_test2() ->
     cuttlefish_unit:assert_config(Config, "bitcask.frag_threshold", 40),
     cuttlefish_unit:assert_config(Config, "bitcask.dead_bytes_threshold", 134217728),
     cuttlefish_unit:assert_config(Config, "bitcask.small_file_threshold", 10485760),
+    cuttlefish_unit:assert_config(Config, "bitcask.merge_workers", 1),
+    cuttlefish_unit:assert_config(Config, "bitcask.merge_io_rate", unlimited),
+    cuttlefish_unit:assert_config(Config, "bitcask.merge_io_latency_target", off),
+    cuttlefish_unit:assert_config(Config, "bitcask.merge_io_budget", unlimited),
     cuttlefish_unit:assert_config(Config, "bitcask.max_fold_age", -1),
     cuttlefish_unit:assert_config(Config, "bitcask.max_fold_puts", 0),
     cuttlefish_unit:assert_config(Config, "bitcask.expiry_secs", -1),
     cuttlefish_unit:assert_config(Config, "bitcask.require_hint_crc", true),
     cuttlefish_unit:assert_config(Config, "bitcask.expiry_grace_time", 0),
     cuttlefish_unit:assert_config(Config, "bitcask.io_mode", erlang),
+    cuttlefish_unit:assert_config(Config, "bitcask.mmap_reads", false),
+    cuttlefish_unit:assert_config(Config, "bitcask.checksum", crc32c),
+    cuttlefish_unit:assert_config(Config, "bitcask.compression", none),
+    cuttlefish_unit:assert_config(Config, "bitcask.block_size", off),
+    cuttlefish_unit:assert_config(Config, "bitcask.keydir_entry_layout", standard),
+    cuttlefish_unit:assert_config(Config, "bitcask.keydir_load_threads", 4),
+    cuttlefish_unit:assert_config(Config, "bitcask.keydir_snapshot", true),
+    cuttlefish_unit:assert_config(Config, "bitcask.keydir_snapshot_interval", 0),
+    cuttlefish_unit:assert_config(Config, "bitcask.keydir_expiry_index", false),
+    cuttlefish_unit:assert_config(Config, "bitcask.keydir_bloom_filter", false),
+    cuttlefish_unit:assert_config(Config, "bitcask.keydir_value_cache", off),
 
     %% Make sure no multi_backend
     cuttlefish_unit:assert_not_configured(Config, "riak_kv.multi_backend"),
@@ -58,17 +73,46 @@ merge_window_test2() ->
     cuttlefish_unit:assert_config(Config, "bitcask.frag_threshold", 40),
     cuttlefish_unit:assert_config(Config, "bitcask.dead_bytes_threshold", 134217728),
     cuttlefish_unit:assert_config(Config, "bitcask.small_file_threshold", 10485760),
+    cuttlefish_unit:assert_config(Config, "bitcask.merge_workers", 1),
+    cuttlefish_unit:assert_config(Config, "bitcask.merge_io_rate", unlimited),
+    cuttlefish_unit:assert_config(Config, "bitcask.merge_io_latency_target", off),
+    cuttlefish_unit:assert_config(Config, "bitcask.merge_io_budget", unlimited),
     cuttlefish_unit:assert_config(Config, "bitcask.max_fold_age", -1),
     cuttlefish_unit:assert_config(Config, "bitcask.max_fold_puts", 0),
     cuttlefish_unit:assert_config(Config, "bitcask.expiry_secs", -1),
     cuttlefish_unit:assert_config(Config, "bitcask.require_hint_crc", true),
     cuttlefish_unit:assert_config(Config, "bitcask.expiry_grace_time", 0),
     cuttlefish_unit:assert_config(Config, "bitcask.io_mode", erlang),
+    cuttlefish_unit:assert_config(Config, "bitcask.mmap_reads", false),
+    cuttlefish_unit:assert_config(Config, "bitcask.checksum", crc32c),
+    cuttlefish_unit:assert_config(Config, "bitcask.compression", none),
+    cuttlefish_unit:assert_config(Config, "bitcask.block_size", off),
+    cuttlefish_unit:assert_config(Config, "bitcask.keydir_entry_layout", standard),
+    cuttlefish_unit:assert_config(Config, "bitcask.keydir_load_threads", 4),
+    cuttlefish_unit:assert_config(Config, "bitcask.keydir_snapshot", true),
+    cuttlefish_unit:assert_config(Config, "bitcask.keydir_snapshot_interval", 0),
+    cuttlefish_unit:assert_config(Config, "bitcask.keydir_expiry_index", false),
+    cuttlefish_unit:assert_config(Config, "bitcask.keydir_bloom_filter", false),
+    cuttlefish_unit:assert_config(Config, "bitcask.keydir_value_cache", off),
 
     %% Make sure no multi_backend
     cuttlefish_unit:assert_not_configured(Config, "riak_kv.multi_backend"),
     ok.
 
+group_commit_schema_test_() ->
+    {timeout, 60, fun group_commit_schema_test2/0}.
+
+group_commit_schema_test2() ->
+    lager:start(),
+    Conf = [
+        {["bitcask", "sync", "strategy"], group_commit}
+    ],
+
+    Config = cuttlefish_unit:generate_templated_config("priv/bitcask.schema", Conf, context(), predefined_schema()),
+
+    cuttlefish_unit:assert_config(Config, "bitcask.sync_strategy", group_commit),
+    ok.
+
 override_schema_test_() ->
     {timeout, 60, fun override_schema_test2/0}.
 
@@ -90,12 +134,27 @@ override_schema_test2() ->
         {["bitcask", "merge", "thresholds", "fragmentation"], 10},
         {["bitcask", "merge", "thresholds", "dead_bytes"], "64MB"},
         {["bitcask", "merge", "thresholds", "small_file"], "5MB"},
+        {["bitcask", "merge", "workers"], 4},
+        {["bitcask", "merge", "io_rate"], "20MB"},
+        {["bitcask", "merge", "io_latency_target"], "50ms"},
+        {["bitcask", "merge", "io_budget"], "2GB"},
         {["bitcask", "fold", "max_age"], "12ms"},
         {["bitcask", "fold", "max_puts"], 7},
         {["bitcask", "expiry"], "20s" },
         {["bitcask", "hintfile_checksums"], "allow_missing"},
         {["bitcask", "expiry", "grace_time"], "15s" },
-        {["bitcask", "io_mode"], nif}
+        {["bitcask", "io_mode"], nif},
+        {["bitcask", "mmap_reads"], on},
+        {["bitcask", "checksum"], crc32},
+        {["bitcask", "compression"], lz4},
+        {["bitcask", "block_size"], "16KB"},
+        {["bitcask", "keydir", "entry_layout"], compact},
+        {["bitcask", "keydir", "load_threads"], 8},
+        {["bitcask", "keydir", "snapshot"], off},
+        {["bitcask", "keydir", "snapshot_interval"], "10m"},
+        {["bitcask", "keydir", "expiry_index"], on},
+        {["bitcask", "keydir", "bloom_filter"], on},
+        {["bitcask", "keydir", "value_cache"], "64MB"}
     ],
 
     %% The defaults are defined in ../priv/bitcask.schema. it is the file under test.
@@ -111,12 +170,27 @@ override_schema_test2() ->
     cuttlefish_unit:assert_config(Config, "bitcask.frag_threshold", 10),
     cuttlefish_unit:assert_config(Config, "bitcask.dead_bytes_threshold", 67108864),
     cuttlefish_unit:assert_config(Config, "bitcask.small_file_threshold", 5242880),
+    cuttlefish_unit:assert_config(Config, "bitcask.merge_workers", 4),
+    cuttlefish_unit:assert_config(Config, "bitcask.merge_io_rate", 20971520),
+    cuttlefish_unit:assert_config(Config, "bitcask.merge_io_latency_target", 50),
+    cuttlefish_unit:assert_config(Config, "bitcask.merge_io_budget", 2147483648),
     cuttlefish_unit:assert_config(Config, "bitcask.max_fold_age", 12000),
     cuttlefish_unit:assert_config(Config, "bitcask.max_fold_puts", 7),
     cuttlefish_unit:assert_config(Config, "bitcask.expiry_secs", 20),
     cuttlefish_unit:assert_config(Config, "bitcask.require_hint_crc", false),
     cuttlefish_unit:assert_config(Config, "bitcask.expiry_grace_time", 15),
     cuttlefish_unit:assert_config(Config, "bitcask.io_mode", nif),
+    cuttlefish_unit:assert_config(Config, "bitcask.mmap_reads", true),
+    cuttlefish_unit:assert_config(Config, "bitcask.checksum", crc32),
+    cuttlefish_unit:assert_config(Config, "bitcask.compression", lz4),
+    cuttlefish_unit:assert_config(Config, "bitcask.block_size", 16384),
+    cuttlefish_unit:assert_config(Config, "bitcask.keydir_entry_layout", compact),
+    cuttlefish_unit:assert_config(Config, "bitcask.keydir_load_threads", 8),
+    cuttlefish_unit:assert_config(Config, "bitcask.keydir_snapshot", false),
+    cuttlefish_unit:assert_config(Config, "bitcask.keydir_snapshot_interval", 600),
+    cuttlefish_unit:assert_config(Config, "bitcask.keydir_expiry_index", true),
+    cuttlefish_unit:assert_config(Config, "bitcask.keydir_bloom_filter", true),
+    cuttlefish_unit:assert_config(Config, "bitcask.keydir_value_cache", 67108864),
 
     %% Make sure no multi_backend
     cuttlefish_unit:assert_not_configured(Config, "riak_kv.multi_backend"),
@@ -150,12 +224,27 @@ multi_backend_test2() ->
     cuttlefish_unit:assert_config(DefaultBackend, "frag_threshold", 40),
     cuttlefish_unit:assert_config(DefaultBackend, "dead_bytes_threshold", 134217728),
     cuttlefish_unit:assert_config(DefaultBackend, "small_file_threshold", 10485760),
+    cuttlefish_unit:assert_config(DefaultBackend, "merge_workers", 1),
+    cuttlefish_unit:assert_config(DefaultBackend, "merge_io_rate", unlimited),
+    cuttlefish_unit:assert_config(DefaultBackend, "merge_io_latency_target", off),
+    cuttlefish_unit:assert_config(DefaultBackend, "merge_io_budget", unlimited),
     cuttlefish_unit:assert_config(DefaultBackend, "max_fold_age", -1),
     cuttlefish_unit:assert_config(DefaultBackend, "max_fold_puts", 0),
     cuttlefish_unit:assert_config(DefaultBackend, "expiry_secs", -1),
     cuttlefish_unit:assert_config(DefaultBackend, "require_hint_crc", true),
     cuttlefish_unit:assert_config(DefaultBackend, "expiry_grace_time", 0),
     cuttlefish_unit:assert_config(DefaultBackend, "io_mode", erlang),
+    cuttlefish_unit:assert_config(DefaultBackend, "mmap_reads", false),
+    cuttlefish_unit:assert_config(DefaultBackend, "checksum", crc32c),
+    cuttlefish_unit:assert_config(DefaultBackend, "compression", none),
+    cuttlefish_unit:assert_config(DefaultBackend, "block_size", off),
+    cuttlefish_unit:assert_config(DefaultBackend, "keydir_entry_layout", standard),
+    cuttlefish_unit:assert_config(DefaultBackend, "keydir_load_threads", 4),
+    cuttlefish_unit:assert_config(DefaultBackend, "keydir_snapshot", true),
+    cuttlefish_unit:assert_config(DefaultBackend, "keydir_snapshot_interval", 0),
+    cuttlefish_unit:assert_config(DefaultBackend, "keydir_expiry_index", false),
+    cuttlefish_unit:assert_config(DefaultBackend, "keydir_bloom_filter", false),
+    cuttlefish_unit:assert_config(DefaultBackend, "keydir_value_cache", off),
     ok.
 
 %% this context() represents the substitution variables that rebar